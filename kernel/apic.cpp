@@ -0,0 +1,152 @@
+#include <assert.h>
+#include <kernel/apic.h>
+#include <kernel/kernel.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
+#include <stdio.h>
+
+// Set this to 1 to enable kernel traces.
+#define LOCAL_KTRACE 0
+
+#if LOCAL_KTRACE
+#define KTRACE(...) printf("KTRACE> " __VA_ARGS__)
+#else
+#define KTRACE(...)
+#endif
+
+namespace apic {
+
+namespace {
+
+constexpr uint32_t kCpuidApicFlag = 1 << 9;  // CPUID.01h:EDX - bit 9
+
+constexpr uint32_t kApicBaseMSR = 0x1B;
+constexpr uint64_t kApicBaseEnable = 1 << 11;
+constexpr uint64_t kApicBaseAddrMask = 0xFFFFF000;
+
+// Register offsets from the APIC base.
+constexpr uint32_t kIdReg = 0x20;
+constexpr uint32_t kEOIReg = 0xB0;
+constexpr uint32_t kSpuriousReg = 0xF0;
+constexpr uint32_t kLvtTimerReg = 0x320;
+constexpr uint32_t kTimerInitialCountReg = 0x380;
+constexpr uint32_t kTimerCurrentCountReg = 0x390;
+constexpr uint32_t kTimerDivideReg = 0x3E0;
+constexpr uint32_t kIcrLowReg = 0x300;
+constexpr uint32_t kIcrHighReg = 0x310;
+
+constexpr uint32_t kSoftwareEnable = 1 << 8;  // Spurious vector register
+constexpr uint32_t kLvtMasked = 1 << 16;
+constexpr uint32_t kTimerDivideBy16 = 0x3;
+
+// Interrupt command register fields.
+constexpr uint32_t kIcrDeliveryInit = 0x5 << 8;
+constexpr uint32_t kIcrDeliveryStartup = 0x6 << 8;
+constexpr uint32_t kIcrDeliveryPending = 1 << 12;
+constexpr uint32_t kIcrLevelAssert = 1 << 14;
+constexpr uint32_t kIcrAllExcludingSelf = 0x3 << 18;
+
+volatile uint32_t *gApicBase = nullptr;
+
+uint32_t Read(uint32_t reg) {
+  assert(gApicBase && "The local APIC was not initialized.");
+  return gApicBase[reg / sizeof(uint32_t)];
+}
+
+void Write(uint32_t reg, uint32_t val) {
+  assert(gApicBase && "The local APIC was not initialized.");
+  gApicBase[reg / sizeof(uint32_t)] = val;
+}
+
+// Enable the local APIC of the CPU running this code. Every CPU has its own
+// local APIC, but they are all mapped at the same address.
+void EnableLocal() {
+  WriteMSR(kApicBaseMSR, ReadMSR(kApicBaseMSR) | kApicBaseEnable);
+
+  // Software-enable the APIC and route spurious interrupts to a vector we
+  // ignore.
+  Write(kSpuriousReg, kSoftwareEnable | APIC_SPURIOUS_VECTOR);
+
+  // The timer stays masked until something arms it.
+  Write(kTimerDivideReg, kTimerDivideBy16);
+  Write(kLvtTimerReg, kLvtMasked | APIC_TIMER_VECTOR);
+  Write(kTimerInitialCountReg, 0);
+}
+
+void SendCommand(uint32_t dest_apic_id, uint32_t command) {
+  Write(kIcrHighReg, dest_apic_id << 24);
+  Write(kIcrLowReg, command);
+  while (Read(kIcrLowReg) & kIcrDeliveryPending) asm volatile("pause");
+}
+
+}  // namespace
+
+bool IsAvailable() {
+  uint32_t eax, ebx, ecx, edx;
+  CPUID(1, eax, ebx, ecx, edx);
+  return edx & kCpuidApicFlag;
+}
+
+bool IsEnabled() { return gApicBase; }
+
+void Initialize() {
+  assert(IsAvailable());
+  assert(!gApicBase && "The local APIC was already initialized.");
+
+  auto base =
+      static_cast<uintptr_t>(ReadMSR(kApicBaseMSR) & kApicBaseAddrMask);
+
+  // The registers are identity-mapped and uncached. This should be done before
+  // any user page directories are cloned from the kernel page directory so
+  // every address space can reach the APIC.
+  uintptr_t page = pmm::PageAddress(base);
+  auto &pd = paging::GetKernelPageDirectory();
+  assert(!pd.VaddrIsMapped(page) && "The APIC page is already in use.");
+  pd.MapPage(page, page, /*flags=*/PG_PCD | PG_PWT | PG_GLOBAL);
+  gApicBase = reinterpret_cast<volatile uint32_t *>(base);
+  EnableLocal();
+
+  KTRACE("local APIC %u at 0x%x\n", GetId(), base);
+}
+
+void InitializeAP() {
+  assert(gApicBase && "The boot processor should map the local APIC first.");
+  EnableLocal();
+}
+
+uint32_t GetId() { return Read(kIdReg) >> 24; }
+
+void SendEndOfInterrupt() { Write(kEOIReg, 0); }
+
+void StartOneShot(uint32_t count, bool masked) {
+  // One-shot mode is selected by leaving bits 17-18 of the LVT timer register
+  // as zero.
+  Write(kLvtTimerReg, (masked ? kLvtMasked : 0) | APIC_TIMER_VECTOR);
+  Write(kTimerInitialCountReg, count);
+}
+
+void StopTimer() {
+  Write(kLvtTimerReg, kLvtMasked | APIC_TIMER_VECTOR);
+  Write(kTimerInitialCountReg, 0);
+}
+
+void BroadcastInitIPI() {
+  SendCommand(/*dest_apic_id=*/0,
+              kIcrAllExcludingSelf | kIcrLevelAssert | kIcrDeliveryInit);
+}
+
+void BroadcastStartupIPI(uint32_t paddr) {
+  assert(paddr % 4096 == 0 && paddr < 0x100000 &&
+         "APs can only start on a page below 1MB.");
+  SendCommand(/*dest_apic_id=*/0, kIcrAllExcludingSelf | kIcrLevelAssert |
+                                      kIcrDeliveryStartup | (paddr >> 12));
+}
+
+void SendIPI(uint32_t dest_apic_id, uint8_t vector) {
+  SendCommand(dest_apic_id, kIcrLevelAssert | vector);
+}
+
+uint32_t GetTimerInitialCount() { return Read(kTimerInitialCountReg); }
+uint32_t GetTimerCurrentCount() { return Read(kTimerCurrentCountReg); }
+
+}  // namespace apic
@@ -1,137 +1,306 @@
 #include <kernel/channel.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
 #include <kernel/scheduler.h>
+#include <kernel/slab.h>
+#include <kernel/timer.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <memory>
-#include <vector>
-
 namespace channel {
-namespace {
 
+// Both ends of a channel live together, and the whole channel is freed once
+// both are closed.
 struct Channel {
   Endpoint end1, end2;
-  const scheduler::Task *owner1, *owner2;
 
-  Channel(const scheduler::Task *owner) : owner1(owner), owner2(owner) {}
+  explicit Channel(scheduler::Process &owner) {
+    end1.Init(*this, end2, owner);
+    end2.Init(*this, end1, owner);
+  }
+};
+
+namespace {
+
+// Channels never move once created, so endpoint pointers can be used as
+// handles.
+kern::Slab<Channel> *gChannels;
+
+// A task blocked reading from an endpoint. It stays on the endpoint's
+// `readers_` queue until the task runs again and finishes the read, so closing
+// the endpoint can always find it.
+struct ReadWaiter : public scheduler::WaitQueueEntry {
+  // This is null once the endpoint is closed.
+  Endpoint *endpoint;
+  IoVec iov[kMaxIoVecs];
+  size_t count;
+
+  // The total size of the segments.
+  size_t size;
+  bool has_deadline;
+  uint32_t deadline;
+
+  ReadWaiter(scheduler::Task &task, Endpoint &endpoint, const IoVec *iov,
+             size_t count, size_t size, bool has_deadline, uint32_t deadline)
+      : WaitQueueEntry(task),
+        endpoint(&endpoint),
+        count(count),
+        size(size),
+        has_deadline(has_deadline),
+        deadline(deadline) {
+    memcpy(this->iov, iov, count * sizeof(IoVec));
+  }
 };
 
-std::vector<Channel> *gChannels;
+// Sum the segment sizes into `size`. Return false if there are too many
+// segments or the sum overflows.
+bool GetTotalSize(const IoVec *iov, size_t count, size_t &size) {
+  if (count > kMaxIoVecs) return false;
+  size = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (__builtin_add_overflow(size, iov[i].size, &size)) return false;
+  }
+  return true;
+}
+
+bool KernelCopy(void *dst, const void *src, size_t size) {
+  memcpy(dst, src, size);
+  return true;
+}
 
 }  // namespace
 
-void Endpoint::ReserveIfNeeded(size_t amt) {
-  if (amt > capacity_) {
-    void *newdata = malloc(amt);
-    assert(newdata);
-    memcpy(newdata, data_, size_);
-    free(data_);
+bool Endpoint::CopyOutOfRing(void *buf, size_t start, size_t size,
+                             copy_func_t copy) const {
+  auto *data = reinterpret_cast<const uint8_t *>(data_);
+  size_t first = std::min(size, capacity_ - start);
+  return copy(buf, data + start, first) &&
+         copy(reinterpret_cast<uint8_t *>(buf) + first, data, size - first);
+}
+
+bool Endpoint::CopyIntoRing(size_t start, const void *buf, size_t size,
+                            copy_func_t copy) {
+  auto *data = reinterpret_cast<uint8_t *>(data_);
+  size_t first = std::min(size, capacity_ - start);
+  return copy(data + start, buf, first) &&
+         copy(data, reinterpret_cast<const uint8_t *>(buf) + first,
+              size - first);
+}
+
+void Endpoint::Resize(size_t capacity) {
+  assert(IsPowerOf2(capacity) && capacity >= size_);
+  void *newdata = malloc(capacity);
+  assert(newdata);
+  CopyOutOfRing(newdata, head_, size_, KernelCopy);
+  free(data_);
+
+  data_ = newdata;
+  capacity_ = capacity;
+  head_ = 0;
+}
+
+void Endpoint::GrowIfNeeded(size_t amt) {
+  assert(amt <= kMaxCapacity);
+  if (amt <= capacity_) return;
+  size_t capacity = capacity_;
+  while (capacity < amt) capacity *= 2;
+  Resize(capacity);
+}
+
+void Endpoint::ShrinkIfSparse() {
+  // Only halve once the ring is a quarter full, so a channel hovering around a
+  // power of two does not reallocate on every read and write.
+  if (capacity_ > kDefaultCapacity && size_ <= capacity_ / 4)
+    Resize(capacity_ / 2);
+}
 
-    data_ = newdata;
-    capacity_ = amt;
+kstatus_t Endpoint::WriteSelf(const IoVec *iov, size_t count) {
+  size_t size;
+  if (!GetTotalSize(iov, count, size)) return K_INVALID_ARG;
+
+  // Turn away what can be turned away before growing the ring for it.
+  size_t new_size;
+  if (__builtin_add_overflow(size_, size, &new_size) || new_size > kMaxCapacity)
+    return K_INVALID_ARG;
+  for (size_t i = 0; i < count; ++i) {
+    if (!paging::IsUserRange(reinterpret_cast<uintptr_t>(iov[i].base),
+                             iov[i].size))
+      return K_INVALID_ARG;
+  }
+  GrowIfNeeded(new_size);
+
+  // The bytes only count once they are all copied in.
+  size_t tail = (head_ + size_) & (capacity_ - 1);
+  for (size_t i = 0; i < count; ++i) {
+    if (!CopyIntoRing(tail, iov[i].base, iov[i].size, paging::CopyFromUser))
+      return K_INVALID_ARG;
+    tail = (tail + iov[i].size) & (capacity_ - 1);
   }
+  size_ += size;
+  WakeReaders();
+  return K_OK;
 }
 
-void Endpoint::ShrinkCapacity(size_t amt) {
-  if (amt >= size_ && amt < capacity_) {
-    if (amt == 0) {
-      free(data_);
-      data_ = nullptr;
-    } else {
-      void *newdata = malloc(amt);
-      assert(newdata);
-      memcpy(newdata, data_, size_);
-      free(data_);
-      data_ = newdata;
-    }
-    capacity_ = amt;
+void Endpoint::WakeReaders() {
+  for (scheduler::WaitQueueEntry &entry : readers_) {
+    if (static_cast<ReadWaiter &>(entry).size <= size_)
+      scheduler::WakeTask(entry.getTask());
   }
+  for (scheduler::WaitQueueEntry &entry : watchers_)
+    scheduler::WakeTask(entry.getTask());
 }
 
-void Endpoint::WriteSelf(const void *src, size_t size) {
-  ReserveIfNeeded(size_ + size);
-  memcpy(reinterpret_cast<uint8_t *>(data_) + size_, src, size);
-  size_ += size;
+void Endpoint::ReadVToUserOrBlock(isr::registers_t *regs, const IoVec *iov,
+                                  size_t count) {
+  size_t size;
+  if (!GetTotalSize(iov, count, size)) {
+    regs->eax = K_INVALID_ARG;
+    return;
+  }
+
+  size_t bytes_available = 0;
+  kstatus_t status = ReadSelf(iov, count, &bytes_available);
+  if (status == K_BUFFER_TOO_SMALL && !nonblocking_ && !PeerClosed()) {
+    uint32_t deadline = timer::GetTicks() + read_timeout_;
+    QueueRead(scheduler::GetCurrentTask(), iov, count, deadline);
+    if (read_timeout_)
+      scheduler::SleepUntil(regs, deadline);
+    else
+      scheduler::Block(regs);
+    abort();
+  }
+
+  if (status == K_BUFFER_TOO_SMALL && PeerClosed()) status = K_PEER_CLOSED;
+  regs->eax = status;
+  if (status != K_OK) regs->ebx = bytes_available;
+}
+
+void Endpoint::QueueRead(scheduler::Task &task, const IoVec *iov, size_t count,
+                         uint32_t deadline) {
+  size_t size;
+  [[maybe_unused]] bool valid = GetTotalSize(iov, count, size);
+  assert(valid && "Too many segments or too big a read.");
+
+  auto *waiter = new ReadWaiter(task, *this, iov, count, size,
+                                /*has_deadline=*/read_timeout_ != 0, deadline);
+  readers_.Add(*waiter);
+
+  // The read is finished from here once the task runs again.
+  task.setResumeHook(
+      [](scheduler::Task &task, void *arg) {
+        auto *waiter = reinterpret_cast<ReadWaiter *>(arg);
+        kstatus_t status = K_INVALID_HANDLE;
+        size_t bytes_available = 0;
+        if (Endpoint *endpoint = waiter->endpoint) {
+          endpoint->readers_.Remove(*waiter);
+          status = endpoint->ReadSelf(waiter->iov, waiter->count,
+                                      &bytes_available);
+          if (status == K_BUFFER_TOO_SMALL) {
+            if (endpoint->PeerClosed())
+              status = K_PEER_CLOSED;
+            else if (waiter->has_deadline &&
+                     !timer::TickBefore(timer::GetTicks(), waiter->deadline))
+              status = K_TIMED_OUT;
+          }
+        }
+        task.getSyscallStatusReg() = status;
+        task.getSyscallResultReg() = bytes_available;
+        delete waiter;
+      },
+      waiter);
 }
 
-bool Endpoint::ReadSelf(void *dst, size_t size, size_t *bytes_available) {
-  if (size == 0) return true;
+kstatus_t Endpoint::ReadSelf(const IoVec *iov, size_t count,
+                             size_t *bytes_available) {
+  size_t size;
+  if (!GetTotalSize(iov, count, size)) return K_INVALID_ARG;
+  if (size == 0) return K_OK;
 
   if (size > size_) {
     if (bytes_available) *bytes_available = size_;
-    return false;
+    return K_BUFFER_TOO_SMALL;
   }
-  memcpy(dst, data_, size);
-  memmove(data_, reinterpret_cast<uint8_t *>(data_) + size, size_ - size);
+
+  // Nothing comes off the channel unless every segment is filled.
+  size_t start = head_;
+  for (size_t i = 0; i < count; ++i) {
+    if (!CopyOutOfRing(iov[i].base, start, iov[i].size, paging::CopyToUser))
+      return K_INVALID_ARG;
+    start = (start + iov[i].size) & (capacity_ - 1);
+  }
+  head_ = start;
   size_ -= size;
 
-  ShrinkCapacity(size_);
+  ShrinkIfSparse();
 
-  return true;
+  return K_OK;
+}
+
+void Endpoint::Init(Channel &channel, Endpoint &other,
+                    scheduler::Process &owner) {
+  channel_ = &channel;
+  other_ = &other;
+  owner_ = &owner;
+  owner.getOwnedEndpoints().PushBack(*this);
 }
 
 void Create(Endpoint *&end1, Endpoint *&end2) {
-  Channel &channel = gChannels->emplace_back(&scheduler::GetCurrentTask());
-  channel.end1.Init(&channel.end2);
-  channel.end2.Init(&channel.end1);
-  end1 = &channel.end1;
-  end2 = &channel.end2;
+  Channel *channel = gChannels->New(scheduler::GetCurrentTask().getProcess());
+  end1 = &channel->end1;
+  end2 = &channel->end2;
 }
 
 bool Endpoint::Close() {
   // This is already closed.
   if (!other_) return false;
-  other_ = nullptr;
 
-  for (auto it = gChannels->begin(); it != gChannels->end(); ++it) {
-    Channel &channel = *it;
-    if ((&channel.end1 == this && !channel.end2.other_) ||
-        (&channel.end2 == this && !channel.end1.other_)) {
-      // Both this and the other end are closed, so we can remove this channel.
-      gChannels->erase(it);
-      return true;
-    }
+  // Readers and watchers on this end lose their handle, and those on the other
+  // end will get no more bytes.
+  for (scheduler::WaitQueueEntry &entry : readers_) {
+    static_cast<ReadWaiter &>(entry).endpoint = nullptr;
+    scheduler::WakeTask(entry.getTask());
+  }
+  readers_.Clear();
+  for (scheduler::WaitQueueEntry &entry : watchers_) {
+    static_cast<Watcher &>(entry).endpoint_ = nullptr;
+    scheduler::WakeTask(entry.getTask());
   }
+  watchers_.Clear();
+  for (uint32_t ppage : loaned_pages_) pmm::SetPageFree(ppage);
+  loaned_pages_.clear();
+  for (scheduler::WaitQueueEntry &entry : other_->readers_)
+    scheduler::WakeTask(entry.getTask());
+  for (scheduler::WaitQueueEntry &entry : other_->watchers_)
+    scheduler::WakeTask(entry.getTask());
 
-  return false;
-}
+  owner_->getOwnedEndpoints().Remove(*this);
+  owner_ = nullptr;
 
-void CloseEndpointsOwnedByTask(const scheduler::Task *owner) {
-  auto it = gChannels->begin();
-  auto end = gChannels->end();
-  for (; it != end;) {
-    Channel &channel = *it;
+  bool peer_closed = !other_->other_;
+  other_ = nullptr;
+  if (!peer_closed) return false;
 
-    bool did_remove_channel = false;
-    if (channel.owner1 == owner) { did_remove_channel |= channel.end1.Close(); }
-    if (channel.owner2 == owner) { did_remove_channel |= channel.end2.Close(); }
+  // Both this and the other end are closed, so we can free this channel.
+  gChannels->Delete(channel_);
+  return true;
+}
 
-    if (did_remove_channel) {
-      // It's possible that the vector now has new iterators after the erase.
-      // We'll need to make new ones. This results in a costly scan.
-      it = gChannels->begin();
-      end = gChannels->end();
-    } else {
-      ++it;
-    }
-  }
+void CloseEndpointsOwnedByProcess(scheduler::Process &owner) {
+  // Closing an endpoint takes it off the list.
+  while (Endpoint *endpoint = owner.getOwnedEndpoints().front())
+    endpoint->Close();
 }
 
-void Endpoint::TransferOwner(const scheduler::Task *newowner) const {
-  for (auto it = gChannels->begin(); it != gChannels->end(); ++it) {
-    Channel &channel = *it;
-    if (&channel.end1 == this) {
-      channel.owner1 = newowner;
-      return;
-    } else if (&channel.end2 == this) {
-      channel.owner2 = newowner;
-      return;
-    }
-  }
+void Endpoint::TransferOwner(scheduler::Process &newowner) {
+  // A closed endpoint has no owner to move it between.
+  if (!owner_) return;
+  owner_->getOwnedEndpoints().Remove(*this);
+  newowner.getOwnedEndpoints().PushBack(*this);
+  owner_ = &newowner;
 }
 
-void Initialize() { gChannels = new std::vector<Channel>; }
+void Initialize() { gChannels = new kern::Slab<Channel>; }
 
 void Destroy() { delete gChannels; }
 
@@ -1,22 +1,34 @@
+#include <kernel/apic.h>
 #include <kernel/irq.h>
 #include <kernel/isr.h>
 #include <kernel/paging.h>
 #include <kernel/scheduler.h>
+#include <kernel/smp.h>
 #include <kernel/syscalls.h>
 #include <kernel/timer.h>
 #include <stdio.h>
 
-using ::paging::PageDirectory4M;
 using ::scheduler::Task;
 
+namespace {
+
+// An instruction that may fault on a user address, and where to resume if it
+// does. The linker collects these from `__ex_table` sections.
+struct ExceptionTableEntry {
+  uintptr_t insn;
+  uintptr_t fixup;
+};
+
+}  // namespace
+
+extern "C" const ExceptionTableEntry __EX_TABLE_BEGIN[], __EX_TABLE_END[];
+
 namespace exceptions {
 namespace {
 
-// TODO: Would be cleaner to wrap this and the other syscalls in a class rather
-// than having a global here. Or even better, all user pointers are wrapped
-// with a class whose constructor takes this page directory and those are passed
-// as arguments instead.
-PageDirectory4M *gOldPageDir = nullptr;
+// Page fault error code bits.
+constexpr uint32_t kPresentFlag = 0x1;
+constexpr uint32_t kWriteFlag = 0x2;
 
 void HandleKernelException(isr::registers_t *regs) {
   auto &task = scheduler::GetCurrentTask();
@@ -71,13 +83,88 @@ void DispatchKernelException(isr::registers_t *regs) {
   }
 }
 
+// Return true if this was a page fault on a kernel heap page the current
+// address space had not picked up yet. The faulting instruction can just be
+// retried.
+bool HandleKernelMappingFault(const isr::registers_t *regs) {
+  if (regs->int_no != isr::kPageFault) return false;
+  uint32_t faulting_addr;
+  asm volatile("mov %%cr2, %0" : "=r"(faulting_addr));
+  return paging::SyncKernelMapping(faulting_addr);
+}
+
+// Return true if this was the first touch of a page in a lazy area of the
+// current address space. The page is mapped now, so the faulting instruction
+// can be retried. This covers kernel code touching user memory too.
+bool HandleDemandPagingFault(const isr::registers_t *regs) {
+  if (regs->int_no != isr::kPageFault || (regs->err_code & kPresentFlag))
+    return false;
+  uint32_t faulting_addr;
+  asm volatile("mov %%cr2, %0" : "=r"(faulting_addr));
+  return paging::HandleDemandFault(faulting_addr);
+}
+
+// Return true if this was a write to a copy-on-write page in the current
+// address space. The page is writable now, so the faulting instruction can be
+// retried. Like demand paging, this covers kernel code writing to user memory.
+bool HandleCopyOnWriteFault(const isr::registers_t *regs) {
+  constexpr uint32_t kFlags = kPresentFlag | kWriteFlag;
+  if (regs->int_no != isr::kPageFault || (regs->err_code & kFlags) != kFlags)
+    return false;
+  uint32_t faulting_addr;
+  asm volatile("mov %%cr2, %0" : "=r"(faulting_addr));
+  return paging::HandleCopyOnWriteFault(faulting_addr);
+}
+
+// Return true if this was a page fault on a user address in kernel code that
+// expects it, like `copy_user_bytes`. The kernel resumes at the fixup for the
+// faulting instruction, which reports the failure to its caller.
+bool HandleUserAccessFault(isr::registers_t *regs) {
+  if (regs->int_no != isr::kPageFault || (regs->cs & 0x3) != 0) return false;
+  for (const ExceptionTableEntry *entry = __EX_TABLE_BEGIN;
+       entry != __EX_TABLE_END; ++entry) {
+    if (entry->insn == regs->eip) {
+      regs->eip = entry->fixup;
+      return true;
+    }
+  }
+  return false;
+}
+
 void ExceptionDispatcher(isr::registers_t *regs) {
-  gOldPageDir = &paging::GetCurrentPageDirectory();
-  paging::SwitchPageDirectory(paging::GetKernelPageDirectory());
+  // The CPU that sent this holds the kernel lock until every CPU it sent this
+  // to is done, so this can't wait for the lock.
+  if (regs->int_no == APIC_TLB_SHOOTDOWN_VECTOR) {
+    smp::HandleTlbShootdown();
+    apic::SendEndOfInterrupt();
+    return;
+  }
+
+  // If this switches tasks, the lock is released once we are off this task's
+  // kernel stack.
+  smp::LockKernel();
+
+  // The handlers run on the interrupted task's page directory. The kernel is
+  // mapped into every address space, and user memory is reached through
+  // `paging::CopyFromUser` and `paging::CopyToUser`.
+  if (HandleKernelMappingFault(regs) || HandleDemandPagingFault(regs) ||
+      HandleCopyOnWriteFault(regs) || HandleUserAccessFault(regs)) {
+    smp::UnlockKernel();
+    return;
+  }
 
   switch (regs->int_no) {
     case IRQ0:
+    case APIC_TIMER_VECTOR:
       timer::TimerCallback(regs);
+      scheduler::PreemptIfNeeded(regs);
+      break;
+    case APIC_RESCHEDULE_VECTOR:
+      apic::SendEndOfInterrupt();
+      scheduler::HandleRescheduleIPI(regs);
+      break;
+    case APIC_SPURIOUS_VECTOR:
+      // Spurious interrupts do not get an EOI.
       break;
     case syscalls::kSyscallHandler:
       syscalls::SyscallHandler(regs);
@@ -92,13 +179,11 @@ void ExceptionDispatcher(isr::registers_t *regs) {
     }
   }
 
-  paging::SwitchPageDirectory(*gOldPageDir);
+  smp::UnlockKernel();
 }
 
 }  // namespace
 
-PageDirectory4M &GetPageDirBeforeException() { return *gOldPageDir; }
-
 void InitializeHandlers() {
   for (size_t i = 0; i < isr::kNumIsrHandlers; ++i) {
     isr::RegisterIsrHandler(static_cast<uint8_t>(i), ExceptionDispatcher);
@@ -0,0 +1,273 @@
+#include <assert.h>
+#include <kernel/fairqueue.h>
+
+namespace scheduler {
+
+namespace {
+
+// Running time is charged in units of 2^kCycleShift TSC cycles.
+constexpr uint32_t kCycleShift = 10;
+
+}  // namespace
+
+void FairQueueEntry::setWeight(uint32_t weight) {
+  assert(!queue_ && "Cannot change the weight of a queued entry.");
+  assert(weight >= kMinWeight && weight <= kMaxWeight);
+  weight_ = weight;
+  inv_weight_ = (kDefaultWeight << 16) / weight;
+}
+
+void FairQueueEntry::Charge(uint64_t cycles) {
+  // Clamping keeps the multiply from overflowing. This is over an hour of
+  // running time, so nothing should get close to it.
+  uint64_t units = cycles >> kCycleShift;
+  if (units > UINT32_MAX) units = UINT32_MAX;
+  vruntime_ += (units * inv_weight_) >> 16;
+}
+
+void FairQueue::ReplaceChild(FairQueueEntry *parent, FairQueueEntry *old_child,
+                             FairQueueEntry *new_child) {
+  if (!parent)
+    root_ = new_child;
+  else if (parent->left_ == old_child)
+    parent->left_ = new_child;
+  else
+    parent->right_ = new_child;
+  if (new_child) new_child->parent_ = parent;
+}
+
+void FairQueue::RotateLeft(FairQueueEntry *node) {
+  FairQueueEntry *pivot = node->right_;
+  node->right_ = pivot->left_;
+  if (pivot->left_) pivot->left_->parent_ = node;
+  ReplaceChild(node->parent_, node, pivot);
+  pivot->left_ = node;
+  node->parent_ = pivot;
+}
+
+void FairQueue::RotateRight(FairQueueEntry *node) {
+  FairQueueEntry *pivot = node->left_;
+  node->left_ = pivot->right_;
+  if (pivot->right_) pivot->right_->parent_ = node;
+  ReplaceChild(node->parent_, node, pivot);
+  pivot->right_ = node;
+  node->parent_ = pivot;
+}
+
+void FairQueue::InsertFixup(FairQueueEntry *node) {
+  // The parent is red, so it cannot be the root and the grandparent exists.
+  while (IsRed(node->parent_)) {
+    FairQueueEntry *parent = node->parent_;
+    FairQueueEntry *grandparent = parent->parent_;
+    if (parent == grandparent->left_) {
+      FairQueueEntry *uncle = grandparent->right_;
+      if (IsRed(uncle)) {
+        parent->red_ = uncle->red_ = false;
+        grandparent->red_ = true;
+        node = grandparent;
+        continue;
+      }
+      if (node == parent->right_) {
+        RotateLeft(parent);
+        node = parent;
+        parent = node->parent_;
+      }
+      parent->red_ = false;
+      grandparent->red_ = true;
+      RotateRight(grandparent);
+    } else {
+      FairQueueEntry *uncle = grandparent->left_;
+      if (IsRed(uncle)) {
+        parent->red_ = uncle->red_ = false;
+        grandparent->red_ = true;
+        node = grandparent;
+        continue;
+      }
+      if (node == parent->left_) {
+        RotateRight(parent);
+        node = parent;
+        parent = node->parent_;
+      }
+      parent->red_ = false;
+      grandparent->red_ = true;
+      RotateLeft(grandparent);
+    }
+  }
+  root_->red_ = false;
+}
+
+// `node` took the place of a removed black node and may be null. `parent` is
+// its parent, which we need since a null node cannot tell us.
+void FairQueue::DeleteFixup(FairQueueEntry *node, FairQueueEntry *parent) {
+  while (node != root_ && !IsRed(node)) {
+    if (node == parent->left_) {
+      FairQueueEntry *sibling = parent->right_;
+      if (IsRed(sibling)) {
+        sibling->red_ = false;
+        parent->red_ = true;
+        RotateLeft(parent);
+        sibling = parent->right_;
+      }
+      if (!IsRed(sibling->left_) && !IsRed(sibling->right_)) {
+        sibling->red_ = true;
+        node = parent;
+        parent = node->parent_;
+        continue;
+      }
+      if (!IsRed(sibling->right_)) {
+        sibling->left_->red_ = false;
+        sibling->red_ = true;
+        RotateRight(sibling);
+        sibling = parent->right_;
+      }
+      sibling->red_ = parent->red_;
+      parent->red_ = false;
+      sibling->right_->red_ = false;
+      RotateLeft(parent);
+    } else {
+      FairQueueEntry *sibling = parent->left_;
+      if (IsRed(sibling)) {
+        sibling->red_ = false;
+        parent->red_ = true;
+        RotateRight(parent);
+        sibling = parent->left_;
+      }
+      if (!IsRed(sibling->left_) && !IsRed(sibling->right_)) {
+        sibling->red_ = true;
+        node = parent;
+        parent = node->parent_;
+        continue;
+      }
+      if (!IsRed(sibling->left_)) {
+        sibling->right_->red_ = false;
+        sibling->red_ = true;
+        RotateLeft(sibling);
+        sibling = parent->left_;
+      }
+      sibling->red_ = parent->red_;
+      parent->red_ = false;
+      sibling->left_->red_ = false;
+      RotateRight(parent);
+    }
+    node = root_;
+  }
+  if (node) node->red_ = false;
+}
+
+void FairQueue::Enqueue(FairQueueEntry &entry) {
+  assert(!entry.queue_ && "Entry is already on a fair queue.");
+
+  // Equal vruntimes go to the right so they run in FIFO order.
+  FairQueueEntry *parent = nullptr;
+  FairQueueEntry **link = &root_;
+  bool leftmost = true;
+  while (*link) {
+    parent = *link;
+    if (entry.vruntime_ < parent->vruntime_) {
+      link = &parent->left_;
+    } else {
+      link = &parent->right_;
+      leftmost = false;
+    }
+  }
+
+  entry.parent_ = parent;
+  entry.left_ = entry.right_ = nullptr;
+  entry.red_ = true;
+  entry.queue_ = this;
+  *link = &entry;
+  if (leftmost) leftmost_ = &entry;
+  InsertFixup(&entry);
+
+  ++size_;
+  total_weight_ += entry.weight_;
+}
+
+void FairQueue::Dequeue(FairQueueEntry &entry) {
+  assert(Contains(entry) && "Entry is not on this queue.");
+  if (leftmost_ == &entry) leftmost_ = Next(entry);
+
+  FairQueueEntry *child, *parent;
+  bool removed_red;
+  if (!entry.left_ || !entry.right_) {
+    child = entry.left_ ? entry.left_ : entry.right_;
+    parent = entry.parent_;
+    removed_red = entry.red_;
+    ReplaceChild(parent, &entry, child);
+  } else {
+    // Swap in the successor, which has no left child.
+    FairQueueEntry *successor = entry.right_;
+    while (successor->left_) successor = successor->left_;
+    removed_red = successor->red_;
+    child = successor->right_;
+    if (successor->parent_ == &entry) {
+      parent = successor;
+    } else {
+      parent = successor->parent_;
+      ReplaceChild(parent, successor, child);
+      successor->right_ = entry.right_;
+      successor->right_->parent_ = successor;
+    }
+    ReplaceChild(entry.parent_, &entry, successor);
+    successor->left_ = entry.left_;
+    successor->left_->parent_ = successor;
+    successor->red_ = entry.red_;
+  }
+  if (!removed_red) DeleteFixup(child, parent);
+
+  entry.parent_ = entry.left_ = entry.right_ = nullptr;
+  entry.queue_ = nullptr;
+  --size_;
+  total_weight_ -= entry.weight_;
+}
+
+FairQueueEntry *FairQueue::PopNext() {
+  FairQueueEntry *entry = leftmost_;
+  if (entry) Dequeue(*entry);
+  return entry;
+}
+
+FairQueueEntry *FairQueue::PeekLast() const {
+  FairQueueEntry *node = root_;
+  while (node && node->right_) node = node->right_;
+  return node;
+}
+
+FairQueueEntry *FairQueue::Next(const FairQueueEntry &entry) {
+  const FairQueueEntry *node = &entry;
+  if (node->right_) {
+    node = node->right_;
+    while (node->left_) node = node->left_;
+    return const_cast<FairQueueEntry *>(node);
+  }
+  while (node->parent_ && node == node->parent_->right_) node = node->parent_;
+  return node->parent_;
+}
+
+FairQueueEntry *FairQueue::Prev(const FairQueueEntry &entry) {
+  const FairQueueEntry *node = &entry;
+  if (node->left_) {
+    node = node->left_;
+    while (node->right_) node = node->right_;
+    return const_cast<FairQueueEntry *>(node);
+  }
+  while (node->parent_ && node == node->parent_->left_) node = node->parent_;
+  return node->parent_;
+}
+
+void FairQueue::UpdateMinVruntime(const FairQueueEntry *current) {
+  uint64_t vruntime;
+  if (current && leftmost_) {
+    vruntime = current->vruntime_ < leftmost_->vruntime_ ? current->vruntime_
+                                                         : leftmost_->vruntime_;
+  } else if (current) {
+    vruntime = current->vruntime_;
+  } else if (leftmost_) {
+    vruntime = leftmost_->vruntime_;
+  } else {
+    return;
+  }
+  if (vruntime > min_vruntime_) min_vruntime_ = vruntime;
+}
+
+}  // namespace scheduler
@@ -1,3 +1,6 @@
+#include <kernel/gdt.h>
+#include <kernel/kernel.h>
+#include <kernel/smp.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -5,6 +8,7 @@ extern "C" {
 
 extern void GDTFlush(uint32_t);
 extern void TSSFlush();
+extern void sysenter_entry();
 
 }  // extern "C"
 
@@ -30,9 +34,10 @@ struct gdt_ptr_t {
   uint32_t base;   // The address of the first gdt_entry_t struct.
 } __attribute__((packed));
 
-constexpr size_t kNumGDTEntries = 6;
-gdt_entry_t gdt_entries[kNumGDTEntries];
-gdt_ptr_t gdt_ptr;
+constexpr size_t kNumGDTEntries = 7;
+
+// The user TLS segment is the last entry.
+constexpr int32_t kTlsEntry = kUserTlsSeg / sizeof(gdt_entry_t);
 
 // A struct describing a Task State Segment.
 struct tss_entry_t {
@@ -67,11 +72,26 @@ struct tss_entry_t {
 } __attribute__((packed));
 static_assert(sizeof(tss_entry_t) == 104, "");
 
-tss_entry_t tss_entry;
+// Each CPU gets its own GDT and TSS. The segments are the same on every CPU,
+// but each TSS holds the kernel stack for whatever task that CPU is running,
+// and a TSS descriptor is marked busy once it is loaded.
+struct cpu_tables_t {
+  gdt_entry_t gdt_entries[kNumGDTEntries];
+  gdt_ptr_t gdt_ptr;
+  tss_entry_t tss_entry;
+};
+
+cpu_tables_t gCpuTables[smp::kMaxCpus];
+
+constexpr uint32_t kCpuidSepFlag = 1 << 11;  // CPUID.01h:EDX - bit 11
+
+constexpr uint32_t kSysenterCsMsr = 0x174;
+constexpr uint32_t kSysenterEspMsr = 0x175;
+constexpr uint32_t kSysenterEipMsr = 0x176;
 
 // Set the value of one GDT entry.
-void GDTSetGate(int32_t num, uint32_t base, uint32_t limit, uint8_t access,
-                uint8_t gran) {
+void GDTSetGate(gdt_entry_t *gdt_entries, int32_t num, uint32_t base,
+                uint32_t limit, uint8_t access, uint8_t gran) {
   gdt_entries[num].base_low = (base & 0xFFFF);
   gdt_entries[num].base_middle = (base >> 16) & 0xFF;
   gdt_entries[num].base_high = (base >> 24) & 0xFF;
@@ -83,7 +103,9 @@ void GDTSetGate(int32_t num, uint32_t base, uint32_t limit, uint8_t access,
   gdt_entries[num].access = access;
 }
 
-void WriteTSS(int32_t num, uint16_t ss0, uint32_t esp0) {
+void WriteTSS(cpu_tables_t &tables, int32_t num, uint16_t ss0, uint32_t esp0) {
+  tss_entry_t &tss_entry = tables.tss_entry;
+
   // Firstly, let's compute the base and limit of our entry into the GDT.
   uint32_t base = reinterpret_cast<uint32_t>(&tss_entry);
   uint32_t limit = sizeof(tss_entry);
@@ -122,27 +144,57 @@ void WriteTSS(int32_t num, uint16_t ss0, uint32_t esp0) {
       0x13;
 
   // Now, add our TSS descriptor's address to the GDT.
-  GDTSetGate(num, base, limit, 0xE9, 0x00);
+  GDTSetGate(tables.gdt_entries, num, base, limit, 0xE9, 0x00);
 }
 
 }  // namespace
 
 // Internal function prototypes.
 void Initialize() {
-  gdt_ptr.limit = (sizeof(gdt_entry_t) * kNumGDTEntries) - 1;
-  gdt_ptr.base = reinterpret_cast<uint32_t>(&gdt_entries);
+  cpu_tables_t &tables = gCpuTables[smp::GetCurrentCpu()];
+  gdt_entry_t *gdt_entries = tables.gdt_entries;
+  tables.gdt_ptr.limit = (sizeof(gdt_entry_t) * kNumGDTEntries) - 1;
+  tables.gdt_ptr.base = reinterpret_cast<uint32_t>(gdt_entries);
+
+  // Null segment (0x00)
+  GDTSetGate(gdt_entries, 0, 0, 0, 0, 0);
+  // Code segment (0x08)
+  GDTSetGate(gdt_entries, 1, 0, 0xFFFFFFFF, 0x9A, 0xCF);
+  // Data segment (0x10)
+  GDTSetGate(gdt_entries, 2, 0, 0xFFFFFFFF, 0x92, 0xCF);
+  // User mode code segment (0x18)
+  GDTSetGate(gdt_entries, 3, 0, 0xFFFFFFFF, 0xFA, 0xCF);
+  // User mode data segment (0x20)
+  GDTSetGate(gdt_entries, 4, 0, 0xFFFFFFFF, 0xF2, 0xCF);
+  WriteTSS(tables, 5, 0x10, 0);
+  // User mode TLS segment (0x30). The base changes with the running task.
+  GDTSetGate(gdt_entries, kTlsEntry, 0, 0xFFFFFFFF, 0xF2, 0xCF);
+
+  GDTFlush(reinterpret_cast<uint32_t>(&tables.gdt_ptr));
+  TSSFlush();
 
-  GDTSetGate(0, 0, 0, 0, 0);                 // Null segment (0x00)
-  GDTSetGate(1, 0, 0xFFFFFFFF, 0x9A, 0xCF);  // Code segment (0x08)
-  GDTSetGate(2, 0, 0xFFFFFFFF, 0x92, 0xCF);  // Data segment (0x10)
-  GDTSetGate(3, 0, 0xFFFFFFFF, 0xFA, 0xCF);  // User mode code segment (0x18)
-  GDTSetGate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF);  // User mode data segment (0x20)
-  WriteTSS(5, 0x10, 0);
+  // SYSENTER takes its CS from the MSR and assumes the kernel data, user code,
+  // and user data segments follow it in that order, which they do. It also
+  // takes a fixed stack pointer, but each task has its own kernel stack, so we
+  // point it just past this CPU's TSS.esp0. `sysenter_entry` loads the real
+  // stack from there.
+  uint32_t eax, ebx, ecx, edx;
+  CPUID(1, eax, ebx, ecx, edx);
+  if (edx & kCpuidSepFlag) {
+    WriteMSR(kSysenterCsMsr, kKernCodeSeg);
+    WriteMSR(kSysenterEspMsr,
+             reinterpret_cast<uint32_t>(&tables.tss_entry.esp0 + 1));
+    WriteMSR(kSysenterEipMsr, reinterpret_cast<uint32_t>(sysenter_entry));
+  }
+}
 
-  GDTFlush(reinterpret_cast<uint32_t>(&gdt_ptr));
-  TSSFlush();
+void SetKernelStack(uintptr_t stack) {
+  gCpuTables[smp::GetCurrentCpu()].tss_entry.esp0 = stack;
 }
 
-void SetKernelStack(uintptr_t stack) { tss_entry.esp0 = stack; }
+void SetTlsBase(uintptr_t base) {
+  gdt_entry_t *gdt_entries = gCpuTables[smp::GetCurrentCpu()].gdt_entries;
+  GDTSetGate(gdt_entries, kTlsEntry, base, 0xFFFFFFFF, 0xF2, 0xCF);
+}
 
 }  // namespace gdt
@@ -0,0 +1,143 @@
+#include <assert.h>
+#include <kernel/channel.h>
+#include <kernel/handle.h>
+#include <kernel/scheduler.h>
+#include <stdlib.h>
+
+namespace handle {
+
+Table::~Table() {
+  for (Entry &entry : entries_) {
+    if (entry.kind == Kind::kTask) entry.task->Release();
+  }
+}
+
+const Table::Entry *Table::Find(handle_t handle) const {
+  uint32_t index = handle & kIndexMask;
+  if (index >= entries_.size()) return nullptr;
+  const Entry &entry = entries_[index];
+  if (entry.kind == Kind::kNone || entry.generation != handle >> kIndexBits)
+    return nullptr;
+  return &entry;
+}
+
+uint32_t Table::Allocate() {
+  if (free_head_ == kNoFreeSlot) {
+    if (entries_.size() > kIndexMask) return kNoFreeSlot;
+    entries_.emplace_back();
+    return entries_.size() - 1;
+  }
+  uint32_t index = free_head_;
+  free_head_ = entries_[index].next_free;
+  return index;
+}
+
+void Table::Free(Entry &entry) {
+  entry.kind = Kind::kNone;
+
+  // Skip zero when wrapping around so no handle is ever zero.
+  if (++entry.generation == 0) entry.generation = 1;
+
+  entry.next_free = free_head_;
+  free_head_ = static_cast<uint32_t>(&entry - entries_.data());
+  --size_;
+}
+
+handle_t Table::Add(scheduler::Task &task) {
+  // Tasks are handed out by looking them up (such as a process's children), so
+  // reuse a handle if there is one. Handles to tasks that have exited are
+  // cleaned up along the way.
+  for (uint32_t i = 0; i < entries_.size(); ++i) {
+    Entry &entry = entries_[i];
+    if (entry.kind != Kind::kTask) continue;
+    scheduler::Task *other = entry.task->get();
+    if (other == &task) return MakeHandle(i, entry.generation);
+    if (!other) {
+      entry.task->Release();
+      Free(entry);
+    }
+  }
+
+  uint32_t index = Allocate();
+  if (index == kNoFreeSlot) return 0;
+  Entry &entry = entries_[index];
+  entry.kind = Kind::kTask;
+  entry.task = &task.getRef();
+  entry.task->Acquire();
+  ++size_;
+  return MakeHandle(index, entry.generation);
+}
+
+handle_t Table::Add(channel::Endpoint &endpoint) {
+  uint32_t index = Allocate();
+  if (index == kNoFreeSlot) return 0;
+  Entry &entry = entries_[index];
+  entry.kind = Kind::kEndpoint;
+  entry.endpoint = &endpoint;
+  ++size_;
+  return MakeHandle(index, entry.generation);
+}
+
+scheduler::Task *Table::getTask(handle_t handle) {
+  Entry *entry = Find(handle);
+  if (!entry || entry->kind != Kind::kTask) return nullptr;
+  if (scheduler::Task *task = entry->task->get()) return task;
+
+  // The task exited, so this handle is no good anymore.
+  entry->task->Release();
+  Free(*entry);
+  return nullptr;
+}
+
+channel::Endpoint *Table::getEndpoint(handle_t handle) const {
+  const Entry *entry = Find(handle);
+  if (!entry || entry->kind != Kind::kEndpoint) return nullptr;
+  return entry->endpoint;
+}
+
+bool Table::Close(handle_t handle) {
+  Entry *entry = Find(handle);
+  if (!entry) return false;
+
+  switch (entry->kind) {
+    case Kind::kTask:
+      entry->task->Release();
+      break;
+    case Kind::kEndpoint:
+      entry->endpoint->Close();
+      break;
+    case Kind::kNone:
+      abort();  // `Find` never returns a free slot.
+  }
+  Free(*entry);
+  return true;
+}
+
+handle_t Table::TransferTo(handle_t handle, scheduler::Process &dest) {
+  Entry *entry = Find(handle);
+  if (!entry) return 0;
+
+  Table &dest_table = dest.getHandles();
+  if (&dest_table == this) return handle;
+
+  handle_t new_handle = 0;
+  switch (entry->kind) {
+    case Kind::kTask:
+      if (scheduler::Task *task = entry->task->get())
+        new_handle = dest_table.Add(*task);
+      if (!new_handle) return 0;
+      entry->task->Release();
+      break;
+    case Kind::kEndpoint:
+      new_handle = dest_table.Add(*entry->endpoint);
+      if (!new_handle) return 0;
+      entry->endpoint->TransferOwner(dest);
+      break;
+    case Kind::kNone:
+      abort();  // `Find` never returns a free slot.
+  }
+  Free(*entry);
+  return new_handle;
+}
+
+}  // namespace handle
@@ -40,14 +40,18 @@ void IDTSetGate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags) {
   idt_entries[num].flags = flags;
 }
 
+void Load() {
+  // IDTFlush(reinterpret_cast<uint32_t>(&idt_ptr));
+  asm("lidt (%0)\n" ::"r"(&idt_ptr));
+}
+
 void Initialize() {
   idt_ptr.limit = sizeof(idt_entry_t) * 256 - 1;
   idt_ptr.base = reinterpret_cast<uint32_t>(&idt_entries);
 
   memset(&idt_entries, 0, sizeof(idt_entry_t) * 256);
 
-  // IDTFlush(reinterpret_cast<uint32_t>(&idt_ptr));
-  asm("lidt (%0)\n" ::"r"(&idt_ptr));
+  Load();
 }
 
 }  // namespace idt
@@ -0,0 +1,59 @@
+#ifndef KERNEL_INCLUDE_KERNEL_APIC_H_
+#define KERNEL_INCLUDE_KERNEL_APIC_H_
+
+// Interrupt vectors delivered by the local APIC. These sit just past the
+// remapped PIC IRQs.
+#define APIC_TIMER_VECTOR 48
+#define APIC_RESCHEDULE_VECTOR 49
+#define APIC_TLB_SHOOTDOWN_VECTOR 50
+#define APIC_SPURIOUS_VECTOR 255
+
+#ifndef ASM_FILE
+
+#include <stdint.h>
+
+namespace apic {
+
+// Return true if this CPU has a local APIC.
+bool IsAvailable();
+
+// Map the local APIC registers and software-enable it. This should only be
+// called if `IsAvailable()` is true.
+void Initialize();
+
+// Enable the local APIC on an application processor. The boot processor must
+// have called `Initialize` already.
+void InitializeAP();
+
+// Return true if `Initialize` was called.
+bool IsEnabled();
+
+uint32_t GetId();
+
+// This must be sent at the end of every interrupt delivered by the local APIC
+// except for spurious interrupts.
+void SendEndOfInterrupt();
+
+// Send INIT, then a startup IPI, to every other CPU. The startup IPI makes the
+// other CPUs start executing in real mode at physical address `paddr`.
+void BroadcastInitIPI();
+void BroadcastStartupIPI(uint32_t paddr);
+
+// Raise interrupt `vector` on the CPU with the local APIC ID `dest_apic_id`.
+void SendIPI(uint32_t dest_apic_id, uint8_t vector);
+
+// The local APIC timer counts down from an initial count at the bus frequency
+// divided by some divisor. Once it reaches zero, it raises
+// `APIC_TIMER_VECTOR`. In one-shot mode, it stops after reaching zero. If
+// `masked` is true, the timer still counts down but never raises an interrupt.
+// This is useful for calibrating the timer.
+void StartOneShot(uint32_t count, bool masked = false);
+void StopTimer();
+uint32_t GetTimerInitialCount();
+uint32_t GetTimerCurrentCount();
+
+}  // namespace apic
+
+#endif  // ifndef ASM_FILE
+
+#endif  // KERNEL_INCLUDE_KERNEL_APIC_H_
@@ -1,62 +1,267 @@
 #ifndef KERNEL_INCLUDE_KERNEL_CHANNEL_H_
 #define KERNEL_INCLUDE_KERNEL_CHANNEL_H_
 
+#include <assert.h>
+#include <kernel/kernel.h>
 #include <kernel/scheduler.h>
+#include <kernel/status.h>
+#include <kernel/waitqueue.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 #include <algorithm>
+#include <vector>
 
 namespace channel {
 
-class Endpoint {
+struct Channel;
+
+// Links an endpoint into the list of endpoints its process owns.
+struct OwnerTag;
+
+class Endpoint;
+
+// One segment of a vectored read or write. `base` is a user address.
+struct IoVec {
+  void *base;
+  size_t size;
+};
+
+// The most segments one vectored read or write can have.
+constexpr size_t kMaxIoVecs = 16;
+
+// What an endpoint can be waited on for with `Endpoint::Watch`.
+enum ready_signal_t : uint32_t {
+  // There are bytes to read.
+  kReadable = 0x1,
+
+  // The other end was closed, so no more bytes will arrive.
+  kPeerClosed = 0x2,
+
+  // There is a loaned page to take.
+  kPageLoaned = 0x4,
+};
+
+// Lets a blocked task hear about an endpoint becoming readable or its peer
+// closing without reading from it. The watching task is woken, but the
+// watcher stays on the endpoint until it is destroyed.
+class Watcher : public scheduler::WaitQueueEntry {
  public:
-  // Read off the channel `size` bytes and store them at `dst`. Return true if
-  // `size` bytes were read. Otherwise, return false and set `bytes_available`
-  // to the number of bytes available on the channel.
-  bool Read(void *dst, size_t size, size_t *bytes_available) {
-    return ReadSelf(dst, size, bytes_available);
+  explicit Watcher(scheduler::Task &task) : WaitQueueEntry(task) {}
+  Watcher(const Watcher &) = delete;
+  Watcher &operator=(const Watcher &) = delete;
+  ~Watcher();
+
+  // This is null if the endpoint was never watched or has been closed.
+  Endpoint *getEndpoint() const { return endpoint_; }
+
+ private:
+  friend class Endpoint;
+
+  Endpoint *endpoint_ = nullptr;
+};
+
+class Endpoint : public kern::IntrusiveListNode<OwnerTag> {
+ public:
+  // Read off the channel `size` bytes and store them at `user_dst` in user
+  // memory. If there are fewer than `size` bytes on the channel, return
+  // K_BUFFER_TOO_SMALL and set `bytes_available` to the number of bytes
+  // available. If `user_dst` cannot be written, return K_INVALID_ARG. Nothing
+  // is taken off the channel unless this returns K_OK.
+  kstatus_t ReadToUser(void *user_dst, size_t size, size_t *bytes_available) {
+    IoVec iov = {user_dst, size};
+    return ReadVToUser(&iov, 1, bytes_available);
+  }
+
+  // Read like `ReadToUser`, but scatter the bytes across the `count` segments
+  // of `iov`, in order, as if they were one buffer of their total size.
+  kstatus_t ReadVToUser(const IoVec *iov, size_t count,
+                        size_t *bytes_available) {
+    return ReadSelf(iov, count, bytes_available);
+  }
+
+  // Read like `ReadToUser`, but if there are fewer than `size` bytes on the
+  // channel, block the current task until there are, the other end closes, or
+  // the read timeout passes. Non-blocking endpoints return right away. This
+  // writes the status to EAX in `regs`, and the number of bytes available to
+  // EBX if the read could not be done.
+  //
+  // A blocked read finishes when the task next runs. Its status is then
+  // K_PEER_CLOSED if the other end closed first, K_TIMED_OUT if the timeout
+  // passed first, or K_INVALID_HANDLE if this end was closed under it.
+  void ReadToUserOrBlock(isr::registers_t *regs, void *user_dst, size_t size) {
+    IoVec iov = {user_dst, size};
+    ReadVToUserOrBlock(regs, &iov, 1);
+  }
+
+  // Read like `ReadToUserOrBlock`, but scatter the bytes like `ReadVToUser`.
+  // The read only happens once the total size of the segments is on the
+  // channel, so it is all or nothing. `iov` is copied, so it only needs to live
+  // until this returns. Up to `kMaxIoVecs` segments can be used, and more
+  // returns K_INVALID_ARG.
+  void ReadVToUserOrBlock(isr::registers_t *regs, const IoVec *iov,
+                          size_t count);
+
+  // Have `task` finish a read of `iov` the next time it runs, through its
+  // resume hook, with the same statuses as `ReadToUserOrBlock`. The read times
+  // out on `deadline` if this endpoint has a read timeout. Blocking the task is
+  // left to the caller.
+  void QueueRead(scheduler::Task &task, const IoVec *iov, size_t count,
+                 uint32_t deadline);
+
+  // Reads on a non-blocking endpoint never wait for bytes to arrive.
+  void setNonBlocking(bool nonblocking) { nonblocking_ = nonblocking; }
+
+  // How many ticks a blocking read waits before giving up. Zero waits forever.
+  void setReadTimeout(uint32_t ticks) { read_timeout_ = ticks; }
+
+  // Write `size` bytes from `user_src` in user memory to the other end. If
+  // `user_src` cannot be read, or the channel would hold more than
+  // `kMaxCapacity` bytes, return K_INVALID_ARG and write nothing.
+  kstatus_t WriteFromUser(const void *user_src, size_t size) {
+    IoVec iov = {const_cast<void *>(user_src), size};
+    return WriteVFromUser(&iov, 1);
+  }
+
+  // Write like `WriteFromUser`, but gather the bytes from the `count` segments
+  // of `iov`, in order. The segments land on the channel together, so no other
+  // write can come between them. Nothing is written if any segment cannot be
+  // read, or if there are more than `kMaxIoVecs`.
+  kstatus_t WriteVFromUser(const IoVec *iov, size_t count) {
+    return other_ ? other_->WriteSelf(iov, count) : K_OK;
   }
 
-  void Write(const void *src, size_t size) {
-    if (other_) other_->WriteSelf(src, size);
+  // Queue the physical page `ppage` for the other end to take, so it moves
+  // between address spaces without being copied. The caller has already
+  // unmapped it and given up ownership, and the page stays marked used while it
+  // is on the channel. Return K_PEER_CLOSED and queue nothing if the other end
+  // is closed.
+  kstatus_t LoanPage(uint32_t ppage) {
+    if (PeerClosed()) return K_PEER_CLOSED;
+    other_->loaned_pages_.push_back(ppage);
+    other_->WakeReaders();
+    return K_OK;
+  }
+
+  // Take the oldest page loaned to this end. Return false if there is none.
+  bool TakeLoanedPage(uint32_t &ppage) {
+    if (loaned_pages_.empty()) return false;
+    ppage = loaned_pages_.front();
+    loaned_pages_.erase(loaned_pages_.begin());
+    return true;
   }
 
   // Close this endpoint of the channel. Return true if the whole channel was
-  // closed from this (ie. this was closed when the other end was closed).
+  // closed from this (ie. this was closed when the other end was closed), in
+  // which case the channel is freed. This is O(1).
   bool Close();
 
-  void TransferOwner(const scheduler::Task *newowner) const;
+  // Move this endpoint onto another process's list of owned endpoints. This
+  // does nothing if the endpoint is closed.
+  void TransferOwner(scheduler::Process &newowner);
+
+  scheduler::Process *getOwner() const { return owner_; }
 
-  // FIXME: This shouldn't be default constructable.
-  Endpoint() : Endpoint(0) {}
+  // The size of the ring holding the bytes waiting to be read from this end.
+  size_t getCapacity() const { return capacity_; }
+
+  // The `ready_signal_t`s that hold for this endpoint right now.
+  uint32_t getReadySignals() const {
+    uint32_t signals = 0;
+    if (size_) signals |= kReadable;
+    if (PeerClosed()) signals |= kPeerClosed;
+    if (!loaned_pages_.empty()) signals |= kPageLoaned;
+    return signals;
+  }
+
+  // Wake the watcher's task whenever bytes arrive or the peer closes.
+  void Watch(Watcher &watcher) {
+    assert(!watcher.endpoint_ && "This watcher is already watching.");
+    watcher.endpoint_ = this;
+    watchers_.Add(watcher);
+  }
+
+  Endpoint(const Endpoint &) = delete;
+  Endpoint &operator=(const Endpoint &) = delete;
   ~Endpoint() { free(data_); }
 
  private:
+  // Capacities are always powers of two so ring indices wrap with a mask.
   static constexpr size_t kDefaultCapacity = 8;
-  friend void Create(Endpoint *&, Endpoint *&);
 
-  Endpoint(size_t size)
-      : size_(size),
-        capacity_(std::max(size_, kDefaultCapacity)),
-        data_(malloc(capacity_)) {}
+  // Writes that would leave more than this on the channel are refused. Bigger
+  // transfers should loan pages instead.
+  static constexpr size_t kMaxCapacity = 0x100000;
+  static_assert(IsPowerOf2(kMaxCapacity), "Capacities must be powers of two.");
+  friend struct Channel;
 
-  bool ReadSelf(void *dst, size_t size, size_t *bytes_available);
-  void WriteSelf(const void *src, size_t size);
+  using copy_func_t = bool (*)(void *dst, const void *src, size_t size);
 
-  void Init(Endpoint *other) { other_ = other; }
+  Endpoint() : capacity_(kDefaultCapacity), data_(malloc(capacity_)) {
+    assert(IsPowerOf2(capacity_));
+  }
 
-  void ReserveIfNeeded(size_t amt);
-  void ShrinkCapacity(size_t amt);
+  kstatus_t ReadSelf(const IoVec *iov, size_t count, size_t *bytes_available);
+  kstatus_t WriteSelf(const IoVec *iov, size_t count);
 
+  void Init(Channel &channel, Endpoint &other, scheduler::Process &owner);
+
+  // True if either end of the channel was closed, so no more bytes will
+  // arrive here.
+  bool PeerClosed() const { return !other_ || !other_->other_; }
+
+  // Wake up any blocked readers whose reads can now be done, and every
+  // watcher.
+  void WakeReaders();
+
+  // Copy `size` bytes between `buf` and the ring starting at index `start`.
+  // These take at most two calls to `copy`, one on each side of the wrap.
+  bool CopyOutOfRing(void *buf, size_t start, size_t size,
+                     copy_func_t copy) const;
+  bool CopyIntoRing(size_t start, const void *buf, size_t size,
+                    copy_func_t copy);
+
+  // Move the contents to a new buffer of `capacity` bytes, starting at index
+  // zero.
+  void Resize(size_t capacity);
+  void GrowIfNeeded(size_t amt);
+  void ShrinkIfSparse();
+
+  // The channel this is one end of, and the process that owns this end. The
+  // owner is null once this end is closed.
+  Channel *channel_ = nullptr;
   Endpoint *other_ = nullptr;
-  size_t size_;
+  scheduler::Process *owner_ = nullptr;
+
+  // The bytes on the channel start at `head_` and wrap around the end.
+  size_t head_ = 0;
+  size_t size_ = 0;
   size_t capacity_;
   void *data_;
+
+  bool nonblocking_ = false;
+  uint32_t read_timeout_ = 0;
+
+  // Tasks blocked in `ReadToUserOrBlock` on this endpoint.
+  scheduler::WaitQueue readers_;
+
+  // Physical pages loaned to this end that have not been taken yet, oldest
+  // first. These are freed if this end closes first.
+  std::vector<uint32_t> loaned_pages_;
+
+  friend class Watcher;
+  scheduler::WaitQueue watchers_;
 };
 
+inline Watcher::~Watcher() {
+  if (endpoint_) endpoint_->watchers_.Remove(*this);
+}
+
+// Create a channel whose ends are both owned by the current process.
 void Create(Endpoint *&end1, Endpoint *&end2);
-void CloseEndpointsOwnedByTask(const scheduler::Task *owner);
+
+// Close every endpoint `owner` owns. This is O(endpoints owned).
+void CloseEndpointsOwnedByProcess(scheduler::Process &owner);
 
 void Initialize();
 void Destroy();
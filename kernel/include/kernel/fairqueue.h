@@ -0,0 +1,119 @@
+#ifndef KERNEL_INCLUDE_KERNEL_FAIRQUEUE_H_
+#define KERNEL_INCLUDE_KERNEL_FAIRQUEUE_H_
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace scheduler {
+
+// Weights scale how fast an entry's virtual runtime grows. An entry with twice
+// the weight of another gets twice as much CPU time when both are runnable.
+constexpr uint32_t kMinWeight = 16;
+constexpr uint32_t kDefaultWeight = 1024;
+constexpr uint32_t kMaxWeight = 65536;
+
+class FairQueue;
+
+// Anything that can be placed on a FairQueue inherits from this.
+class FairQueueEntry {
+ public:
+  // Virtual runtime is the time this entry spent running, scaled down by its
+  // weight. At the default weight, one unit is 1024 TSC cycles.
+  uint64_t getVruntime() const { return vruntime_; }
+  void setVruntime(uint64_t vruntime) {
+    assert(!queue_ && "Cannot change the vruntime of a queued entry.");
+    vruntime_ = vruntime;
+  }
+
+  uint32_t getWeight() const { return weight_; }
+  bool isQueued() const { return queue_ != nullptr; }
+
+  // The weight can only be changed while this is not on a fair queue.
+  void setWeight(uint32_t weight);
+
+  // Add `cycles` TSC cycles of running time, scaled by the weight.
+  void Charge(uint64_t cycles);
+
+ private:
+  friend class FairQueue;
+
+  // Links in the red-black tree of the queue this is on.
+  FairQueueEntry *parent_ = nullptr;
+  FairQueueEntry *left_ = nullptr;
+  FairQueueEntry *right_ = nullptr;
+  bool red_ = false;
+  const FairQueue *queue_ = nullptr;
+
+  uint64_t vruntime_ = 0;
+  uint32_t weight_ = kDefaultWeight;
+
+  // 2^26 / weight_, so charging is a multiply rather than a 64-bit divide.
+  uint32_t inv_weight_ = (kDefaultWeight << 16) / kDefaultWeight;
+};
+
+// A red-black tree of entries ordered by virtual runtime. The entry that has
+// had the least weighted CPU time runs next. Entries with equal vruntime run in
+// the order they were enqueued. Enqueueing and dequeueing are O(log n), and
+// picking the next entry is O(1).
+class FairQueue {
+ public:
+  FairQueue() = default;
+  FairQueue(const FairQueue &) = delete;
+  FairQueue &operator=(const FairQueue &) = delete;
+
+  void Enqueue(FairQueueEntry &entry);
+  void Dequeue(FairQueueEntry &entry);
+
+  // Return the entry with the smallest vruntime, or null if the queue is
+  // empty. `PopNext` also removes it from the queue.
+  FairQueueEntry *PeekNext() const { return leftmost_; }
+  FairQueueEntry *PopNext();
+
+  // Return the entry with the largest vruntime, or null if the queue is empty.
+  FairQueueEntry *PeekLast() const;
+
+  // Walk the queue in vruntime order. These return null past either end.
+  static FairQueueEntry *Next(const FairQueueEntry &entry);
+  static FairQueueEntry *Prev(const FairQueueEntry &entry);
+
+  bool Contains(const FairQueueEntry &entry) const {
+    return entry.queue_ == this;
+  }
+  bool empty() const { return root_ == nullptr; }
+  size_t size() const { return size_; }
+
+  // The sum of the weights of every queued entry.
+  uint32_t getTotalWeight() const { return total_weight_; }
+
+  // A floor for the vruntime of entries on this queue. This never goes
+  // backwards, so entries that slept or came from another queue can be placed
+  // relative to it.
+  uint64_t getMinVruntime() const { return min_vruntime_; }
+
+  // Move the floor up to the smallest vruntime out of the queued entries and
+  // `current`, which is the entry running off this queue, if any.
+  void UpdateMinVruntime(const FairQueueEntry *current);
+
+ private:
+  static bool IsRed(const FairQueueEntry *node) { return node && node->red_; }
+  void ReplaceChild(FairQueueEntry *parent, FairQueueEntry *old_child,
+                    FairQueueEntry *new_child);
+  void RotateLeft(FairQueueEntry *node);
+  void RotateRight(FairQueueEntry *node);
+  void InsertFixup(FairQueueEntry *node);
+  void DeleteFixup(FairQueueEntry *node, FairQueueEntry *parent);
+
+  FairQueueEntry *root_ = nullptr;
+
+  // The entry with the smallest vruntime is cached since it is picked next.
+  FairQueueEntry *leftmost_ = nullptr;
+
+  size_t size_ = 0;
+  uint32_t total_weight_ = 0;
+  uint64_t min_vruntime_ = 0;
+};
+
+}  // namespace scheduler
+
+#endif  // KERNEL_INCLUDE_KERNEL_FAIRQUEUE_H_
@@ -5,13 +5,23 @@
 
 namespace gdt {
 
+// Load a GDT and TSS for the CPU running this code. Each CPU calls this once.
 void Initialize();
+
+// Set the stack the CPU running this code switches to when it enters the
+// kernel from user mode.
 void SetKernelStack(uintptr_t stack);
 
+// Set the base of the user TLS segment on the CPU running this code. A segment
+// register only picks this up when it is next loaded, which happens on every
+// return to user mode.
+void SetTlsBase(uintptr_t base);
+
 constexpr uint8_t kKernCodeSeg = 0x08;
 constexpr uint8_t kKernDataSeg = 0x10;
 constexpr uint8_t kUserCodeSeg = 0x18;
 constexpr uint8_t kUserDataSeg = 0x20;
+constexpr uint8_t kUserTlsSeg = 0x30;
 
 constexpr uint8_t kRing0 = 0;
 constexpr uint8_t kRing3 = 3;
@@ -0,0 +1,117 @@
+#ifndef KERNEL_INCLUDE_KERNEL_HANDLE_H_
+#define KERNEL_INCLUDE_KERNEL_HANDLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace channel {
+
+class Endpoint;
+
+}  // namespace channel
+
+namespace scheduler {
+
+class Process;
+class Task;
+class TaskRef;
+
+}  // namespace scheduler
+
+namespace handle {
+
+// A handle is an index into the handle table of one process, with the
+// generation of that slot in the upper bits. Closing a handle bumps the
+// generation of its slot, so a stale handle is rejected even once the slot is
+// reused. Zero is never a valid handle.
+using handle_t = uint32_t;
+
+// The objects a process can hold handles to. Every lookup names the kind it
+// expects, so a handle to one kind of object can't be used as another.
+enum class Kind : uint8_t {
+  kNone,
+  kTask,
+  kEndpoint,
+};
+
+// The handles a process holds. Every thread in the process shares it. Looking
+// up, adding, and closing a handle are O(1), except that adding a task handle
+// first checks if the process already has one for that task.
+class Table {
+ public:
+  Table() = default;
+  Table(const Table &) = delete;
+  Table &operator=(const Table &) = delete;
+
+  // This drops the references to tasks. Endpoints are closed by their owning
+  // process before it gets here.
+  ~Table();
+
+  // Return a handle to `task`. If this table already has one, that handle is
+  // returned again.
+  handle_t Add(scheduler::Task &task);
+  handle_t Add(channel::Endpoint &endpoint);
+
+  // Return what `handle` refers to, or null if it is not a live handle of that
+  // kind. A handle to a task that has exited is closed here.
+  scheduler::Task *getTask(handle_t handle);
+  channel::Endpoint *getEndpoint(handle_t handle) const;
+
+  Kind getKind(handle_t handle) const {
+    const Entry *entry = Find(handle);
+    return entry ? entry->kind : Kind::kNone;
+  }
+
+  // Close `handle`. A channel endpoint is closed along with it. Returns false
+  // if `handle` is not live.
+  bool Close(handle_t handle);
+
+  // Move `handle` out of this table and into the table of `dest`, handing over
+  // ownership of whatever it refers to. Returns the handle in `dest`, or zero
+  // if `handle` is not live.
+  handle_t TransferTo(handle_t handle, scheduler::Process &dest);
+
+  // The number of live handles.
+  size_t size() const { return size_; }
+
+ private:
+  static constexpr uint32_t kIndexBits = 16;
+  static constexpr uint32_t kIndexMask = (uint32_t{1} << kIndexBits) - 1;
+
+  struct Entry {
+    // Starts at 1 so no handle is ever zero.
+    uint16_t generation = 1;
+    Kind kind = Kind::kNone;
+    union {
+      scheduler::TaskRef *task = nullptr;
+      channel::Endpoint *endpoint;
+      uint32_t next_free;
+    };
+  };
+
+  static handle_t MakeHandle(uint32_t index, uint16_t generation) {
+    return (static_cast<uint32_t>(generation) << kIndexBits) | index;
+  }
+
+  const Entry *Find(handle_t handle) const;
+  Entry *Find(handle_t handle) {
+    return const_cast<Entry *>(static_cast<const Table *>(this)->Find(handle));
+  }
+
+  // Take a free slot, growing the table if there are none.
+  uint32_t Allocate();
+  void Free(Entry &entry);
+
+  // Free slots are chained through `next_free`, ending at `kNoFreeSlot`.
+  static constexpr uint32_t kNoFreeSlot = ~uint32_t{0};
+
+  std::vector<Entry> entries_;
+  uint32_t free_head_ = kNoFreeSlot;
+  size_t size_ = 0;
+};
+
+}  // namespace handle
+
+#endif  // KERNEL_INCLUDE_KERNEL_HANDLE_H_
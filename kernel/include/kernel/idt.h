@@ -6,6 +6,10 @@
 namespace idt {
 
 void Initialize();
+
+// Load the IDT on the CPU running this code. Every CPU shares the same IDT.
+void Load();
+
 void IDTSetGate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags);
 
 }  // namespace idt
@@ -28,6 +28,24 @@ constexpr inline T RoundUp(T x, size_t align) {
   return (x + (static_cast<T>(align) - 1)) & ~(static_cast<T>(align) - 1);
 }
 
+// Return the index of the lowest set bit. `x` must be non-zero since the
+// result of BSF is undefined otherwise.
+inline uint32_t LowestSetBit(uint32_t x) {
+  assert(x);
+  uint32_t idx;
+  asm("bsf %1, %0" : "=r"(idx) : "rm"(x));
+  return idx;
+}
+
+// Return the index of the highest set bit. `x` must be non-zero since the
+// result of BSR is undefined otherwise.
+inline uint32_t HighestSetBit(uint32_t x) {
+  assert(x);
+  uint32_t idx;
+  asm("bsr %1, %0" : "=r"(idx) : "rm"(x));
+  return idx;
+}
+
 inline void DisableInterrupts() { asm volatile("cli"); }
 inline void EnableInterrupts() { asm volatile("sti"); }
 inline bool InterruptsAreEnabled() {
@@ -40,6 +58,33 @@ inline bool InterruptsAreEnabled() {
   return eflags & 0x200;
 }
 
+// Read the CPU's timestamp counter. This is only useful for measuring relative
+// durations since the rate it increments at is not known.
+inline uint64_t ReadTimestampCounter() {
+  uint32_t lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+
+inline void CPUID(uint32_t leaf, uint32_t &eax, uint32_t &ebx, uint32_t &ecx,
+                  uint32_t &edx) {
+  asm volatile("cpuid"
+               : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+               : "a"(leaf), "c"(0));
+}
+
+// Read and write model-specific registers.
+inline uint64_t ReadMSR(uint32_t msr) {
+  uint32_t lo, hi;
+  asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+  return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+
+inline void WriteMSR(uint32_t msr, uint64_t value) {
+  asm volatile("wrmsr" ::"c"(msr), "a"(static_cast<uint32_t>(value)),
+               "d"(static_cast<uint32_t>(value >> 32)));
+}
+
 /**
  * RAII for disabling interrupts in a scope, then re-enabling them after exiting
  * the scope only if they were already enabled at the start.
@@ -1,6 +1,9 @@
 #ifndef KERNEL_INCLUDE_KERNEL_LINKEDLIST_H_
 #define KERNEL_INCLUDE_KERNEL_LINKEDLIST_H_
 
+#include <assert.h>
+#include <stdint.h>
+
 namespace kern {
 
 template <typename T>
@@ -51,6 +54,148 @@ class Node {
 template <typename T>
 using LinkedList = Node<T>;
 
+// A node that lets an object be placed on an IntrusiveList without any extra
+// allocations. Objects opt in by inheriting from this. An object can be on
+// multiple lists at once by inheriting from nodes with different `Tag`s.
+template <typename Tag = void>
+class IntrusiveListNode {
+ public:
+  IntrusiveListNode() = default;
+  IntrusiveListNode(const IntrusiveListNode &) = delete;
+  IntrusiveListNode &operator=(const IntrusiveListNode &) = delete;
+  ~IntrusiveListNode() {
+    assert(!isLinked() && "Destroying a node that is still on a list.");
+  }
+
+  bool isLinked() const { return list_ != nullptr; }
+
+ private:
+  template <typename, typename>
+  friend class IntrusiveList;
+
+  IntrusiveListNode *prev_ = nullptr;
+  IntrusiveListNode *next_ = nullptr;
+
+  // The list this node is on. This is only used for validation.
+  const void *list_ = nullptr;
+};
+
+// A doubly-linked list of objects inheriting from IntrusiveListNode<Tag>.
+// Insertion and removal are O(1) and the list never allocates. The list does
+// not own any of its elements.
+template <typename T, typename Tag = void>
+class IntrusiveList {
+  using NodeTy = IntrusiveListNode<Tag>;
+
+ public:
+  class iterator {
+   public:
+    iterator(NodeTy *node) : node_(node) {}
+    T &operator*() const { return *static_cast<T *>(node_); }
+    T *operator->() const { return static_cast<T *>(node_); }
+    iterator &operator++() {
+      node_ = node_->next_;
+      return *this;
+    }
+    bool operator==(const iterator &other) const {
+      return node_ == other.node_;
+    }
+    bool operator!=(const iterator &other) const {
+      return node_ != other.node_;
+    }
+
+   private:
+    NodeTy *node_;
+  };
+
+  IntrusiveList() = default;
+  IntrusiveList(const IntrusiveList &) = delete;
+  IntrusiveList &operator=(const IntrusiveList &) = delete;
+
+  bool empty() const { return head_ == nullptr; }
+  size_t size() const { return size_; }
+
+  T *front() const { return head_ ? static_cast<T *>(head_) : nullptr; }
+  T *back() const { return tail_ ? static_cast<T *>(tail_) : nullptr; }
+
+  // Return the element after `val` on this list, or null if `val` is last.
+  // This is useful for iterating while removing elements.
+  T *next(T &val) const {
+    NodeTy &node = val;
+    assert(node.list_ == this);
+    return node.next_ ? static_cast<T *>(node.next_) : nullptr;
+  }
+
+  // Return the element before `val` on this list, or null if `val` is first.
+  T *prev(T &val) const {
+    NodeTy &node = val;
+    assert(node.list_ == this);
+    return node.prev_ ? static_cast<T *>(node.prev_) : nullptr;
+  }
+
+  bool Contains(const T &val) const {
+    return static_cast<const NodeTy &>(val).list_ == this;
+  }
+
+  void PushBack(T &val) {
+    NodeTy &node = val;
+    assert(!node.isLinked() && "Node is already on a list.");
+    node.list_ = this;
+    node.prev_ = tail_;
+    node.next_ = nullptr;
+    if (tail_)
+      tail_->next_ = &node;
+    else
+      head_ = &node;
+    tail_ = &node;
+    ++size_;
+  }
+
+  void PushFront(T &val) {
+    NodeTy &node = val;
+    assert(!node.isLinked() && "Node is already on a list.");
+    node.list_ = this;
+    node.prev_ = nullptr;
+    node.next_ = head_;
+    if (head_)
+      head_->prev_ = &node;
+    else
+      tail_ = &node;
+    head_ = &node;
+    ++size_;
+  }
+
+  void Remove(T &val) {
+    NodeTy &node = val;
+    assert(node.list_ == this && "Node is not on this list.");
+    if (node.prev_)
+      node.prev_->next_ = node.next_;
+    else
+      head_ = node.next_;
+    if (node.next_)
+      node.next_->prev_ = node.prev_;
+    else
+      tail_ = node.prev_;
+    node.prev_ = node.next_ = nullptr;
+    node.list_ = nullptr;
+    --size_;
+  }
+
+  T *PopFront() {
+    T *val = front();
+    if (val) Remove(*val);
+    return val;
+  }
+
+  iterator begin() const { return iterator(head_); }
+  iterator end() const { return iterator(nullptr); }
+
+ private:
+  NodeTy *head_ = nullptr;
+  NodeTy *tail_ = nullptr;
+  size_t size_ = 0;
+};
+
 }  // namespace kern
 
 #endif  // KERNEL_INCLUDE_KERNEL_LINKEDLIST_H_
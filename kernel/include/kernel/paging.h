@@ -7,6 +7,8 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <vector>
+
 #define PG_PRESENT 0x00000001  // page directory / table
 #define PG_WRITE 0x00000002    // page is writable
 #define PG_USER 0x00000004     // page can be accessed by user (et. all)
@@ -21,6 +23,12 @@
   0x00000100  // Tells the processor not to invalidate the TLB entry
               // corresponding to the page upon a MOV to CR3 instruction. Bit 7
               // (PGE) in CR4 must be set to enable global pages.
+#define PG_CONTINUE \
+  0x00000200  // One of the bits left for the OS. Set on a 4KB page that belongs
+              // to the same mapping as the 4KB page just below it.
+#define PG_COW \
+  0x00000400  // Another bit left for the OS. Set on a 4KB page that is mapped
+              // read-only and copied the first time it is written to.
 
 namespace paging {
 
@@ -31,23 +39,69 @@ constexpr size_t kPageDirAlignment =
 
 // Mask everything except the first 4MB.
 constexpr const uintptr_t kPageMask4M = ~UINT32_C(0x3FFFFF);
-
+constexpr const uintptr_t kPageMask4K = ~UINT32_C(0xFFF);
+
+// Page tables must be 4KB aligned.
+constexpr size_t kPageTableAlignment = 4096;
+
+// Virtual addresses below this are reserved for the kernel image and the
+// kernel heap in every address space, and user pages are only ever mapped
+// above it. Traps are handled on whichever page directory was loaded when they
+// happened, so kernel mappings made after an address space was cloned are
+// copied into it when it is switched to, or on first touch if they are made
+// while it is loaded (see `SyncKernelMapping`).
+constexpr uintptr_t kUserSpaceStart = UINT32_C(0x10000000);
+constexpr uint32_t kFirstUserPage =
+    static_cast<uint32_t>(kUserSpaceStart / pmm::kPageSize4M);
+
+// Despite the name, this maps both 4MB pages and 4KB pages. A directory entry
+// either maps a 4MB page itself or points to a page table of 4KB pages. A
+// mapping is one 4MB page, or a run of 4KB pages that starts with a page
+// without PG_CONTINUE.
 class PageDirectory4M {
  public:
   uint32_t *get() { return pd_impl_; }
   const uint32_t *get() const { return pd_impl_; }
 
-  // Map unmapped virtual memory to physical memory.
+  // Map unmapped virtual memory to physical memory with a 4MB page.
   //
   // The virtual and physical addresses must be page-aligned. The physical
-  // memory may or may not be alread in use.
-  void MapPage(uintptr_t v_addr, uintptr_t p_addr, uint8_t flags);
+  // memory may or may not be alread in use. Only kernel mappings shared by
+  // every address space should be PG_GLOBAL.
+  void MapPage(uintptr_t v_addr, uintptr_t p_addr, uint32_t flags);
 
   void UnmapPage(uintptr_t vaddr);
+
+  // Map or unmap a 4KB page. These are only for user space, since the kernel's
+  // part of the address space is shared between page directories one entry
+  // at a time. A page table is created when its first page is mapped and
+  // freed when its last page is unmapped.
+  void MapPage4K(uintptr_t vaddr, uintptr_t paddr, uint32_t flags);
+  void UnmapPage4K(uintptr_t vaddr);
+
+  // Return true if `vaddr` is on a mapped page of either size.
   bool VaddrIsMapped(uintptr_t vaddr) const;
+
+  // Return true if `vaddr` is on a mapped page that only the kernel can reach,
+  // like the local APIC registers.
+  bool IsSupervisorOnly(uintptr_t vaddr) const;
+
+  // Return true if user code can write to the page `vaddr` is mapped on.
+  bool IsUserWritable(uintptr_t vaddr) const;
+
+  // Return true if nothing is mapped anywhere in [`vaddr`, `vaddr` + `size`).
+  bool RangeIsFree(uintptr_t vaddr, size_t size) const;
+
+  // The size of the page `vaddr` is mapped on.
+  size_t getPageSize(uintptr_t vaddr) const;
+
+  // The size of the mapping that starts at `vaddr`. For 4KB pages, this is
+  // the page at `vaddr` and every PG_CONTINUE page after it.
+  size_t getMappingSize(uintptr_t vaddr) const;
+
   bool isKernelPageDir() const;
 
-  void Clear() { memset(pd_impl_, 0, sizeof(pd_impl_)); }
+  void Clear();
   size_t getNumFreeVPages() const;
 
   // Get the next free virtual page in this page directory. `lower_bound`
@@ -58,6 +112,32 @@ class PageDirectory4M {
   // Return negative number on no available virtual pages.
   int32_t getNextFreePage(uint32_t lower_bound = 0) const;
 
+  // Find `size` bytes of unmapped virtual memory at or above `lower_bound`
+  // that 4KB pages can be mapped to. `size` must be a multiple of 4KB. Return
+  // false if there is no range that large.
+  bool FindFreeRange(size_t size, uintptr_t lower_bound,
+                     uintptr_t &vaddr) const;
+
+  // Copy-on-write 4KB pages are read-only, and writing to one faults (see
+  // `HandleCopyOnWriteFault`). Mapping a page with PG_COW leaves it read-only.
+  // `ResolveCopyOnWrite` points the page at `paddr`, which may be the frame it
+  // already has, and makes it writable again.
+  void MarkCopyOnWrite(uintptr_t vaddr);
+  bool IsCopyOnWrite(uintptr_t vaddr) const;
+  void ResolveCopyOnWrite(uintptr_t vaddr, uintptr_t paddr);
+
+  // Reserve [`vaddr`, `vaddr` + `size`) for memory that is only mapped when
+  // it is first touched (see `HandleDemandFault`). A lazy area is never found
+  // free, even where nothing in it is mapped yet. The range must be
+  // 4KB-aligned, in user space, and free.
+  void ReserveLazyArea(uintptr_t vaddr, size_t size);
+
+  // Drop the lazy area that starts at `vaddr` and return its size, or zero if
+  // no area starts there. Pages already mapped in it are left mapped.
+  size_t ReleaseLazyArea(uintptr_t vaddr);
+
+  bool InLazyArea(uintptr_t vaddr) const { return FindLazyArea(vaddr, 1); }
+
   // Works similar to memcpy, but it copies data from the `src` virtual
   // address in the *current* page directory into the `dst` virtual address
   // in *this* page directory. If the current page directory is this page
@@ -76,26 +156,97 @@ class PageDirectory4M {
   // mappings as the original. This is useful for ensuring that new page
   // directories cloned from the main kernel directory contain the same
   // mappings to kernel pages (such as the page the kernel is on and
-  // wherever kernel allocations are stored).
+  // wherever kernel allocations are stored). Page tables are copied rather
+  // than shared.
   PageDirectory4M *Clone() const;
 
   void DumpMappedPages() const;
 
   PageDirectory4M() = default;
+  ~PageDirectory4M();
 
  private:
   PageDirectory4M(const PageDirectory4M &) = default;
 
+  struct alignas(kPageTableAlignment) PageTable {
+    uint32_t entries[pmm::kFramesPer4MPage];
+  };
+
   uint32_t &getPDE(uint32_t vaddr);
   const uint32_t &getPDE(uint32_t vaddr) const;
 
+  // Return the page table entry for `vaddr`, or null if its directory entry
+  // does not point to a page table.
+  const uint32_t *getPTE(uintptr_t vaddr) const;
+  uint32_t *getPTE(uintptr_t vaddr) {
+    return const_cast<uint32_t *>(
+        static_cast<const PageDirectory4M *>(this)->getPTE(vaddr));
+  }
+
+  struct LazyArea {
+    uintptr_t start;
+    size_t size;
+  };
+
+  // Return the lazy area overlapping [`vaddr`, `vaddr` + `size`), or null.
+  const LazyArea *FindLazyArea(uintptr_t vaddr, size_t size) const;
+
+  // `FindFreeRange` without the lazy areas.
+  bool FindUnmappedRange(size_t size, uintptr_t lower_bound,
+                         uintptr_t &vaddr) const;
+
   alignas(kPageDirAlignment) uint32_t pd_impl_[pmm::kNumPageDirEntries];
+
+  // Where the kernel can reach the page table for each directory entry that
+  // has one. The directory itself only holds their physical addresses.
+  PageTable *tables_[pmm::kNumPageDirEntries]{};
+
+  // There are only ever a few of these, so they are searched in order.
+  std::vector<LazyArea> lazy_areas_;
 };
 
 PageDirectory4M &GetCurrentPageDirectory();
 PageDirectory4M &GetKernelPageDirectory();
+
+// Load `pd` on this CPU, after copying in any kernel mappings it is missing.
 void SwitchPageDirectory(PageDirectory4M &pd);
 
+// Copy the kernel page directory's mapping for `vaddr` into the current page
+// directory. This is for kernel heap pages added since the current page
+// directory was last switched to. Return false if there was nothing to copy,
+// in which case a fault on `vaddr` is a real fault.
+bool SyncKernelMapping(uintptr_t vaddr);
+
+// Map a new zeroed 4KB frame at `vaddr` if it is in a lazy area of the current
+// page directory and not mapped yet. The frame is owned by the current
+// process. If another thread already mapped the page, there is nothing to do
+// and the faulting access can just be retried. Return false if `vaddr` is not
+// in a lazy area or there is no frame to map, in which case a fault on `vaddr`
+// is a real fault.
+bool HandleDemandFault(uintptr_t vaddr);
+
+// Handle a write to a present page at `vaddr` in the current page directory.
+// If the page is copy-on-write, the current process gets its own copy of the
+// frame, unless it is the last one sharing it. If the page is already writable,
+// another thread got to it first and the write can just be retried. Return
+// false if the page is neither, or there is no frame for the copy, in which
+// case the fault is a real fault.
+bool HandleCopyOnWriteFault(uintptr_t vaddr);
+
+// Return true if [`addr`, `addr` + `size`) lies entirely in user space and
+// none of it is mapped for the kernel only. The kernel does not fault on those
+// pages, so they are turned away here. Whether the rest is mapped is only found
+// out by touching it.
+bool IsUserRange(uintptr_t addr, size_t size);
+
+// Copy between kernel memory and user memory in the current address space.
+// The user range may span several pages, and pages in lazy areas are mapped
+// as they are reached. These return false if any part of the user range is
+// outside user space, mapped for the kernel only, or not mapped, in which case
+// only part of it may have been copied.
+bool CopyFromUser(void *dst, const void *user_src, size_t size);
+bool CopyToUser(void *user_dst, const void *src, size_t size);
+
 void InspectPhysicalMem(uintptr_t pstart, uintptr_t pend);
 void PageFaultHandler(isr::registers_t *regs);
 
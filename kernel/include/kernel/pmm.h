@@ -9,6 +9,8 @@ constexpr size_t kPageSize4M = 0x400000;  // 4MB
 constexpr size_t kNumPageDirEntries =
     1024;  // If we support 4MB pages, and we have a virtual address space of
            // 4GB, then we have 1024 page directories we can allocate.
+constexpr size_t kPageSize4K = 0x1000;  // 4KB
+constexpr size_t kFramesPer4MPage = kPageSize4M / kPageSize4K;
 
 void Initialize(uintptr_t mem_upper);
 size_t GetNum4MPages();
@@ -36,6 +38,43 @@ constexpr inline uintptr_t PageAddress(uintptr_t addr) {
 // value if there are no free pages.
 int32_t GetNextFreePage();
 
+// 4KB frames are handed out by a buddy allocator. A block of order `k` is 2^k
+// physically contiguous frames, aligned to its size. The largest blocks are
+// whole 4MB pages, and the page functions above work on those directly. A 4MB
+// page is split the first time a smaller block is needed and no page split
+// already has room for it. It stays marked used as a whole until everything
+// in it is freed and its blocks are merged back together.
+constexpr uint32_t kMaxOrder = 10;
+static_assert((size_t{1} << kMaxOrder) == kFramesPer4MPage);
+
+// Unlike `GetNextFreePage`, this marks the frames it returns as used. Return
+// the first frame of the block, or a negative value if there is no free block
+// of that order and no page to split.
+int32_t AllocFrames(uint32_t order);
+
+// Free a block returned by `AllocFrames`. `order` must be the order it was
+// allocated with.
+void FreeFrames(uint32_t frame, uint32_t order);
+
+inline int32_t AllocFrame() { return AllocFrames(/*order=*/0); }
+inline void FreeFrame(uint32_t frame) { FreeFrames(frame, /*order=*/0); }
+
+// A frame from `AllocFrame` can be shared copy-on-write. Each sharer holds a
+// reference, and `FreeFrame` only frees the frame once the last one is
+// dropped. The frame starts out with one reference.
+void ShareFrame(uint32_t frame);
+uint32_t GetFrameRefs(uint32_t frame);
+bool FrameIsUsed(uint32_t frame);
+
+// The number of frames in use in split pages.
+size_t GetNumUsedFrames();
+constexpr inline uint32_t AddrToFrame(uintptr_t addr) {
+  return addr / kPageSize4K;
+}
+constexpr inline uintptr_t FrameToAddr(uint32_t frame) {
+  return frame * kPageSize4K;
+}
+
 void Dump();
 
 }  // namespace pmm
@@ -0,0 +1,91 @@
+#ifndef KERNEL_INCLUDE_KERNEL_RUNQUEUE_H_
+#define KERNEL_INCLUDE_KERNEL_RUNQUEUE_H_
+
+#include <kernel/kernel.h>
+#include <kernel/linkedlist.h>
+#include <stdint.h>
+
+namespace scheduler {
+
+using priority_t = uint8_t;
+
+// There is one bit per priority level in the ready bitmap, so we can have at
+// most 32 levels. Lower numbers are higher priorities.
+constexpr size_t kNumPriorities = 32;
+constexpr priority_t kHighestPriority = 0;
+constexpr priority_t kLowestPriority = kNumPriorities - 1;
+constexpr priority_t kDefaultPriority = kNumPriorities / 2;
+
+// Anything that can be placed on a RunQueue inherits from this.
+class RunQueueEntry : public kern::IntrusiveListNode<RunQueueEntry> {
+ public:
+  priority_t getPriority() const { return priority_; }
+
+  // The priority can only be changed while this is not on a run queue.
+  void setPriority(priority_t priority) {
+    assert(!isLinked() && "Cannot change the priority of a queued entry.");
+    assert(priority < kNumPriorities);
+    priority_ = priority;
+  }
+
+ private:
+  priority_t priority_ = kDefaultPriority;
+};
+
+// A run queue made of one FIFO list per priority level plus a bitmap of which
+// levels are non-empty. Enqueueing, dequeueing, and picking the next entry are
+// all O(1) regardless of how many entries are on the queue.
+class RunQueue {
+ public:
+  RunQueue() = default;
+  RunQueue(const RunQueue &) = delete;
+  RunQueue &operator=(const RunQueue &) = delete;
+
+  // Add an entry to the back of the list for its priority.
+  void Enqueue(RunQueueEntry &entry);
+
+  // Remove an entry from anywhere on this queue.
+  void Dequeue(RunQueueEntry &entry);
+
+  // Return the entry at the front of the highest non-empty priority level, or
+  // null if the queue is empty. `PopNext` also removes it from the queue.
+  RunQueueEntry *PeekNext() const;
+  RunQueueEntry *PopNext();
+
+  // Return the entry that would run last out of the ones `can_take` accepts,
+  // or null if it accepts none. Levels are checked from the lowest priority
+  // up, and the search stops at the first level with an accepted entry.
+  template <typename Pred>
+  RunQueueEntry *FindLast(Pred can_take) const {
+    for (uint32_t bitmap = ready_bitmap_; bitmap;) {
+      uint32_t priority = HighestSetBit(bitmap);
+      bitmap &= ~(UINT32_C(1) << priority);
+
+      const EntryList &queue = queues_[priority];
+      for (RunQueueEntry *entry = queue.back(); entry;
+           entry = queue.prev(*entry)) {
+        if (can_take(*entry)) return entry;
+      }
+    }
+    return nullptr;
+  }
+
+  bool Contains(const RunQueueEntry &entry) const {
+    return queues_[entry.getPriority()].Contains(entry);
+  }
+  bool empty() const { return ready_bitmap_ == 0; }
+  size_t size() const { return size_; }
+
+ private:
+  using EntryList = kern::IntrusiveList<RunQueueEntry, RunQueueEntry>;
+
+  EntryList queues_[kNumPriorities];
+
+  // Bit N is set iff `queues_[N]` is non-empty.
+  uint32_t ready_bitmap_ = 0;
+  size_t size_ = 0;
+};
+
+}  // namespace scheduler
+
+#endif  // KERNEL_INCLUDE_KERNEL_RUNQUEUE_H_
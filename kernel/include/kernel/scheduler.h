@@ -3,17 +3,124 @@
 
 #ifndef ASM_FILE
 
+#include <kernel/fairqueue.h>
+#include <kernel/handle.h>
 #include <kernel/isr.h>
+#include <kernel/linkedlist.h>
 #include <kernel/paging.h>
+#include <kernel/runqueue.h>
+#include <kernel/timerwheel.h>
+#include <kernel/waitqueue.h>
 
 #include <vector>
 
+namespace channel {
+
+class Endpoint;
+struct OwnerTag;
+
+}  // namespace channel
+
 namespace scheduler {
 
 void Initialize();
 void Destroy();
 
-class Task {
+// Set up the idle task and run queue for the application processor running
+// this code. This should be called once per AP before it runs `RunIdleTask`.
+void InitializeAP();
+
+// Tag for the list of every task registered with the scheduler.
+struct AllTasksTag;
+
+// What the tasks of one process share: the address space, the physical pages
+// it owns, its handles, and the channel endpoints it holds. A process starts
+// with one task, and more can be added as threads. Each task holds a
+// reference, and the last one to be destroyed frees everything.
+class Process {
+ public:
+  using EndpointList =
+      kern::IntrusiveList<channel::Endpoint, channel::OwnerTag>;
+
+  explicit Process(paging::PageDirectory4M &pd) : pd_(&pd) {}
+  ~Process();
+  Process(const Process &) = delete;
+  Process &operator=(const Process &) = delete;
+
+  paging::PageDirectory4M &getPageDir() const { return *pd_; }
+
+  void RecordOwnedPage(uint32_t ppage);
+  void RemoveOwnedPage(uint32_t ppage);
+  bool PageIsRecorded(uint32_t ppage) const;
+
+  // 4KB frames this process owns. These are freed when it exits. Unlike 4MB
+  // pages, recording a frame does not mark it used, since `pmm::AllocFrame`
+  // already has. `DisownFrame` hands a frame back to the caller without
+  // freeing it, and returns false if this process did not own it. A frame
+  // shared copy-on-write is owned by every process sharing it, and each holds
+  // one of its references (see `pmm::ShareFrame`).
+  void RecordOwnedFrame(uint32_t frame);
+  bool DisownFrame(uint32_t frame);
+  bool OwnsFrame(uint32_t frame) const;
+
+  // The number of tasks running in this process.
+  size_t getNumThreads() const { return num_threads_; }
+
+  // Channel endpoints this process owns. They are closed when it exits.
+  EndpointList &getOwnedEndpoints() { return owned_endpoints_; }
+
+  handle::Table &getHandles() { return handles_; }
+
+ private:
+  friend class Task;
+
+  paging::PageDirectory4M *pd_;
+
+  // TODO: To avoid implementing vectors, instead have a set buffer size for
+  // pages "owned" by this process.
+  // FIXME: Might be more space-efficient to have a linked-list of pages
+  // rather than a static table which will likely be mostly empty.
+  static constexpr size_t kMaxPages = 256;
+  uint32_t owned_phys_pages_[kMaxPages]{};
+  std::vector<uint32_t> owned_frames_;
+
+  size_t num_threads_ = 0;
+  EndpointList owned_endpoints_;
+  handle::Table handles_;
+};
+
+class Task;
+
+// A reference to a task that can outlive it. Handles to a task hold one of
+// these, so a handle to a task that has exited is caught without searching
+// every task. The task holds a reference itself and clears it on the way out.
+class TaskRef {
+ public:
+  TaskRef(const TaskRef &) = delete;
+  TaskRef &operator=(const TaskRef &) = delete;
+
+  // This is null once the task is destroyed.
+  Task *get() const { return task_; }
+
+  void Acquire() { ++refs_; }
+  void Release() {
+    if (--refs_ == 0) delete this;
+  }
+
+ private:
+  friend class Task;
+
+  explicit TaskRef(Task &task) : task_(&task) {}
+
+  Task *task_;
+  uint32_t refs_ = 1;
+};
+
+// Every scheduling policy has its own queue entry. Only the one for the policy
+// in use is ever linked.
+class Task : public RunQueueEntry,
+             public FairQueueEntry,
+             public kern::IntrusiveListNode<AllTasksTag> {
  public:
   enum signal_t : uint32_t {
     // The task is ready to run, but has not yet started.
@@ -33,7 +140,11 @@ class Task {
 
   static constexpr size_t kDefaultKernStackSize = 0x2000;  // 2kB stack
 
+  // Create the first task of a new process that runs in `pd`.
   Task(bool user, paging::PageDirectory4M &pd, Task *parent);
+
+  // Create another thread in `process`.
+  Task(bool user, Process &process, Task *parent);
   ~Task();
 
   bool isUser() const { return is_user_; }
@@ -61,60 +172,175 @@ class Task {
 #error "What arch?"
 #endif
   }
+  uint32_t &getWakeTickReg() {
+#if defined(__i386__)
+    return regs_.ebx;
+#else
+#error "What arch?"
+#endif
+  }
+
+  // Where a blocking syscall leaves its status and first result for when this
+  // task resumes.
+  uint32_t &getSyscallStatusReg() {
+#if defined(__i386__)
+    return regs_.eax;
+#else
+#error "What arch?"
+#endif
+  }
+  uint32_t &getSyscallResultReg() {
+#if defined(__i386__)
+    return regs_.ebx;
+#else
+#error "What arch?"
+#endif
+  }
+  void setUserStack(uintptr_t stack) { regs_.useresp = stack; }
+
+  // Point this task's TLS segment at `base`. User code reaches it through
+  // %gs.
+  void setTlsBase(uintptr_t base);
+  uintptr_t getTlsBase() const { return tls_base_; }
+
   const isr::registers_t &getRegs() const { return regs_; }
   uintptr_t getKernelStackBase() const;
-  paging::PageDirectory4M &getPageDir() const { return *pd_; }
-  Task *getParent() const { return parent_; }
+  Process &getProcess() const { return *process_; }
+  paging::PageDirectory4M &getPageDir() const {
+    return process_->getPageDir();
+  }
+  // This is null if the task had no parent or the parent has exited.
+  Task *getParent() const { return parent_ ? parent_->get() : nullptr; }
+  TaskRef &getRef() const { return *ref_; }
   std::vector<Task *> getChildren() const;
 
-  void RecordOwnedPage(uint32_t ppage);
-  void RemoveOwnedPage(uint32_t ppage);
-  bool PageIsRecorded(uint32_t ppage) const;
+  void RecordOwnedPage(uint32_t ppage) { process_->RecordOwnedPage(ppage); }
+  void RemoveOwnedPage(uint32_t ppage) { process_->RemoveOwnedPage(ppage); }
+  bool PageIsRecorded(uint32_t ppage) const {
+    return process_->PageIsRecorded(ppage);
+  }
 
-  // Wait for a signal from another task.
+  // Wait for a signal from another task. This only registers interest in the
+  // signal. The caller is expected to `Block` afterwards.
   void WaitOn(Task &other_task, signal_t signals);
 
   // Return true if any of the signals this task is waiting on have not been
   // handled.
   bool isWaitingOnSignal() const { return !waiting_on_signals_.empty(); }
 
+  // The signal received from the task `other` refers to since this task
+  // started waiting on it, or 0 if there was none. This still works once that
+  // task has exited.
+  signal_t getSignalFrom(const TaskRef &other, uint32_t *value) const {
+    for (Signals &signal : waiting_on_signals_) {
+      if (signal.task == &other && signal.received_signal) {
+        *value = signal.value;
+        return signal.received_signal;
+      }
+    }
+    return signal_t(0);
+  }
+
+  // Stop waiting on every task, whether or not a signal was received.
+  void StopWaitingOnSignals() {
+    while (Signals *signal = waiting_on_signals_.front()) RemoveSignal(*signal);
+  }
+
   // If this task was waiting on a signal but has received a signal from one
   // of the tasks it was listening to, return that signal (which will be
   // non-zero) and value sent with it. If multiple signals were received, this
   // will return any one of them (no order is guaranteed).
   //
   // If this task was not waiting on a signal, return 0.
-  signal_t getReceivedSignal(uint32_t *value = nullptr,
-                             const Task **task = nullptr) const {
-    for (Signals &signal : waiting_on_signals_) {
-      if (signal.received_signal) {
-        if (value) *value = signal.value;
-        if (task) *task = signal.task;
-        return signal.received_signal;
-      }
+  signal_t getReceivedSignal(uint32_t *value = nullptr) const {
+    if (Signals *signal = GetReceivedSignal()) {
+      if (value) *value = signal->value;
+      return signal->received_signal;
     }
     return signal_t(0);
   }
 
   // This task can *not* run if:
-  // - It is waiting on signals, none of which has been received yet.
+  // - It is waiting on signals, none of which has been received yet, and has
+  //   no resume hook to sort out being woken for some other reason.
   bool canRunTask() const {
-    if (isWaitingOnSignal()) {
+    if (isWaitingOnSignal() && !hasResumeHook()) {
       if (!getReceivedSignal(/*value=*/nullptr)) { return false; }
     }
     return true;
   }
 
+  // Send signals to every task waiting on them from this task. Any of those
+  // tasks that were blocked are put back on the run queue.
   void SendSignal(signal_t signal, uint32_t value);
 
-  void RemoveSignal(const Task *task);
+  // If a signal was received, stop waiting on the task that sent it and write
+  // the signal and its value into this task's registers. Return true if a
+  // signal was consumed.
+  bool ConsumeReceivedSignal();
+
+  // True if this task is parked off the run queue waiting to be woken up.
+  bool isBlocked() const { return blocked_; }
+
+  // Have the scheduler call `func` the next time it switches to this task,
+  // once this task's address space is loaded. Blocking syscalls use this to
+  // finish up after they are woken, such as copying results out to user memory
+  // and setting the return registers.
+  using resume_func_t = void (*)(Task &task, void *arg);
+  void setResumeHook(resume_func_t func, void *arg) {
+    assert(!resume_func_ && "This task already has a resume hook.");
+    resume_func_ = func;
+    resume_arg_ = arg;
+  }
+
+  bool hasResumeHook() const { return resume_func_; }
+
+  // Call and clear the resume hook, if any.
+  void RunResumeHook() {
+    if (resume_func_t func = resume_func_) {
+      resume_func_ = nullptr;
+      func(*this, resume_arg_);
+    }
+  }
+
+  // The CPU whose run queue this task is put on when it can run. This can only
+  // change while the task is not on a run queue.
+  size_t getCpu() const { return cpu_; }
+  void setCpu(size_t cpu) {
+    assert(!RunQueueEntry::isLinked() && !isQueued() &&
+           "Cannot move a queued task to another CPU.");
+    cpu_ = cpu;
+  }
+
+  // The tick this task last stopped running. Returns false if it never ran.
+  // A task that ran very recently likely still has its working set in its
+  // CPU's cache, so the balancer leaves it where it is.
+  bool getLastRanTick(uint32_t &tick) const {
+    tick = last_ran_tick_;
+    return has_run_;
+  }
+  void setLastRanTick(uint32_t tick) {
+    last_ran_tick_ = tick;
+    has_run_ = true;
+  }
 
  private:
   friend void Initialize();
-
-  struct Signals {
-    // The other task this task is expecting a signal from.
-    const Task *task;
+  friend void InitializeAP();
+  friend void Block(isr::registers_t *regs);
+  friend void WakeTask(Task &task);
+  friend void SleepUntil(isr::registers_t *regs, uint32_t deadline);
+
+  struct SignalsTag;
+
+  // One of these is created for each task this task waits on. It sits on the
+  // other task's `signal_waiters_` queue and on this task's
+  // `waiting_on_signals_` list.
+  struct Signals : public WaitQueueEntry,
+                   public kern::IntrusiveListNode<SignalsTag> {
+    // The other task this task is expecting a signal from. This holds a
+    // reference, and `task->get()` is null once that task is destroyed.
+    TaskRef *task;
 
     // The type of the signal.
     signal_t expecting_signals;
@@ -125,11 +351,15 @@ class Task {
     // The signal this task recevied.
     signal_t received_signal;
 
-    Signals(const Task *task, signal_t signals, uint32_t value)
-        : task(task),
-          expecting_signals(signals),
-          value(value),
-          received_signal(signal_t(0)) {}
+    Signals(Task &waiter, Task &other)
+        : WaitQueueEntry(waiter),
+          task(&other.getRef()),
+          expecting_signals(signal_t(0)),
+          value(0),
+          received_signal(signal_t(0)) {
+      task->Acquire();
+    }
+    ~Signals() { task->Release(); }
   };
 
   // This is used by the kernel for initializing the main kernel task.
@@ -138,27 +368,21 @@ class Task {
              /*parent=*/nullptr) {}
 
   Signals *GetSignal(const Task &other) const {
-    for (auto &signal : waiting_on_signals_) {
-      if (signal.task == &other) return &signal;
+    for (Signals &signal : waiting_on_signals_) {
+      if (signal.task == &other.getRef()) return &signal;
     }
     return nullptr;
   }
 
-  Signals &GetOrCreateSignal(const Task &other) {
-    Signals *expected = GetSignal(other);
-    if (expected) return *expected;
-    waiting_on_signals_.emplace_back(&other, /*signals=*/signal_t(0),
-                                     /*value=*/0u);
-    return waiting_on_signals_.back();
-  }
-
-  void AddListener(const Task &waiting_task) {
-    for (const Task *t : listening_for_signals_) {
-      if (t == &waiting_task) return;
+  Signals *GetReceivedSignal() const {
+    for (Signals &signal : waiting_on_signals_) {
+      if (signal.received_signal) return &signal;
     }
-    listening_for_signals_.push_back(&waiting_task);
+    return nullptr;
   }
 
+  void RemoveSignal(Signals &signal);
+
   const bool is_user_;
   isr::registers_t regs_{};
 
@@ -167,29 +391,33 @@ class Task {
   // this allocation actually points at the end of the stack.
   void *kernel_stack_allocation_;
 
-  paging::PageDirectory4M *pd_;
-  Task *parent_;
+  Process *process_;
+  TaskRef *parent_;
+  TaskRef *ref_;
+  uintptr_t tls_base_ = 0;
 
-  // TODO: To avoid implementing vectors, instead have a set buffer size for
-  // pages "owned" by this task.
-  // FIXME: Might be more space-efficient to have a linked-list of pages
-  // rather than a static table which will likely be mostly empty.
-  static constexpr size_t kMaxPages = 256;
-  uint32_t owned_phys_pages_[kMaxPages]{};
+  // The signals we expect to receive from other tasks.
+  kern::IntrusiveList<Signals, SignalsTag> waiting_on_signals_;
 
-  // A list of tasks that we expect to receive signals from.
-  std::vector<Signals> waiting_on_signals_;
+  // Other tasks waiting on signals from this task.
+  WaitQueue signal_waiters_;
 
-  // A list of tasks this task is expected to send signals to.
-  std::vector<const Task *> listening_for_signals_;
+  bool blocked_ = false;
+  resume_func_t resume_func_ = nullptr;
+  void *resume_arg_ = nullptr;
+
+  size_t cpu_ = 0;
+  bool has_run_ = false;
+  uint32_t last_ran_tick_ = 0;
+
+  // Wakes this task up once it is done sleeping.
+  timer::Timer sleep_timer_;
 };
 
 void RegisterTask(Task &task);
 Task &GetCurrentTask();
 Task &GetMainKernelTask();
 
-bool IsRunningTask(Task *);
-
 // If regs is non-null, save the regs passed into the current task and switch
 // to the next task. Otherwise, destroy the current task and switch to the next
 // one.
@@ -197,6 +425,66 @@ bool IsRunningTask(Task *);
 // task to schedule.
 void Schedule(isr::registers_t *regs, uint32_t retval);
 
+// Switch to the next task if the current task's time slice ran out. This is
+// checked on the way out of the timer interrupt.
+void PreemptIfNeeded(isr::registers_t *regs);
+
+// Called when another CPU puts a task on this CPU's run queue. This switches
+// away from the idle task, or starts the current task's time slice.
+void HandleRescheduleIPI(isr::registers_t *regs);
+
+// Save the regs passed into the current task and park it off the run queue
+// until something calls `WakeTask` on it. The caller should have already put
+// the task on whatever wait queue it will be woken up from.
+void Block(isr::registers_t *regs);
+
+// Put the current task behind the other tasks that are waiting to run and
+// switch to the next one. This returns right away if no other task can run.
+void Yield(isr::registers_t *regs);
+
+// Block the current task until the timer reaches `deadline`. When it wakes
+// up, the tick it woke up on is written to `getWakeTickReg()`.
+void SleepUntil(isr::registers_t *regs, uint32_t deadline);
+
+// Put a blocked task back on its CPU's run queue. This does nothing if the
+// task is not blocked.
+void WakeTask(Task &task);
+
+// Turn the current CPU's first task into its idle task. This halts the CPU
+// until an interrupt arrives and never returns. The scheduler switches to the
+// idle task only when no other task on that CPU can run. This must be called
+// with the kernel lock held, and releases it.
+[[noreturn]] void RunIdleTask();
+
+// The number of timer ticks (milliseconds) `cpu` has spent in its idle task.
+// `cpu` must be running the scheduler.
+uint32_t GetIdleTicks(size_t cpu);
+
+// Change how much CPU time `task` gets relative to other tasks. The default
+// weight is `kDefaultWeight`. Returns false if `weight` is out of range.
+bool SetWeight(Task &task, uint32_t weight);
+
+// Counters for how often a CPU pulls work off other CPUs' run queues. A CPU
+// only steals when it would otherwise go idle.
+struct StealStats {
+  // Tasks this CPU took from other CPUs.
+  uint32_t steals;
+
+  // Tasks other CPUs took from this one.
+  uint32_t stolen;
+
+  // Times this CPU found a busy CPU but every task waiting there was cache
+  // hot, so nothing was taken.
+  uint32_t failed_steals;
+
+  // Cache hot tasks passed over while looking for one to steal.
+  uint32_t hot_skips;
+};
+
+// Fill `stats` for `cpu`. Returns false if that CPU is not running the
+// scheduler.
+bool GetStealStats(size_t cpu, StealStats &stats);
+
 void PrintPagesMappingPhysical(uintptr_t paddr);
 
 }  // namespace scheduler
@@ -217,6 +505,8 @@ void PrintPagesMappingPhysical(uintptr_t paddr);
 #define EDX_OFFSET 28
 #define ECX_OFFSET 32
 #define EAX_OFFSET 36
+#define INT_NO_OFFSET 40
+#define ERR_CODE_OFFSET 44
 
 #define EIP_OFFSET 48
 #define CS_OFFSET 52
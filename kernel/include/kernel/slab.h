@@ -0,0 +1,82 @@
+#ifndef KERNEL_INCLUDE_KERNEL_SLAB_H_
+#define KERNEL_INCLUDE_KERNEL_SLAB_H_
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <new>
+#include <utility>
+
+namespace kern {
+
+// Hands out objects of one type carved out of larger slabs. Objects never move
+// once allocated, so pointers to them can be handed out as handles. Freed
+// objects go on a free list and are reused first, so allocating and freeing
+// are O(1). Slabs are only returned to the heap when the allocator is
+// destroyed.
+template <typename T, size_t kObjectsPerSlab = 32>
+class Slab {
+ public:
+  Slab() = default;
+  Slab(const Slab &) = delete;
+  Slab &operator=(const Slab &) = delete;
+  ~Slab() {
+    while (SlabPage *slab = slabs_) {
+      slabs_ = slab->next;
+      free(slab);
+    }
+  }
+
+  template <typename... Args>
+  T *New(Args &&...args) {
+    if (!free_) Grow();
+    Slot *slot = free_;
+    free_ = slot->next_free;
+    ++num_allocated_;
+    return new (slot->storage) T(std::forward<Args>(args)...);
+  }
+
+  void Delete(T *obj) {
+    assert(obj && num_allocated_ && "Deleting an object twice?");
+    obj->~T();
+    auto *slot = reinterpret_cast<Slot *>(obj);
+    slot->next_free = free_;
+    free_ = slot;
+    --num_allocated_;
+  }
+
+  size_t getNumAllocated() const { return num_allocated_; }
+
+ private:
+  union Slot {
+    Slot *next_free;
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+
+  struct SlabPage {
+    SlabPage *next;
+    Slot slots[kObjectsPerSlab];
+  };
+
+  void Grow() {
+    auto *slab = static_cast<SlabPage *>(malloc(sizeof(SlabPage)));
+    assert(slab && "Out of memory for a new slab.");
+    slab->next = slabs_;
+    slabs_ = slab;
+
+    // Thread the new slots onto the free list in address order.
+    for (size_t i = kObjectsPerSlab; i-- > 0;) {
+      slab->slots[i].next_free = free_;
+      free_ = &slab->slots[i];
+    }
+  }
+
+  SlabPage *slabs_ = nullptr;
+  Slot *free_ = nullptr;
+  size_t num_allocated_ = 0;
+};
+
+}  // namespace kern
+
+#endif  // KERNEL_INCLUDE_KERNEL_SLAB_H_
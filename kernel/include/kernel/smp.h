@@ -0,0 +1,66 @@
+#ifndef KERNEL_INCLUDE_KERNEL_SMP_H_
+#define KERNEL_INCLUDE_KERNEL_SMP_H_
+
+// Application processors (APs) start in real mode at a page-aligned address
+// below 1MB. The trampoline in smpboot.S is copied here before they are
+// started.
+#define AP_TRAMPOLINE_ADDR 0x8000
+
+// Each AP runs its idle task on one of these stacks.
+#define AP_BOOT_STACK_SIZE 0x4000
+
+#define SMP_MAX_CPUS 8
+
+#ifndef ASM_FILE
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace smp {
+
+constexpr size_t kMaxCpus = SMP_MAX_CPUS;
+
+// Return the index of the CPU running this code. The boot processor is always
+// CPU 0. The APs are numbered in the order they come up.
+size_t GetCurrentCpu();
+
+// The number of CPUs that are up and scheduling tasks.
+size_t GetNumCpus();
+
+// Return true if `cpu` is up and scheduling tasks.
+bool CpuIsOnline(size_t cpu);
+
+// Wake up every AP with the local APIC INIT/SIPI sequence. Each AP sets up its
+// own GDT, TSS, local APIC timer and run queue, then idles until it is given a
+// task. This does nothing if the local APIC is not used. This should be called
+// on the boot processor with interrupts disabled and before any user page
+// directories are cloned from the kernel page directory.
+void StartApplicationProcessors();
+
+// Interrupt another CPU so it checks its run queue.
+void SendRescheduleIPI(size_t cpu);
+
+// Make every CPU in `cpus`, a bitmask of CPU indices, drop its TLB entry for
+// the page `vaddr` is on, and wait until they all have. This must be called
+// with the kernel lock held, and `cpus` must not include this CPU.
+void ShootdownTlbEntry(uint32_t cpus, uintptr_t vaddr);
+
+// Drop the TLB entry a shootdown asked this CPU to drop, if there is one.
+// This runs without the kernel lock, since the CPU that sent the shootdown
+// holds it while it waits.
+void HandleTlbShootdown();
+
+// Only one CPU at a time runs kernel code outside of its idle loop. The lock
+// is taken on every trap and released once the CPU leaves the kernel. User
+// tasks on different CPUs still run in parallel. The lock can be taken again
+// by the CPU that already holds it, such as on a fault while handling a
+// syscall, and must then be unlocked just as many times.
+void LockKernel();
+void UnlockKernel();
+bool KernelLockIsHeld();
+
+}  // namespace smp
+
+#endif  // ifndef ASM_FILE
+
+#endif  // KERNEL_INCLUDE_KERNEL_SMP_H_
@@ -0,0 +1,53 @@
+#ifndef KERNEL_INCLUDE_KERNEL_SPINLOCK_H_
+#define KERNEL_INCLUDE_KERNEL_SPINLOCK_H_
+
+#include <assert.h>
+
+namespace kern {
+
+// A test-and-test-and-set lock. Waiters spin on a plain load so the cache line
+// is only written when the lock looks free. This does not disable interrupts,
+// so anything that can also be taken from an interrupt handler should only be
+// locked with interrupts disabled.
+class Spinlock {
+ public:
+  Spinlock() = default;
+  Spinlock(const Spinlock &) = delete;
+  Spinlock &operator=(const Spinlock &) = delete;
+
+  void Lock() {
+    while (!TryLock()) {
+      while (isLocked()) asm volatile("pause");
+    }
+  }
+
+  bool TryLock() {
+    return !__atomic_exchange_n(&locked_, true, __ATOMIC_ACQUIRE);
+  }
+
+  void Unlock() {
+    assert(isLocked() && "Unlocking a lock that is not held.");
+    __atomic_store_n(&locked_, false, __ATOMIC_RELEASE);
+  }
+
+  bool isLocked() const { return __atomic_load_n(&locked_, __ATOMIC_RELAXED); }
+
+ private:
+  bool locked_ = false;
+};
+
+// RAII for holding a Spinlock for the duration of a scope.
+class SpinlockGuard {
+ public:
+  explicit SpinlockGuard(Spinlock &lock) : lock_(lock) { lock_.Lock(); }
+  ~SpinlockGuard() { lock_.Unlock(); }
+  SpinlockGuard(const SpinlockGuard &) = delete;
+  SpinlockGuard &operator=(const SpinlockGuard &) = delete;
+
+ private:
+  Spinlock &lock_;
+};
+
+}  // namespace kern
+
+#endif  // KERNEL_INCLUDE_KERNEL_SPINLOCK_H_
@@ -27,6 +27,15 @@ enum kstatus_t {
 
   // Some argument was invalid.
   K_INVALID_ARG = 8,
+
+  // A blocking call gave up before what it was waiting for happened.
+  K_TIMED_OUT = 9,
+
+  // The other end of a channel was closed.
+  K_PEER_CLOSED = 10,
+
+  // The process has no room for another handle.
+  K_OOM_HANDLES = 11,
 };
 
 #endif  // KERNEL_INCLUDE_KERNEL_STATUS_H_
@@ -1,15 +1,25 @@
 #ifndef KERNEL_INCLUDE_KERNEL_SYSCALLS_H_
 #define KERNEL_INCLUDE_KERNEL_SYSCALLS_H_
 
+#define SYSCALL_VECTOR 128
+
+// Syscalls that come in through SYSENTER are dispatched like `int $0x80`, but
+// have this in place of the error code so we know to return through SYSEXIT.
+#define SYSENTER_ERR_CODE 1
+
+#ifndef ASM_FILE
+
 #include <kernel/isr.h>
 #include <stdint.h>
 
 namespace syscalls {
 
-constexpr uint8_t kSyscallHandler = 128;
+constexpr uint8_t kSyscallHandler = SYSCALL_VECTOR;
 
 void SyscallHandler(isr::registers_t *regs);
 
 }  // namespace syscalls
 
+#endif  // ifndef ASM_FILE
+
 #endif  // KERNEL_INCLUDE_KERNEL_SYSCALLS_H_
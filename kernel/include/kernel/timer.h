@@ -2,16 +2,59 @@
 #define KERNEL_INCLUDE_KERNEL_TIMER_H_
 
 #include <kernel/isr.h>
+#include <kernel/timerwheel.h>
 
 namespace timer {
 
+// The longest we will go without a timer event. This keeps the clock moving
+// even when nothing has asked for an event.
+constexpr uint32_t kMaxEventIntervalMs = 1000;
+
+// If the local APIC is available, this calibrates its timer against the PIT
+// and uses it in one-shot mode so timer events only happen when something
+// asks for them. Otherwise, this falls back to a periodic PIT.
 void Initialize();
 
-// Each callback will be called on a timer click.
-void RegisterTimerCallback(uint8_t num, isr::handler_t callback);
-void UnregisterTimerCallback(uint8_t num);
+// Start the clock on an application processor at tick `now`. This reuses the
+// boot processor's calibration since every local APIC timer runs at the same
+// rate.
+void InitializeAP(uint32_t now);
+
+// Advance the clock and fire any expired timers. This is called on every timer
+// interrupt.
 void TimerCallback(isr::registers_t* regs);
 
+// The number of timer ticks since the timer was initialized. Each tick is a
+// millisecond. Every CPU keeps its own clock, but they agree with each other
+// to within a tick.
+uint32_t GetTicks();
+
+// Return true if tick `a` comes before tick `b`. This accounts for the tick
+// count wrapping around.
+inline bool TickBefore(uint32_t a, uint32_t b) {
+  return static_cast<int32_t>(a - b) < 0;
+}
+
+// Arm `timer` so its callback runs on `deadline`. If `period` is non-zero, it
+// runs again every `period` ticks until it is cancelled. Callbacks run from
+// the timer interrupt with interrupts disabled and must not switch tasks. The
+// timer fires on the CPU that armed it.
+void Arm(Timer& timer, uint32_t deadline, uint32_t period = 0);
+inline void ArmIn(Timer& timer, uint32_t ticks, uint32_t period = 0) {
+  Arm(timer, GetTicks() + ticks, period);
+}
+
+// Disarm `timer`. This does nothing if the timer is not armed. The timer can
+// be cancelled from any CPU.
+void Cancel(Timer& timer);
+
+// Return true if timer events only happen when requested.
+bool IsTickless();
+
+// The number of TSC cycles in a tick, measured against the PIT at boot. This
+// is only an estimate, but is good enough for scaling cycle counts.
+uint32_t GetTscPerTick();
+
 }  // namespace timer
 
 #endif  // KERNEL_INCLUDE_KERNEL_TIMER_H_
@@ -0,0 +1,115 @@
+#ifndef KERNEL_INCLUDE_KERNEL_TIMERWHEEL_H_
+#define KERNEL_INCLUDE_KERNEL_TIMERWHEEL_H_
+
+#include <assert.h>
+#include <kernel/linkedlist.h>
+#include <stdint.h>
+
+namespace timer {
+
+class TimerWheel;
+
+// A callback that runs once the timer tick count reaches some deadline. The
+// owner of a Timer must cancel it before destroying it.
+class Timer : public kern::IntrusiveListNode<Timer> {
+ public:
+  using callback_t = void (*)(Timer &timer, void *arg);
+
+  explicit Timer(callback_t callback, void *arg = nullptr)
+      : callback_(callback), arg_(arg) {
+    assert(callback);
+  }
+
+  bool isArmed() const { return isLinked(); }
+
+  // The tick this timer fires on. This is only meaningful while armed.
+  uint32_t getDeadline() const { return deadline_; }
+
+  // If non-zero, the timer is re-armed this many ticks after each deadline.
+  uint32_t getPeriod() const { return period_; }
+
+  // The wheel this timer is armed on, or null if it is not armed.
+  TimerWheel *getWheel() const { return isArmed() ? wheel_ : nullptr; }
+
+ private:
+  friend class TimerWheel;
+
+  callback_t callback_;
+  void *arg_;
+  TimerWheel *wheel_ = nullptr;
+  uint32_t deadline_ = 0;
+  uint32_t period_ = 0;
+
+  // Where this timer sits in the wheel so it can be removed in O(1).
+  uint8_t level_ = 0;
+  uint8_t slot_ = 0;
+};
+
+// A hierarchical timing wheel. Each level has `kNumSlots` slots, and each slot
+// on a level covers `kNumSlots` times as many ticks as a slot on the level
+// below it. A timer goes on the lowest level whose range covers its deadline.
+// When time reaches the range of a slot on a higher level, the timers in it
+// are cascaded down to lower levels. Timers on the lowest level fire on the
+// exact tick of their deadline.
+//
+// Arming and cancelling are O(1). Moving time forward skips over empty slots
+// using a bitmap of occupied slots on each level.
+class TimerWheel {
+ public:
+  static constexpr uint32_t kSlotBits = 5;
+  static constexpr uint32_t kNumSlots = 1 << kSlotBits;
+  static constexpr uint32_t kSlotMask = kNumSlots - 1;
+  static constexpr uint32_t kNumLevels = 5;
+
+  // Deadlines further out than this are parked on the last slot in range and
+  // re-cascaded until they are in range.
+  static constexpr uint32_t kMaxRange = UINT32_C(1)
+                                        << (kSlotBits * kNumLevels);
+
+  explicit TimerWheel(uint32_t now = 0) : now_(now) {}
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+  ~TimerWheel() { assert(empty() && "Destroying a wheel with armed timers."); }
+
+  // Arm `timer` to fire on `deadline`. A deadline that has already passed
+  // fires on the next tick. If `period` is non-zero, the timer is re-armed
+  // for `period` ticks after each deadline.
+  void Insert(Timer &timer, uint32_t deadline, uint32_t period = 0);
+  void Remove(Timer &timer);
+
+  // Move time forward to `now`, firing every timer whose deadline is on or
+  // before it. Callbacks run with the wheel already at their deadline, so
+  // they can arm other timers.
+  void Advance(uint32_t now);
+
+  // If no timers are armed, return false. Otherwise, set `tick` to a tick no
+  // later than the earliest deadline. This is exact if the earliest timer is
+  // on the lowest level. Otherwise it is the tick the timer is cascaded on.
+  bool NextEventTick(uint32_t &tick) const;
+
+  uint32_t getNow() const { return now_; }
+  bool empty() const { return num_timers_ == 0; }
+  uint32_t size() const { return num_timers_; }
+
+ private:
+  using TimerList = kern::IntrusiveList<Timer, Timer>;
+
+  void Place(Timer &timer);
+  void Cascade(uint32_t level, uint32_t tick);
+  void RunSlot(uint32_t tick);
+
+  // The last tick that was fully processed.
+  uint32_t now_;
+  uint32_t num_timers_ = 0;
+
+  TimerList slots_[kNumLevels][kNumSlots];
+  uint32_t occupied_[kNumLevels] = {};
+
+  // The timers `RunSlot` has taken off the current slot but not run yet.
+  // They are still armed, so they can be cancelled from other callbacks.
+  TimerList expiring_;
+};
+
+}  // namespace timer
+
+#endif  // KERNEL_INCLUDE_KERNEL_TIMERWHEEL_H_
@@ -0,0 +1,58 @@
+#ifndef KERNEL_INCLUDE_KERNEL_WAITQUEUE_H_
+#define KERNEL_INCLUDE_KERNEL_WAITQUEUE_H_
+
+#include <kernel/linkedlist.h>
+
+namespace scheduler {
+
+class Task;
+
+// An entry a task places on a WaitQueue for each thing it is waiting on. The
+// entry is owned by the waiting task.
+class WaitQueueEntry : public kern::IntrusiveListNode<WaitQueueEntry> {
+ public:
+  explicit WaitQueueEntry(Task &task) : task_(&task) {}
+
+  Task &getTask() const { return *task_; }
+
+ private:
+  Task *task_;
+};
+
+// A list of tasks waiting on some event. Tasks blocked on a wait queue are not
+// on any run queue, so they cost nothing when scheduling. They only go back on
+// a run queue when whatever they are waiting on wakes them up.
+class WaitQueue {
+  using EntryList = kern::IntrusiveList<WaitQueueEntry, WaitQueueEntry>;
+
+ public:
+  WaitQueue() = default;
+  WaitQueue(const WaitQueue &) = delete;
+  WaitQueue &operator=(const WaitQueue &) = delete;
+  ~WaitQueue() { assert(empty() && "Destroying a wait queue with waiters."); }
+
+  void Add(WaitQueueEntry &entry) { entries_.PushBack(entry); }
+  void Remove(WaitQueueEntry &entry) { entries_.Remove(entry); }
+  bool Contains(const WaitQueueEntry &entry) const {
+    return entries_.Contains(entry);
+  }
+  bool empty() const { return entries_.empty(); }
+
+  // Take every entry off this queue and wake up the tasks that were waiting.
+  void WakeAll();
+
+  // Take every entry off this queue without waking anyone.
+  void Clear() {
+    while (entries_.PopFront()) {}
+  }
+
+  EntryList::iterator begin() const { return entries_.begin(); }
+  EntryList::iterator end() const { return entries_.end(); }
+
+ private:
+  EntryList entries_;
+};
+
+}  // namespace scheduler
+
+#endif  // KERNEL_INCLUDE_KERNEL_WAITQUEUE_H_
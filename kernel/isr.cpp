@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <kernel/apic.h>
 #include <kernel/idt.h>
 #include <kernel/isr.h>
 #include <kernel/kernel.h>
@@ -91,7 +92,11 @@ extern void isr29();
 extern void isr30();
 extern void isr31();
 
+extern void isr48();
+extern void isr49();
+extern void isr50();
 extern void isr128();
+extern void isr255();
 
 /* Calls the handler registered to a specific interrupt, if any.
  * This function is called from the real interrupt handlers set up in
@@ -145,6 +150,16 @@ void Initialize() {
   idt::IDTSetGate(39, reinterpret_cast<uint32_t>(isr30), 0x08, 0x8E);
   idt::IDTSetGate(31, reinterpret_cast<uint32_t>(isr31), 0x08, 0x8E);
 
+  // Interrupts from the local APIC.
+  idt::IDTSetGate(APIC_TIMER_VECTOR, reinterpret_cast<uint32_t>(isr48), 0x08,
+                  0x8E);
+  idt::IDTSetGate(APIC_RESCHEDULE_VECTOR, reinterpret_cast<uint32_t>(isr49),
+                  0x08, 0x8E);
+  idt::IDTSetGate(APIC_TLB_SHOOTDOWN_VECTOR, reinterpret_cast<uint32_t>(isr50),
+                  0x08, 0x8E);
+  idt::IDTSetGate(APIC_SPURIOUS_VECTOR, reinterpret_cast<uint32_t>(isr255),
+                  0x08, 0x8E);
+
   // Set the interrupt gate privilege for 0x80 to 3 so usermode can access it.
   idt::IDTSetGate(syscalls::kSyscallHandler, reinterpret_cast<uint32_t>(isr128),
                   0x08, 0x8E | kDPLUser);
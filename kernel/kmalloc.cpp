@@ -13,17 +13,20 @@ namespace kmalloc {
 namespace {
 
 void AskForMoreKernelSpace(uintptr_t &alloc, size_t &alloc_size) {
-  // Allocate some anonymous page.
+  // Allocate some anonymous page. This only goes into the kernel page
+  // directory. Other address spaces pick it up when they first fault on it.
   auto &pd = paging::GetKernelPageDirectory();
   // FIXME: Might want to move this hardcoded `1` into a setting somewhere.
   int32_t free_vpage = pd.getNextFreePage(/*lower_bound=*/1);
-  assert(free_vpage >= 0 && "Out of virtual memory");
+  assert(free_vpage >= 0 &&
+         static_cast<uint32_t>(free_vpage) < paging::kFirstUserPage &&
+         "Out of kernel virtual memory");
   uintptr_t page_vaddr = pmm::PageToAddr(static_cast<uint32_t>(free_vpage));
 
   int32_t free_ppage = pmm::GetNextFreePage();
   assert(free_ppage >= 0 && "Out of physical memory");
   pd.MapPage(page_vaddr, pmm::PageToAddr(static_cast<uint32_t>(free_ppage)),
-             /*flags=*/0);
+             /*flags=*/PG_GLOBAL);
   pmm::SetPageUsed(static_cast<uint32_t>(free_ppage));
 
   alloc = page_vaddr;
@@ -49,7 +52,7 @@ void Initialize() {
   pmm::SetPageUsed(static_cast<uint32_t>(free_ppage));
   paging::GetCurrentPageDirectory().MapPage(
       kmalloc_vaddr, static_cast<uint32_t>(free_ppage) * pmm::kPageSize4M,
-      /*flags=*/0);
+      /*flags=*/PG_GLOBAL);
 
   libc::malloc::Initialize(/*alloc_start=*/kmalloc_vaddr,
                            /*alloc_size=*/pmm::kPageSize4M,
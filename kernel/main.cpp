@@ -11,6 +11,7 @@
 #include <kernel/pmm.h>
 #include <kernel/scheduler.h>
 #include <kernel/serial.h>
+#include <kernel/smp.h>
 #include <kernel/syscalls.h>
 #include <kernel/tests.h>
 #include <kernel/timer.h>
@@ -91,6 +92,11 @@ void InitPmm(uintptr_t mem_upper, uintptr_t kernel_begin,
 
 void JumpToUserMode(uintptr_t initrd_start, uintptr_t initrd_end) {
   assert(!InterruptsAreEnabled());
+
+  // From here on, other CPUs can run kernel code. The idle task releases this
+  // once it starts.
+  smp::LockKernel();
+
   assert(initrd_start < initrd_end);
   printf("Initrd start: 0x%x\n", initrd_start);
   printf("Initrd end (inclusive): 0x%x\n", initrd_end);
@@ -100,15 +106,13 @@ void JumpToUserMode(uintptr_t initrd_start, uintptr_t initrd_end) {
   // program to do anything else.
   //
   // Setup the initial user page directory. We will only allocate one page for
-  // the user. If they want more, they need to request more via syscalls. Just
-  // to be nice, we'll also ensure the first user process doesn't get mapped to
-  // address zero.
+  // the user. If they want more, they need to request more via syscalls. It
+  // goes in the first page past the kernel's part of the address space.
   //
   // Note that the kernel will not guarantee which page the first user program
   // will be loaded in. So userboot *should* be PC-relative code.
   paging::PageDirectory4M *user_pd = paging::GetKernelPageDirectory().Clone();
-  int32_t free_vpage =
-      paging::GetCurrentPageDirectory().getNextFreePage(/*lower_bound=*/1);
+  int32_t free_vpage = user_pd->getNextFreePage(paging::kFirstUserPage);
   assert(free_vpage > 0);
   uintptr_t user_start = pmm::PageToAddr(static_cast<uint32_t>(free_vpage));
   int32_t free_ppage = pmm::GetNextFreePage();
@@ -126,11 +130,9 @@ void JumpToUserMode(uintptr_t initrd_start, uintptr_t initrd_end) {
   init_user_task->setEntry(user_start);
   RegisterTask(*init_user_task);
 
-  // The timer will start after this call. This will start the scheduler which
-  // will switch between different tasks.
-  EnableInterrupts();
-
-  while (1) {}
+  // The timer will start once the idle task enables interrupts. This will start
+  // the scheduler which will switch between different tasks.
+  scheduler::RunIdleTask();
 }
 
 // Setup the actual kernel here using copied values from the multiboot.
@@ -172,6 +174,9 @@ void KernelSetup(uintptr_t mem_upper, multiboot::multiboot_memory_map_t *mmaps,
   tests::RunKernelTests();
 
   if (initrd_start && initrd_end) {
+    // The APs are only started if we are going to run something. They never
+    // stop, so the leak checks below would not hold.
+    smp::StartApplicationProcessors();
     JumpToUserMode(initrd_start, initrd_end);
   } else {
     printf(
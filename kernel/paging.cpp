@@ -6,12 +6,18 @@
 #include <kernel/pmm.h>
 #include <kernel/scheduler.h>
 #include <kernel/serial.h>
+#include <kernel/smp.h>
 #include <kernel/stacktrace.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <algorithm>
+
 extern "C" uint32_t __KERNEL_BEGIN, __KERNEL_END;
 
+// See usercopy.S.
+extern "C" size_t copy_user_bytes(void *dst, const void *src, size_t size);
+
 namespace paging {
 
 void InspectPhysicalMem(uintptr_t start, uintptr_t end) {
@@ -20,33 +26,106 @@ void InspectPhysicalMem(uintptr_t start, uintptr_t end) {
   uintptr_t page_end = pmm::PageAddress(end);
   assert(page_start == page_end);
 
+  // Stay out of the kernel's part of the address space, which may hold heap
+  // pages this page directory has not picked up yet.
   auto &pd = GetCurrentPageDirectory();
-  int32_t free_vpage = pd.getNextFreePage();
+  int32_t free_vpage = pd.getNextFreePage(kFirstUserPage);
   assert(free_vpage >= 0);
-  pd.MapPage((uint32_t)free_vpage, page_start, /*flags=*/0);
+  uintptr_t vaddr = pmm::PageToAddr(static_cast<uint32_t>(free_vpage));
+  pd.MapPage(vaddr, page_start, /*flags=*/0);
 
-  const uint32_t *begin =
-      (uint32_t *)(start - page_start + (uint32_t)free_vpage);
-  const uint32_t *end_ = (uint32_t *)(end - page_end + (uint32_t)free_vpage);
+  const uint32_t *begin = (uint32_t *)(start - page_start + vaddr);
+  const uint32_t *end_ = (uint32_t *)(end - page_end + vaddr);
   size_t i = 0;
   while (begin < end_) {
-    printf("0x%x[%d]: 0x%x\n",
-           (uintptr_t)begin - (uint32_t)free_vpage + page_start, i, *begin);
+    printf("0x%x[%d]: 0x%x\n", (uintptr_t)begin - vaddr + page_start, i,
+           *begin);
     ++i;
     ++begin;
   }
 
-  pd.UnmapPage((uint32_t)free_vpage);
+  pd.UnmapPage(vaddr);
 }
 
 namespace {
 
 PageDirectory4M gKernelPageDir;
-PageDirectory4M *gCurrentPageDir;
+
+// The page directory loaded on each CPU.
+PageDirectory4M *gCurrentPageDirs[smp::kMaxCpus];
 
 void MapKernelPage(PageDirectory4M &pd) {
   uintptr_t kernel_start = reinterpret_cast<uintptr_t>(&__KERNEL_BEGIN);
-  pd.MapPage(kernel_start, kernel_start, PG_PRESENT | PG_WRITE | PG_4MB);
+  pd.MapPage(kernel_start, kernel_start,
+             PG_PRESENT | PG_WRITE | PG_4MB | PG_GLOBAL);
+}
+
+
+// Drop the TLB entry for the page `vaddr` is on. This also drops global
+// entries, and anything cached about the page table above it.
+void InvalidatePage(uintptr_t vaddr) {
+  asm volatile("invlpg (%0)" ::"r"(vaddr) : "memory");
+}
+
+// Drop the TLB entry for the page `vaddr` is on in `pd`, both here and on every
+// other CPU that has `pd` loaded, like ones running other threads of the same
+// process. This is only needed when a mapping goes away or changes. CPUs don't
+// cache entries for pages that are not present.
+void InvalidatePageEverywhere(const PageDirectory4M &pd, uintptr_t vaddr) {
+  InvalidatePage(vaddr);
+
+  size_t this_cpu = smp::GetCurrentCpu();
+  uint32_t cpus = 0;
+  for (size_t cpu = 0; cpu < smp::kMaxCpus; ++cpu) {
+    if (cpu != this_cpu && gCurrentPageDirs[cpu] == &pd &&
+        smp::CpuIsOnline(cpu))
+      cpus |= UINT32_C(1) << cpu;
+  }
+  smp::ShootdownTlbEntry(cpus, vaddr);
+}
+
+// Page tables live on the kernel heap, which is mapped the same way in every
+// address space.
+uintptr_t KernelPhysicalAddr(const void *ptr) {
+  return GetKernelPageDirectory().getPhysicalAddr(
+      reinterpret_cast<uintptr_t>(ptr));
+}
+
+uint32_t PageTableIndex(uintptr_t vaddr) {
+  return (vaddr / pmm::kPageSize4K) % pmm::kFramesPer4MPage;
+}
+
+// Map the 4MB of physical memory around `paddr` into a free part of the
+// current page directory that only the kernel can reach, and return where
+// `paddr` landed. This lets a frame be filled before user code, including other
+// threads of the current process, can see it. Return null if there is no room.
+// Undo this with `UnmapKernelWindow`.
+uint8_t *MapKernelWindow(uintptr_t paddr) {
+  auto &pd = GetCurrentPageDirectory();
+  int32_t free_vpage = pd.getNextFreePage(kFirstUserPage);
+  if (free_vpage < 0) return nullptr;
+
+  uintptr_t page_paddr = pmm::PageAddress(paddr);
+  uintptr_t vaddr = pmm::PageToAddr(static_cast<uint32_t>(free_vpage));
+  pd.MapPage(vaddr, page_paddr, /*flags=*/0);
+  return reinterpret_cast<uint8_t *>(vaddr + (paddr - page_paddr));
+}
+
+void UnmapKernelWindow(const uint8_t *window) {
+  GetCurrentPageDirectory().UnmapPage(
+      pmm::PageAddress(reinterpret_cast<uintptr_t>(window)));
+}
+
+// Copy every kernel page directory entry `pd` has not picked up yet into it.
+// Kernel heap pages are never unmapped, so nothing stale is left behind.
+void SyncKernelMappings(PageDirectory4M &pd) {
+  const auto &kernel_pd = GetKernelPageDirectory();
+  if (&pd == &kernel_pd) return;
+  for (uint32_t page = 0; page < kFirstUserPage; ++page) {
+    uint32_t kernel_pde = kernel_pd.get()[page];
+    if ((kernel_pde & PG_PRESENT) && !(pd.get()[page] & PG_PRESENT))
+      pd.get()[page] = kernel_pde;
+  }
 }
 
 }  // namespace
@@ -86,7 +165,12 @@ void PageDirectory4M::DumpMappedPages() const {
   printf("Mapped pages:\n");
   for (size_t i = 0; i < pmm::kNumPageDirEntries; ++i) {
     uint32_t pde = get()[i];
-    if (pde) {
+    if (const PageTable *table = tables_[i]) {
+      size_t num_mapped = 0;
+      for (uint32_t pte : table->entries) num_mapped += bool(pte & PG_PRESENT);
+      printf("%u) 0x%x (vaddr 0x%x => page table at 0x%x, %u 4KB pages)\n",
+             i, pde, pmm::PageToAddr(i), pde & kPageMask4K, num_mapped);
+    } else if (pde) {
       printf("%u) 0x%x (vaddr 0x%x => paddr 0x%x, %s, %s, %s, %s, %s)\n", i,
              pde, pmm::PageToAddr(i), pmm::PageAddress(pde),
              pde & PG_PRESENT ? "present" : "not present",
@@ -99,15 +183,127 @@ void PageDirectory4M::DumpMappedPages() const {
 }
 
 void SwitchPageDirectory(PageDirectory4M &pd) {
-  gCurrentPageDir = &pd;
-  asm volatile("mov %0, %%cr3" ::"r"(pd.get()));
+  // Kernel stacks are on the kernel heap. Both the one we are running on and
+  // the one the next trap lands on may be on heap pages added after `pd` was
+  // cloned, and neither can fault its way in.
+  SyncKernelMappings(pd);
+
+  gCurrentPageDirs[smp::GetCurrentCpu()] = &pd;
+  // Page directories made after boot live on the kernel heap, which isn't
+  // identity mapped.
+  asm volatile("mov %0, %%cr3" ::"r"(KernelPhysicalAddr(pd.get())));
+}
+
+bool SyncKernelMapping(uintptr_t vaddr) {
+  if (vaddr >= kUserSpaceStart) return false;
+
+  auto &current_pd = GetCurrentPageDirectory();
+  const auto &kernel_pd = GetKernelPageDirectory();
+  uint32_t page = pmm::AddrToPage(vaddr);
+  uint32_t kernel_pde = kernel_pd.get()[page];
+  if (&current_pd == &kernel_pd || (current_pd.get()[page] & PG_PRESENT) ||
+      !(kernel_pde & PG_PRESENT))
+    return false;
+
+  // Nothing was mapped here, so there is no stale TLB entry to flush.
+  current_pd.get()[page] = kernel_pde;
+  return true;
+}
+
+bool HandleDemandFault(uintptr_t vaddr) {
+  auto &pd = GetCurrentPageDirectory();
+  if (!pd.InLazyArea(vaddr)) return false;
+
+  // Another thread of this process may have faulted on the same page on
+  // another CPU and mapped it while this fault waited for the kernel lock.
+  if (pd.VaddrIsMapped(vaddr)) return true;
+
+  int32_t frame = pmm::AllocFrame();
+  if (frame < 0) return false;
+
+  // The frame still holds whatever its last owner left in it, so it is zeroed
+  // before the page is mapped. Otherwise other threads of this process could
+  // read it on other CPUs in the meantime.
+  uintptr_t paddr = pmm::FrameToAddr(static_cast<uint32_t>(frame));
+  uint8_t *window = MapKernelWindow(paddr);
+  if (!window) {
+    pmm::FreeFrame(static_cast<uint32_t>(frame));
+    return false;
+  }
+  memset(window, 0, pmm::kPageSize4K);
+  UnmapKernelWindow(window);
+
+  pd.MapPage4K(vaddr & kPageMask4K, paddr, /*flags=*/PG_USER);
+  scheduler::GetCurrentTask().getProcess().RecordOwnedFrame(
+      static_cast<uint32_t>(frame));
+  return true;
+}
+
+bool HandleCopyOnWriteFault(uintptr_t vaddr) {
+  auto &pd = GetCurrentPageDirectory();
+  uintptr_t page_vaddr = vaddr & kPageMask4K;
+
+  // Another thread of this process may have written to the same page on
+  // another CPU and resolved it while this fault waited for the kernel lock.
+  if (!pd.IsCopyOnWrite(page_vaddr)) return pd.IsUserWritable(page_vaddr);
+
+  auto &process = scheduler::GetCurrentTask().getProcess();
+  uint32_t frame = pmm::AddrToFrame(pd.getPhysicalAddr(page_vaddr));
+  if (pmm::GetFrameRefs(frame) == 1 && process.OwnsFrame(frame)) {
+    pd.ResolveCopyOnWrite(page_vaddr, pmm::FrameToAddr(frame));
+    return true;
+  }
+
+  int32_t copy = pmm::AllocFrame();
+  if (copy < 0) return false;
+
+  // The copy is filled before the page is switched over to it. Other threads
+  // of this process may be using the page on other CPUs, and must never see a
+  // partial copy or have their writes to it overwritten.
+  uintptr_t copy_paddr = pmm::FrameToAddr(static_cast<uint32_t>(copy));
+  uint8_t *window = MapKernelWindow(copy_paddr);
+  if (!window) {
+    pmm::FreeFrame(static_cast<uint32_t>(copy));
+    return false;
+  }
+  memcpy(window, reinterpret_cast<const void *>(page_vaddr), pmm::kPageSize4K);
+  UnmapKernelWindow(window);
+  pd.ResolveCopyOnWrite(page_vaddr, copy_paddr);
+
+  process.RecordOwnedFrame(static_cast<uint32_t>(copy));
+  if (process.DisownFrame(frame)) pmm::FreeFrame(frame);
+  return true;
+}
+
+bool IsUserRange(uintptr_t addr, size_t size) {
+  if (addr < kUserSpaceStart || addr + size < addr) return false;
+  if (!size) return true;
+
+  const PageDirectory4M &pd = GetCurrentPageDirectory();
+  uintptr_t last_page = (addr + size - 1) & kPageMask4K;
+  for (uintptr_t page = addr & kPageMask4K;; page += pmm::kPageSize4K) {
+    if (pd.IsSupervisorOnly(page)) return false;
+    if (page == last_page) return true;
+  }
+}
+
+bool CopyFromUser(void *dst, const void *user_src, size_t size) {
+  if (!IsUserRange(reinterpret_cast<uintptr_t>(user_src), size)) return false;
+  return copy_user_bytes(dst, user_src, size) == 0;
+}
+
+bool CopyToUser(void *user_dst, const void *src, size_t size) {
+  if (!IsUserRange(reinterpret_cast<uintptr_t>(user_dst), size)) return false;
+  return copy_user_bytes(user_dst, src, size) == 0;
 }
 
 bool PageDirectory4M::isKernelPageDir() const {
-  return this == gCurrentPageDir;
+  return this == &GetCurrentPageDirectory();
 }
 
-PageDirectory4M &GetCurrentPageDirectory() { return *gCurrentPageDir; }
+PageDirectory4M &GetCurrentPageDirectory() {
+  return *gCurrentPageDirs[smp::GetCurrentCpu()];
+}
 PageDirectory4M &GetKernelPageDirectory() { return gKernelPageDir; }
 
 void Initialize() {
@@ -138,24 +334,30 @@ void Initialize() {
   SwitchPageDirectory(gKernelPageDir);
 
   // Enable paging.
-  // PSE is required for 4MB pages.
+  // PSE is required for 4MB pages. PGE keeps the kernel's global pages in the
+  // TLB across page directory switches.
+  // WP makes the kernel fault on read-only user pages too, so copy-on-write
+  // pages are copied before the kernel writes to them.
   constexpr uint32_t kPagingFlag = 0x80000000;  // CR0 - bit 31
+  constexpr uint32_t kWpFlag = 0x00010000;      // CR0 - bit 16
   constexpr uint32_t kPseFlag = 0x00000010;     // CR4 - bit 4
+  constexpr uint32_t kPgeFlag = 0x00000080;     // CR4 - bit 7
   asm volatile(
       "mov %%cr4, %%eax \n\
       or %1, %%eax \n\
       mov %%eax, %%cr4 \n\
       mov %%cr0, %%eax \n\
       or %0, %%eax \n\
-      mov %%eax, %%cr0" ::"i"(kPagingFlag),
-      "i"(kPseFlag));
+      mov %%eax, %%cr0" ::"i"(kPagingFlag | kWpFlag),
+      "i"(kPseFlag | kPgeFlag));
 
   uint32_t cr0, cr4;
   asm volatile("mov %%cr0, %0" : "=r"(cr0));
   asm volatile("mov %%cr4, %0" : "=r"(cr4));
-  assert(cr4 == kPseFlag && "Expected only Page Size Extension to be on.");
+  assert(cr4 == (kPseFlag | kPgeFlag) &&
+         "Expected only Page Size Extension and Page Global Enable to be on.");
   // FIXME: Move this into a constant variable and document the flags.
-  assert(cr0 == 0x80000011);
+  assert(cr0 == 0x80010011);
 }
 
 uint32_t &PageDirectory4M::getPDE(uint32_t vaddr) {
@@ -170,7 +372,8 @@ const uint32_t &PageDirectory4M::getPDE(uint32_t vaddr) const {
   return pd_impl_[vaddr / pmm::kPageSize4M];
 }
 
-void PageDirectory4M::MapPage(uintptr_t vaddr, uintptr_t paddr, uint8_t flags) {
+void PageDirectory4M::MapPage(uintptr_t vaddr, uintptr_t paddr,
+                              uint32_t flags) {
   DisableInterruptsRAII disable_interrupts_raii;
 
   // With 4MB pages, bits 31 through 12 are reserved, so the the physical
@@ -183,11 +386,13 @@ void PageDirectory4M::MapPage(uintptr_t vaddr, uintptr_t paddr, uint8_t flags) {
       !(pde & PG_PRESENT) &&
       "The page directory entry for this virtual address is already assigned.");
 
+  // Global pages survive CR3 switches, so they must be the same in every
+  // address space and never reachable from user mode.
+  assert(!((flags & PG_GLOBAL) && (flags & PG_USER)) &&
+         "User pages cannot be global.");
   pde = paddr | (PG_PRESENT | PG_4MB | PG_WRITE | flags);
-  assert(!(pde & PG_GLOBAL) && "DO NOT ENABLE THE GLOBAL BIT");
 
-  // Invalidate page in TLB.
-  asm volatile("invlpg %0" ::"m"(vaddr));
+  InvalidatePage(vaddr);
 }
 
 void PageDirectory4M::UnmapPage(uintptr_t vaddr) {
@@ -197,15 +402,159 @@ void PageDirectory4M::UnmapPage(uintptr_t vaddr) {
   assert(
       (pde & PG_PRESENT) &&
       "The page directory entry for this virtual address is already assigned.");
+  assert((pde & PG_4MB) && "Use UnmapPage4K for 4KB pages.");
 
   pde = 0;
 
-  // Invalidate page in TLB.
-  asm volatile("invlpg %0" ::"m"(vaddr));
+  InvalidatePageEverywhere(*this, vaddr);
+}
+
+void PageDirectory4M::MapPage4K(uintptr_t vaddr, uintptr_t paddr,
+                                uint32_t flags) {
+  DisableInterruptsRAII disable_interrupts_raii;
+
+  assert(vaddr % pmm::kPageSize4K == 0 && paddr % pmm::kPageSize4K == 0 &&
+         "Attempting to map a page that is not 4KB aligned!");
+  assert(vaddr >= kUserSpaceStart && "Kernel pages must be 4MB pages.");
+  assert(!(flags & (PG_GLOBAL | PG_4MB)) && "Unexpected 4KB page flags.");
+
+  uint32_t index = pmm::AddrToPage(vaddr);
+  uint32_t &pde = pd_impl_[index];
+  PageTable *&table = tables_[index];
+  if (!table) {
+    assert(!(pde & PG_PRESENT) &&
+           "A 4MB page is already mapped at this virtual address.");
+    table = new PageTable();
+    assert(table);
+
+    // Each page table entry decides what its own page allows.
+    pde = KernelPhysicalAddr(table) | PG_PRESENT | PG_WRITE | PG_USER;
+  }
+
+  uint32_t &pte = table->entries[PageTableIndex(vaddr)];
+  assert(!(pte & PG_PRESENT) &&
+         "The page table entry for this virtual address is already assigned.");
+  uint32_t write = (flags & PG_COW) ? 0 : PG_WRITE;
+  pte = paddr | (PG_PRESENT | write | flags);
+
+  InvalidatePage(vaddr);
+}
+
+void PageDirectory4M::UnmapPage4K(uintptr_t vaddr) {
+  DisableInterruptsRAII disable_interrupts_raii;
+
+  uint32_t index = pmm::AddrToPage(vaddr);
+  PageTable *table = tables_[index];
+  assert(table && "No page table for this virtual address.");
+  uint32_t &pte = table->entries[PageTableIndex(vaddr)];
+  assert((pte & PG_PRESENT) && "This virtual address is not mapped.");
+  pte = 0;
+
+  bool table_is_empty = true;
+  for (uint32_t entry : table->entries) {
+    if (entry & PG_PRESENT) {
+      table_is_empty = false;
+      break;
+    }
+  }
+  if (table_is_empty) {
+    pd_impl_[index] = 0;
+    tables_[index] = nullptr;
+    delete table;
+  }
+
+  InvalidatePageEverywhere(*this, vaddr);
+}
+
+void PageDirectory4M::MarkCopyOnWrite(uintptr_t vaddr) {
+  DisableInterruptsRAII disable_interrupts_raii;
+
+  uint32_t *pte = getPTE(vaddr);
+  assert(pte && (*pte & PG_PRESENT) && "Expected a mapped 4KB page.");
+  *pte = (*pte & ~PG_WRITE) | PG_COW;
+
+  InvalidatePageEverywhere(*this, vaddr);
+}
+
+bool PageDirectory4M::IsCopyOnWrite(uintptr_t vaddr) const {
+  const uint32_t *pte = getPTE(vaddr);
+  return pte && (*pte & PG_PRESENT) && (*pte & PG_COW);
+}
+
+void PageDirectory4M::ResolveCopyOnWrite(uintptr_t vaddr, uintptr_t paddr) {
+  DisableInterruptsRAII disable_interrupts_raii;
+
+  assert(IsCopyOnWrite(vaddr));
+  assert(paddr % pmm::kPageSize4K == 0);
+  uint32_t *pte = getPTE(vaddr);
+  *pte = paddr | (*pte & ~(kPageMask4K | PG_COW)) | PG_WRITE;
+
+  InvalidatePageEverywhere(*this, vaddr);
+}
+
+const uint32_t *PageDirectory4M::getPTE(uintptr_t vaddr) const {
+  const PageTable *table = tables_[pmm::AddrToPage(vaddr)];
+  return table ? &table->entries[PageTableIndex(vaddr)] : nullptr;
 }
 
 bool PageDirectory4M::VaddrIsMapped(uintptr_t vaddr) const {
-  return getPDE(vaddr) & PG_PRESENT;
+  uint32_t pde = pd_impl_[pmm::AddrToPage(vaddr)];
+  if (!(pde & PG_PRESENT)) return false;
+  if (pde & PG_4MB) return true;
+  return *getPTE(vaddr) & PG_PRESENT;
+}
+
+bool PageDirectory4M::IsSupervisorOnly(uintptr_t vaddr) const {
+  if (!VaddrIsMapped(vaddr)) return false;
+  uint32_t pde = pd_impl_[pmm::AddrToPage(vaddr)];
+  if (!(pde & PG_USER)) return true;
+  return !(pde & PG_4MB) && !(*getPTE(vaddr) & PG_USER);
+}
+
+bool PageDirectory4M::IsUserWritable(uintptr_t vaddr) const {
+  if (!VaddrIsMapped(vaddr) || IsSupervisorOnly(vaddr)) return false;
+  uint32_t pde = pd_impl_[pmm::AddrToPage(vaddr)];
+  if (!(pde & PG_WRITE)) return false;
+  return (pde & PG_4MB) || (*getPTE(vaddr) & PG_WRITE);
+}
+
+bool PageDirectory4M::RangeIsFree(uintptr_t vaddr, size_t size) const {
+  assert(vaddr % pmm::kPageSize4K == 0 && size % pmm::kPageSize4K == 0);
+  if (FindLazyArea(vaddr, size)) return false;
+  for (uintptr_t end = vaddr + size; vaddr != end;
+       vaddr += pmm::kPageSize4K) {
+    if (VaddrIsMapped(vaddr)) return false;
+  }
+  return true;
+}
+
+size_t PageDirectory4M::getPageSize(uintptr_t vaddr) const {
+  assert(VaddrIsMapped(vaddr));
+  return (pd_impl_[pmm::AddrToPage(vaddr)] & PG_4MB) ? pmm::kPageSize4M
+                                                     : pmm::kPageSize4K;
+}
+
+size_t PageDirectory4M::getMappingSize(uintptr_t vaddr) const {
+  size_t size = getPageSize(vaddr);
+  if (size == pmm::kPageSize4M) return size;
+
+  for (uintptr_t next = vaddr + size; VaddrIsMapped(next) &&
+                                      getPageSize(next) == pmm::kPageSize4K &&
+                                      (*getPTE(next) & PG_CONTINUE);
+       next += pmm::kPageSize4K) {
+    size += pmm::kPageSize4K;
+  }
+  return size;
+}
+
+void PageDirectory4M::Clear() {
+  for (const PageTable *table : tables_)
+    assert(!table && "Clearing a page directory with page tables.");
+  memset(pd_impl_, 0, sizeof(pd_impl_));
+}
+
+PageDirectory4M::~PageDirectory4M() {
+  for (PageTable *table : tables_) delete table;
 }
 
 size_t PageDirectory4M::getNumFreeVPages() const {
@@ -216,43 +565,143 @@ size_t PageDirectory4M::getNumFreeVPages() const {
 }
 
 int32_t PageDirectory4M::getNextFreePage(uint32_t lower_bound) const {
-  for (size_t i = lower_bound; i < pmm::kNumPageDirEntries; ++i)
-    if (!(pd_impl_[i] & PG_PRESENT)) return static_cast<int32_t>(i);
+  for (size_t i = lower_bound; i < pmm::kNumPageDirEntries; ++i) {
+    if (!(pd_impl_[i] & PG_PRESENT) &&
+        !FindLazyArea(pmm::PageToAddr(i), pmm::kPageSize4M))
+      return static_cast<int32_t>(i);
+  }
   return -1;
 }
 
+bool PageDirectory4M::FindFreeRange(size_t size, uintptr_t lower_bound,
+                                    uintptr_t &vaddr) const {
+  // Look again past any lazy area the unmapped range runs into.
+  while (FindUnmappedRange(size, lower_bound, vaddr)) {
+    const LazyArea *area = FindLazyArea(vaddr, size);
+    if (!area) return true;
+
+    uintptr_t area_end = area->start + area->size;
+    if (area_end <= lower_bound) return false;  // It ends at the top.
+    lower_bound = area_end;
+  }
+  return false;
+}
+
+void PageDirectory4M::ReserveLazyArea(uintptr_t vaddr, size_t size) {
+  assert(vaddr >= kUserSpaceStart && size && vaddr + (size - 1) >= vaddr &&
+         "Invalid lazy area.");
+  assert(RangeIsFree(vaddr, size) && "Lazy area overlaps another mapping.");
+  lazy_areas_.push_back({vaddr, size});
+}
+
+size_t PageDirectory4M::ReleaseLazyArea(uintptr_t vaddr) {
+  for (LazyArea &area : lazy_areas_) {
+    if (area.start == vaddr) {
+      size_t size = area.size;
+      area = lazy_areas_.back();
+      lazy_areas_.pop_back();
+      return size;
+    }
+  }
+  return 0;
+}
+
+const PageDirectory4M::LazyArea *PageDirectory4M::FindLazyArea(
+    uintptr_t vaddr, size_t size) const {
+  for (const LazyArea &area : lazy_areas_) {
+    // Compare last bytes so a range that ends at the top of memory works.
+    if (vaddr <= area.start + (area.size - 1) &&
+        area.start <= vaddr + (size - 1))
+      return &area;
+  }
+  return nullptr;
+}
+
+bool PageDirectory4M::FindUnmappedRange(size_t size, uintptr_t lower_bound,
+                                        uintptr_t &vaddr) const {
+  assert(size && size % pmm::kPageSize4K == 0);
+  size_t needed = size / pmm::kPageSize4K;
+
+  // Count free 4KB slots until there are enough in a row. An empty directory
+  // entry counts for every slot under it at once.
+  constexpr size_t kNumSlots = pmm::kNumPageDirEntries * pmm::kFramesPer4MPage;
+  size_t run_start = 0, run = 0;
+  for (size_t slot = lower_bound / pmm::kPageSize4K; slot < kNumSlots;) {
+    size_t index = slot / pmm::kFramesPer4MPage;
+    size_t left_in_entry = pmm::kFramesPer4MPage - slot % pmm::kFramesPer4MPage;
+    if (const PageTable *table = tables_[index]) {
+      if (table->entries[slot % pmm::kFramesPer4MPage] & PG_PRESENT) {
+        run = 0;
+      } else if (run++ == 0) {
+        run_start = slot;
+      }
+      ++slot;
+    } else if (pd_impl_[index] & PG_PRESENT) {
+      run = 0;
+      slot += left_in_entry;
+    } else {
+      if (run == 0) run_start = slot;
+      run += left_in_entry;
+      slot += left_in_entry;
+    }
+
+    if (run >= needed) {
+      vaddr = run_start * pmm::kPageSize4K;
+      return true;
+    }
+  }
+  return false;
+}
+
 PageDirectory4M *PageDirectory4M::Clone() const {
   // TODO: For user page directories, it shouldn't be necessary for us to copy
   // all kernel pages. Only the starting page holding the whole kernel should
   // do.
   auto *pd = new PageDirectory4M(*this);
   assert(pd);
+
+  for (size_t i = 0; i < pmm::kNumPageDirEntries; ++i) {
+    if (!tables_[i]) continue;
+    auto *table = new PageTable(*tables_[i]);
+    assert(table);
+    pd->tables_[i] = table;
+    pd->pd_impl_[i] = KernelPhysicalAddr(table) | (pd_impl_[i] & ~kPageMask4K);
+  }
   return pd;
 }
 
 uintptr_t PageDirectory4M::getPhysicalAddr(uintptr_t vaddr) const {
-  const uint32_t &pd_entry = getPDE(vaddr);
-  assert((pd_entry & PG_PRESENT) && "Page for virtual address not present");
-  return pd_entry & kPageMask4M;
+  assert(VaddrIsMapped(vaddr) && "Page for virtual address not present");
+  uint32_t pde = pd_impl_[pmm::AddrToPage(vaddr)];
+  if (pde & PG_4MB) return (pde & kPageMask4M) | (vaddr & ~kPageMask4M);
+  return (*getPTE(vaddr) & kPageMask4K) | (vaddr & ~kPageMask4K);
 }
 
 // Create an anonymous virtual page mapping to the physical page in another
 // page directory mapped with the virtual address `vaddr` in that PD. Return
 // an address in this page directory that is mapped to the same physical
 // memory mapped to the `vaddr` in `other_pd`.
+//
+// This maps the whole 4MB of physical memory around the page, which covers a
+// 4KB page as well as a 4MB one.
 static uintptr_t TempMap(PageDirectory4M &other_pd, uintptr_t vaddr) {
   auto &current_pd = paging::GetCurrentPageDirectory();
   assert(&other_pd != &current_pd);
-  uintptr_t page_vaddr = pmm::PageAddress(vaddr);
-  size_t vaddr_offset = vaddr - page_vaddr;
-  assert(other_pd.VaddrIsMapped(page_vaddr));
-  uintptr_t paddr = other_pd.getPhysicalAddr(page_vaddr);
+  assert(other_pd.VaddrIsMapped(vaddr));
+  uintptr_t paddr = other_pd.getPhysicalAddr(vaddr);
+  uintptr_t page_paddr = pmm::PageAddress(paddr);
 
-  int32_t free_vpage = current_pd.getNextFreePage();
+  int32_t free_vpage = current_pd.getNextFreePage(kFirstUserPage);
   assert(free_vpage >= 0 && "No free virtual pages");
   uintptr_t new_page_vaddr = pmm::PageToAddr(static_cast<uint32_t>(free_vpage));
-  current_pd.MapPage(new_page_vaddr, paddr, /*flags=*/0);
-  return new_page_vaddr + vaddr_offset;
+  current_pd.MapPage(new_page_vaddr, page_paddr, /*flags=*/0);
+  return new_page_vaddr + (paddr - page_paddr);
+}
+
+// The number of bytes from `vaddr` to the end of the page it is mapped on.
+static size_t BytesLeftOnPage(const PageDirectory4M &pd, uintptr_t vaddr) {
+  size_t page_size = pd.getPageSize(vaddr);
+  return page_size - vaddr % page_size;
 }
 
 static void Memcpy(PageDirectory4M &src_pd, PageDirectory4M &dst_pd,
@@ -269,34 +718,45 @@ static void Memcpy(PageDirectory4M &src_pd, PageDirectory4M &dst_pd,
   // are the current page directory, then we need to virtual map one page from
   // each PD into the current one, then do a memcpy between those pages. If
   // at least one of them is the current page dir, then we'll only need to
-  // allocate one page.
-  const void *this_pd_src;
-  if (&src_pd == &current_pd) {
-    this_pd_src = src;
-  } else {
-    this_pd_src = reinterpret_cast<const void *>(
-        TempMap(src_pd, reinterpret_cast<uintptr_t>(src)));
-  }
+  // allocate one page. Pages that are next to each other in another page
+  // directory need not be next to each other in physical memory, so this goes
+  // one page at a time.
+  auto src_addr = reinterpret_cast<uintptr_t>(src);
+  auto dst_addr = reinterpret_cast<uintptr_t>(dst);
+  while (size) {
+    size_t chunk = size;
+    const void *this_pd_src;
+    if (&src_pd == &current_pd) {
+      this_pd_src = reinterpret_cast<const void *>(src_addr);
+    } else {
+      chunk = std::min(chunk, BytesLeftOnPage(src_pd, src_addr));
+      this_pd_src = reinterpret_cast<const void *>(TempMap(src_pd, src_addr));
+    }
 
-  void *this_pd_dst;
-  if (&dst_pd == &current_pd) {
-    this_pd_dst = dst;
-  } else {
-    this_pd_dst = reinterpret_cast<void *>(
-        TempMap(dst_pd, reinterpret_cast<uintptr_t>(dst)));
-  }
+    void *this_pd_dst;
+    if (&dst_pd == &current_pd) {
+      this_pd_dst = reinterpret_cast<void *>(dst_addr);
+    } else {
+      chunk = std::min(chunk, BytesLeftOnPage(dst_pd, dst_addr));
+      this_pd_dst = reinterpret_cast<void *>(TempMap(dst_pd, dst_addr));
+    }
 
-  // Do the memcpy in the current address space.
-  memcpy(this_pd_dst, this_pd_src, size);
+    // Do the memcpy in the current address space.
+    memcpy(this_pd_dst, this_pd_src, chunk);
 
-  // Free any temporarily-mapped pages.
-  if (&src_pd != &current_pd) {
-    current_pd.UnmapPage(
-        pmm::PageAddress(reinterpret_cast<uintptr_t>(this_pd_src)));
-  }
-  if (&dst_pd != &current_pd) {
-    current_pd.UnmapPage(
-        pmm::PageAddress(reinterpret_cast<uintptr_t>(this_pd_dst)));
+    // Free any temporarily-mapped pages.
+    if (&src_pd != &current_pd) {
+      current_pd.UnmapPage(
+          pmm::PageAddress(reinterpret_cast<uintptr_t>(this_pd_src)));
+    }
+    if (&dst_pd != &current_pd) {
+      current_pd.UnmapPage(
+          pmm::PageAddress(reinterpret_cast<uintptr_t>(this_pd_dst)));
+    }
+
+    src_addr += chunk;
+    dst_addr += chunk;
+    size -= chunk;
   }
 }
 
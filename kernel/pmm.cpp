@@ -15,6 +15,8 @@ namespace pmm {
 
 namespace {
 
+constexpr size_t kBitsPerWord = 32;
+
 size_t gNum4MPages;
 
 // This refers to the number of physical pages available. Each bit in this
@@ -22,61 +24,158 @@ size_t gNum4MPages;
 // space means there can be up to 4GB of physical memory available, but that
 // might not always be the case. `gNum4MPages` represents the actual number
 // of pages available and may be smaller than `kNumPageDirEntries`.
-uint8_t gPhysicalBitmap[kNumPageDirEntries / CHAR_BIT];
+//
+// The bitmaps are searched a word at a time, so a full word of used pages is
+// skipped with one comparison.
+uint32_t gPhysicalBitmap[kNumPageDirEntries / kBitsPerWord];
+
+// Kept in step with `gPhysicalBitmap` so the page counts are O(1). Only the
+// first `gNum4MPages` pages are counted.
+size_t gNumFree4MPages;
+
+// Where the next search for a free page starts. This moves past each page
+// marked used, so searches don't rescan the used pages at the bottom of memory
+// every time and a page that was just freed isn't handed straight back out.
+uint32_t gNextFreeHint;
+
+// Frames are handed out by a binary buddy allocator. A block of order `k` is
+// 2^k frames aligned to its size, and the 4MB pages above are the blocks of
+// order `kMaxOrder`. For each lower order there is a bitmap with a bit set
+// for each free block of that order. A free block always has its buddy in use,
+// otherwise the two would have been merged into one block of the next order.
+constexpr size_t kNumFrames = kNumPageDirEntries * kFramesPer4MPage;
+
+constexpr size_t NumFreeBitmapWords(uint32_t order) {
+  return (kNumFrames >> order) / kBitsPerWord;
+}
+
+constexpr size_t FreeBitmapOffset(uint32_t order) {
+  return order ? FreeBitmapOffset(order - 1) + NumFreeBitmapWords(order - 1)
+               : 0;
+}
+
+uint32_t gFreeBlockBitmaps[FreeBitmapOffset(kMaxOrder)];
+
+// The number of free blocks of each order, and where to start looking for one.
+// The hint is the last block of that order made free.
+size_t gNumFreeBlocks[kMaxOrder];
+uint32_t gFreeBlockHint[kMaxOrder];
+
+// The number of frames in use in each 4MB page. A page is split exactly when
+// this is non-zero.
+uint16_t gNumFramesUsed[kNumPageDirEntries];
+
+size_t gNumUsedFrames;
+
+// For each frame, the number of references to it besides the first. Only
+// frames shared copy-on-write have any. Most pages never hold one, so these
+// are only allocated for a page once one of its frames is shared, and are
+// dropped with the page.
+uint16_t *gExtraFrameRefs[kNumPageDirEntries];
+
+constexpr uint32_t BitMask(uint32_t bit) {
+  return UINT32_C(1) << (bit % kBitsPerWord);
+}
+
+uint32_t *FreeBitmap(uint32_t order) {
+  assert(order < kMaxOrder);
+  return &gFreeBlockBitmaps[FreeBitmapOffset(order)];
+}
+
+// Only the blocks in the first `gNum4MPages` pages are searched.
+size_t NumBlocks(uint32_t order) {
+  return gNum4MPages * (kFramesPer4MPage >> order);
+}
+
+bool BlockIsFree(uint32_t block, uint32_t order) {
+  return FreeBitmap(order)[block / kBitsPerWord] & BitMask(block);
+}
+
+void AddFreeBlock(uint32_t block, uint32_t order) {
+  assert(!BlockIsFree(block, order));
+  FreeBitmap(order)[block / kBitsPerWord] |= BitMask(block);
+  ++gNumFreeBlocks[order];
+  gFreeBlockHint[order] = block;
+}
+
+void RemoveFreeBlock(uint32_t block, uint32_t order) {
+  assert(BlockIsFree(block, order));
+  FreeBitmap(order)[block / kBitsPerWord] &= ~BitMask(block);
+  --gNumFreeBlocks[order];
+}
+
+// Return the first bit equal to `value` among the first `num_bits` bits of
+// `bitmap`, starting from `start` and wrapping around to the beginning. Return
+// a negative value if there is none.
+int32_t FindBit(const uint32_t *bitmap, size_t num_bits, size_t start,
+                bool value) {
+  size_t num_words = (num_bits + kBitsPerWord - 1) / kBitsPerWord;
+  size_t word = start / kBitsPerWord;
+
+  // The word `start` is in is checked twice: first from `start` up, then once
+  // everything else has been checked, from the bottom.
+  for (size_t i = 0; i <= num_words; ++i) {
+    uint32_t bits = value ? bitmap[word] : ~bitmap[word];
+    if (i == 0) bits &= ~(BitMask(start % kBitsPerWord) - 1);
+
+    // Ignore the bits past the end in the last word.
+    if (word == num_words - 1 && num_bits % kBitsPerWord)
+      bits &= BitMask(num_bits % kBitsPerWord) - 1;
+
+    if (bits) {
+      return static_cast<int32_t>(word * kBitsPerWord + LowestSetBit(bits));
+    }
+    word = (word + 1) % num_words;
+  }
+  return -1;
+}
 
 }  // namespace
 
 size_t GetNum4MPages() { return gNum4MPages; }
 
 bool PageIsUsed(uint32_t page) {
-  assert(page <= kNumPageDirEntries);
-  return gPhysicalBitmap[page / CHAR_BIT] & (1 << (page % CHAR_BIT));
+  assert(page < kNumPageDirEntries);
+  return gPhysicalBitmap[page / kBitsPerWord] & BitMask(page);
 }
 
 void SetPageUsed(uint32_t page) {
   assert(!PageIsUsed(page));
-  gPhysicalBitmap[page / CHAR_BIT] |= (1 << (page % CHAR_BIT));
+  gPhysicalBitmap[page / kBitsPerWord] |= BitMask(page);
+  if (page < gNum4MPages) {
+    --gNumFree4MPages;
+    gNextFreeHint = (page + 1) % static_cast<uint32_t>(gNum4MPages);
+  }
 }
 
 void SetPageFree(uint32_t page) {
   assert(PageIsUsed(page));
-  gPhysicalBitmap[page / CHAR_BIT] &= ~(1 << (page % CHAR_BIT));
+  assert(!gNumFramesUsed[page] && "Split pages are freed a frame at a time.");
+  gPhysicalBitmap[page / kBitsPerWord] &= ~BitMask(page);
+  if (page < gNum4MPages) ++gNumFree4MPages;
 }
 
 void Dump() {
-  printf("Physical 4M pages:\n");
-  for (size_t i = 0; i < gNum4MPages; i += CHAR_BIT) {
-    printf("  0x%x\n", gPhysicalBitmap[i / CHAR_BIT]);
+  printf("Physical 4M pages (%u free):\n", gNumFree4MPages);
+  for (size_t i = 0; i < gNum4MPages; i += kBitsPerWord) {
+    printf("  0x%x\n", gPhysicalBitmap[i / kBitsPerWord]);
   }
+  printf("4K frames in use: %u\n", gNumUsedFrames);
+  printf("Free blocks by order:");
+  for (size_t order = 0; order < kMaxOrder; ++order)
+    printf(" %u", gNumFreeBlocks[order]);
+  printf("\n");
 }
 
-size_t GetNumFree4MPages() {
-  auto num_zero_bits = [](uint8_t x) {
-    size_t n = 0;
-    x = ~x;  // Count 0s by bitwise NOTing and counting the 1s.
-    while (x) {
-      n += (x & 1);
-      x >>= 1;
-    }
-    return n;
-  };
-
-  size_t num = 0;
-  for (size_t i = 0; i < gNum4MPages / CHAR_BIT; ++i)
-    num += num_zero_bits(gPhysicalBitmap[i]);
-
-  if (gNum4MPages % CHAR_BIT)
-    num += num_zero_bits(gPhysicalBitmap[gNum4MPages / CHAR_BIT]);
-
-  return num;
-}
+size_t GetNumFree4MPages() { return gNumFree4MPages; }
 
 size_t GetNumUsed4MPages() {
-  size_t available = GetNumFree4MPages();
-  assert(available <= gNum4MPages);
-  return gNum4MPages - available;
+  assert(gNumFree4MPages <= gNum4MPages);
+  return gNum4MPages - gNumFree4MPages;
 }
 
+size_t GetNumUsedFrames() { return gNumUsedFrames; }
+
 void Initialize(uintptr_t mem_upper) {
   // The total memory avaiable can be provided by the upper bound value
   // provided by multiboot. This value is given in KB.
@@ -94,12 +193,17 @@ void Initialize(uintptr_t mem_upper) {
     memset(gPhysicalBitmap, 0xFF, sizeof(gPhysicalBitmap));
 
     // Clear bottom of the bitmap.
-    memset(gPhysicalBitmap, 0, gNum4MPages / CHAR_BIT + 1);
-    gPhysicalBitmap[gNum4MPages / CHAR_BIT] =
-        static_cast<uint8_t>(~((UINT8_C(1) << (gNum4MPages % CHAR_BIT)) - 1));
+    size_t num_free_words = gNum4MPages / kBitsPerWord;
+    memset(gPhysicalBitmap, 0, num_free_words * sizeof(uint32_t));
+    gPhysicalBitmap[num_free_words] = ~(BitMask(gNum4MPages) - 1);
   }
 
-  assert(GetNumFree4MPages() == gNum4MPages &&
+  gNumFree4MPages = gNum4MPages;
+  gNextFreeHint = 0;
+  size_t num_used = 0;
+  for (uint32_t word : gPhysicalBitmap)
+    num_used += static_cast<size_t>(__builtin_popcount(word));
+  assert(num_used == kNumPageDirEntries - gNum4MPages &&
          "Expected all pages to be available.");
 
   // uintptr_t kernel_begin = reinterpret_cast<uintptr_t>(&__KERNEL_BEGIN);
@@ -118,18 +222,128 @@ void Initialize(uintptr_t mem_upper) {
 }
 
 int32_t GetNextFreePage() {
-  for (size_t i = 0; i < gNum4MPages / CHAR_BIT; ++i) {
-    uint8_t x = gPhysicalBitmap[i];
-    if (x == 0xFF) continue;  // All used up here.
-
-    int idx = 0;
-    while (x & 1) {
-      ++idx;
-      x >>= 1;
+  if (!gNumFree4MPages) return -1;
+  return FindBit(gPhysicalBitmap, gNum4MPages, gNextFreeHint, /*value=*/false);
+}
+
+bool FrameIsUsed(uint32_t frame) {
+  assert(frame < kNumFrames);
+  uint32_t page = frame / kFramesPer4MPage;
+  if (!PageIsUsed(page)) return false;
+  if (!gNumFramesUsed[page]) return true;  // The whole page is in use.
+
+  for (uint32_t order = 0; order < kMaxOrder; ++order) {
+    if (BlockIsFree(frame >> order, order)) return false;
+  }
+  return true;
+}
+
+int32_t AllocFrames(uint32_t order) {
+  assert(order <= kMaxOrder);
+
+  // Take the smallest free block that is big enough. Only split another 4MB
+  // page when the pages split already have no room.
+  uint32_t block_order = order;
+  while (block_order < kMaxOrder && !gNumFreeBlocks[block_order])
+    ++block_order;
+
+  uint32_t block;
+  if (block_order == kMaxOrder) {
+    int32_t free_page = GetNextFreePage();
+    if (free_page < 0) return -1;
+    block = static_cast<uint32_t>(free_page);
+    SetPageUsed(block);
+  } else {
+    int32_t free_block =
+        FindBit(FreeBitmap(block_order), NumBlocks(block_order),
+                gFreeBlockHint[block_order], /*value=*/true);
+    assert(free_block >= 0 && "Free block count is out of sync.");
+    block = static_cast<uint32_t>(free_block);
+    RemoveFreeBlock(block, block_order);
+  }
+
+  // Halve the block until it is the size asked for, freeing the upper half
+  // each time.
+  while (block_order > order) {
+    --block_order;
+    block *= 2;
+    AddFreeBlock(block + 1, block_order);
+  }
+
+  uint32_t frame = block << order;
+  if (order < kMaxOrder) {
+    uint32_t page = frame / kFramesPer4MPage;
+    uint32_t num_frames = UINT32_C(1) << order;
+    gNumFramesUsed[page] =
+        static_cast<uint16_t>(gNumFramesUsed[page] + num_frames);
+    gNumUsedFrames += num_frames;
+  }
+  return static_cast<int32_t>(frame);
+}
+
+void FreeFrames(uint32_t frame, uint32_t order) {
+  assert(order <= kMaxOrder);
+  assert(frame % (UINT32_C(1) << order) == 0 &&
+         "Frame is not aligned to the block size.");
+  assert(FrameIsUsed(frame));
+
+  uint32_t page = frame / kFramesPer4MPage;
+  if (uint16_t *refs = gExtraFrameRefs[page]) {
+    uint16_t &extra_refs = refs[frame % kFramesPer4MPage];
+    if (extra_refs) {
+      assert(order == 0 && "Only single frames can be shared.");
+      --extra_refs;
+      return;
     }
-    return static_cast<int32_t>(i) * CHAR_BIT + idx;
   }
-  return -1;
+
+  if (order < kMaxOrder) {
+    uint32_t num_frames = UINT32_C(1) << order;
+    assert(gNumFramesUsed[page] >= num_frames);
+    gNumFramesUsed[page] =
+        static_cast<uint16_t>(gNumFramesUsed[page] - num_frames);
+    gNumUsedFrames -= num_frames;
+  } else {
+    assert(!gNumFramesUsed[page] && "Freeing a split page as a whole.");
+  }
+
+  // Merge with the buddy for as long as it is free too.
+  uint32_t block = frame >> order;
+  while (order < kMaxOrder && BlockIsFree(block ^ 1, order)) {
+    RemoveFreeBlock(block ^ 1, order);
+    block /= 2;
+    ++order;
+  }
+
+  if (order == kMaxOrder) {
+    assert(!gNumFramesUsed[page]);
+    delete[] gExtraFrameRefs[page];
+    gExtraFrameRefs[page] = nullptr;
+    SetPageFree(page);
+  } else {
+    AddFreeBlock(block, order);
+  }
+}
+
+void ShareFrame(uint32_t frame) {
+  assert(FrameIsUsed(frame));
+  uint32_t page = frame / kFramesPer4MPage;
+  assert(gNumFramesUsed[page] && "Only frames in split pages can be shared.");
+
+  uint16_t *&refs = gExtraFrameRefs[page];
+  if (!refs) {
+    refs = new uint16_t[kFramesPer4MPage]();
+    assert(refs);
+  }
+  uint16_t &extra_refs = refs[frame % kFramesPer4MPage];
+  assert(extra_refs != UINT16_MAX && "Too many references to one frame.");
+  ++extra_refs;
+}
+
+uint32_t GetFrameRefs(uint32_t frame) {
+  assert(FrameIsUsed(frame));
+  const uint16_t *refs = gExtraFrameRefs[frame / kFramesPer4MPage];
+  return 1 + (refs ? refs[frame % kFramesPer4MPage] : 0);
 }
 
 }  // namespace pmm
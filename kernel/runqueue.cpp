@@ -0,0 +1,40 @@
+#include <assert.h>
+#include <kernel/kernel.h>
+#include <kernel/runqueue.h>
+
+namespace scheduler {
+
+namespace {
+
+static_assert(kNumPriorities <= sizeof(uint32_t) * CHAR_BIT,
+              "Each priority needs a bit in the ready bitmap.");
+
+}  // namespace
+
+void RunQueue::Enqueue(RunQueueEntry &entry) {
+  priority_t priority = entry.getPriority();
+  queues_[priority].PushBack(entry);
+  ready_bitmap_ |= UINT32_C(1) << priority;
+  ++size_;
+}
+
+void RunQueue::Dequeue(RunQueueEntry &entry) {
+  priority_t priority = entry.getPriority();
+  EntryList &queue = queues_[priority];
+  queue.Remove(entry);
+  if (queue.empty()) ready_bitmap_ &= ~(UINT32_C(1) << priority);
+  --size_;
+}
+
+RunQueueEntry *RunQueue::PeekNext() const {
+  if (empty()) return nullptr;
+  return queues_[LowestSetBit(ready_bitmap_)].front();
+}
+
+RunQueueEntry *RunQueue::PopNext() {
+  RunQueueEntry *entry = PeekNext();
+  if (entry) Dequeue(*entry);
+  return entry;
+}
+
+}  // namespace scheduler
@@ -1,10 +1,14 @@
 #include <assert.h>
 #include <kernel/channel.h>
+#include <kernel/fairqueue.h>
 #include <kernel/gdt.h>
 #include <kernel/isr.h>
+#include <kernel/kernel.h>
 #include <kernel/kmalloc.h>
 #include <kernel/linkedlist.h>
+#include <kernel/runqueue.h>
 #include <kernel/scheduler.h>
+#include <kernel/smp.h>
 #include <kernel/status.h>
 #include <kernel/timer.h>
 #include <stddef.h>
@@ -22,25 +26,319 @@
 #define KTRACE(...)
 #endif
 
+// Set this to 0 to use fixed priorities with round robin scheduling instead of
+// weighted fair scheduling.
+#define USE_FAIR_POLICY 1
+
 namespace scheduler {
 namespace {
 struct jump_args_t;
+void FinishTaskSwitch();
 }  // namespace
 }  // namespace scheduler
 
-extern "C" void switch_task(scheduler::jump_args_t *);
+extern "C" void switch_task(scheduler::jump_args_t *, uintptr_t stack);
+
+// Called by `switch_task` once it is off the old task's stack.
+extern "C" void finish_task_switch() {
+  scheduler::FinishTaskSwitch();
+  smp::UnlockKernel();
+}
 
 namespace scheduler {
 namespace {
 
-using TaskNode = kern::LinkedList<Task *>;
-TaskNode *gTaskQueue = nullptr;
+using TaskList = kern::IntrusiveList<Task, AllTasksTag>;
+
+// Every registered task, including the ones currently running on each CPU.
+TaskList *gTasks = nullptr;
+
+// The main kernel task. Once the kernel is done setting up, this becomes the
+// boot processor's idle task.
 Task *gKernelTask = nullptr;
 
+// How long a task can run before it is preempted, in timer ticks, if other
+// tasks are waiting to run.
+constexpr uint32_t kTimeSliceTicks = 10;
+
+// Under the fair policy, every runnable task on a CPU should get a turn within
+// this many ticks, though no task runs for less than the minimum granularity.
+constexpr uint32_t kSchedLatencyTicks = 12;
+constexpr uint32_t kMinGranularityTicks = 2;
+
+// Under the fair policy, a waiting task only preempts the current task once
+// the current task is ahead of it by this many ticks worth of vruntime.
+constexpr uint32_t kWakeupGranularityTicks = 1;
+
+// A task that stopped running within this many ticks is considered cache hot
+// and is not stolen by other CPUs.
+constexpr uint32_t kCacheHotTicks = 3;
+
 struct jump_args_t {
   isr::registers_t regs;
 };
 
+// How the tasks that are ready to run on one CPU are ordered. Each CPU has its
+// own instance. These are only used with the kernel lock held.
+class Policy {
+ public:
+  virtual ~Policy() = default;
+
+  // Add a task that was not running, such as a new task or one that was just
+  // woken up.
+  virtual void Enqueue(Task &task) = 0;
+
+  // Put back the task that was just running on this CPU. `yielded` is true if
+  // it gave up the CPU on its own.
+  virtual void Requeue(Task &task, bool yielded) = 0;
+
+  // Remove a queued task.
+  virtual void Dequeue(Task &task) = 0;
+
+  // Move a queued task off of, or onto, this CPU. Policies can use these to
+  // translate any per-CPU state kept in the task.
+  virtual void Detach(Task &task) { Dequeue(task); }
+  virtual void Attach(Task &task) { Enqueue(task); }
+
+  // Remove and return the task that should run next, or null if nothing is
+  // queued.
+  virtual Task *PopNext() = 0;
+
+  virtual bool Contains(const Task &task) const = 0;
+  virtual size_t size() const = 0;
+  bool empty() const { return size() == 0; }
+
+  // Return the queued task that would run last out of the ones `can_take`
+  // accepts, or null if it accepts none.
+  virtual Task *FindLast(bool (*can_take)(Task &, void *), void *arg) const = 0;
+
+  // `task` has been running on this CPU for `cycles` TSC cycles since it was
+  // last charged.
+  virtual void Charge(Task &, uint64_t /*cycles*/) {}
+
+  // Return true if `current` should give way to a queued task right away
+  // rather than at the end of its time slice.
+  virtual bool ShouldPreempt(const Task &) const { return false; }
+
+  // How many ticks `current` can run while other tasks are waiting.
+  virtual uint32_t getTimeSlice(const Task &current) const = 0;
+};
+
+// Fixed priorities, with round robin between tasks of the same priority.
+class PriorityPolicy : public Policy {
+ public:
+  void Enqueue(Task &task) override { queue_.Enqueue(task); }
+  void Requeue(Task &task, bool) override { queue_.Enqueue(task); }
+  void Dequeue(Task &task) override { queue_.Dequeue(task); }
+  Task *PopNext() override { return static_cast<Task *>(queue_.PopNext()); }
+  bool Contains(const Task &task) const override {
+    return queue_.Contains(task);
+  }
+  size_t size() const override { return queue_.size(); }
+
+  Task *FindLast(bool (*can_take)(Task &, void *), void *arg) const override {
+    return static_cast<Task *>(queue_.FindLast([=](RunQueueEntry &entry) {
+      return can_take(static_cast<Task &>(entry), arg);
+    }));
+  }
+
+  uint32_t getTimeSlice(const Task &) const override { return kTimeSliceTicks; }
+
+ private:
+  RunQueue queue_;
+};
+
+// Weighted fair scheduling. A task's virtual runtime grows by the time it runs
+// divided by its weight, and the task with the smallest virtual runtime runs
+// next. Each runnable task gets CPU time in proportion to its weight. Tasks
+// that mostly sleep, like an interactive shell, fall behind in virtual runtime
+// and so run soon after they wake up.
+class FairPolicy : public Policy {
+ public:
+  // `vruntime_per_tick` is how much a task at the default weight's vruntime
+  // grows in one tick.
+  explicit FairPolicy(uint64_t vruntime_per_tick)
+      : vruntime_per_tick_(vruntime_per_tick) {}
+
+  void Enqueue(Task &task) override {
+    // New tasks start level with the rest of the queue. Tasks that slept get
+    // up to half a latency period of credit so they run soon, but they cannot
+    // bank all the time they slept.
+    uint64_t floor = queue_.getMinVruntime();
+    uint32_t last_ran;
+    if (task.getLastRanTick(last_ran)) {
+      uint64_t credit = kSchedLatencyTicks / 2 * vruntime_per_tick_;
+      floor = floor > credit ? floor - credit : 0;
+    }
+    if (task.getVruntime() < floor) task.setVruntime(floor);
+    queue_.Enqueue(task);
+  }
+
+  void Requeue(Task &task, bool yielded) override {
+    // Yielding puts the task behind everything else that is waiting.
+    if (yielded && !queue_.empty()) {
+      uint64_t last = queue_.PeekLast()->getVruntime();
+      if (task.getVruntime() < last) task.setVruntime(last);
+    }
+    queue_.Enqueue(task);
+  }
+
+  void Dequeue(Task &task) override { queue_.Dequeue(task); }
+
+  // Each CPU's queue has its own idea of how far along virtual time is, so a
+  // task's vruntime is carried over relative to the queue's floor.
+  void Detach(Task &task) override {
+    queue_.Dequeue(task);
+    uint64_t floor = queue_.getMinVruntime();
+    uint64_t vruntime = task.getVruntime();
+    task.setVruntime(vruntime > floor ? vruntime - floor : 0);
+  }
+  void Attach(Task &task) override {
+    task.setVruntime(task.getVruntime() + queue_.getMinVruntime());
+    queue_.Enqueue(task);
+  }
+
+  Task *PopNext() override {
+    auto *task = static_cast<Task *>(queue_.PopNext());
+    if (task) queue_.UpdateMinVruntime(task);
+    return task;
+  }
+  bool Contains(const Task &task) const override {
+    return queue_.Contains(task);
+  }
+  size_t size() const override { return queue_.size(); }
+
+  Task *FindLast(bool (*can_take)(Task &, void *), void *arg) const override {
+    for (FairQueueEntry *entry = queue_.PeekLast(); entry;
+         entry = FairQueue::Prev(*entry)) {
+      auto &task = static_cast<Task &>(*entry);
+      if (can_take(task, arg)) return &task;
+    }
+    return nullptr;
+  }
+
+  void Charge(Task &task, uint64_t cycles) override {
+    task.FairQueueEntry::Charge(cycles);
+    queue_.UpdateMinVruntime(&task);
+  }
+
+  bool ShouldPreempt(const Task &current) const override {
+    const FairQueueEntry *next = queue_.PeekNext();
+    return next && current.getVruntime() >
+                       next->getVruntime() +
+                           kWakeupGranularityTicks * vruntime_per_tick_;
+  }
+
+  // Split the latency period between the current task and the waiting ones by
+  // weight.
+  uint32_t getTimeSlice(const Task &current) const override {
+    uint32_t total_weight = queue_.getTotalWeight() + current.getWeight();
+    uint32_t slice = static_cast<uint32_t>(
+        uint64_t{kSchedLatencyTicks} * current.getWeight() / total_weight);
+    return slice > kMinGranularityTicks ? slice : kMinGranularityTicks;
+  }
+
+ private:
+  FairQueue queue_;
+  uint64_t vruntime_per_tick_;
+};
+
+Policy *NewPolicy() {
+#if USE_FAIR_POLICY
+  // Vruntime is charged in units of 1024 TSC cycles at the default weight.
+  return new FairPolicy(timer::GetTscPerTick() >> 10);
+#else
+  return new PriorityPolicy;
+#endif
+}
+
+// Scheduler state private to each CPU. A CPU only picks tasks off its own run
+// queue. Other CPUs can put tasks on it, then send a reschedule IPI so this
+// CPU notices.
+struct CpuState {
+  // Tasks that are ready to run on this CPU. The currently running task is
+  // not on here.
+  Policy *policy;
+
+  Task *current_task;
+
+  // The TSC when the current task started running or was last charged for
+  // its time.
+  uint64_t run_start_cycles = 0;
+
+  // Set when the current task gives up the CPU through `Yield`.
+  bool yield_current = false;
+
+  // This runs when nothing else on this CPU can. It is never put on the run
+  // queue.
+  Task *idle_task;
+
+  // Fires when the current task's time slice is up. Timer callbacks cannot
+  // switch tasks, so this only marks that we should reschedule on the way out
+  // of the timer interrupt.
+  timer::Timer preempt_timer;
+  bool need_resched = false;
+
+  // Idle time accounting, in timer ticks. This only starts once the idle task
+  // starts idling.
+  bool idle_task_started = false;
+  uint32_t idle_start_tick = 0;
+  uint32_t idle_ticks = 0;
+
+  StealStats steal_stats{};
+
+  // A task that exited in `Schedule`. It is deleted in `finish_task_switch`,
+  // since `Schedule` still runs on its kernel stack.
+  Task *dead_task = nullptr;
+
+  // `switch_task` moves onto this stack before the kernel lock is released.
+  // Another CPU may pick up the old task as soon as the lock is released, so
+  // we cannot still be on its kernel stack.
+  static constexpr size_t kSwitchStackSize = 1024;
+  jump_args_t switch_args;
+  alignas(16) uint8_t switch_stack[kSwitchStackSize];
+
+  explicit CpuState(Task &idle)
+      : policy(NewPolicy()),
+        current_task(&idle),
+        idle_task(&idle),
+        preempt_timer([](timer::Timer &, void *arg) {
+          reinterpret_cast<CpuState *>(arg)->need_resched = true;
+        }, this) {}
+  ~CpuState() { delete policy; }
+
+  uintptr_t getSwitchStackTop() const {
+    return reinterpret_cast<uintptr_t>(switch_stack) + kSwitchStackSize;
+  }
+
+  // The number of tasks that would have to run before a new task on this CPU
+  // gets a turn.
+  size_t getLoad() const {
+    return policy->size() + (current_task != idle_task);
+  }
+
+  bool isIdle() const { return current_task == idle_task && policy->empty(); }
+};
+
+CpuState *gCpus[smp::kMaxCpus];
+
+CpuState &ThisCpu() {
+  CpuState *cpu = gCpus[smp::GetCurrentCpu()];
+  assert(cpu && "The scheduler is not running on this CPU.");
+  return *cpu;
+}
+
+void FinishTaskSwitch() {
+  CpuState &cpu = ThisCpu();
+  Task *dead_task = cpu.dead_task;
+  if (!dead_task) return;
+  cpu.dead_task = nullptr;
+
+  // Delete the exited task. This also takes it off the task list.
+  KTRACE("DELETING task %p\n", dead_task);
+  delete dead_task;
+}
+
 static_assert(offsetof(jump_args_t, regs.gs) == GS_OFFSET);
 static_assert(offsetof(jump_args_t, regs.fs) == FS_OFFSET);
 static_assert(offsetof(jump_args_t, regs.es) == ES_OFFSET);
@@ -53,6 +351,8 @@ static_assert(offsetof(jump_args_t, regs.ebx) == EBX_OFFSET);
 static_assert(offsetof(jump_args_t, regs.edx) == EDX_OFFSET);
 static_assert(offsetof(jump_args_t, regs.ecx) == ECX_OFFSET);
 static_assert(offsetof(jump_args_t, regs.eax) == EAX_OFFSET);
+static_assert(offsetof(jump_args_t, regs.int_no) == INT_NO_OFFSET);
+static_assert(offsetof(jump_args_t, regs.err_code) == ERR_CODE_OFFSET);
 
 static_assert(offsetof(jump_args_t, regs.eip) == EIP_OFFSET);
 static_assert(offsetof(jump_args_t, regs.cs) == CS_OFFSET);
@@ -61,11 +361,12 @@ static_assert(offsetof(jump_args_t, regs.useresp) == USERESP_OFFSET);
 static_assert(offsetof(jump_args_t, regs.ss) == SS_OFFSET);
 
 bool SegmentRegisterValueIsValid(uint32_t reg) {
-  if (reg > (gdt::kUserDataSeg | gdt::kRing3)) return false;
+  if (reg > (gdt::kUserTlsSeg | gdt::kRing3)) return false;
 
   constexpr uint32_t kMask = 0xFC;  // All but the first 3 bits.
   return (reg & kMask) == 0x08 || (reg & kMask) == 0x10 ||
-         (reg & kMask) == 0x18 || (reg & kMask) == 0x20;
+         (reg & kMask) == 0x18 || (reg & kMask) == 0x20 ||
+         (reg & kMask) == gdt::kUserTlsSeg;
 }
 
 void ValidateRegs(Task &task, const isr::registers_t &regs) {
@@ -90,105 +391,245 @@ void ValidateRegs(Task &task, const isr::registers_t &regs) {
 using iter_tasks_callback_t = void (*)(Task &t, void *arg);
 
 void IterateTasks(iter_tasks_callback_t callback, void *arg) {
-  assert(gTaskQueue);
-  TaskNode *node = gTaskQueue;
-  do { callback(*node->get(), arg); } while ((node = node->next()));
+  assert(gTasks);
+  for (Task &task : *gTasks) callback(task, arg);
+}
+
+// Charge the current task for the time it has spent running since it was last
+// charged.
+void UpdateCurrentRuntime(CpuState &cpu) {
+  uint64_t now = ReadTimestampCounter();
+  if (cpu.current_task != cpu.idle_task)
+    cpu.policy->Charge(*cpu.current_task, now - cpu.run_start_cycles);
+  cpu.run_start_cycles = now;
+}
+
+// If other tasks are waiting to run on this CPU, make sure the timer goes off
+// so the current one can be preempted. The idle task should give way right
+// away, as should any task the policy says a waiting task should preempt.
+void RequestPreemption() {
+  CpuState &cpu = ThisCpu();
+  if (cpu.policy->empty()) return;
+
+  // Give way as soon as we leave the current interrupt.
+  UpdateCurrentRuntime(cpu);
+  if (cpu.current_task == cpu.idle_task ||
+      cpu.policy->ShouldPreempt(*cpu.current_task)) {
+    cpu.need_resched = true;
+    return;
+  }
+
+  uint32_t deadline =
+      timer::GetTicks() + cpu.policy->getTimeSlice(*cpu.current_task);
+  if (cpu.preempt_timer.isArmed()) {
+    if (!timer::TickBefore(deadline, cpu.preempt_timer.getDeadline())) return;
+    timer::Cancel(cpu.preempt_timer);
+  }
+  timer::Arm(cpu.preempt_timer, deadline);
+}
+
+// Return the first idle CPU other than `except`, or `smp::kMaxCpus` if every
+// CPU is busy.
+size_t FindIdleCpu(size_t except) {
+  for (size_t cpu = 0; cpu < smp::kMaxCpus; ++cpu) {
+    if (cpu != except && gCpus[cpu] && gCpus[cpu]->isIdle()) return cpu;
+  }
+  return smp::kMaxCpus;
+}
+
+// Put a task on the run queue of the CPU it belongs to and make sure that CPU
+// notices. If the task has to wait there while another CPU sits idle, the idle
+// CPU is kicked so it can steal it.
+void Enqueue(Task &task) {
+  size_t cpu = task.getCpu();
+  assert(gCpus[cpu]);
+  gCpus[cpu]->policy->Enqueue(task);
+  if (cpu == smp::GetCurrentCpu())
+    RequestPreemption();
+  else
+    smp::SendRescheduleIPI(cpu);
+
+  if (gCpus[cpu]->getLoad() < 2) return;
+  size_t idle_cpu = FindIdleCpu(cpu);
+  if (idle_cpu == smp::kMaxCpus) return;
+  if (idle_cpu == smp::GetCurrentCpu())
+    gCpus[idle_cpu]->need_resched = true;  // `Schedule` steals it.
+  else
+    smp::SendRescheduleIPI(idle_cpu);
+}
+
+bool IsCacheHot(const Task &task, uint32_t now) {
+  uint32_t last_ran;
+  if (!task.getLastRanTick(last_ran)) return false;
+  return now - last_ran < kCacheHotTicks;
+}
+
+struct StealArgs {
+  uint32_t now;
+  uint32_t *hot_skips;
+};
+
+bool CanSteal(Task &task, void *arg) {
+  auto &args = *reinterpret_cast<StealArgs *>(arg);
+  if (!IsCacheHot(task, args.now)) return true;
+  ++*args.hot_skips;
+  return false;
+}
+
+// Move a task from the busiest CPU onto this one's run queue. Only tasks that
+// are actually waiting behind another task are taken. Tasks at the tail of the
+// busiest queue would run last there, so they are taken first. Returns true if
+// a task was moved.
+bool StealTask(CpuState &thief) {
+  size_t this_cpu = smp::GetCurrentCpu();
+  CpuState *victim = nullptr;
+  for (size_t cpu = 0; cpu < smp::kMaxCpus; ++cpu) {
+    CpuState *other = gCpus[cpu];
+    if (cpu == this_cpu || !other || other->getLoad() < 2) continue;
+    if (!victim || other->policy->size() > victim->policy->size())
+      victim = other;
+  }
+  if (!victim) return false;
+
+  StealArgs args = {timer::GetTicks(), &thief.steal_stats.hot_skips};
+  Task *task = victim->policy->FindLast(CanSteal, &args);
+  if (!task) {
+    ++thief.steal_stats.failed_steals;
+    return false;
+  }
+
+  KTRACE("CPU %u stealing task %p from CPU %u\n", this_cpu, task,
+         task->getCpu());
+  victim->policy->Detach(*task);
+  task->setCpu(this_cpu);
+  thief.policy->Attach(*task);
+  ++thief.steal_stats.steals;
+  ++victim->steal_stats.stolen;
+  return true;
+}
+
+// Pick the CPU a new task should start on. This is whichever CPU has the
+// fewest tasks to get through first, preferring the current one on a tie.
+size_t PickCpuForNewTask() {
+  size_t best = smp::GetCurrentCpu();
+  size_t best_load = gCpus[best]->getLoad();
+  for (size_t cpu = 0; cpu < smp::kMaxCpus; ++cpu) {
+    if (!gCpus[cpu]) continue;
+    size_t load = gCpus[cpu]->getLoad();
+    if (load < best_load) {
+      best = cpu;
+      best_load = load;
+    }
+  }
+  return best;
+}
+
+// Pop the next task to run off this CPU's run queue, or fall back to the idle
+// task if nothing else can run.
+Task *PickNextTask(CpuState &cpu) {
+  if (Task *next = cpu.policy->PopNext()) return next;
+  return cpu.idle_task;
 }
 
 }  // namespace
 
 void Task::SendSignal(signal_t signals, uint32_t value) {
   assert(signals);
-  for (const Task *listener : listening_for_signals_) {
-    Signals *signal = listener->GetSignal(*this);
-    if (signal && (signal->expecting_signals & signals)) {
-      signal->received_signal = signals;
-      signal->value = value;
+  for (WaitQueueEntry &entry : signal_waiters_) {
+    auto &signal = static_cast<Signals &>(entry);
+    if (signal.expecting_signals & signals) {
+      signal.received_signal = signals;
+      signal.value = value;
+      WakeTask(signal.getTask());
     }
   }
 }
 
 void Task::WaitOn(Task &other_task, signal_t signals) {
   assert(signals);
-  auto &waiting_on = GetOrCreateSignal(other_task);
-  signal_t &waiting_on_signals = waiting_on.expecting_signals;
+  Signals *waiting_on = GetSignal(other_task);
+  if (!waiting_on) {
+    waiting_on = new Signals(*this, other_task);
+    waiting_on_signals_.PushBack(*waiting_on);
+    other_task.signal_waiters_.Add(*waiting_on);
+  }
+  signal_t &waiting_on_signals = waiting_on->expecting_signals;
   waiting_on_signals = static_cast<signal_t>(waiting_on_signals | signals);
+}
 
-  other_task.AddListener(*this);
+void Task::RemoveSignal(Signals &signal) {
+  if (Task *task = signal.task->get()) task->signal_waiters_.Remove(signal);
+  waiting_on_signals_.Remove(signal);
+  delete &signal;
 }
 
-void Task::RemoveSignal(const Task *task) {
-  auto it = waiting_on_signals_.begin();
-  const auto end = waiting_on_signals_.end();
-  while (it != end) {
-    if ((*it).task == task) {
-      waiting_on_signals_.erase(it);
-      return;
-    }
-    ++it;
-  }
-  printf("COULDN'T FIND TASK %p THAT TASK %p WAS WAITING ON\n", task, this);
-  __builtin_trap();
+bool Task::ConsumeReceivedSignal() {
+  Signals *signal = GetReceivedSignal();
+  if (!signal) return false;
+
+  // This task came from the ProcessWait syscall.
+  if (isUser()) { assert(getRegs().eax == K_OK); }
+
+  getSignalReceivedReg() = signal->received_signal;
+  getSignalValReg() = signal->value;
+
+  // Now that we've received a signal from a task we were waiting on, remove
+  // it.
+  RemoveSignal(*signal);
+  return true;
 }
 
 void PrintPagesMappingPhysical(uintptr_t paddr) {
-  TaskNode *node = gTaskQueue;
-  assert(node);
   paddr = pmm::PageAddress(paddr);
   printf("Checking vaddrs mapping to paddr 0x%x\n", paddr);
-  do {
-    printf("task %p\n", node->get());
-    const auto *pd = node->get()->getPageDir().get();
-    for (size_t i = 0; i < pmm::kNumPageDirEntries; ++i) {
-      if (pmm::PageAddress(pd[i]) == paddr) {
-        printf("%u) 0x%x maps\n", i, pd[i]);
-      }
-    }
-  } while ((node = node->next()));
+  IterateTasks(
+      [](Task &task, void *arg) {
+        uintptr_t paddr = *reinterpret_cast<uintptr_t *>(arg);
+        printf("task %p\n", &task);
+        const auto *pd = task.getPageDir().get();
+        for (size_t i = 0; i < pmm::kNumPageDirEntries; ++i) {
+          if (pmm::PageAddress(pd[i]) == paddr) {
+            printf("%u) 0x%x maps\n", i, pd[i]);
+          }
+        }
+      },
+      &paddr);
 }
 
 void Schedule(isr::registers_t *regs, uint32_t retval) {
-  if (regs) { ValidateRegs(GetCurrentTask(), *regs); }
-
-  assert(gTaskQueue);
-  assert(gTaskQueue->get());
+  assert(smp::KernelLockIsHeld());
+  CpuState &cpu = ThisCpu();
+  Task *current_task = cpu.current_task;
+  assert(current_task);
+  cpu.need_resched = false;
+  bool yielded = cpu.yield_current;
+  cpu.yield_current = false;
+  UpdateCurrentRuntime(cpu);
 
-  // This is the only task in the queue (which should be the kernel).
-  // In this case, just don't do anything.
-  if (!gTaskQueue->next()) {
-    assert(gTaskQueue->get() == gKernelTask);
-    return;
+  if (regs) {
+    ValidateRegs(*current_task, *regs);
+
+    // The current task goes back to the policy, which decides where it lands
+    // relative to the tasks already waiting. Blocked tasks are parked on wait
+    // queues instead and come back through `WakeTask`. The idle task is never
+    // queued.
+    if (current_task != cpu.idle_task && !current_task->isBlocked())
+      cpu.policy->Requeue(*current_task, yielded);
   }
 
-  TaskNode *current_node = gTaskQueue;
-  Task *current_task = current_node->get();
-  TaskNode *next_node = gTaskQueue->next();
+  // Rather than going idle, see if another CPU has work to spare.
+  if (cpu.policy->empty()) StealTask(cpu);
 
-  // Keep cycling until we find a task not waiting on signals.
-  while (next_node && !next_node->get()->canRunTask()) {
-    next_node = next_node->next();
-  }
+  Task *new_task = PickNextTask(cpu);
+  assert(new_task->canRunTask() && "Blocked tasks should not be queued.");
 
-  // In this specific situation, we are switching from the main kernel task to
-  // some other task. However, all the other tasks we cycled through are waiting
-  // on signals from other tasks (deadlock). Technically we still have the main
-  // kernal task which can run, but it will just loop forever.
-  //
-  // TODO: See what the appropriate thing for the kernel to do in this
-  // situation.
-  if (!next_node && current_task == &GetMainKernelTask()) {
-    printf(
-        "WARN: All userspace tasks are waiting on signals and have "
-        "deadlocked!\n");
+  // Either the current task is the only one that can run, or nothing can run
+  // and we are already idle.
+  if (new_task == current_task) {
+    RequestPreemption();
     return;
   }
 
-  assert(next_node &&
-         "If the current task is not the main kernel task, we should've found "
-         "at least one node that had an active task with no signals.");
-
-  Task *new_task = next_node->get();
-
   if (!current_task->isUser() && regs) {
     // If we interrupt in the middle of a kernel task, that means we at still
     // on the same stack as that task. This is because there's no privilege
@@ -203,66 +644,152 @@ void Schedule(isr::registers_t *regs, uint32_t retval) {
     assert(esp[4] == regs->eflags);
   }
 
-  if (regs) {
-    // Update the queue such that it's now starting with the selected new
-    // thread.
-    while (gTaskQueue != next_node) gTaskQueue = gTaskQueue->Cycle();
-    assert(gTaskQueue);
+  cpu.current_task = new_task;
+  current_task->setLastRanTick(timer::GetTicks());
+
+  // We may be running on the current task's page directory, which goes away
+  // if it is the last thread of its process to exit.
+  paging::SwitchPageDirectory(new_task->getPageDir());
+
+  if (cpu.idle_task_started) {
+    uint32_t now = timer::GetTicks();
+    if (current_task == cpu.idle_task)
+      cpu.idle_ticks += now - cpu.idle_start_tick;
+    if (new_task == cpu.idle_task) cpu.idle_start_tick = now;
+  }
 
+  if (regs) {
     // Save the registers into the current task.
     current_task->setRegs(*regs);
 
     KTRACE("jumping from current task %p @0x%x\n", current_task, regs->eip);
   } else {
-    // First remove the current node from the queue, then update so the next
-    // node is at the front.
-    gTaskQueue = current_node->next();
-    while (gTaskQueue != next_node) gTaskQueue = gTaskQueue->Cycle();
-    assert(gTaskQueue);
-
-    KTRACE("DELETING task %p\n", current_task);
     current_task->SendSignal(Task::kTerminated, retval);
 
-    // Delete the current task and its node.
-    delete current_task;
-    delete current_node;
+    // We are still on the current task's kernel stack, and resume hooks below
+    // may allocate, so it is only freed once we are off of it.
+    assert(!cpu.dead_task);
+    cpu.dead_task = current_task;
   }
 
   KTRACE("SWITCH to %p @IP = 0x%x\n", new_task, new_task->getRegs().eip);
 
-  if (new_task->isWaitingOnSignal()) {
-    uint32_t signal_val;
-    const Task *sending_task;
-    if (Task::signal_t received_signal =
-            new_task->getReceivedSignal(&signal_val, &sending_task)) {
-      // This task came from the ProcessWait syscall.
-      if (new_task->isUser()) { assert(new_task->getRegs().eax == K_OK); }
-
-      new_task->getSignalReceivedReg() = received_signal;
-      new_task->getSignalValReg() = signal_val;
-
-      // Now that we've received a signal from a task we were waiting on, remove
-      // it.
-      new_task->RemoveSignal(sending_task);
-    }
-  }
+  // A task with a resume hook finishes its own wait, signals included.
+  if (new_task->hasResumeHook())
+    new_task->RunResumeHook();
+  else if (new_task->isWaitingOnSignal())
+    new_task->ConsumeReceivedSignal();
 
   // Load the new registers as our arguments.
   ValidateRegs(*new_task, new_task->getRegs());
 
   // Set the next kernel stack for the next interrupt.
   gdt::SetKernelStack(new_task->getKernelStackBase());
+  gdt::SetTlsBase(new_task->getTlsBase());
 
   // Send the running signal.
   // TODO: We only really need to send this on the very first run of this task.
   new_task->SendSignal(Task::kRunning, /*value=*/0);
 
-  // Switch the page directory.
-  paging::SwitchPageDirectory(new_task->getPageDir());
+  // The new task gets a full time slice.
+  timer::Cancel(cpu.preempt_timer);
+  RequestPreemption();
+
+  // The arguments are copied out of the task since another CPU may pick the
+  // task up and overwrite its registers as soon as the kernel lock is
+  // released. `switch_task` releases the lock once it is off the old stack.
+  cpu.switch_args.regs = new_task->getRegs();
+  cpu.switch_args.regs.eflags |= 0x200;  // Re-enable interrupts.
+  switch_task(&cpu.switch_args, cpu.getSwitchStackTop());
+}
+
+void RunIdleTask() {
+  assert(smp::KernelLockIsHeld());
+  CpuState &cpu = ThisCpu();
+  assert(cpu.current_task == cpu.idle_task &&
+         "Only this CPU's idle task can idle.");
+  assert(!InterruptsAreEnabled());
+  cpu.idle_start_tick = timer::GetTicks();
+  cpu.idle_task_started = true;
+
+  // The idle loop runs without the kernel lock. Any interrupt takes it again.
+  smp::UnlockKernel();
+
+  // Interrupts are only enabled while halted. `sti` takes effect after the
+  // next instruction, so no interrupt can sneak in between it and the `hlt`
+  // and leave us halted with work to do. Any interrupt that makes another task
+  // runnable will switch away from here in `Schedule`.
+  while (true) asm volatile("sti\n hlt\n cli");
+}
+
+uint32_t GetIdleTicks(size_t cpu) {
+  assert(cpu < smp::kMaxCpus && gCpus[cpu]);
+  const CpuState &state = *gCpus[cpu];
+  uint32_t idle_ticks = state.idle_ticks;
+
+  // The clocks of other CPUs may be a tick ahead of this one.
+  uint32_t now = timer::GetTicks();
+  if (state.idle_task_started && state.current_task == state.idle_task &&
+      timer::TickBefore(state.idle_start_tick, now))
+    idle_ticks += now - state.idle_start_tick;
+  return idle_ticks;
+}
+
+void PreemptIfNeeded(isr::registers_t *regs) {
+  if (ThisCpu().need_resched) Schedule(regs, /*retval=*/0);
+}
+
+void HandleRescheduleIPI(isr::registers_t *regs) {
+  CpuState &cpu = ThisCpu();
+  if (cpu.isIdle()) StealTask(cpu);
+  RequestPreemption();
+  PreemptIfNeeded(regs);
+}
+
+bool GetStealStats(size_t cpu, StealStats &stats) {
+  if (cpu >= smp::kMaxCpus || !gCpus[cpu]) return false;
+  stats = gCpus[cpu]->steal_stats;
+  return true;
+}
+
+void Block(isr::registers_t *regs) {
+  assert(regs);
+  CpuState &cpu = ThisCpu();
+  Task *current_task = cpu.current_task;
+  assert(current_task != cpu.idle_task && "The idle task cannot block.");
+  current_task->blocked_ = true;
+  Schedule(regs, /*retval=*/0);
+}
+
+void Yield(isr::registers_t *regs) {
+  ThisCpu().yield_current = true;
+  Schedule(regs, /*retval=*/0);
+}
+
+void SleepUntil(isr::registers_t *regs, uint32_t deadline) {
+  Task &task = *ThisCpu().current_task;
+  timer::Arm(task.sleep_timer_, deadline);
+  Block(regs);
+}
+
+void WakeTask(Task &task) {
+  if (!task.blocked_) return;
+  task.blocked_ = false;
+  timer::Cancel(task.sleep_timer_);
+  Enqueue(task);
+}
 
-  jump_args_t args{new_task->getRegs()};
-  args.regs.eflags |= 0x200;  // Re-enable interrupts.
-  switch_task(&args);
+bool SetWeight(Task &task, uint32_t weight) {
+  if (weight < kMinWeight || weight > kMaxWeight) return false;
+
+  // The queue orders tasks partly by weight, so a queued task is taken off
+  // while it changes.
+  Policy &policy = *gCpus[task.getCpu()]->policy;
+  bool queued = policy.Contains(task);
+  if (queued) policy.Dequeue(task);
+  task.setWeight(weight);
+  if (queued) policy.Enqueue(task);
+  return true;
 }
 
 uintptr_t Task::getKernelStackBase() const {
@@ -276,10 +803,21 @@ uintptr_t Task::getKernelStackBase() const {
 }
 
 Task::Task(bool user, paging::PageDirectory4M &pd, Task *parent)
+    : Task(user, *new Process(pd), parent) {}
+
+Task::Task(bool user, Process &process, Task *parent)
     : is_user_(user),
       kernel_stack_allocation_(kmalloc::kmalloc(kDefaultKernStackSize)),
-      pd_(&pd),
-      parent_(parent) {
+      process_(&process),
+      parent_(parent ? &parent->getRef() : nullptr),
+      ref_(new TaskRef(*this)),
+      sleep_timer_(
+          [](timer::Timer &, void *arg) {
+            auto &task = *reinterpret_cast<Task *>(arg);
+            task.getWakeTickReg() = timer::GetTicks();
+            WakeTask(task);
+          },
+          this) {
   if (user) {
     regs_.ss = regs_.ds = regs_.gs = regs_.fs = regs_.es =
         (gdt::kUserDataSeg | gdt::kRing3);
@@ -288,51 +826,106 @@ Task::Task(bool user, paging::PageDirectory4M &pd, Task *parent)
     regs_.ss = regs_.ds = regs_.gs = regs_.fs = regs_.es = gdt::kKernDataSeg;
     regs_.cs = gdt::kKernCodeSeg;
   }
+  if (parent_) parent_->Acquire();
+  ++process.num_threads_;
+}
+
+void Task::setTlsBase(uintptr_t base) {
+  assert(isUser() && "Only user tasks have a TLS segment.");
+  tls_base_ = base;
+  regs_.gs = gdt::kUserTlsSeg | gdt::kRing3;
 }
 
 Task::~Task() {
-  channel::CloseEndpointsOwnedByTask(this);
+  if (gTasks->Contains(*this)) gTasks->Remove(*this);
+  Policy &policy = *gCpus[cpu_]->policy;
+  if (policy.Contains(*this)) policy.Dequeue(*this);
+  timer::Cancel(sleep_timer_);
+
+  StopWaitingOnSignals();
+
+  // Anyone still waiting on this task will never hear from it. Their
+  // references see it is gone once `ref_` is cleared below.
+  signal_waiters_.Clear();
 
   kmalloc::kfree(kernel_stack_allocation_);
 
+  // Handles to this task now see it is gone.
+  ref_->task_ = nullptr;
+  ref_->Release();
+  if (parent_) parent_->Release();
+
+  // The last thread out frees the process.
+  if (--process_->num_threads_ == 0) delete process_;
+}
+
+Process::~Process() {
+  assert(!num_threads_ && "Threads are still running in this process.");
+  channel::CloseEndpointsOwnedByProcess(*this);
+
   for (uint32_t &ppage : owned_phys_pages_) {
     if (ppage) {
       assert(pmm::PageIsUsed(ppage));
       pmm::SetPageFree(ppage);
     }
   }
+  for (uint32_t frame : owned_frames_) pmm::FreeFrame(frame);
 
   if (pd_ != &paging::GetKernelPageDirectory()) delete pd_;
 }
 
 void Initialize() {
+  gTasks = new TaskList;
+
+  // The main kernel task is never put on the run queue. Once it becomes the
+  // idle task, `PickNextTask` falls back to it when nothing else can run.
   gKernelTask = new Task();
   gdt::SetKernelStack(gKernelTask->getKernelStackBase());
-  gTaskQueue = new TaskNode(gKernelTask, /*next=*/nullptr);
+  gTasks->PushBack(*gKernelTask);
 
-  timer::RegisterTimerCallback(
-      0, [](isr::registers_t *regs) { return Schedule(regs, /*retval=*/0); });
+  assert(smp::GetCurrentCpu() == 0);
+  gCpus[0] = new CpuState(*gKernelTask);
+}
+
+void InitializeAP() {
+  size_t cpu = smp::GetCurrentCpu();
+  assert(!gCpus[cpu]);
+
+  Task *idle_task = new Task();
+  idle_task->setCpu(cpu);
+  gdt::SetKernelStack(idle_task->getKernelStackBase());
+  gTasks->PushBack(*idle_task);
+  gCpus[cpu] = new CpuState(*idle_task);
 }
 
 void Destroy() {
-  assert(gTaskQueue);
-  assert(!gTaskQueue->next() && "Expected only the kernel task to remain.");
-  delete gTaskQueue;
+  assert(gTasks);
+  CpuState *cpu = gCpus[0];
+  assert(cpu);
+  assert(cpu->policy->empty() && gTasks->size() == 1 &&
+         "Expected only the kernel task to remain.");
+  assert(cpu->current_task == gKernelTask);
+  timer::Cancel(cpu->preempt_timer);
+  delete cpu;
+  gCpus[0] = nullptr;
   delete gKernelTask;
+  delete gTasks;
 
   // TODO: Destroy `gSignals`
 }
 
 void RegisterTask(Task &task) {
-  assert(gTaskQueue);
-  gTaskQueue->Append(&task);
+  assert(gCpus[0]);
+  gTasks->PushBack(task);
+  task.setCpu(PickCpuForNewTask());
+  Enqueue(task);
   task.SendSignal(Task::kReady, /*retval=*/0);
 }
 
-Task &GetCurrentTask() { return *gTaskQueue->get(); }
+Task &GetCurrentTask() { return *ThisCpu().current_task; }
 Task &GetMainKernelTask() { return *gKernelTask; }
 
-bool Task::PageIsRecorded(uint32_t ppage) const {
+bool Process::PageIsRecorded(uint32_t ppage) const {
   uint32_t const *page = owned_phys_pages_;
   const uint32_t *end = owned_phys_pages_ + kMaxPages;
   while (page != end) {
@@ -341,7 +934,7 @@ bool Task::PageIsRecorded(uint32_t ppage) const {
   return false;
 }
 
-void Task::RecordOwnedPage(uint32_t ppage) {
+void Process::RecordOwnedPage(uint32_t ppage) {
   assert(!PageIsRecorded(ppage) && "Physical address already recorded.");
   for (uint32_t &page : owned_phys_pages_) {
     if (!page) {
@@ -351,11 +944,11 @@ void Task::RecordOwnedPage(uint32_t ppage) {
     }
   }
 
-  printf("FIXME: Unable to record any more pages for this task!\n");
+  printf("FIXME: Unable to record any more pages for this process!\n");
   abort();
 }
 
-void Task::RemoveOwnedPage(uint32_t ppage) {
+void Process::RemoveOwnedPage(uint32_t ppage) {
   assert(PageIsRecorded(ppage) && "Physical address not recorded.");
   for (uint32_t &page : owned_phys_pages_) {
     if (page == ppage) {
@@ -368,12 +961,26 @@ void Task::RemoveOwnedPage(uint32_t ppage) {
   abort();
 }
 
-bool IsRunningTask(Task *task) {
-  assert(gTaskQueue);
-  TaskNode *node = gTaskQueue;
-  do {
-    if (node->get() == task) return true;
-  } while ((node = node->next()));
+void Process::RecordOwnedFrame(uint32_t frame) {
+  assert(pmm::FrameIsUsed(frame));
+  owned_frames_.push_back(frame);
+}
+
+bool Process::DisownFrame(uint32_t frame) {
+  for (uint32_t &owned : owned_frames_) {
+    if (owned == frame) {
+      owned = owned_frames_.back();
+      owned_frames_.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Process::OwnsFrame(uint32_t frame) const {
+  for (uint32_t owned : owned_frames_) {
+    if (owned == frame) return true;
+  }
   return false;
 }
 
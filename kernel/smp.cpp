@@ -0,0 +1,235 @@
+#include <assert.h>
+#include <kernel/apic.h>
+#include <kernel/gdt.h>
+#include <kernel/idt.h>
+#include <kernel/kernel.h>
+#include <kernel/paging.h>
+#include <kernel/scheduler.h>
+#include <kernel/smp.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// These are shared with smpboot.S.
+extern "C" {
+
+extern const uint8_t ap_trampoline_start[], ap_trampoline_end[];
+
+// The physical address of the kernel page directory. Each AP loads this into
+// CR3 before turning on paging.
+uint32_t ap_boot_cr3;
+
+// The CR4 paging features the boot processor turned on. Each AP turns on the
+// same ones.
+uint32_t ap_boot_cr4;
+
+// The number the next AP to come up takes. The boot processor is CPU 0.
+uint32_t ap_next_cpu = 1;
+
+// Each AP runs its idle task on one of these.
+alignas(16) uint8_t ap_boot_stacks[SMP_MAX_CPUS - 1][AP_BOOT_STACK_SIZE];
+
+[[noreturn]] void ap_main(size_t cpu);
+
+}  // extern "C"
+
+namespace smp {
+namespace {
+
+// How long to wait for every AP to come up after the startup IPIs, in timer
+// ticks.
+constexpr uint32_t kStartupTimeoutTicks = 100;
+
+constexpr size_t kNoCpu = SIZE_MAX;
+
+// Local APIC IDs are 8 bits, but do not have to be contiguous.
+size_t gCpuForApicId[256];
+uint32_t gApicIdForCpu[kMaxCpus];
+bool gCpuOnline[kMaxCpus] = {true};
+size_t gNumCpusOnline = 1;
+
+kern::Spinlock gKernelLock;
+size_t gKernelLockOwner = kNoCpu;
+uint32_t gKernelLockDepth = 0;
+
+// The page the current TLB shootdown is for, and a bit for each CPU that has
+// yet to drop its entry for it. Only the kernel lock holder sends shootdowns,
+// so there is only ever one in flight.
+static_assert(kMaxCpus <= 32, "Each CPU needs a bit in a shootdown mask.");
+uintptr_t gShootdownVaddr;
+uint32_t gShootdownPending;
+
+// The boot processor keeps publishing its tick count here while it waits for
+// the APs so they can start their clocks in step with it.
+uint32_t gBootTick;
+
+// Let any pending timer interrupt in, then publish the current tick. The clock
+// only keeps advancing while timer interrupts can be taken.
+uint32_t UpdateBootTick() {
+  asm volatile("sti\n pause\n cli");
+  uint32_t now = timer::GetTicks();
+  __atomic_store_n(&gBootTick, now, __ATOMIC_RELEASE);
+  return now;
+}
+
+void WaitTicks(uint32_t ticks) {
+  uint32_t deadline = UpdateBootTick() + ticks;
+  while (timer::TickBefore(UpdateBootTick(), deadline)) {}
+}
+
+}  // namespace
+
+size_t GetCurrentCpu() {
+  if (!apic::IsEnabled()) return 0;
+  size_t cpu = gCpuForApicId[apic::GetId()];
+  assert(cpu < kMaxCpus && "This CPU was never registered.");
+  return cpu;
+}
+
+size_t GetNumCpus() {
+  return __atomic_load_n(&gNumCpusOnline, __ATOMIC_ACQUIRE);
+}
+
+bool CpuIsOnline(size_t cpu) {
+  return cpu < kMaxCpus && __atomic_load_n(&gCpuOnline[cpu], __ATOMIC_ACQUIRE);
+}
+
+void StartApplicationProcessors() {
+  assert(!InterruptsAreEnabled());
+  assert(GetNumCpus() == 1 && "The APs were already started.");
+  if (!apic::IsEnabled() || !timer::IsTickless()) {
+    printf("No local APIC. Only using the boot processor.\n");
+    return;
+  }
+
+  // The boot processor is always CPU 0.
+  for (size_t &cpu : gCpuForApicId) cpu = kNoCpu;
+  gCpuForApicId[apic::GetId()] = 0;
+  gApicIdForCpu[0] = apic::GetId();
+
+  // Copy the trampoline below 1MB where the APs can start from.
+  auto &pd = paging::GetKernelPageDirectory();
+  int32_t free_vpage = pd.getNextFreePage();
+  assert(free_vpage >= 0);
+  uintptr_t vpage = pmm::PageToAddr(static_cast<uint32_t>(free_vpage));
+  pd.MapPage(vpage, /*paddr=*/0, /*flags=*/0);
+  auto trampoline_size =
+      static_cast<size_t>(ap_trampoline_end - ap_trampoline_start);
+  memcpy(reinterpret_cast<void *>(vpage + AP_TRAMPOLINE_ADDR),
+         ap_trampoline_start, trampoline_size);
+  pd.UnmapPage(vpage);
+
+  ap_boot_cr3 = reinterpret_cast<uint32_t>(pd.get());
+  asm volatile("mov %%cr4, %0" : "=r"(ap_boot_cr4));
+
+  // The INIT-SIPI-SIPI sequence. The second startup IPI is only there in case
+  // the first was missed. An AP that is already running ignores it.
+  apic::BroadcastInitIPI();
+  WaitTicks(10);
+  apic::BroadcastStartupIPI(AP_TRAMPOLINE_ADDR);
+  WaitTicks(1);
+  apic::BroadcastStartupIPI(AP_TRAMPOLINE_ADDR);
+
+  // We do not know how many APs there are, so give them all a chance to take
+  // a CPU number, then wait for the ones that did to finish coming up.
+  WaitTicks(kStartupTimeoutTicks);
+  size_t num_cpus;
+  do {
+    UpdateBootTick();
+    uint32_t claimed = __atomic_load_n(&ap_next_cpu, __ATOMIC_ACQUIRE);
+    num_cpus = claimed < kMaxCpus ? claimed : kMaxCpus;
+  } while (GetNumCpus() != num_cpus);
+
+  printf("%u CPUs online\n", num_cpus);
+}
+
+void SendRescheduleIPI(size_t cpu) {
+  assert(CpuIsOnline(cpu));
+  apic::SendIPI(gApicIdForCpu[cpu], APIC_RESCHEDULE_VECTOR);
+}
+
+void ShootdownTlbEntry(uint32_t cpus, uintptr_t vaddr) {
+  if (!cpus) return;
+  assert(KernelLockIsHeld());
+  assert(!(cpus & (UINT32_C(1) << GetCurrentCpu())) &&
+         "This CPU should invalidate its own entry.");
+
+  gShootdownVaddr = vaddr;
+  __atomic_store_n(&gShootdownPending, cpus, __ATOMIC_RELEASE);
+  for (size_t cpu = 0; cpu < kMaxCpus; ++cpu) {
+    if (!(cpus & (UINT32_C(1) << cpu))) continue;
+    assert(CpuIsOnline(cpu));
+    apic::SendIPI(gApicIdForCpu[cpu], APIC_TLB_SHOOTDOWN_VECTOR);
+  }
+  while (__atomic_load_n(&gShootdownPending, __ATOMIC_ACQUIRE))
+    asm volatile("pause");
+}
+
+void HandleTlbShootdown() {
+  uint32_t cpu_bit = UINT32_C(1) << GetCurrentCpu();
+  if (!(__atomic_load_n(&gShootdownPending, __ATOMIC_ACQUIRE) & cpu_bit))
+    return;
+  asm volatile("invlpg (%0)" ::"r"(gShootdownVaddr) : "memory");
+  __atomic_fetch_and(&gShootdownPending, ~cpu_bit, __ATOMIC_RELEASE);
+}
+
+void LockKernel() {
+  assert(!InterruptsAreEnabled() &&
+         "An interrupt could try to take the lock we are taking.");
+  size_t cpu = GetCurrentCpu();
+  if (__atomic_load_n(&gKernelLockOwner, __ATOMIC_RELAXED) == cpu) {
+    ++gKernelLockDepth;
+    return;
+  }
+  // A CPU waiting here has interrupts disabled, so it can't take the IPI for
+  // a shootdown sent by the lock holder. It checks for one as it spins.
+  while (!gKernelLock.TryLock()) {
+    while (gKernelLock.isLocked()) {
+      HandleTlbShootdown();
+      asm volatile("pause");
+    }
+  }
+  __atomic_store_n(&gKernelLockOwner, cpu, __ATOMIC_RELAXED);
+  gKernelLockDepth = 1;
+}
+
+void UnlockKernel() {
+  assert(KernelLockIsHeld());
+  if (--gKernelLockDepth) return;
+  __atomic_store_n(&gKernelLockOwner, kNoCpu, __ATOMIC_RELAXED);
+  gKernelLock.Unlock();
+}
+
+bool KernelLockIsHeld() {
+  return __atomic_load_n(&gKernelLockOwner, __ATOMIC_RELAXED) ==
+         GetCurrentCpu();
+}
+
+}  // namespace smp
+
+void ap_main(size_t cpu) {
+  using namespace smp;
+
+  uint32_t apic_id = apic::GetId();
+  gApicIdForCpu[cpu] = apic_id;
+  gCpuForApicId[apic_id] = cpu;
+
+  LockKernel();
+
+  // This only records the page directory `ap_start32` already loaded.
+  paging::SwitchPageDirectory(paging::GetKernelPageDirectory());
+  gdt::Initialize();
+  idt::Load();
+  apic::InitializeAP();
+  timer::InitializeAP(__atomic_load_n(&gBootTick, __ATOMIC_ACQUIRE));
+  scheduler::InitializeAP();
+
+  __atomic_store_n(&gCpuOnline[cpu], true, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&gNumCpusOnline, 1, __ATOMIC_RELEASE);
+  printf("CPU %u online (local APIC %u)\n", cpu, apic_id);
+
+  scheduler::RunIdleTask();
+}
@@ -18,7 +18,7 @@ void PrintStackTrace() {
   printf("Stack trace (pipe this through llvm-symbolizer):\n");
   for (size_t frame = 0; stack; ++frame) {
     if (paging::GetCurrentPageDirectory().VaddrIsMapped(
-            pmm::PageAddress(reinterpret_cast<uintptr_t>(stack)))) {
+            reinterpret_cast<uintptr_t>(stack))) {
       printf("0x%x\n", stack->eip);
       stack = stack->ebp;
     } else {
@@ -1,14 +1,17 @@
 #include <kernel/channel.h>
-#include <kernel/exceptions.h>
+#include <kernel/handle.h>
 #include <kernel/isr.h>
+#include <kernel/paging.h>
 #include <kernel/scheduler.h>
 #include <kernel/serial.h>
 #include <kernel/status.h>
 #include <kernel/syscalls.h>
-#include <libc/resizable_buffer.h>
+#include <kernel/timer.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <algorithm>
+
 // Set this to 1 to enable kernel traces.
 #define LOCAL_KTRACE 0
 
@@ -19,16 +22,14 @@
 #endif
 
 // Define this to be the lowest free virtual page we would like to pass to the
-// user when anonymously allocating a page. Technically, we're allowed to pass
-// the zero/first page, but for debugging purposes, it's probably easier just
-// to ignore this for consideration.
-#define FREE_PAGE_LOWER_BOUND 1
+// user when anonymously allocating a page. Everything below this is kept for
+// the kernel.
+#define FREE_PAGE_LOWER_BOUND paging::kFirstUserPage
 
 namespace syscalls {
 
 namespace {
 
-using ::exceptions::GetPageDirBeforeException;
 using ::paging::PageDirectory4M;
 
 // Print a C-style string at the address specified. This accepts arguments via
@@ -40,11 +41,17 @@ using ::paging::PageDirectory4M;
 void SYS_DebugWrite(isr::registers_t *regs) {
   const char *str = reinterpret_cast<const char *>(regs->ebx);
   size_t size = regs->ecx;
-  ResizableBuffer buffer(size + 1);
-  paging::GetCurrentPageDirectory().Memcpy(GetPageDirBeforeException(),
-                                           buffer.getData(), str, size);
-  buffer.get<char>(size) = 0;
-  printf("%s", reinterpret_cast<char *>(buffer.getData()));
+
+  // Print in chunks small enough to copy onto the stack.
+  char chunk[64];
+  while (size) {
+    size_t chunk_size = std::min(size, sizeof(chunk) - 1);
+    if (!paging::CopyFromUser(chunk, str, chunk_size)) return;
+    chunk[chunk_size] = 0;
+    printf("%s", chunk);
+    str += chunk_size;
+    size -= chunk_size;
+  }
 }
 
 // Try to read a character from serial. This accepts arguments via the
@@ -60,11 +67,11 @@ void SYS_DebugRead(isr::registers_t *regs) {
   char *dst = reinterpret_cast<char *>(regs->ebx);
 
   char c;
-  bool success = serial::TryRead(c);
-  GetPageDirBeforeException().Memcpy(paging::GetCurrentPageDirectory(), dst, &c,
-                                     sizeof(c));
-
-  regs->eax = success ? K_OK : K_UNABLE_TO_READ;
+  if (!serial::TryRead(c)) {
+    regs->eax = K_UNABLE_TO_READ;
+    return;
+  }
+  regs->eax = paging::CopyToUser(dst, &c, sizeof(c)) ? K_OK : K_INVALID_ARG;
 }
 
 // Stop a process and pass a return value. This accepts arguments via the
@@ -81,19 +88,79 @@ void SYS_ProcessKill(isr::registers_t *regs) {
   abort();
 }
 
-using handle_t = uint32_t;
+using handle::handle_t;
+
+// Handles are looked up in the table of the process making the syscall.
+handle::Table &GetHandles() {
+  return scheduler::GetCurrentTask().getProcess().getHandles();
+}
+
+scheduler::Task *GetTask(handle_t handle) {
+  return GetHandles().getTask(handle);
+}
+
+channel::Endpoint *GetEndpoint(handle_t handle) {
+  return GetHandles().getEndpoint(handle);
+}
 
 enum alloc_page_flags_t : uint32_t {
   ALLOC_ANON = 0x1,
   ALLOC_CURRENT = 0x2,
+  ALLOC_SIZED = 0x4,
+  ALLOC_LAZY = 0x8,
 };
 
-// Allocate a physical page, map it somewhere in this address space, and return
-// the virtual address it's mapped to. This accepts arguments via the following
+// Find where a mapping of `size` bytes can go in `pd` for ALLOC_ANON and
+// MAP_ANON. Return false if there is no room.
+bool FindAnonVaddr(const PageDirectory4M &pd, size_t size, uintptr_t &vaddr) {
+  if (size == pmm::kPageSize4M) {
+    int32_t free_vpage =
+        pd.getNextFreePage(/*lower_bound=*/FREE_PAGE_LOWER_BOUND);
+    if (free_vpage < 0) return false;
+    vaddr = pmm::PageToAddr(static_cast<uint32_t>(free_vpage));
+    return true;
+  }
+  return pd.FindFreeRange(size, pmm::PageToAddr(FREE_PAGE_LOWER_BOUND), vaddr);
+}
+
+// Unmap the 4KB pages in [`vaddr`, `vaddr` + `size`) from the address space of
+// `task`, freeing the frames its process owns.
+void UnmapFrames(scheduler::Task &task, uintptr_t vaddr, size_t size) {
+  auto &pd = task.getPageDir();
+  for (uintptr_t end = vaddr + size; vaddr != end; vaddr += pmm::kPageSize4K) {
+    uint32_t frame = pmm::AddrToFrame(pd.getPhysicalAddr(vaddr));
+    if (task.getProcess().DisownFrame(frame)) pmm::FreeFrame(frame);
+    pd.UnmapPage4K(vaddr);
+  }
+}
+
+// Map `size` bytes of new 4KB frames at `vaddr` in the address space of `task`
+// as one mapping. If frames run out, nothing is left mapped.
+kstatus_t MapNewFrames(scheduler::Task &task, uintptr_t vaddr, size_t size) {
+  auto &pd = task.getPageDir();
+  for (size_t offset = 0; offset < size; offset += pmm::kPageSize4K) {
+    int32_t frame = pmm::AllocFrame();
+    if (frame < 0) {
+      UnmapFrames(task, vaddr, offset);
+      return K_OOM_PHYS;
+    }
+    pd.MapPage4K(vaddr + offset, pmm::FrameToAddr(static_cast<uint32_t>(frame)),
+                 /*flags=*/PG_USER | (offset ? PG_CONTINUE : 0));
+    task.getProcess().RecordOwnedFrame(static_cast<uint32_t>(frame));
+  }
+  return K_OK;
+}
+
+// Allocate physical memory, map it somewhere in this address space, and return
+// the virtual address it's mapped to. This is one 4MB page unless ALLOC_SIZED
+// asks for less, in which case it is mapped with 4KB pages and only takes as
+// many 4KB frames as it needs. This accepts arguments via the following
 // registers:
 //
 //   EBX - The virtual address to map this page to. If this address is already
-//         mapped, then K_VPAGE_MAPPED is set as the status.
+//         mapped, then K_VPAGE_MAPPED is set as the status. Addresses reserved
+//         for the kernel give K_INVALID_ARG. It must be aligned to the size of
+//         the pages used, or K_UNALIGNED_PAGE_ADDR is set as the status.
 //   ECX - The handle for the process who's address space we want to map to.
 //   EDX - Optional flags
 //         ALLOC_ANON - Map to an anonymous memory address. If this is provided,
@@ -101,6 +168,14 @@ enum alloc_page_flags_t : uint32_t {
 //         ALLOC_CURRENT - Map to the address space of the current process. If
 //                         this is provided, then the proccess handle passed to
 //                         ECX is ignored.
+//         ALLOC_SIZED - Allocate the size passed in ESI.
+//         ALLOC_LAZY - Only reserve the virtual memory. Each 4KB page in it is
+//                      backed by a zeroed frame the first time it is touched.
+//                      The size can be more than 4MB, and the address only
+//                      needs to be 4KB-aligned.
+//   ESI - The number of bytes to allocate, if ALLOC_SIZED is provided. This is
+//         rounded up to 4KB, and a size that rounds up to 4MB gets a 4MB page.
+//         Zero, or more than 4MB without ALLOC_LAZY, gives K_INVALID_ARG.
 //
 // This sets return values via the following registers:
 //
@@ -111,44 +186,67 @@ void SYS_AllocPage(isr::registers_t *regs) {
   uintptr_t page_vaddr = regs->ebx;
   handle_t proc_handle = regs->ecx;
   uint32_t flags = regs->edx;
-
-  int32_t free_ppage = pmm::GetNextFreePage();
-  if (free_ppage < 0) {
-    regs->eax = K_OOM_PHYS;
-    return;
-  }
+  size_t size = (flags & ALLOC_SIZED) ? regs->esi : pmm::kPageSize4M;
 
   scheduler::Task *task;
   if (flags & ALLOC_CURRENT) {
     task = &scheduler::GetCurrentTask();
-  } else {
-    task = reinterpret_cast<scheduler::Task *>(proc_handle);
+  } else if (!(task = GetTask(proc_handle))) {
+    regs->eax = K_INVALID_HANDLE;
+    return;
+  }
+
+  // Rounding up a size near the top of memory wraps around to zero.
+  bool lazy = flags & ALLOC_LAZY;
+  size = RoundUp(size, pmm::kPageSize4K);
+  if (size == 0 || (size > pmm::kPageSize4M && !lazy)) {
+    regs->eax = K_INVALID_ARG;
+    return;
   }
+  bool use_4m_page = !lazy && size == pmm::kPageSize4M;
 
   auto &pd = task->getPageDir();
   if (flags & ALLOC_ANON) {
-    int32_t free_vpage =
-        pd.getNextFreePage(/*lower_bound=*/FREE_PAGE_LOWER_BOUND);
-    if (free_vpage < 0) {
+    if (!FindAnonVaddr(pd, size, page_vaddr)) {
       regs->eax = K_OOM_VIRT;
       return;
     }
-    page_vaddr = pmm::PageToAddr(static_cast<uint32_t>(free_vpage));
-  } else if (pd.VaddrIsMapped(page_vaddr)) {
+  } else if (page_vaddr < paging::kUserSpaceStart ||
+             page_vaddr + (size - 1) < page_vaddr) {
+    regs->eax = K_INVALID_ARG;
+    return;
+  } else if (page_vaddr % (use_4m_page ? pmm::kPageSize4M : pmm::kPageSize4K)) {
+    regs->eax = K_UNALIGNED_PAGE_ADDR;
+    return;
+  } else if (!pd.RangeIsFree(page_vaddr, size)) {
     regs->eax = K_VPAGE_MAPPED;
     return;
   }
 
-  pd.MapPage(page_vaddr, pmm::PageToAddr(static_cast<uint32_t>(free_ppage)),
-             /*flags=*/PG_USER);
+  // TODO: This should also work for kernel tasks.
+  assert(task->isUser());
+
+  if (lazy) {
+    pd.ReserveLazyArea(page_vaddr, size);
+  } else if (use_4m_page) {
+    int32_t free_ppage = pmm::GetNextFreePage();
+    if (free_ppage < 0) {
+      regs->eax = K_OOM_PHYS;
+      return;
+    }
+    pd.MapPage(page_vaddr, pmm::PageToAddr(static_cast<uint32_t>(free_ppage)),
+               /*flags=*/PG_USER);
+    task->RecordOwnedPage(static_cast<uint32_t>(free_ppage));
+  } else {
+    kstatus_t status = MapNewFrames(*task, page_vaddr, size);
+    if (status != K_OK) {
+      regs->eax = status;
+      return;
+    }
+  }
 
   regs->eax = K_OK;
   regs->ebx = page_vaddr;
-
-  // TODO: This should also work for kernel tasks.
-  assert(task->isUser());
-  task->RecordOwnedPage(
-      pmm::AddrToPage(task->getPageDir().getPhysicalAddr(page_vaddr)));
 }
 
 void SYS_PageSize(isr::registers_t *regs) { regs->eax = pmm::kPageSize4M; }
@@ -156,7 +254,8 @@ void SYS_PageSize(isr::registers_t *regs) { regs->eax = pmm::kPageSize4M; }
 // Create (but do not start) a new process. The syscall sets return values via
 // the follwing registers:
 //
-//   EAX - The result status of this syscall.
+//   EAX - The result status of this syscall. This is K_OOM_HANDLES if this
+//         process has no room for the new handle.
 //   EBX - The handle to this process. This is only valid if the syscall result
 //         is K_OK.
 //
@@ -165,7 +264,14 @@ void SYS_ProcessCreate(isr::registers_t *regs) {
   auto *init_user_task = new scheduler::Task(/*user=*/true, *user_pd,
                                              &scheduler::GetCurrentTask());
 
-  regs->ebx = reinterpret_cast<uint32_t>(init_user_task);
+  handle_t handle = GetHandles().Add(*init_user_task);
+  if (!handle) {
+    delete init_user_task;
+    regs->eax = K_OOM_HANDLES;
+    return;
+  }
+
+  regs->ebx = handle;
   regs->eax = K_OK;
 }
 
@@ -175,7 +281,10 @@ void SYS_ProcessCreate(isr::registers_t *regs) {
 // a physical page. This will only update the page table of the process that
 // doesn't have the physical page backing. This will do nothing and return a
 // K_OK if the handle for the other process and the current process are the
-// same.
+// same, or are threads in the same process.
+//
+// If the mapped side is a run of 4KB pages, the whole run from that address on
+// is mapped, at the same size and with the same pages, on the other side.
 //
 // This accepts arguments via the following registers:
 //
@@ -189,6 +298,10 @@ void SYS_ProcessCreate(isr::registers_t *regs) {
 //                      the owner of the physical page.
 //         MAP_ANON - Map to a free page in the other process' address space.
 //                    If this is provided, the value passed to EDX is ignored.
+//         MAP_COW - Share the pages copy-on-write instead. Both sides become
+//                   read-only, and both processes own the frames. Whichever
+//                   side writes to a page first gets its own copy of it. This
+//                   only works for 4KB pages, and not with SWAP_OWNER.
 //
 // This sets return values via the following registers:
 //
@@ -202,8 +315,12 @@ void SYS_MapPage(isr::registers_t *regs) {
   uint32_t flags = regs->esi;
 
   auto *task1 = &scheduler::GetCurrentTask();
-  auto *task2 = reinterpret_cast<scheduler::Task *>(handle2);
-  if (task1 == task2) {
+  auto *task2 = GetTask(handle2);
+  if (!task2) {
+    regs->eax = K_INVALID_HANDLE;
+    return;
+  }
+  if (&task1->getProcess() == &task2->getProcess()) {
     regs->eax = K_OK;
     regs->ebx = vaddr2;
     return;
@@ -216,36 +333,52 @@ void SYS_MapPage(isr::registers_t *regs) {
   enum map_page_flags_t : uint32_t {
     SWAP_OWNER = 0x1,
     MAP_ANON = 0x2,
+    MAP_COW = 0x4,
   };
   if (flags & MAP_ANON) {
-    int32_t free_vpage =
-        pd2.getNextFreePage(/*lower_bound=*/FREE_PAGE_LOWER_BOUND);
-    if (free_vpage < 0) {
+    // The anonymous side is the one to map, so it must fit what is mapped in
+    // this process.
+    if (vaddr1 < paging::kUserSpaceStart) {
+      regs->eax = K_INVALID_ARG;
+      return;
+    }
+    if (!pd1.VaddrIsMapped(vaddr1)) {
+      regs->eax = K_VPAGE_MAPPED;
+      return;
+    }
+    if (!FindAnonVaddr(pd2, pd1.getMappingSize(vaddr1), vaddr2)) {
       regs->eax = K_OOM_VIRT;
       return;
     }
-    vaddr2 = pmm::PageToAddr(static_cast<uint32_t>(free_vpage));
   }
 
   // NOTE: This means we don't accept virtual addresses that are on a page
   // boundary.
-  if (vaddr1 % pmm::kPageSize4M || vaddr2 % pmm::kPageSize4M) {
+  if (vaddr1 % pmm::kPageSize4K || vaddr2 % pmm::kPageSize4K) {
     regs->eax = K_UNALIGNED_PAGE_ADDR;
     return;
   }
 
+  // Neither side may touch the kernel's part of the address space.
+  if (vaddr1 < paging::kUserSpaceStart || vaddr2 < paging::kUserSpaceStart) {
+    regs->eax = K_INVALID_ARG;
+    return;
+  }
+
   // Exactly one of these must have a physical page backing it up.
-  uintptr_t paddr, vaddr_to_map;
-  PageDirectory4M *dir_to_map;
+  uintptr_t src_vaddr, vaddr_to_map;
+  PageDirectory4M *src_dir, *dir_to_map;
   scheduler::Task *current_owner, *new_owner;
   if (pd1.VaddrIsMapped(vaddr1) && !pd2.VaddrIsMapped(vaddr2)) {
-    paddr = pd1.getPhysicalAddr(vaddr1);
+    src_dir = &pd1;
+    src_vaddr = vaddr1;
     dir_to_map = &pd2;
     vaddr_to_map = vaddr2;
     current_owner = task1;
     new_owner = task2;
   } else if (!pd1.VaddrIsMapped(vaddr1) && pd2.VaddrIsMapped(vaddr2)) {
-    paddr = pd2.getPhysicalAddr(vaddr2);
+    src_dir = &pd2;
+    src_vaddr = vaddr2;
     dir_to_map = &pd1;
     vaddr_to_map = vaddr1;
     current_owner = task2;
@@ -256,14 +389,57 @@ void SYS_MapPage(isr::registers_t *regs) {
     return;
   }
 
-  dir_to_map->MapPage(vaddr_to_map, paddr, /*flags=*/PG_USER);
-  KTRACE("Mapped vaddr 0x%x => paddr 0x%x in task %p\n", vaddr_to_map, paddr,
-         new_owner);
+  // Both sides must start on a page of the size being mapped, and the side
+  // being mapped must be free for all of it.
+  size_t page_size = src_dir->getPageSize(src_vaddr);
+  if (src_vaddr % page_size || vaddr_to_map % page_size) {
+    regs->eax = K_UNALIGNED_PAGE_ADDR;
+    return;
+  }
+  if ((flags & MAP_COW) &&
+      (page_size != pmm::kPageSize4K || (flags & SWAP_OWNER))) {
+    regs->eax = K_INVALID_ARG;
+    return;
+  }
+  size_t size = src_dir->getMappingSize(src_vaddr);
+  if (vaddr_to_map + (size - 1) < vaddr_to_map ||
+      !dir_to_map->RangeIsFree(vaddr_to_map, size)) {
+    regs->eax = K_VPAGE_MAPPED;
+    return;
+  }
+
+  if (page_size == pmm::kPageSize4M) {
+    uintptr_t paddr = src_dir->getPhysicalAddr(src_vaddr);
+    dir_to_map->MapPage(vaddr_to_map, paddr, /*flags=*/PG_USER);
+    KTRACE("Mapped vaddr 0x%x => paddr 0x%x in task %p\n", vaddr_to_map,
+           paddr, new_owner);
 
-  if (flags & SWAP_OWNER) {
-    uint32_t ppage = pmm::AddrToPage(paddr);
-    current_owner->RemoveOwnedPage(ppage);
-    new_owner->RecordOwnedPage(ppage);
+    if (flags & SWAP_OWNER) {
+      uint32_t ppage = pmm::AddrToPage(paddr);
+      current_owner->RemoveOwnedPage(ppage);
+      new_owner->RecordOwnedPage(ppage);
+    }
+  } else {
+    for (size_t offset = 0; offset < size; offset += pmm::kPageSize4K) {
+      uintptr_t paddr = src_dir->getPhysicalAddr(src_vaddr + offset);
+      uint32_t frame = pmm::AddrToFrame(paddr);
+      uint32_t map_flags = PG_USER | (offset ? PG_CONTINUE : 0);
+      if (flags & MAP_COW) {
+        if (!src_dir->IsCopyOnWrite(src_vaddr + offset))
+          src_dir->MarkCopyOnWrite(src_vaddr + offset);
+        pmm::ShareFrame(frame);
+        new_owner->getProcess().RecordOwnedFrame(frame);
+        map_flags |= PG_COW;
+      }
+      dir_to_map->MapPage4K(vaddr_to_map + offset, paddr, map_flags);
+
+      if ((flags & SWAP_OWNER) &&
+          current_owner->getProcess().DisownFrame(frame)) {
+        new_owner->getProcess().RecordOwnedFrame(frame);
+      }
+    }
+    KTRACE("Mapped 0x%x bytes at vaddr 0x%x in task %p\n", size,
+           vaddr_to_map, new_owner);
   }
 
   regs->eax = K_OK;
@@ -271,17 +447,44 @@ void SYS_MapPage(isr::registers_t *regs) {
 }
 
 // Unmap a page from this page directory. If this is the owner of a physical
-// page backing the virtual address, that physical page is freed.
+// page backing the virtual address, that physical page is freed. For 4KB
+// pages, this unmaps the page at the address and the rest of its run. At the
+// start of memory reserved with ALLOC_LAZY, this releases the whole
+// reservation along with every page in it that was touched. Unmapping a page
+// elsewhere in the reservation just means it is zeroed again on the next touch.
 //
 // This accepts arguments via the following registers:
 //
-//   EBX - The virtual address in this address we want to unmap.
+//   EBX - The virtual address in this address we want to unmap. Nothing
+//         happens if it is not the start of a mapped user page or reservation.
 //
 void SYS_UnmapPage(isr::registers_t *regs) {
   auto *task = &scheduler::GetCurrentTask();
   uintptr_t page_vaddr = regs->ebx;
   auto &pd = task->getPageDir();
 
+  if (page_vaddr < paging::kUserSpaceStart) return;
+
+  size_t lazy_size = pd.ReleaseLazyArea(page_vaddr);
+  if (lazy_size) {
+    for (uintptr_t end = page_vaddr + lazy_size; page_vaddr != end;
+         page_vaddr += pmm::kPageSize4K) {
+      if (pd.VaddrIsMapped(page_vaddr))
+        UnmapFrames(*task, page_vaddr, pmm::kPageSize4K);
+    }
+    return;
+  }
+
+  if (!pd.VaddrIsMapped(page_vaddr) ||
+      page_vaddr % pd.getPageSize(page_vaddr)) {
+    return;
+  }
+
+  if (pd.getPageSize(page_vaddr) == pmm::kPageSize4K) {
+    UnmapFrames(*task, page_vaddr, pd.getMappingSize(page_vaddr));
+    return;
+  }
+
   uint32_t ppage = pmm::AddrToPage(pd.getPhysicalAddr(page_vaddr));
   if (task->PageIsRecorded(ppage)) { task->RemoveOwnedPage(ppage); }
 
@@ -291,7 +494,63 @@ void SYS_UnmapPage(isr::registers_t *regs) {
          page_vaddr, pmm::PageToAddr(ppage), task, did_own);
 }
 
-// Start a process. This accepts arguments via the following registers:
+// Create and start a new thread in the current process. The thread shares the
+// address space, owned pages, and handles of the process. The process is only
+// torn down once every thread in it has been killed. The thread's entry point
+// should never return and should end with a ProcessKill syscall instead, which
+// only kills that thread.
+//
+// This accepts arguments via the following registers:
+//
+//   EBX - The entry point for the new thread.
+//   ECX - The top of the user stack for the new thread.
+//   EDX - An argument to be passed to the new thread. EAX will be set to this
+//         at the start of the new thread.
+//   ESI - The base of the thread's TLS segment, which it can reach through GS.
+//         If this is zero, GS is left as the user data segment.
+//
+// This sets return values via the following registers:
+//
+//   EAX - The result status of this syscall. This is K_OOM_HANDLES if this
+//         process has no room for the new handle.
+//   EBX - The handle to the new thread. This is only valid if the syscall
+//         result is K_OK.
+//
+void SYS_ThreadCreate(isr::registers_t *regs) {
+  uintptr_t entry = regs->ebx;
+  uintptr_t stack = regs->ecx;
+  uint32_t arg = regs->edx;
+  uintptr_t tls_base = regs->esi;
+
+  scheduler::Task &current = scheduler::GetCurrentTask();
+  if (!current.isUser()) {
+    regs->eax = K_INVALID_ARG;
+    return;
+  }
+
+  auto *thread =
+      new scheduler::Task(/*user=*/true, current.getProcess(), &current);
+  handle_t handle = GetHandles().Add(*thread);
+  if (!handle) {
+    delete thread;
+    regs->eax = K_OOM_HANDLES;
+    return;
+  }
+  thread->setEntry(entry);
+  thread->setArg(arg);
+  thread->setUserStack(stack);
+  if (tls_base) thread->setTlsBase(tls_base);
+
+  KTRACE("Starting thread %p at entry 0x%x with stack 0x%x\n", thread, entry,
+         stack);
+
+  regs->eax = K_OK;
+  regs->ebx = handle;
+  RegisterTask(*thread);
+}
+
+// Start a process. This does nothing if the handle is not a task. This accepts
+// arguments via the following registers:
 //
 //   EBX - The handle to the process to start.
 //   ECX - The entry point for the new process.
@@ -306,7 +565,8 @@ void SYS_ProcessStart(isr::registers_t *regs) {
   KTRACE("Starting task 0x%x at entry 0x%x with arg 0x%x\n", proc_handle, entry,
          arg);
 
-  auto *task = reinterpret_cast<scheduler::Task *>(proc_handle);
+  scheduler::Task *task = GetTask(proc_handle);
+  if (!task) return;
   task->setEntry(entry);
   task->setArg(arg);
   RegisterTask(*task);
@@ -315,8 +575,7 @@ void SYS_ProcessStart(isr::registers_t *regs) {
 kstatus_t TryCopy(const void *src, size_t src_size, void *buff,
                   size_t buff_size) {
   if (buff_size < src_size) { return K_BUFFER_TOO_SMALL; }
-  GetPageDirBeforeException().Memcpy(paging::GetCurrentPageDirectory(), buff,
-                                     src, src_size);
+  if (!paging::CopyToUser(buff, src, src_size)) return K_INVALID_ARG;
   return K_OK;
 }
 
@@ -361,34 +620,41 @@ void SYS_ProcessInfo(isr::registers_t *regs) {
 
   scheduler::Task *task;
   if (flags == PROC_CURRENT) {
-    task = reinterpret_cast<scheduler::Task *>(&scheduler::GetCurrentTask());
-  } else {
-    task = reinterpret_cast<scheduler::Task *>(proc_handle);
-    if (!scheduler::IsRunningTask(task)) {
-      regs->eax = K_INVALID_HANDLE;
-      return;
-    }
+    task = &scheduler::GetCurrentTask();
+  } else if (!(task = GetTask(proc_handle))) {
+    regs->eax = K_INVALID_HANDLE;
+    return;
   }
 
+  // Every task written out gets a handle in this process.
+  handle::Table &handles = GetHandles();
   switch (flags) {
     case PROC_CURRENT: {
-      handle_t this_task = reinterpret_cast<handle_t>(task);
+      handle_t this_task = handles.Add(*task);
       regs->eax = TryCopy(&this_task, sizeof(handle_t), buffer, size);
       regs->ebx = sizeof(handle_t);
       break;
     }
     case PROC_PARENT: {
-      handle_t parent = reinterpret_cast<handle_t>(task->getParent());
+      scheduler::Task *parent_task = task->getParent();
+      handle_t parent = parent_task ? handles.Add(*parent_task) : 0;
       regs->eax = TryCopy(&parent, sizeof(handle_t), buffer, size);
       regs->ebx = sizeof(handle_t);
       break;
     }
     case PROC_CHILDREN: {
       std::vector<scheduler::Task *> children = task->getChildren();
-      static_assert(sizeof(scheduler::Task *) == sizeof(handle_t));
-      regs->eax = TryCopy(children.data(), children.size() * sizeof(handle_t),
-                          buffer, size);
-      regs->ebx = children.size() * sizeof(handle_t);
+      size_t needed = children.size() * sizeof(handle_t);
+      regs->ebx = needed;
+      if (size < needed) {
+        regs->eax = K_BUFFER_TOO_SMALL;
+        break;
+      }
+
+      std::vector<handle_t> child_handles;
+      for (scheduler::Task *child : children)
+        child_handles.push_back(handles.Add(*child));
+      regs->eax = TryCopy(child_handles.data(), needed, buffer, size);
       break;
     }
     default:
@@ -422,8 +688,8 @@ void SYS_ProcessWait(isr::registers_t *regs) {
     return;
   }
 
-  auto *proc = reinterpret_cast<scheduler::Task *>(proc_handle);
-  if (!scheduler::IsRunningTask(proc)) {
+  scheduler::Task *proc = GetTask(proc_handle);
+  if (!proc) {
     regs->eax = K_INVALID_HANDLE;
     return;
   }
@@ -431,10 +697,9 @@ void SYS_ProcessWait(isr::registers_t *regs) {
   scheduler::GetCurrentTask().WaitOn(*proc, signals);
   regs->eax = K_OK;
 
-  // The next time we enter back into this task, it will be when we schedule
-  // back into it after a signal has been received. The signal value will be
-  // set there.
-  scheduler::Schedule(regs, /*retval=*/0);
+  // The next time we enter back into this task, it will be when it is woken
+  // after a signal has been received. The signal value will be set there.
+  scheduler::Block(regs);
   abort();
 }
 
@@ -452,27 +717,26 @@ void SYS_ProcessWait(isr::registers_t *regs) {
 void SYS_ChannelCreate(isr::registers_t *regs) {
   channel::Endpoint *end1, *end2;
   channel::Create(end1, end2);
-  regs->eax = reinterpret_cast<handle_t>(end1);
-  regs->ebx = reinterpret_cast<handle_t>(end2);
+  handle::Table &handles = GetHandles();
+  regs->eax = handles.Add(*end1);
+  regs->ebx = handles.Add(*end2);
 }
 
 // Close a handle. This has different behavior depending on the handle type. If
 // this a handle to one endpoint of a channel, this will close the other
-// endpoint also.
+// endpoint also. Closing a task handle leaves the task running. Closing a
+// handle that is not open does nothing.
 //
 // This accepts arguments via the following syscalls:
 //
 //   EBX - The handle to close.
 //
 void SYS_HandleClose(isr::registers_t *regs) {
-  handle_t handle = regs->ebx;
-
-  // FIXME: This just assumes a channel endpoint handle.
-  auto *endpoint = reinterpret_cast<channel::Endpoint *>(handle);
-  endpoint->Close();
+  GetHandles().Close(regs->ebx);
 }
 
-// Read from a channel.
+// Read from a channel. Unless the endpoint is non-blocking, this blocks until
+// the requested number of bytes is on the channel.
 //
 // This accepts arguments via the following syscalls:
 //
@@ -482,33 +746,26 @@ void SYS_HandleClose(isr::registers_t *regs) {
 //
 // This sets return values via the following registers:
 //
-//   EAX - The return status. This is K_BUFFER_TOO_SMALL if the read size is
-//         less than the number of bytes on the channel.
+//   EAX - The return status. This is
+//         K_BUFFER_TOO_SMALL if the endpoint is non-blocking and the read size
+//           is more than the number of bytes on the channel.
+//         K_PEER_CLOSED if the other end was closed before enough bytes
+//           arrived.
+//         K_TIMED_OUT if the endpoint's read timeout passed first.
+//         K_INVALID_ARG if the destination cannot be written.
+//         K_INVALID_HANDLE if EBX is not a channel endpoint.
 //   EBX - The number of bytes available to read. This is only set if the
-//         number of bytes requested to read is greater than the number of
-//         bytes in the channel.
+//         read could not be done.
 //
 void SYS_ChannelRead(isr::registers_t *regs) {
-  auto *endpoint = reinterpret_cast<channel::Endpoint *>(regs->ebx);
-  void *dst = reinterpret_cast<void *>(regs->ecx);
-  size_t size = regs->edx;
-  size_t bytes_available;
-
-  // Copy into this local buffer first.
-  ResizableBuffer buffer(size);
-
-  bool success = endpoint->Read(buffer.getData(), size, &bytes_available);
-  if (!success) {
-    regs->eax = K_BUFFER_TOO_SMALL;
-    regs->ebx = bytes_available;
+  channel::Endpoint *endpoint = GetEndpoint(regs->ebx);
+  if (!endpoint) {
+    regs->eax = K_INVALID_HANDLE;
     return;
   }
-
-  // Then copy from the buffer to the original page directory.
-  GetPageDirBeforeException().Memcpy(paging::GetCurrentPageDirectory(), dst,
-                                     buffer.getData(), size);
-
-  regs->eax = K_OK;
+  void *dst = reinterpret_cast<void *>(regs->ecx);
+  size_t size = regs->edx;
+  endpoint->ReadToUserOrBlock(regs, dst, size);
 }
 
 // Write to a channel.
@@ -519,34 +776,570 @@ void SYS_ChannelRead(isr::registers_t *regs) {
 //   ECX - The source address to read data from.
 //   EDX - The number of bytes to write.
 //
+// This sets return values via the following registers:
+//
+//   EAX - The return status. This is K_INVALID_ARG and nothing is written if
+//         `src` cannot be read or the channel would hold more than 1MB.
+//
 void SYS_ChannelWrite(isr::registers_t *regs) {
-  auto *endpoint = reinterpret_cast<channel::Endpoint *>(regs->ebx);
+  channel::Endpoint *endpoint = GetEndpoint(regs->ebx);
   void *src = reinterpret_cast<void *>(regs->ecx);
   size_t size = regs->edx;
-
-  // First copy locally.
-  ResizableBuffer buffer(size);
-  paging::GetCurrentPageDirectory().Memcpy(GetPageDirBeforeException(),
-                                           buffer.getData(), src, size);
-
-  endpoint->Write(buffer.getData(), size);
+  if (!endpoint) {
+    regs->eax = K_INVALID_HANDLE;
+    return;
+  }
+  regs->eax = endpoint->WriteFromUser(src, size);
 }
 
-// Transfer ownership of a handle to another process.
+// Transfer ownership of a handle to another process. The handle is closed in
+// this process, and the other process gets its own handle to the same object.
 //
 // This accepts arguments via the following registers:
 //
 //   EBX - The handle of the process to transfer ownership to.
 //   ECX - The handle to transfer ownership.
 //
+// This sets return values via the following registers:
+//
+//   EAX - The result status of this syscall. This is K_INVALID_HANDLE if
+//         either handle is not open, or K_OOM_HANDLES if the other process has
+//         no room for it.
+//   EBX - The handle in the other process. The other process has to be told
+//         this value, such as through its start argument.
+//
 void SYS_TransferHandle(isr::registers_t *regs) {
   handle_t proc_handle = regs->ebx;
   handle_t transfer_handle = regs->ecx;
-  auto *task = reinterpret_cast<scheduler::Task *>(proc_handle);
-  auto *endpoint = reinterpret_cast<channel::Endpoint *>(transfer_handle);
 
-  // FIXME: This only works for channel handles.
-  endpoint->TransferOwner(task);
+  handle::Table &handles = GetHandles();
+  scheduler::Task *task = handles.getTask(proc_handle);
+  handle::Kind kind = handles.getKind(transfer_handle);
+  if (!task || kind == handle::Kind::kNone ||
+      (kind == handle::Kind::kTask && !handles.getTask(transfer_handle))) {
+    regs->eax = K_INVALID_HANDLE;
+    return;
+  }
+
+  handle_t new_handle = handles.TransferTo(transfer_handle, task->getProcess());
+  if (!new_handle) {
+    regs->eax = K_OOM_HANDLES;
+    return;
+  }
+  regs->eax = K_OK;
+  regs->ebx = new_handle;
+}
+
+// Give up the rest of this task's time slice to other tasks that can run. If
+// no other task can run, this returns right away. This takes no arguments.
+void SYS_Yield(isr::registers_t *regs) {
+  regs->eax = K_OK;
+  scheduler::Yield(regs);
+}
+
+// Sleep until the timer reaches a given tick. Ticks are milliseconds since
+// boot. The task does not run at all while sleeping. This accepts arguments
+// via the following registers:
+//
+//   EBX - The tick to sleep until. If this tick has already passed, this
+//         returns right away without giving up the CPU.
+//
+// This sets return values via the following registers:
+//
+//   EAX - The return status of this syscall.
+//   EBX - The current tick.
+//
+void SYS_SleepUntil(isr::registers_t *regs) {
+  uint32_t deadline = regs->ebx;
+  uint32_t now = timer::GetTicks();
+  regs->eax = K_OK;
+  if (!timer::TickBefore(now, deadline)) {
+    regs->ebx = now;
+    return;
+  }
+
+  scheduler::SleepUntil(regs, deadline);
+  abort();
+}
+
+// What SchedStats copies out for one CPU.
+struct sched_stats_t {
+  // The work stealing counters. See `scheduler::StealStats`.
+  uint32_t steals;
+  uint32_t stolen;
+  uint32_t failed_steals;
+  uint32_t hot_skips;
+
+  // The number of ticks this CPU has spent in its idle task.
+  uint32_t idle_ticks;
+};
+
+// Read the scheduler counters for one CPU. These are meant for tuning the load
+// balancer. This accepts arguments via the following registers:
+//
+//   EBX - The index of the CPU. CPU 0 is the boot processor.
+//   ECX - Where to copy the counters to. This is laid out like
+//         `sched_stats_t`.
+//
+// This sets return values via the following registers:
+//
+//   EAX - The return status of this syscall. This is K_INVALID_ARG if the CPU
+//         is not running the scheduler or the counters cannot be written.
+//
+void SYS_SchedStats(isr::registers_t *regs) {
+  scheduler::StealStats steal_stats;
+  if (!scheduler::GetStealStats(regs->ebx, steal_stats)) {
+    regs->eax = K_INVALID_ARG;
+    return;
+  }
+
+  sched_stats_t stats = {
+      steal_stats.steals,        steal_stats.stolen,
+      steal_stats.failed_steals, steal_stats.hot_skips,
+      scheduler::GetIdleTicks(regs->ebx),
+  };
+  void *dst = reinterpret_cast<void *>(regs->ecx);
+  regs->eax =
+      paging::CopyToUser(dst, &stats, sizeof(stats)) ? K_OK : K_INVALID_ARG;
+}
+
+// Change how much CPU time a task gets relative to other runnable tasks when
+// the scheduler is using the fair policy. A task with twice the weight of
+// another gets twice the CPU time and runs sooner after waking up. This accepts
+// arguments via the following registers:
+//
+//   EBX - The handle of the task, or 0 for the current task.
+//   ECX - The new weight. The default weight is 1024, and it can range from 16
+//         to 65536.
+//
+// This sets return values via the following registers:
+//
+//   EAX - The return status of this syscall. This is K_INVALID_ARG if the
+//         weight is out of range.
+//
+void SYS_SetWeight(isr::registers_t *regs) {
+  handle_t proc_handle = regs->ebx;
+  uint32_t weight = regs->ecx;
+
+  scheduler::Task *task;
+  if (proc_handle == 0) {
+    task = &scheduler::GetCurrentTask();
+  } else if (!(task = GetTask(proc_handle))) {
+    regs->eax = K_INVALID_HANDLE;
+    return;
+  }
+
+  regs->eax = scheduler::SetWeight(*task, weight) ? K_OK : K_INVALID_ARG;
+}
+
+// Set how reads on one end of a channel behave. This accepts arguments via the
+// following registers:
+//
+//   EBX - The handle to one end of the channel.
+//   ECX - Flags
+//         CHANNEL_NONBLOCK - Reads return K_BUFFER_TOO_SMALL right away rather
+//                            than waiting for bytes to arrive.
+//   EDX - The number of ticks a blocking read waits before returning
+//         K_TIMED_OUT. Zero waits forever.
+//
+// This sets return values via the following registers:
+//
+//   EAX - The result status of this syscall.
+//
+void SYS_ChannelSetOptions(isr::registers_t *regs) {
+  channel::Endpoint *endpoint = GetEndpoint(regs->ebx);
+  uint32_t flags = regs->ecx;
+  uint32_t timeout = regs->edx;
+  if (!endpoint) {
+    regs->eax = K_INVALID_HANDLE;
+    return;
+  }
+
+  enum channel_option_flags_t : uint32_t {
+    CHANNEL_NONBLOCK = 0x1,
+  };
+  if (flags & ~uint32_t{CHANNEL_NONBLOCK}) {
+    regs->eax = K_INVALID_ARG;
+    return;
+  }
+
+  endpoint->setNonBlocking(flags & CHANNEL_NONBLOCK);
+  endpoint->setReadTimeout(timeout);
+  regs->eax = K_OK;
+}
+
+// One entry of the array passed to ObjectWaitMany.
+struct wait_item_t {
+  handle_t handle;
+
+  // The signals to wait for. For tasks, these are TASK_* signals. For channel
+  // endpoints, these are CHANNEL_READABLE, CHANNEL_PEER_CLOSED, and
+  // CHANNEL_PAGE_LOANED.
+  uint32_t signals;
+
+  // Written by the kernel: which of `signals` fired, and the value sent with
+  // a task signal, such as the task's exit value.
+  uint32_t pending;
+  uint32_t value;
+};
+
+constexpr size_t kMaxWaitItems = 64;
+
+// A task blocked in ObjectWaitMany. Every endpoint it waits on has a watcher,
+// and every task it waits on has a `Task::WaitOn` entry, until the waiting task
+// runs again.
+struct WaitMany {
+  wait_item_t *user_items;
+  size_t count;
+  bool has_deadline;
+  uint32_t deadline;
+
+  wait_item_t items[kMaxWaitItems];
+
+  // For each item, exactly one of these is set.
+  scheduler::TaskRef *tasks[kMaxWaitItems]{};
+  channel::Endpoint *endpoints[kMaxWaitItems]{};
+
+  channel::Watcher *watchers[kMaxWaitItems]{};
+
+  ~WaitMany() {
+    for (size_t i = 0; i < count; ++i) delete watchers[i];
+  }
+
+  // Fill in `pending` for every item and return how many fired. If an endpoint
+  // was closed under us, return false and set `bad_item` to its index.
+  bool Collect(const scheduler::Task &waiter, size_t &num_ready,
+               size_t &bad_item) {
+    num_ready = 0;
+    for (size_t i = 0; i < count; ++i) {
+      wait_item_t &item = items[i];
+      item.pending = item.value = 0;
+      if (tasks[i]) {
+        item.pending =
+            waiter.getSignalFrom(*tasks[i], &item.value) & item.signals;
+      } else {
+        channel::Endpoint *endpoint =
+            watchers[i] ? watchers[i]->getEndpoint() : endpoints[i];
+        if (!endpoint) {
+          bad_item = i;
+          return false;
+        }
+        item.pending = endpoint->getReadySignals() & item.signals;
+      }
+      if (item.pending) ++num_ready;
+    }
+    return true;
+  }
+
+  // Write the results back to the user and return the status.
+  kstatus_t Finish(const scheduler::Task &waiter, uint32_t &result) {
+    size_t num_ready, bad_item;
+    if (!Collect(waiter, num_ready, bad_item)) {
+      result = bad_item;
+      return K_INVALID_HANDLE;
+    }
+    if (!paging::CopyToUser(user_items, items, count * sizeof(wait_item_t)))
+      return K_INVALID_ARG;
+
+    result = num_ready;
+    if (!num_ready && has_deadline &&
+        !timer::TickBefore(timer::GetTicks(), deadline))
+      return K_TIMED_OUT;
+    return K_OK;
+  }
+};
+
+// Wait until any of several handles has a signal, like `ProcessWait` over many
+// tasks and channel endpoints at once. Endpoint signals are level-triggered: if
+// one already holds, this returns right away. Task signals are only seen if
+// they are sent while waiting.
+//
+// This accepts arguments via the following registers:
+//
+//   EBX - An array of items, each a handle, the signals to wait for on it, and
+//         fields the kernel writes the signals that fired and their value to.
+//   ECX - The number of items. This can be at most 64.
+//   EDX - The number of ticks to wait before returning K_TIMED_OUT. Zero waits
+//         forever.
+//
+// This sets return values via the following registers:
+//
+//   EAX - The return status. This is
+//         K_INVALID_HANDLE if a handle is not a task or endpoint, or an
+//           endpoint was closed while waiting.
+//         K_INVALID_ARG if the item array cannot be read or written, or holds
+//           no items or too many.
+//         K_TIMED_OUT if the timeout passed with nothing ready.
+//   EBX - The number of items with signals pending. This may be zero if
+//         whatever woke the task no longer holds. For K_INVALID_HANDLE, this
+//         is the index of the bad item instead.
+//
+void SYS_ObjectWaitMany(isr::registers_t *regs) {
+  auto *user_items = reinterpret_cast<wait_item_t *>(regs->ebx);
+  size_t count = regs->ecx;
+  uint32_t timeout = regs->edx;
+  if (count == 0 || count > kMaxWaitItems) {
+    regs->eax = K_INVALID_ARG;
+    return;
+  }
+
+  scheduler::Task &task = scheduler::GetCurrentTask();
+  auto *wait = new WaitMany;
+  wait->user_items = user_items;
+  wait->count = count;
+  wait->has_deadline = timeout != 0;
+  wait->deadline = timer::GetTicks() + timeout;
+  if (!paging::CopyFromUser(wait->items, user_items,
+                            count * sizeof(wait_item_t))) {
+    delete wait;
+    regs->eax = K_INVALID_ARG;
+    return;
+  }
+
+  handle::Table &handles = GetHandles();
+  for (size_t i = 0; i < count; ++i) {
+    handle_t handle = wait->items[i].handle;
+    if (scheduler::Task *other = handles.getTask(handle)) {
+      wait->tasks[i] = &other->getRef();
+    } else if (!(wait->endpoints[i] = handles.getEndpoint(handle))) {
+      delete wait;
+      regs->eax = K_INVALID_HANDLE;
+      regs->ebx = i;
+      return;
+    }
+  }
+
+  // Nothing needs to wait if an endpoint is already ready.
+  kstatus_t status = wait->Finish(task, regs->ebx);
+  if (status != K_OK || regs->ebx) {
+    delete wait;
+    regs->eax = status;
+    return;
+  }
+
+  constexpr uint32_t kTaskSignals =
+      scheduler::Task::kReady | scheduler::Task::kRunning |
+      scheduler::Task::kTerminated;
+  for (size_t i = 0; i < count; ++i) {
+    if (scheduler::TaskRef *other = wait->tasks[i]) {
+      auto signals =
+          static_cast<scheduler::Task::signal_t>(wait->items[i].signals &
+                                                 kTaskSignals);
+      if (signals) task.WaitOn(*other->get(), signals);
+    } else {
+      wait->watchers[i] = new channel::Watcher(task);
+      wait->endpoints[i]->Watch(*wait->watchers[i]);
+    }
+  }
+
+  // The results are gathered from here once the task runs again.
+  task.setResumeHook(
+      [](scheduler::Task &task, void *arg) {
+        auto *wait = reinterpret_cast<WaitMany *>(arg);
+        task.getSyscallStatusReg() =
+            wait->Finish(task, task.getSyscallResultReg());
+        task.StopWaitingOnSignals();
+        delete wait;
+      },
+      wait);
+
+  if (timeout)
+    scheduler::SleepUntil(regs, wait->deadline);
+  else
+    scheduler::Block(regs);
+  abort();
+}
+
+// Give a whole page of this process to the other end of a channel without
+// copying it. The page is unmapped here, and this process no longer owns it.
+// This is meant for large messages, where copying the bytes in and back out of
+// the channel would cost more than remapping the page. Loaned pages are queued
+// apart from the bytes written to the channel.
+//
+// This accepts arguments via the following registers:
+//
+//   EBX - The handle to one end of the channel.
+//   ECX - The virtual address of the page. This process must own the page
+//         backing it.
+//
+// This sets return values via the following registers:
+//
+//   EAX - The return status. This is
+//         K_UNALIGNED_PAGE_ADDR if ECX is not on a page boundary.
+//         K_INVALID_ARG if ECX is not a mapped user page this process owns.
+//         K_PEER_CLOSED if the other end was closed. The page stays mapped.
+//
+void SYS_ChannelLoanPage(isr::registers_t *regs) {
+  channel::Endpoint *endpoint = GetEndpoint(regs->ebx);
+  uintptr_t vaddr = regs->ecx;
+  if (!endpoint) {
+    regs->eax = K_INVALID_HANDLE;
+    return;
+  }
+  if (vaddr % pmm::kPageSize4M) {
+    regs->eax = K_UNALIGNED_PAGE_ADDR;
+    return;
+  }
+
+  scheduler::Task &task = scheduler::GetCurrentTask();
+  auto &pd = task.getPageDir();
+  if (vaddr < paging::kUserSpaceStart || !pd.VaddrIsMapped(vaddr) ||
+      pd.getPageSize(vaddr) != pmm::kPageSize4M) {
+    regs->eax = K_INVALID_ARG;
+    return;
+  }
+  uint32_t ppage = pmm::AddrToPage(pd.getPhysicalAddr(vaddr));
+  if (!task.PageIsRecorded(ppage)) {
+    regs->eax = K_INVALID_ARG;
+    return;
+  }
+  if (endpoint->getReadySignals() & channel::kPeerClosed) {
+    regs->eax = K_PEER_CLOSED;
+    return;
+  }
+
+  pd.UnmapPage(vaddr);
+
+  // The page stays reserved while it is on the channel.
+  task.RemoveOwnedPage(ppage);
+  pmm::SetPageUsed(ppage);
+  regs->eax = endpoint->LoanPage(ppage);
+}
+
+// Take the oldest page loaned to this end of a channel and map it anywhere in
+// this address space. This process then owns the page. This never blocks;
+// ObjectWaitMany can wait for CHANNEL_PAGE_LOANED instead.
+//
+// This accepts arguments via the following registers:
+//
+//   EBX - The handle to one end of the channel.
+//
+// This sets return values via the following registers:
+//
+//   EAX - The return status. This is
+//         K_BUFFER_TOO_SMALL if no page is waiting to be taken.
+//         K_OOM_VIRT if there is no free virtual page to map it to. The page
+//           stays on the channel.
+//   EBX - The virtual address the page is mapped to.
+//
+void SYS_ChannelTakePage(isr::registers_t *regs) {
+  channel::Endpoint *endpoint = GetEndpoint(regs->ebx);
+  if (!endpoint) {
+    regs->eax = K_INVALID_HANDLE;
+    return;
+  }
+  if (!(endpoint->getReadySignals() & channel::kPageLoaned)) {
+    regs->eax = K_BUFFER_TOO_SMALL;
+    return;
+  }
+
+  scheduler::Task &task = scheduler::GetCurrentTask();
+  auto &pd = task.getPageDir();
+  int32_t free_vpage =
+      pd.getNextFreePage(/*lower_bound=*/FREE_PAGE_LOWER_BOUND);
+  if (free_vpage < 0) {
+    regs->eax = K_OOM_VIRT;
+    return;
+  }
+
+  uint32_t ppage;
+  endpoint->TakeLoanedPage(ppage);
+  uintptr_t vaddr = pmm::PageToAddr(static_cast<uint32_t>(free_vpage));
+  pd.MapPage(vaddr, pmm::PageToAddr(ppage), /*flags=*/PG_USER);
+
+  // Ownership is recorded by marking the page used again.
+  pmm::SetPageFree(ppage);
+  task.RecordOwnedPage(ppage);
+
+  regs->eax = K_OK;
+  regs->ebx = vaddr;
+}
+
+// Copy an iovec array from the user. Return false if it cannot be read or has
+// too many segments.
+bool CopyIoVecs(channel::IoVec *iov, const void *user_iov, size_t count) {
+  if (count > channel::kMaxIoVecs) return false;
+  return paging::CopyFromUser(iov, user_iov, count * sizeof(channel::IoVec));
+}
+
+// Write several buffers to a channel at once. The bytes land on the channel
+// back to back, with no other write in between.
+//
+// This accepts arguments via the following registers:
+//
+//   EBX - The handle to one end of the channel.
+//   ECX - An array of segments, each a source address and a size.
+//   EDX - The number of segments. This can be at most 16.
+//
+// This sets return values via the following registers:
+//
+//   EAX - The return status. This is K_INVALID_ARG and nothing is written if
+//         the array or any segment cannot be read, there are too many
+//         segments, or the channel would hold more than 1MB.
+//
+void SYS_ChannelWriteV(isr::registers_t *regs) {
+  channel::Endpoint *endpoint = GetEndpoint(regs->ebx);
+  const void *user_iov = reinterpret_cast<const void *>(regs->ecx);
+  size_t count = regs->edx;
+  if (!endpoint) {
+    regs->eax = K_INVALID_HANDLE;
+    return;
+  }
+
+  channel::IoVec iov[channel::kMaxIoVecs];
+  if (!CopyIoVecs(iov, user_iov, count)) {
+    regs->eax = K_INVALID_ARG;
+    return;
+  }
+  regs->eax = endpoint->WriteVFromUser(iov, count);
+}
+
+// Read from a channel into several buffers at once, filling each in order.
+// This behaves like ChannelRead for the total size of the segments: unless the
+// endpoint is non-blocking, it blocks until that many bytes are on the
+// channel, and nothing is read unless all of them can be.
+//
+// This accepts arguments via the following registers:
+//
+//   EBX - The handle to one end of the channel.
+//   ECX - An array of segments, each a destination address and a size.
+//   EDX - The number of segments. This can be at most 16.
+//
+// This sets return values via the following registers:
+//
+//   EAX - The return status. This is the same as for ChannelRead, and is also
+//         K_INVALID_ARG if the array cannot be read or there are too many
+//         segments.
+//   EBX - The number of bytes available to read. This is only set if the
+//         read could not be done.
+//
+void SYS_ChannelReadV(isr::registers_t *regs) {
+  channel::Endpoint *endpoint = GetEndpoint(regs->ebx);
+  const void *user_iov = reinterpret_cast<const void *>(regs->ecx);
+  size_t count = regs->edx;
+  if (!endpoint) {
+    regs->eax = K_INVALID_HANDLE;
+    return;
+  }
+
+  channel::IoVec iov[channel::kMaxIoVecs];
+  if (!CopyIoVecs(iov, user_iov, count)) {
+    regs->eax = K_INVALID_ARG;
+    return;
+  }
+  endpoint->ReadVToUserOrBlock(regs, iov, count);
+}
+
+// Read the timer. Ticks are milliseconds since boot. This takes no arguments.
+//
+// This sets return values via the following registers:
+//
+//   EAX - The return status of this syscall, which is always K_OK.
+//   EBX - The current tick.
+//
+void SYS_GetTicks(isr::registers_t *regs) {
+  regs->eax = K_OK;
+  regs->ebx = timer::GetTicks();
 }
 
 constexpr isr::handler_t kSyscallHandlers[] = {
@@ -554,6 +1347,10 @@ constexpr isr::handler_t kSyscallHandlers[] = {
     SYS_ProcessCreate, SYS_MapPage,     SYS_ProcessStart, SYS_UnmapPage,
     SYS_ProcessInfo,   SYS_DebugRead,   SYS_ProcessWait,  SYS_ChannelCreate,
     SYS_HandleClose,   SYS_ChannelRead, SYS_ChannelWrite, SYS_TransferHandle,
+    SYS_Yield,         SYS_SleepUntil,  SYS_SchedStats,   SYS_SetWeight,
+    SYS_ThreadCreate,  SYS_ChannelSetOptions, SYS_ObjectWaitMany,
+    SYS_ChannelLoanPage, SYS_ChannelTakePage,   SYS_ChannelWriteV,
+    SYS_ChannelReadV,  SYS_GetTicks,
 };
 constexpr size_t kNumSyscalls =
     sizeof(kSyscallHandlers) / sizeof(isr::handler_t);
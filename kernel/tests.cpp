@@ -1,9 +1,31 @@
+#include <kernel/channel.h>
+#include <kernel/fairqueue.h>
+#include <kernel/handle.h>
+#include <kernel/kernel.h>
 #include <kernel/kmalloc.h>
 #include <kernel/paging.h>
+#include <kernel/pmm.h>
+#include <kernel/runqueue.h>
+#include <kernel/scheduler.h>
+#include <kernel/slab.h>
+#include <kernel/smp.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
 #include <libc/tests/malloc.h>
 #include <libc/tests/test.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+// Set this to 1 to enable kernel traces, like the cycle counts of the run queue
+// latency test.
+#define LOCAL_KTRACE 0
+
+#if LOCAL_KTRACE
+#define KTRACE(...) printf("KTRACE> " __VA_ARGS__)
+#else
+#define KTRACE(...)
+#endif
 
 namespace tests {
 
@@ -70,6 +92,898 @@ void TestVirtualMapping(PagingTests &) {
   pmm::SetPageFree(static_cast<uint32_t>(free_ppage));
 }
 
+// User copies only go through pages mapped into user space.
+// 4KB frames are carved out of one 4MB page, and 4KB pages next to each other
+// can map frames in any order.
+void TestSmallPages(PagingTests &) {
+  size_t num_free_pages = pmm::GetNumFree4MPages();
+  size_t num_used_frames = pmm::GetNumUsedFrames();
+  int32_t frame1 = pmm::AllocFrame();
+  int32_t frame2 = pmm::AllocFrame();
+  ASSERT_GE(frame1, 0);
+  ASSERT_GE(frame2, 0);
+  ASSERT_EQ(pmm::GetNumUsedFrames(), num_used_frames + 2);
+  uintptr_t paddr1 = pmm::FrameToAddr(static_cast<uint32_t>(frame1));
+  uintptr_t paddr2 = pmm::FrameToAddr(static_cast<uint32_t>(frame2));
+  ASSERT_EQ(pmm::PageAddress(paddr1), pmm::PageAddress(paddr2));
+
+  auto &pd = paging::GetCurrentPageDirectory();
+  uintptr_t vaddr;
+  ASSERT_TRUE(pd.FindFreeRange(3 * pmm::kPageSize4K, paging::kUserSpaceStart,
+                               vaddr));
+  pd.MapPage4K(vaddr, paddr2, /*flags=*/0);
+  pd.MapPage4K(vaddr + pmm::kPageSize4K, paddr1, /*flags=*/PG_CONTINUE);
+  pd.MapPage4K(vaddr + 2 * pmm::kPageSize4K, paddr1, /*flags=*/0);
+  ASSERT_EQ(pd.getPageSize(vaddr), pmm::kPageSize4K);
+  ASSERT_EQ(pd.getMappingSize(vaddr), 2 * pmm::kPageSize4K);
+  ASSERT_EQ(pd.getPhysicalAddr(vaddr + pmm::kPageSize4K + 8), paddr1 + 8);
+  ASSERT_TRUE(!pd.RangeIsFree(vaddr, pmm::kPageSize4K));
+
+  // The second and third pages are the same frame.
+  auto *second = reinterpret_cast<uint32_t *>(vaddr + pmm::kPageSize4K);
+  auto *third = reinterpret_cast<uint32_t *>(vaddr + 2 * pmm::kPageSize4K);
+  *second = 0xC0FFEE;
+  ASSERT_EQ(*third, uint32_t{0xC0FFEE});
+
+  // The page table goes away with its last page.
+  for (size_t i = 0; i < 3; ++i) pd.UnmapPage4K(vaddr + i * pmm::kPageSize4K);
+  uint32_t vpage = pmm::AddrToPage(vaddr);
+  ASSERT_EQ(pd.getNextFreePage(vpage), static_cast<int32_t>(vpage));
+
+  pmm::FreeFrame(static_cast<uint32_t>(frame1));
+  pmm::FreeFrame(static_cast<uint32_t>(frame2));
+  ASSERT_EQ(pmm::GetNumFree4MPages(), num_free_pages);
+  ASSERT_EQ(pmm::GetNumUsedFrames(), num_used_frames);
+}
+
+// Blocks of frames are contiguous, aligned to their size, and merge back into
+// whole pages when freed in any order.
+void TestContiguousFrames(PagingTests &) {
+  size_t num_used_frames = pmm::GetNumUsedFrames();
+  int32_t block = pmm::AllocFrames(/*order=*/3);
+  int32_t frame = pmm::AllocFrame();
+  int32_t big_block = pmm::AllocFrames(/*order=*/pmm::kMaxOrder - 1);
+  ASSERT_GE(block, 0);
+  ASSERT_GE(frame, 0);
+  ASSERT_GE(big_block, 0);
+  ASSERT_EQ(block % 8, 0);
+  ASSERT_EQ(big_block % static_cast<int32_t>(pmm::kFramesPer4MPage / 2), 0);
+  for (uint32_t i = 0; i < 8; ++i)
+    ASSERT_TRUE(pmm::FrameIsUsed(static_cast<uint32_t>(block) + i));
+  ASSERT_EQ(pmm::GetNumUsedFrames(),
+            num_used_frames + 9 + pmm::kFramesPer4MPage / 2);
+
+  pmm::FreeFrames(static_cast<uint32_t>(block), /*order=*/3);
+  ASSERT_TRUE(!pmm::FrameIsUsed(static_cast<uint32_t>(block)));
+  pmm::FreeFrames(static_cast<uint32_t>(big_block), pmm::kMaxOrder - 1);
+  pmm::FreeFrame(static_cast<uint32_t>(frame));
+  ASSERT_EQ(pmm::GetNumUsedFrames(), num_used_frames);
+}
+
+// A page that was just freed isn't the next one handed out while there are
+// others free.
+void TestNextFreePageMovesOn(PagingTests &) {
+  int32_t page1 = pmm::GetNextFreePage();
+  ASSERT_GE(page1, 0);
+  pmm::SetPageUsed(static_cast<uint32_t>(page1));
+  int32_t page2 = pmm::GetNextFreePage();
+  pmm::SetPageFree(static_cast<uint32_t>(page1));
+  if (page2 < 0) return;  // That was the last free page.
+
+  ASSERT_NE(page1, page2);
+  ASSERT_EQ(pmm::GetNextFreePage(), page2);
+}
+
+void TestUserCopies(PagingTests &) {
+  int32_t free_ppage = pmm::GetNextFreePage();
+  ASSERT_GE(free_ppage, 0);
+  pmm::SetPageUsed(static_cast<uint32_t>(free_ppage));
+  uintptr_t paddr = static_cast<uint32_t>(free_ppage) * pmm::kPageSize4M;
+
+  auto &pd = paging::GetCurrentPageDirectory();
+  int32_t free_vpage = pd.getNextFreePage(paging::kFirstUserPage);
+  ASSERT_GE(free_vpage, 0);
+  uintptr_t vaddr = static_cast<uint32_t>(free_vpage) * pmm::kPageSize4M;
+  pd.MapPage(vaddr, paddr, /*flags=*/PG_USER);
+
+  uint32_t src = 0xC0FFEE, dst = 0;
+  auto *user = reinterpret_cast<uint32_t *>(vaddr);
+  ASSERT_TRUE(paging::CopyToUser(user, &src, sizeof(src)));
+  ASSERT_TRUE(paging::CopyFromUser(&dst, user, sizeof(dst)));
+  ASSERT_EQ(dst, src);
+
+  // Kernel memory is not user memory. A range running off the end of the user
+  // page faults partway through and is caught by the fixup.
+  ASSERT_TRUE(!paging::CopyFromUser(&dst, &src, sizeof(src)));
+  auto *last = reinterpret_cast<uint32_t *>(vaddr + pmm::kPageSize4M - 2);
+  if (!pd.VaddrIsMapped(vaddr + pmm::kPageSize4M))
+    ASSERT_TRUE(!paging::CopyToUser(last, &src, sizeof(src)));
+
+  pd.UnmapPage(vaddr);
+  pmm::SetPageFree(static_cast<uint32_t>(free_ppage));
+
+  // A page in user space that is mapped for the kernel only, like the local
+  // APIC registers, is turned away before anything is copied. The kernel
+  // would not fault on it.
+  int32_t frame = pmm::AllocFrame();
+  ASSERT_TRUE(frame >= 0);
+  uintptr_t kernel_vaddr;
+  ASSERT_TRUE(pd.FindFreeRange(pmm::kPageSize4K, paging::kUserSpaceStart,
+                               kernel_vaddr));
+  pd.MapPage4K(kernel_vaddr, pmm::FrameToAddr(static_cast<uint32_t>(frame)),
+               /*flags=*/0);
+  auto *kernel_word = reinterpret_cast<volatile uint32_t *>(kernel_vaddr);
+  *kernel_word = 0;
+  ASSERT_TRUE(!paging::CopyToUser(const_cast<uint32_t *>(kernel_word), &src,
+                                  sizeof(src)));
+  ASSERT_EQ(uint32_t{*kernel_word}, uint32_t{0});
+  ASSERT_TRUE(!paging::CopyFromUser(&dst, const_cast<uint32_t *>(kernel_word),
+                                    sizeof(dst)));
+
+  // The same goes for a range that only ends on it.
+  auto *before = reinterpret_cast<uint32_t *>(kernel_vaddr - 2);
+  if (!pd.VaddrIsMapped(kernel_vaddr - pmm::kPageSize4K))
+    ASSERT_TRUE(!paging::CopyToUser(before, &src, sizeof(src)));
+  ASSERT_EQ(uint32_t{*kernel_word}, uint32_t{0});
+
+  pd.UnmapPage4K(kernel_vaddr);
+  pmm::FreeFrame(static_cast<uint32_t>(frame));
+}
+
+// Pages in a lazy area are only mapped once they are touched, either directly
+// or by a user copy, and nothing else is placed in the area before then.
+void TestLazyArea(PagingTests &) {
+  constexpr size_t kSize = 4 * pmm::kPageSize4K;
+  auto &pd = paging::GetCurrentPageDirectory();
+  auto &process = scheduler::GetCurrentTask().getProcess();
+  size_t num_used_frames = pmm::GetNumUsedFrames();
+
+  uintptr_t vaddr, other_vaddr;
+  ASSERT_TRUE(pd.FindFreeRange(kSize, paging::kUserSpaceStart, vaddr));
+  pd.ReserveLazyArea(vaddr, kSize);
+  ASSERT_TRUE(!pd.VaddrIsMapped(vaddr));
+  ASSERT_TRUE(!pd.RangeIsFree(vaddr + kSize - pmm::kPageSize4K,
+                              pmm::kPageSize4K));
+  ASSERT_TRUE(pd.FindFreeRange(kSize, paging::kUserSpaceStart, other_vaddr));
+  ASSERT_TRUE(other_vaddr >= vaddr + kSize || other_vaddr + kSize <= vaddr);
+
+  uintptr_t first = vaddr, third = vaddr + 2 * pmm::kPageSize4K;
+  auto *word = reinterpret_cast<volatile uint32_t *>(third);
+  ASSERT_EQ(uint32_t{*word}, uint32_t{0});
+  *word = 0xC0FFEE;
+  uint32_t src = 0xBEEF;
+  ASSERT_TRUE(paging::CopyToUser(reinterpret_cast<void *>(first), &src,
+                                 sizeof(src)));
+  ASSERT_TRUE(pd.VaddrIsMapped(first));
+  ASSERT_TRUE(!pd.VaddrIsMapped(vaddr + pmm::kPageSize4K));
+  ASSERT_EQ(pmm::GetNumUsedFrames(), num_used_frames + 2);
+
+  // A fault that lost the race to map a page is retried without mapping it
+  // again.
+  ASSERT_TRUE(paging::HandleDemandFault(third));
+  ASSERT_EQ(uint32_t{*word}, uint32_t{0xC0FFEE});
+  ASSERT_EQ(pmm::GetNumUsedFrames(), num_used_frames + 2);
+
+  uintptr_t touched[] = {first, third};
+  for (uintptr_t page : touched) {
+    uint32_t frame = pmm::AddrToFrame(pd.getPhysicalAddr(page));
+    ASSERT_TRUE(process.DisownFrame(frame));
+    pmm::FreeFrame(frame);
+    pd.UnmapPage4K(page);
+  }
+  ASSERT_EQ(pd.ReleaseLazyArea(vaddr), kSize);
+  ASSERT_TRUE(pd.RangeIsFree(vaddr, kSize));
+}
+
+// A write to a shared copy-on-write page moves this process onto a copy, and
+// the last process sharing a frame takes it over without copying.
+void TestCopyOnWrite(PagingTests &) {
+  auto &pd = paging::GetCurrentPageDirectory();
+  auto &process = scheduler::GetCurrentTask().getProcess();
+  size_t num_used_frames = pmm::GetNumUsedFrames();
+
+  int32_t alloc = pmm::AllocFrame();
+  ASSERT_TRUE(alloc >= 0);
+  uint32_t frame = static_cast<uint32_t>(alloc);
+  process.RecordOwnedFrame(frame);
+  uintptr_t vaddr;
+  ASSERT_TRUE(pd.FindFreeRange(pmm::kPageSize4K, paging::kUserSpaceStart,
+                               vaddr));
+  pd.MapPage4K(vaddr, pmm::FrameToAddr(frame), /*flags=*/PG_USER);
+  auto *word = reinterpret_cast<volatile uint32_t *>(vaddr);
+  *word = 0xC0FFEE;
+
+  // Pretend another process shares the frame.
+  pd.MarkCopyOnWrite(vaddr);
+  pmm::ShareFrame(frame);
+  ASSERT_EQ(pmm::GetFrameRefs(frame), uint32_t{2});
+  ASSERT_TRUE(pd.IsCopyOnWrite(vaddr));
+
+  word[1] = 0xBEEF;
+  ASSERT_TRUE(!pd.IsCopyOnWrite(vaddr));
+  uint32_t copy = pmm::AddrToFrame(pd.getPhysicalAddr(vaddr));
+  ASSERT_NE(copy, frame);
+  ASSERT_EQ(uint32_t{*word}, uint32_t{0xC0FFEE});
+  ASSERT_EQ(pmm::GetFrameRefs(frame), uint32_t{1});
+  ASSERT_TRUE(!process.OwnsFrame(frame));
+  ASSERT_TRUE(process.OwnsFrame(copy));
+  ASSERT_EQ(pmm::GetNumUsedFrames(), num_used_frames + 2);
+
+  // The other process lets go of its frame.
+  pmm::FreeFrame(frame);
+  ASSERT_EQ(pmm::GetNumUsedFrames(), num_used_frames + 1);
+
+  // Only this process has the copy, so nothing needs copying.
+  pd.MarkCopyOnWrite(vaddr);
+  *word = 0xF00D;
+  ASSERT_TRUE(!pd.IsCopyOnWrite(vaddr));
+  ASSERT_EQ(pmm::AddrToFrame(pd.getPhysicalAddr(vaddr)), copy);
+  ASSERT_EQ(pmm::GetNumUsedFrames(), num_used_frames + 1);
+
+  // A write fault that lost the race to resolve the page is just retried.
+  ASSERT_TRUE(paging::HandleCopyOnWriteFault(vaddr));
+  ASSERT_EQ(pmm::AddrToFrame(pd.getPhysicalAddr(vaddr)), copy);
+  ASSERT_EQ(pmm::GetNumUsedFrames(), num_used_frames + 1);
+
+  ASSERT_TRUE(process.DisownFrame(copy));
+  pmm::FreeFrame(copy);
+  pd.UnmapPage4K(vaddr);
+}
+
+class RunQueueTests : public ::libc::tests::TestFramework<RunQueueTests> {
+ public:
+  RunQueueTests() : TestFramework() {}
+
+ protected:
+  void Setup() override { avail_kheap_ = kmalloc::GetAvailMemory(); }
+  void Teardown() override {
+    ASSERT_EQ(avail_kheap_, kmalloc::GetAvailMemory());
+  }
+
+ private:
+  size_t avail_kheap_ = 0;
+};
+
+// Entries should come off in priority order, and in FIFO order within the
+// same priority.
+void TestRunQueueOrdering(RunQueueTests &) {
+  scheduler::RunQueue queue;
+  scheduler::RunQueueEntry low1, low2, high, mid;
+  low1.setPriority(scheduler::kLowestPriority);
+  low2.setPriority(scheduler::kLowestPriority);
+  high.setPriority(scheduler::kHighestPriority);
+  mid.setPriority(scheduler::kDefaultPriority);
+
+  queue.Enqueue(low1);
+  queue.Enqueue(mid);
+  queue.Enqueue(low2);
+  queue.Enqueue(high);
+  ASSERT_EQ(queue.size(), size_t{4});
+  ASSERT_TRUE(queue.Contains(mid));
+
+  ASSERT_EQ(queue.PopNext(), &high);
+  ASSERT_EQ(queue.PopNext(), &mid);
+  ASSERT_EQ(queue.PopNext(), &low1);
+
+  // Dequeueing from the middle of a level should leave the rest intact.
+  queue.Enqueue(low1);
+  queue.Dequeue(low2);
+  ASSERT_EQ(queue.PeekNext(), &low1);
+  ASSERT_EQ(queue.PopNext(), &low1);
+  ASSERT_TRUE(queue.empty());
+  ASSERT_TRUE(queue.PopNext() == nullptr);
+}
+
+// Measure the average number of cycles it takes to pick the next entry and put
+// it back on a queue with `num_entries` entries.
+uint32_t MeasurePickNextCycles(size_t num_entries) {
+  constexpr uint32_t kNumIters = 1024;
+  scheduler::RunQueue queue;
+  auto *entries = new scheduler::RunQueueEntry[num_entries];
+  for (size_t i = 0; i < num_entries; ++i) {
+    entries[i].setPriority(
+        static_cast<scheduler::priority_t>(i % scheduler::kNumPriorities));
+    queue.Enqueue(entries[i]);
+  }
+
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < kNumIters; ++i) {
+    uint64_t start = ReadTimestampCounter();
+    scheduler::RunQueueEntry *next = queue.PopNext();
+    queue.Enqueue(*next);
+    total += static_cast<uint32_t>(ReadTimestampCounter() - start);
+  }
+
+  while (scheduler::RunQueueEntry *entry = queue.PopNext()) { (void)entry; }
+  delete[] entries;
+  return total / kNumIters;
+}
+
+// Picking the next task should take about the same time regardless of how
+// many tasks are queued. A linear scan would be ~250x slower at 500 tasks.
+// This only reports the timings since they are too noisy under emulation to
+// fail a boot over.
+void TestRunQueuePickNextLatency(RunQueueTests &) {
+  constexpr size_t kSizes[] = {2, 10, 100, 500};
+  for (size_t num_entries : kSizes) {
+    uint32_t cycles = MeasurePickNextCycles(num_entries);
+    KTRACE("%u tasks: ~%u cycles per pick\n", num_entries, cycles);
+    (void)cycles;
+  }
+}
+
+// Entries should come off in vruntime order, and in FIFO order for equal
+// vruntimes.
+void TestFairQueueOrdering(RunQueueTests &) {
+  scheduler::FairQueue queue;
+  scheduler::FairQueueEntry entries[8];
+  constexpr uint64_t kVruntimes[] = {50, 10, 30, 10, 70, 20, 60, 40};
+  for (size_t i = 0; i < 8; ++i) {
+    entries[i].setVruntime(kVruntimes[i]);
+    queue.Enqueue(entries[i]);
+  }
+  ASSERT_EQ(queue.size(), size_t{8});
+  ASSERT_EQ(queue.getTotalWeight(), 8 * scheduler::kDefaultWeight);
+  ASSERT_EQ(queue.PeekLast(), &entries[4]);
+
+  // Dequeueing from the middle should leave the rest in order.
+  queue.Dequeue(entries[2]);
+  ASSERT_TRUE(!entries[2].isQueued());
+
+  constexpr size_t kOrder[] = {1, 3, 5, 7, 0, 6, 4};
+  for (size_t i : kOrder) ASSERT_EQ(queue.PopNext(), &entries[i]);
+  ASSERT_TRUE(queue.empty());
+  ASSERT_TRUE(queue.PopNext() == nullptr);
+}
+
+// Running for the same time should advance the vruntime of a heavier entry
+// proportionally less.
+void TestFairQueueWeights(RunQueueTests &) {
+  scheduler::FairQueueEntry light, heavy;
+  heavy.setWeight(scheduler::kDefaultWeight * 4);
+  light.Charge(1 << 20);
+  heavy.Charge(1 << 20);
+  ASSERT_EQ(light.getVruntime(), uint64_t{1} << 10);
+  ASSERT_EQ(heavy.getVruntime(), uint64_t{1} << 8);
+
+  scheduler::FairQueue queue;
+  queue.Enqueue(light);
+  queue.Enqueue(heavy);
+  ASSERT_EQ(queue.PeekNext(), &heavy);
+
+  // The floor never goes backwards, even if an entry behind it is added.
+  queue.UpdateMinVruntime(/*current=*/nullptr);
+  ASSERT_EQ(queue.getMinVruntime(), uint64_t{1} << 8);
+  queue.Dequeue(heavy);
+  queue.UpdateMinVruntime(/*current=*/nullptr);
+  ASSERT_EQ(queue.getMinVruntime(), uint64_t{1} << 10);
+  heavy.setVruntime(0);
+  queue.Enqueue(heavy);
+  queue.UpdateMinVruntime(/*current=*/nullptr);
+  ASSERT_EQ(queue.getMinVruntime(), uint64_t{1} << 10);
+
+  queue.Dequeue(light);
+  queue.Dequeue(heavy);
+}
+
+class TimerTests : public ::libc::tests::TestFramework<TimerTests> {
+ public:
+  TimerTests() : TestFramework() {}
+};
+
+// Comparing ticks should still work when the tick count wraps around.
+void TestTickBefore(TimerTests &) {
+  ASSERT_TRUE(timer::TickBefore(1, 2));
+  ASSERT_TRUE(!timer::TickBefore(2, 2));
+  ASSERT_TRUE(!timer::TickBefore(3, 2));
+  ASSERT_TRUE(timer::TickBefore(UINT32_MAX, 0));
+  ASSERT_TRUE(!timer::TickBefore(0, UINT32_MAX));
+}
+
+// Timers should fire exactly on their deadline no matter which level of the
+// wheel they start on, including across the tick count wrapping around.
+void TestTimerWheelDeadlines(TimerTests &) {
+  struct Expiry {
+    uint32_t deadline;
+    uint32_t expected;  // When this should fire.
+    uint32_t fired_at;
+    uint32_t num_fired;
+    timer::TimerWheel *wheel;
+  };
+  auto on_fire = [](timer::Timer &, void *arg) {
+    auto *expiry = reinterpret_cast<Expiry *>(arg);
+    expiry->fired_at = expiry->wheel->getNow();
+    ++expiry->num_fired;
+  };
+
+  constexpr uint32_t kStart = UINT32_MAX - 100;
+  constexpr uint32_t kDelays[] = {0, 1, 31, 32, 33, 1000, 1024, 40000, 3000000};
+  constexpr size_t kNumTimers = sizeof(kDelays) / sizeof(kDelays[0]);
+  timer::TimerWheel wheel(kStart);
+  Expiry expiries[kNumTimers];
+  timer::Timer *timers[kNumTimers];
+  for (size_t i = 0; i < kNumTimers; ++i) {
+    // A timer already due fires on the next tick rather than the current one.
+    uint32_t deadline = kStart + kDelays[i];
+    uint32_t expected = kDelays[i] ? deadline : kStart + 1;
+    expiries[i] = {deadline, expected, 0, 0, &wheel};
+    timers[i] = new timer::Timer(on_fire, &expiries[i]);
+    wheel.Insert(*timers[i], expiries[i].deadline);
+  }
+
+  // Move time forward in uneven steps. The next event should never be after
+  // a pending deadline.
+  uint32_t now = kStart;
+  for (uint32_t step = 7; !wheel.empty(); step = step * 3 + 1) {
+    uint32_t next;
+    ASSERT_TRUE(wheel.NextEventTick(next));
+    for (size_t i = 0; i < kNumTimers; ++i) {
+      if (timers[i]->isArmed())
+        ASSERT_TRUE(!timer::TickBefore(expiries[i].expected, next));
+    }
+    now += step;
+    wheel.Advance(now);
+  }
+
+  for (size_t i = 0; i < kNumTimers; ++i) {
+    ASSERT_EQ(expiries[i].num_fired, uint32_t{1});
+    ASSERT_EQ(expiries[i].fired_at, expiries[i].expected);
+    delete timers[i];
+  }
+}
+
+// Periodic timers keep firing until cancelled, and cancelled timers never
+// fire.
+void TestTimerWheelPeriodicAndCancel(TimerTests &) {
+  auto count = [](timer::Timer &, void *arg) {
+    ++*reinterpret_cast<uint32_t *>(arg);
+  };
+  uint32_t num_periodic = 0, num_cancelled = 0;
+  timer::TimerWheel wheel;
+  timer::Timer periodic(count, &num_periodic);
+  timer::Timer cancelled(count, &num_cancelled);
+
+  wheel.Insert(periodic, /*deadline=*/10, /*period=*/7);
+  wheel.Insert(cancelled, /*deadline=*/500);
+  ASSERT_EQ(wheel.size(), uint32_t{2});
+  wheel.Remove(cancelled);
+  ASSERT_TRUE(!cancelled.isArmed());
+
+  wheel.Advance(10 + 7 * 100);
+  ASSERT_EQ(num_periodic, uint32_t{101});
+  ASSERT_EQ(num_cancelled, uint32_t{0});
+  ASSERT_TRUE(periodic.isArmed());
+  wheel.Remove(periodic);
+  ASSERT_TRUE(wheel.empty());
+}
+
+// A timer re-armed a full lap of the lowest level later lands back on the
+// slot being run, and should wait for the next lap rather than fire again.
+// Timers in that slot can still be cancelled by ones that run before them.
+void TestTimerWheelFullLap(TimerTests &) {
+  constexpr uint32_t kNumLaps = 4;
+  struct Lap {
+    timer::TimerWheel *wheel;
+    timer::Timer *to_cancel;
+    uint32_t num_fired;
+    uint32_t fired_at[kNumLaps];
+  };
+  auto on_fire = [](timer::Timer &timer, void *arg) {
+    auto *lap = reinterpret_cast<Lap *>(arg);
+    ASSERT_TRUE(lap->num_fired < kNumLaps);
+    lap->fired_at[lap->num_fired++] = lap->wheel->getNow();
+    if (lap->to_cancel && lap->to_cancel->isArmed())
+      lap->wheel->Remove(*lap->to_cancel);
+
+    // One-shot timers re-arm themselves for one lap later.
+    if (!timer.getPeriod() && lap->num_fired < kNumLaps) {
+      lap->wheel->Insert(timer,
+                         lap->wheel->getNow() + timer::TimerWheel::kNumSlots);
+    }
+  };
+
+  constexpr uint32_t kLap = timer::TimerWheel::kNumSlots;
+  timer::TimerWheel wheel;
+  Lap periodic_lap = {&wheel, nullptr, 0, {}};
+  Lap oneshot_lap = {&wheel, nullptr, 0, {}};
+  Lap cancelled_lap = {&wheel, nullptr, 0, {}};
+  timer::Timer periodic(on_fire, &periodic_lap);
+  timer::Timer oneshot(on_fire, &oneshot_lap);
+  timer::Timer cancelled(on_fire, &cancelled_lap);
+
+  // All three start on the same slot, and the periodic timer runs first.
+  periodic_lap.to_cancel = &cancelled;
+  wheel.Insert(periodic, /*deadline=*/5, /*period=*/kLap);
+  wheel.Insert(oneshot, /*deadline=*/5);
+  wheel.Insert(cancelled, /*deadline=*/5);
+  wheel.Advance(5 + kLap * (kNumLaps - 1));
+
+  ASSERT_EQ(periodic_lap.num_fired, kNumLaps);
+  ASSERT_EQ(oneshot_lap.num_fired, kNumLaps);
+  ASSERT_EQ(cancelled_lap.num_fired, uint32_t{0});
+  for (uint32_t i = 0; i < kNumLaps; ++i) {
+    ASSERT_EQ(periodic_lap.fired_at[i], 5 + kLap * i);
+    ASSERT_EQ(oneshot_lap.fired_at[i], 5 + kLap * i);
+  }
+  ASSERT_TRUE(!oneshot.isArmed());
+  wheel.Remove(periodic);
+  ASSERT_TRUE(wheel.empty());
+}
+
+// In one-shot mode, the clock is read straight from the APIC timer, so it
+// should move forward even with interrupts disabled, as long as a timer event
+// is coming up.
+void TestTicklessClockAdvances(TimerTests &) {
+  if (!timer::IsTickless()) return;
+  ASSERT_TRUE(!InterruptsAreEnabled());
+
+  // The APIC timer stops counting once it goes off, so make sure it is still
+  // counting past the tick we wait for.
+  timer::Timer event([](timer::Timer &, void *) {});
+  uint32_t start = timer::GetTicks();
+  timer::Arm(event, start + 10);
+
+  // Fail rather than hang if the clock is stuck.
+  uint64_t give_up =
+      ReadTimestampCounter() + uint64_t{timer::GetTscPerTick()} * 100;
+  while (timer::TickBefore(timer::GetTicks(), start + 5) &&
+         ReadTimestampCounter() < give_up) {}
+  ASSERT_TRUE(!timer::TickBefore(timer::GetTicks(), start + 5));
+  timer::Cancel(event);
+}
+
+class SmpTests : public ::libc::tests::TestFramework<SmpTests> {
+ public:
+  SmpTests() : TestFramework() {}
+};
+
+void TestSpinlock(SmpTests &) {
+  kern::Spinlock lock;
+  ASSERT_TRUE(!lock.isLocked());
+  {
+    kern::SpinlockGuard guard(lock);
+    ASSERT_TRUE(lock.isLocked());
+    ASSERT_TRUE(!lock.TryLock());
+  }
+  ASSERT_TRUE(!lock.isLocked());
+  ASSERT_TRUE(lock.TryLock());
+  lock.Unlock();
+}
+
+// The CPU holding the kernel lock can take it again, and only gives it up
+// after unlocking it just as many times.
+void TestKernelLockIsReentrant(SmpTests &) {
+  ASSERT_TRUE(!smp::KernelLockIsHeld());
+  smp::LockKernel();
+  smp::LockKernel();
+  ASSERT_TRUE(smp::KernelLockIsHeld());
+  smp::UnlockKernel();
+  ASSERT_TRUE(smp::KernelLockIsHeld());
+  smp::UnlockKernel();
+  ASSERT_TRUE(!smp::KernelLockIsHeld());
+}
+
+class SlabTests : public ::libc::tests::TestFramework<SlabTests> {
+ public:
+  SlabTests() : TestFramework() {}
+};
+
+// Objects keep their address while others come and go, and freed slots are
+// handed out again before the slab grows.
+void TestSlabReusesSlots(SlabTests &) {
+  kern::Slab<uint32_t, /*kObjectsPerSlab=*/4> slab;
+  uint32_t *objs[6];
+  for (uint32_t i = 0; i < 6; ++i) objs[i] = slab.New(i);
+  ASSERT_EQ(slab.getNumAllocated(), size_t{6});
+
+  slab.Delete(objs[2]);
+  ASSERT_EQ(slab.getNumAllocated(), size_t{5});
+  for (uint32_t i = 0; i < 6; ++i) {
+    if (i != 2) ASSERT_EQ(*objs[i], i);
+  }
+
+  uint32_t *reused = slab.New(42u);
+  ASSERT_EQ(reused, objs[2]);
+  ASSERT_EQ(*reused, 42u);
+  ASSERT_EQ(slab.getNumAllocated(), size_t{6});
+}
+
+class HandleTests : public ::libc::tests::TestFramework<HandleTests> {
+ public:
+  HandleTests() : TestFramework() {}
+};
+
+// A closed handle stays invalid after its slot is reused, and a handle to a
+// task that exited is rejected.
+void TestHandleGenerations(HandleTests &) {
+  handle::Table table;
+  auto *task = new scheduler::Task(/*user=*/false,
+                                   paging::GetKernelPageDirectory(),
+                                   /*parent=*/nullptr);
+
+  handle::handle_t first = table.Add(*task);
+  ASSERT_TRUE(first);
+  ASSERT_EQ(table.getTask(first), task);
+  ASSERT_EQ(table.Add(*task), first);
+  ASSERT_TRUE(!table.getEndpoint(first));
+
+  ASSERT_TRUE(table.Close(first));
+  ASSERT_TRUE(!table.Close(first));
+  ASSERT_TRUE(!table.getTask(first));
+
+  handle::handle_t second = table.Add(*task);
+  ASSERT_TRUE(second && second != first);
+  ASSERT_EQ(table.getTask(second), task);
+
+  delete task;
+  ASSERT_TRUE(!table.getTask(second));
+  ASSERT_EQ(table.size(), size_t{0});
+}
+
+// Closing an endpoint handle closes the endpoint too.
+void TestHandleClosesEndpoint(HandleTests &) {
+  handle::Table table;
+  channel::Endpoint *end1, *end2;
+  channel::Create(end1, end2);
+  handle::handle_t handle1 = table.Add(*end1);
+  handle::handle_t handle2 = table.Add(*end2);
+  ASSERT_EQ(table.getEndpoint(handle1), end1);
+  ASSERT_EQ(table.getEndpoint(handle2), end2);
+  ASSERT_EQ(table.getKind(handle1), handle::Kind::kEndpoint);
+
+  ASSERT_TRUE(table.Close(handle1));
+  ASSERT_TRUE(!end1->getOwner());
+  ASSERT_TRUE(end2->getOwner());
+  ASSERT_TRUE(table.Close(handle2));
+  ASSERT_EQ(table.getKind(handle2), handle::Kind::kNone);
+}
+
+class ProcessTests : public ::libc::tests::TestFramework<ProcessTests> {
+ public:
+  ProcessTests() : TestFramework() {}
+};
+
+// Threads of one process share its page directory, handles, and endpoints. The
+// process outlives all but its last thread, which closes the endpoints the
+// process still owns on the way out.
+void TestThreadsShareProcess(ProcessTests &) {
+  // These tasks are never registered, so they never run.
+  auto *main_thread =
+      new scheduler::Task(/*user=*/true,
+                          *paging::GetKernelPageDirectory().Clone(),
+                          /*parent=*/nullptr);
+  scheduler::Process &process = main_thread->getProcess();
+  auto *thread = new scheduler::Task(/*user=*/true, process, main_thread);
+  ASSERT_EQ(&thread->getProcess(), &process);
+  ASSERT_EQ(&thread->getPageDir(), &main_thread->getPageDir());
+  ASSERT_EQ(process.getNumThreads(), size_t{2});
+  ASSERT_EQ(thread->getParent(), main_thread);
+
+  // A handle one thread adds is there for the other.
+  channel::Endpoint *end1, *end2;
+  channel::Create(end1, end2);
+  end1->TransferOwner(process);
+  handle::handle_t endpoint_handle =
+      main_thread->getProcess().getHandles().Add(*end1);
+  handle::handle_t thread_handle =
+      main_thread->getProcess().getHandles().Add(*thread);
+  ASSERT_EQ(thread->getProcess().getHandles().getEndpoint(endpoint_handle),
+            end1);
+  ASSERT_EQ(thread->getProcess().getHandles().getTask(thread_handle), thread);
+  ASSERT_EQ(end1->getOwner(), &process);
+
+  // The first thread leaving takes nothing with it.
+  delete main_thread;
+  ASSERT_EQ(process.getNumThreads(), size_t{1});
+  ASSERT_TRUE(!thread->getParent());
+  ASSERT_EQ(end1->getOwner(), &process);
+  ASSERT_EQ(end2->getReadySignals(), uint32_t{0});
+
+  // The last one frees the process and closes its end of the channel.
+  delete thread;
+  ASSERT_TRUE(!end1->getOwner());
+  ASSERT_EQ(end2->getReadySignals(), uint32_t{channel::kPeerClosed});
+  end2->Close();
+}
+
+class ChannelTests : public ::libc::tests::TestFramework<ChannelTests> {
+ public:
+  ChannelTests() : TestFramework() {}
+};
+
+// A 4KB user page in the current page directory for channel tests to copy to
+// and from. It is unmapped and freed when this goes out of scope.
+class UserPage {
+ public:
+  UserPage() {
+    int32_t frame = pmm::AllocFrame();
+    ASSERT_TRUE(frame >= 0);
+    frame_ = static_cast<uint32_t>(frame);
+    ASSERT_TRUE(pd_.FindFreeRange(pmm::kPageSize4K, paging::kUserSpaceStart,
+                                  vaddr_));
+    pd_.MapPage4K(vaddr_, pmm::FrameToAddr(frame_), /*flags=*/PG_USER);
+  }
+  UserPage(const UserPage &) = delete;
+  UserPage &operator=(const UserPage &) = delete;
+  ~UserPage() {
+    pd_.UnmapPage4K(vaddr_);
+    pmm::FreeFrame(frame_);
+  }
+
+  char *get() const { return reinterpret_cast<char *>(vaddr_); }
+
+ private:
+  paging::PageDirectory4M &pd_ = paging::GetCurrentPageDirectory();
+  uint32_t frame_;
+  uintptr_t vaddr_;
+};
+
+// A watcher sees the peer close, and is detached once its own end closes.
+void TestEndpointWatcher(ChannelTests &) {
+  channel::Endpoint *end1, *end2;
+  channel::Create(end1, end2);
+  channel::Watcher watcher(scheduler::GetCurrentTask());
+  end1->Watch(watcher);
+  ASSERT_EQ(watcher.getEndpoint(), end1);
+  ASSERT_EQ(end1->getReadySignals(), uint32_t{0});
+
+  end2->Close();
+  ASSERT_EQ(end1->getReadySignals(), uint32_t{channel::kPeerClosed});
+  ASSERT_EQ(watcher.getEndpoint(), end1);
+
+  end1->Close();
+  ASSERT_TRUE(!watcher.getEndpoint());
+}
+
+// Loaned pages come out the other end in order, and a page nobody took is
+// freed when the end it was loaned to closes.
+void TestEndpointLoanedPages(ChannelTests &) {
+  channel::Endpoint *end1, *end2;
+  channel::Create(end1, end2);
+
+  int32_t page = pmm::GetNextFreePage();
+  ASSERT_TRUE(page >= 0);
+  auto ppage = static_cast<uint32_t>(page);
+  pmm::SetPageUsed(ppage);
+
+  uint32_t taken;
+  ASSERT_TRUE(!end2->TakeLoanedPage(taken));
+  ASSERT_EQ(end1->LoanPage(ppage), K_OK);
+  ASSERT_EQ(end2->getReadySignals(), uint32_t{channel::kPageLoaned});
+  ASSERT_TRUE(end2->TakeLoanedPage(taken));
+  ASSERT_EQ(taken, ppage);
+  ASSERT_EQ(end2->getReadySignals(), uint32_t{0});
+
+  ASSERT_EQ(end1->LoanPage(ppage), K_OK);
+  end2->Close();
+  ASSERT_TRUE(!pmm::PageIsUsed(ppage));
+  ASSERT_EQ(end1->LoanPage(ppage), K_PEER_CLOSED);
+  end1->Close();
+}
+
+// Bytes wrap around the end of the ring and come back in order. The ring
+// doubles when a write does not fit, and only halves once it is at most a
+// quarter full.
+void TestEndpointRingBuffer(ChannelTests &) {
+  UserPage page;
+  char *user = page.get();
+  char *user_dst = user + 64;
+
+  channel::Endpoint *end1, *end2;
+  channel::Create(end1, end2);
+  auto write = [&](const char *str, size_t size) {
+    ASSERT_TRUE(paging::CopyToUser(user, str, size));
+    ASSERT_EQ(end1->WriteFromUser(user, size), K_OK);
+  };
+  auto read = [&](const char *expected, size_t size) {
+    char got[16];
+    ASSERT_EQ(end2->ReadToUser(user_dst, size, nullptr), K_OK);
+    ASSERT_TRUE(paging::CopyFromUser(got, user_dst, size));
+    ASSERT_EQ(memcmp(got, expected, size), 0);
+  };
+
+  ASSERT_EQ(end2->getCapacity(), size_t{8});
+  write("abcdef", 6);
+  read("abcd", 4);
+  write("ghijkl", 6);
+  ASSERT_EQ(end2->getCapacity(), size_t{8});
+  read("efghijkl", 8);
+
+  write("mnopqr", 6);
+  write("stuvwx", 6);
+  ASSERT_EQ(end2->getCapacity(), size_t{16});
+  read("mnopqrs", 7);
+  ASSERT_EQ(end2->getCapacity(), size_t{16});
+  read("t", 1);
+  ASSERT_EQ(end2->getCapacity(), size_t{8});
+  read("uvwx", 4);
+
+  end1->Close();
+  end2->Close();
+}
+
+// A blocked read finishes once its task runs again. It comes back with the
+// bytes if they arrived, or with how many there were if the other end closed,
+// the timeout passed, or this end was closed under it.
+void TestEndpointBlockedRead(ChannelTests &) {
+  UserPage page;
+  char *user = page.get();
+  ASSERT_TRUE(paging::CopyToUser(user + 8, "abcd", 4));
+  channel::IoVec iov = {user, 4};
+
+  // The reader never runs here, so it is only ever woken through its hook.
+  auto *reader = new scheduler::Task(/*user=*/false,
+                                     paging::GetKernelPageDirectory(),
+                                     /*parent=*/nullptr);
+  auto finish_read = [&](kstatus_t status, uint32_t bytes_available) {
+    ASSERT_TRUE(reader->hasResumeHook());
+    reader->RunResumeHook();
+    ASSERT_EQ(reader->getSyscallStatusReg(), static_cast<uint32_t>(status));
+    if (status != K_OK)
+      ASSERT_EQ(reader->getSyscallResultReg(), bytes_available);
+  };
+
+  channel::Endpoint *end1, *end2;
+  channel::Create(end1, end2);
+  ASSERT_EQ(end1->WriteFromUser(user + 8, 2), K_OK);
+  end2->QueueRead(*reader, &iov, 1, timer::GetTicks());
+  end1->Close();
+  finish_read(K_PEER_CLOSED, 2);
+  end2->Close();
+
+  channel::Create(end1, end2);
+  end2->setReadTimeout(1);
+  end2->QueueRead(*reader, &iov, 1, timer::GetTicks());
+  finish_read(K_TIMED_OUT, 0);
+
+  // Bytes that arrive in time are read even once the deadline passes.
+  end2->QueueRead(*reader, &iov, 1, timer::GetTicks());
+  ASSERT_EQ(end1->WriteFromUser(user + 8, 4), K_OK);
+  finish_read(K_OK, 0);
+  char got[4];
+  ASSERT_TRUE(paging::CopyFromUser(got, user, 4));
+  ASSERT_EQ(memcmp(got, "abcd", 4), 0);
+
+  end2->QueueRead(*reader, &iov, 1, timer::GetTicks());
+  end2->Close();
+  finish_read(K_INVALID_HANDLE, 0);
+  end1->Close();
+
+  delete reader;
+}
+
+void TestEndpointVectoredIo(ChannelTests &) {
+  UserPage page;
+
+  // Segments are written back to back and read back in order, whatever their
+  // sizes on either side.
+  char *user = page.get();
+  ASSERT_TRUE(paging::CopyToUser(user, "abcdef", 6));
+  channel::IoVec write_iov[] = {{user + 3, 3}, {user, 0}, {user, 3}};
+
+  channel::Endpoint *end1, *end2;
+  channel::Create(end1, end2);
+  ASSERT_EQ(end1->WriteVFromUser(write_iov, 3), K_OK);
+
+  channel::IoVec read_iov[] = {{user + 8, 2}, {user + 16, 4}};
+  size_t available;
+  ASSERT_EQ(end2->ReadVToUser(read_iov, 2, &available), K_OK);
+  char got[6];
+  ASSERT_TRUE(paging::CopyFromUser(got, user + 8, 2));
+  ASSERT_TRUE(paging::CopyFromUser(got + 2, user + 16, 4));
+  ASSERT_EQ(memcmp(got, "defabc", 6), 0);
+
+  // A bad segment fails the whole write.
+  int kernel_var = 0;
+  channel::IoVec bad_iov[] = {{user, 3}, {&kernel_var, sizeof(kernel_var)}};
+  ASSERT_EQ(end1->WriteVFromUser(bad_iov, 2), K_INVALID_ARG);
+  ASSERT_EQ(end2->ReadVToUser(read_iov, 1, &available), K_BUFFER_TOO_SMALL);
+  ASSERT_EQ(available, size_t{0});
+
+  end1->Close();
+  end2->Close();
+}
+
 }  // namespace
 
 void RunKernelTests() {
@@ -79,6 +993,46 @@ void RunKernelTests() {
 
   PagingTests paging_tests;
   RUN_TESTF(paging_tests, TestVirtualMapping);
+  RUN_TESTF(paging_tests, TestSmallPages);
+  RUN_TESTF(paging_tests, TestContiguousFrames);
+  RUN_TESTF(paging_tests, TestNextFreePageMovesOn);
+  RUN_TESTF(paging_tests, TestUserCopies);
+  RUN_TESTF(paging_tests, TestLazyArea);
+  RUN_TESTF(paging_tests, TestCopyOnWrite);
+
+  RunQueueTests runqueue_tests;
+  RUN_TESTF(runqueue_tests, TestRunQueueOrdering);
+  RUN_TESTF(runqueue_tests, TestRunQueuePickNextLatency);
+  RUN_TESTF(runqueue_tests, TestFairQueueOrdering);
+  RUN_TESTF(runqueue_tests, TestFairQueueWeights);
+
+  TimerTests timer_tests;
+  RUN_TESTF(timer_tests, TestTickBefore);
+  RUN_TESTF(timer_tests, TestTicklessClockAdvances);
+  RUN_TESTF(timer_tests, TestTimerWheelDeadlines);
+  RUN_TESTF(timer_tests, TestTimerWheelPeriodicAndCancel);
+  RUN_TESTF(timer_tests, TestTimerWheelFullLap);
+
+  SlabTests slab_tests;
+  RUN_TESTF(slab_tests, TestSlabReusesSlots);
+
+  HandleTests handle_tests;
+  RUN_TESTF(handle_tests, TestHandleGenerations);
+  RUN_TESTF(handle_tests, TestHandleClosesEndpoint);
+
+  ProcessTests process_tests;
+  RUN_TESTF(process_tests, TestThreadsShareProcess);
+
+  ChannelTests channel_tests;
+  RUN_TESTF(channel_tests, TestEndpointWatcher);
+  RUN_TESTF(channel_tests, TestEndpointLoanedPages);
+  RUN_TESTF(channel_tests, TestEndpointVectoredIo);
+  RUN_TESTF(channel_tests, TestEndpointRingBuffer);
+  RUN_TESTF(channel_tests, TestEndpointBlockedRead);
+
+  SmpTests smp_tests;
+  RUN_TESTF(smp_tests, TestSpinlock);
+  RUN_TESTF(smp_tests, TestKernelLockIsReentrant);
 
   printf("All kernel tests passed!\n");
 }
@@ -1,8 +1,13 @@
 #include <assert.h>
+#include <kernel/apic.h>
 #include <kernel/io.h>
 #include <kernel/irq.h>
+#include <kernel/kernel.h>
 #include <kernel/isr.h>
+#include <kernel/smp.h>
+#include <kernel/timer.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #define PIT_CMD 0x43
 #define PIT_SET 0x36
@@ -10,41 +15,211 @@
 #define TIMER_QUOTIENT 1193180
 #define PIT_0 0x40
 
+// Channel 2 is used for calibrating the local APIC timer. Its gate is
+// controlled through bit 0 of port 0x61 and its output can be read from bit 5.
+#define PIT_2 0x42
+#define PIT_2_ONESHOT 0xB0  // Channel 2, lobyte/hibyte, interrupt on terminal
+                            // count.
+#define PIT_2_CONTROL 0x61
+#define PIT_2_GATE 0x01
+#define PIT_2_SPEAKER 0x02
+#define PIT_2_OUT 0x20
+
 namespace timer {
 
 namespace {
 
-uint32_t gTick = 0;
-constexpr size_t kMaxCallbacks = 256;
-isr::handler_t gCallbacks[kMaxCallbacks];
+constexpr uint32_t kPitPeriodMs = 1000 / TIMER_FREQ;
+constexpr uint32_t kCalibrationMs = 10;
 
-}  // namespace
+// Each CPU keeps its own clock, driven by its own local APIC timer, and its
+// own wheel of timers. A timer fires on the CPU it was armed on. The APIC
+// timers all count at the same rate, so once an AP starts its clock from the
+// boot processor's tick count, the clocks stay in step.
+struct Clock {
+  // The tick count as of the last time the clock was advanced.
+  uint32_t tick = 0;
 
-void TimerCallback(isr::registers_t* regs) {
-  ++gTick;
+  TimerWheel *wheel = nullptr;
 
-  // TODO: Maybe we could reduce this if we only have one caller?
-  for (size_t i = 0; i < kMaxCallbacks; ++i) {
-    if (auto callback = gCallbacks[i]) callback(regs);
-  }
+  // The APIC timer's current count as of the last time the clock was
+  // advanced.
+  uint32_t last_count = 0;
+
+  // APIC timer counts that have passed but are not enough to make up a whole
+  // tick. These are carried over to the next time the clock is advanced.
+  uint32_t leftover_count = 0;
+
+  // The tick the APIC timer is currently set to go off at.
+  uint32_t armed_deadline = 0;
+};
+
+Clock gClocks[smp::kMaxCpus];
+
+Clock &ThisClock() { return gClocks[smp::GetCurrentCpu()]; }
+
+bool gTickless = false;
+
+// Local APIC timer counts per millisecond.
+uint32_t gApicCountsPerMs = 0;
+
+// TSC cycles per millisecond, measured against the PIT at boot.
+uint32_t gTscPerMs = 0;
+
+// The APIC timer counts that have passed since `clock.tick` was last updated.
+uint32_t ElapsedCount(const Clock &clock, uint32_t current_count) {
+  return clock.last_count - current_count + clock.leftover_count;
+}
+
+// Move `clock.tick` up to the current time.
+void AdvanceClock(Clock &clock) {
+  uint32_t current_count = apic::GetTimerCurrentCount();
+  uint32_t elapsed = ElapsedCount(clock, current_count);
+  clock.tick += elapsed / gApicCountsPerMs;
+  clock.leftover_count = elapsed % gApicCountsPerMs;
+  clock.last_count = current_count;
+}
+
+// Start the APIC timer so it goes off at `deadline`, or at most
+// `kMaxEventIntervalMs` from now.
+void ArmClockEvent(Clock &clock, uint32_t deadline) {
+  AdvanceClock(clock);
+
+  uint32_t delta =
+      TickBefore(clock.tick, deadline) ? deadline - clock.tick : 0;
+  if (delta > kMaxEventIntervalMs) delta = kMaxEventIntervalMs;
+  clock.armed_deadline = clock.tick + delta;
+
+  // Part of the current tick has already passed, so take that off the count.
+  // A deadline that has already passed goes off right away.
+  uint32_t count = delta ? delta * gApicCountsPerMs - clock.leftover_count : 1;
+  clock.last_count = count;
+  apic::StartOneShot(count);
 }
 
-void RegisterTimerCallback(uint8_t num, isr::handler_t callback) {
-  assert(!gCallbacks[num]);
-  gCallbacks[num] = callback;
+// Run the PIT for `kCalibrationMs` and count how many TSC cycles pass. If
+// `use_apic` is true, this also counts how many APIC timer counts pass.
+void Calibrate(bool use_apic) {
+  constexpr uint32_t kPitCount = TIMER_QUOTIENT / 1000 * kCalibrationMs;
+  static_assert(kPitCount <= UINT16_MAX);
+
+  // Stop channel 2 and keep the speaker off while the count is loaded.
+  uint8_t control = io::Read8(PIT_2_CONTROL) & ~(PIT_2_GATE | PIT_2_SPEAKER);
+  io::Write8(PIT_2_CONTROL, control);
+  io::Write8(PIT_CMD, PIT_2_ONESHOT);
+  io::Write8(PIT_2, kPitCount & 0xFF);
+  io::Write8(PIT_2, (kPitCount >> 8) & 0xFF);
+
+  // Start the timers as close together as possible.
+  if (use_apic) apic::StartOneShot(UINT32_MAX, /*masked=*/true);
+  uint64_t tsc_start = ReadTimestampCounter();
+  io::Write8(PIT_2_CONTROL, control | PIT_2_GATE);
+  while (!(io::Read8(PIT_2_CONTROL) & PIT_2_OUT)) {}
+  auto tsc_elapsed =
+      static_cast<uint32_t>(ReadTimestampCounter() - tsc_start);
+  if (use_apic) {
+    gApicCountsPerMs =
+        (UINT32_MAX - apic::GetTimerCurrentCount()) / kCalibrationMs;
+    apic::StopTimer();
+  }
+
+  io::Write8(PIT_2_CONTROL, control);
+  gTscPerMs = tsc_elapsed / kCalibrationMs;
 }
 
-void UnregisterTimerCallback(uint8_t num) {
-  assert(gCallbacks[num]);
-  gCallbacks[num] = nullptr;
+void InitializeApicTimer() {
+  apic::Initialize();
+  Calibrate(/*use_apic=*/true);
+  assert(gApicCountsPerMs && "The local APIC timer did not count.");
+  assert(gApicCountsPerMs <= UINT32_MAX / kMaxEventIntervalMs &&
+         "The local APIC timer is too fast for the max event interval.");
+
+  // The PIT is no longer needed, so stop it from interrupting.
+  io::Write8(PIC1_DATA, io::Read8(PIC1_DATA) | 0x1);
+
+  gTickless = true;
+  ArmClockEvent(ThisClock(), kMaxEventIntervalMs);
+  printf("Using the local APIC timer (%u counts/ms)\n", gApicCountsPerMs);
 }
 
-void Initialize() {
+void InitializePit() {
+  Calibrate(/*use_apic=*/false);
   uint32_t divisor = TIMER_QUOTIENT / TIMER_FREQ;
 
   io::Write8(PIT_CMD, PIT_SET);
   io::Write8(PIT_0, divisor & 0xFF);
   io::Write8(PIT_0, (divisor >> 8) & 0xFF);
+  printf("Using the PIT timer at %u Hz\n", TIMER_FREQ);
+}
+
+}  // namespace
+
+void TimerCallback(isr::registers_t*) {
+  Clock& clock = ThisClock();
+  if (gTickless) {
+    // Unlike the PIC IRQs, nothing sends the EOI for us before we get here.
+    apic::SendEndOfInterrupt();
+    AdvanceClock(clock);
+  } else {
+    clock.tick += kPitPeriodMs;
+  }
+
+  clock.wheel->Advance(clock.tick);
+
+  if (gTickless) {
+    uint32_t next = clock.tick + kMaxEventIntervalMs;
+    clock.wheel->NextEventTick(next);
+    ArmClockEvent(clock, next);
+  }
+}
+
+void Arm(Timer& timer, uint32_t deadline, uint32_t period) {
+  Clock& clock = ThisClock();
+  assert(clock.wheel);
+  clock.wheel->Insert(timer, deadline, period);
+
+  // The clock event is also started again if it already went off, since the
+  // APIC timer stops counting until its interrupt is handled.
+  if (gTickless && (TickBefore(deadline, clock.armed_deadline) ||
+                    !TickBefore(GetTicks(), clock.armed_deadline)))
+    ArmClockEvent(clock, deadline);
+}
+
+void Cancel(Timer& timer) {
+  // The timer may be on another CPU's wheel. The clock event is left alone.
+  // If it was only armed for this timer, it just goes off with nothing to do.
+  if (timer.isArmed()) timer.getWheel()->Remove(timer);
+}
+
+uint32_t GetTicks() {
+  const Clock& clock = ThisClock();
+  if (gTickless) {
+    return clock.tick +
+           ElapsedCount(clock, apic::GetTimerCurrentCount()) / gApicCountsPerMs;
+  }
+  return clock.tick;
+}
+
+bool IsTickless() { return gTickless; }
+
+uint32_t GetTscPerTick() { return gTscPerMs; }
+
+void Initialize() {
+  Clock& clock = ThisClock();
+  clock.wheel = new TimerWheel(clock.tick);
+  if (apic::IsAvailable())
+    InitializeApicTimer();
+  else
+    InitializePit();
+}
+
+void InitializeAP(uint32_t now) {
+  assert(gTickless && "APs are only started when the local APIC is used.");
+  Clock& clock = ThisClock();
+  assert(!clock.wheel && "This CPU's clock was already initialized.");
+  clock.tick = now;
+  clock.wheel = new TimerWheel(now);
+  ArmClockEvent(clock, now + kMaxEventIntervalMs);
 }
 
 }  // namespace timer
@@ -0,0 +1,166 @@
+#include <assert.h>
+#include <kernel/kernel.h>
+#include <kernel/timer.h>
+#include <kernel/timerwheel.h>
+
+namespace timer {
+
+namespace {
+
+static_assert(TimerWheel::kNumSlots <= sizeof(uint32_t) * CHAR_BIT,
+              "Each slot needs a bit in the occupancy bitmap.");
+static_assert(TimerWheel::kSlotBits * TimerWheel::kNumLevels < 32,
+              "The wheel cannot cover more than the tick range.");
+
+// The number of ticks a single slot covers on `level`.
+constexpr uint32_t SlotShift(uint32_t level) {
+  return level * TimerWheel::kSlotBits;
+}
+
+uint32_t SlotIndex(uint32_t level, uint32_t tick) {
+  return (tick >> SlotShift(level)) & TimerWheel::kSlotMask;
+}
+
+uint32_t RotateRight(uint32_t x, uint32_t n) {
+  n &= 31;
+  return n ? (x >> n) | (x << (32 - n)) : x;
+}
+
+}  // namespace
+
+void TimerWheel::Insert(Timer &timer, uint32_t deadline, uint32_t period) {
+  assert(!timer.isArmed() && "Timer is already armed.");
+  timer.deadline_ = deadline;
+  timer.period_ = period;
+  timer.wheel_ = this;
+  Place(timer);
+  ++num_timers_;
+}
+
+void TimerWheel::Place(Timer &timer) {
+  // Levels are picked relative to the next tick to be processed. Anything due
+  // before then fires on that tick.
+  uint32_t next = now_ + 1;
+  uint32_t tick = TickBefore(timer.deadline_, next) ? next : timer.deadline_;
+  uint32_t delta = tick - next;
+  if (delta >= kMaxRange) {
+    delta = kMaxRange - 1;
+    tick = next + delta;
+  }
+
+  uint32_t level = 0;
+  while (delta >= (UINT32_C(1) << SlotShift(level + 1))) ++level;
+  assert(level < kNumLevels);
+
+  uint32_t slot = SlotIndex(level, tick);
+  timer.level_ = static_cast<uint8_t>(level);
+  timer.slot_ = static_cast<uint8_t>(slot);
+  slots_[level][slot].PushBack(timer);
+  occupied_[level] |= UINT32_C(1) << slot;
+}
+
+void TimerWheel::Remove(Timer &timer) {
+  assert(timer.wheel_ == this && "Timer is not on this wheel.");
+  if (expiring_.Contains(timer)) {
+    expiring_.Remove(timer);
+  } else {
+    TimerList &list = slots_[timer.level_][timer.slot_];
+    list.Remove(timer);
+    if (list.empty())
+      occupied_[timer.level_] &= ~(UINT32_C(1) << timer.slot_);
+  }
+  --num_timers_;
+}
+
+// Move every timer in the slot on `level` that `tick` falls in down to lower
+// levels. This should be called before `now_` is moved up to `tick`.
+void TimerWheel::Cascade(uint32_t level, uint32_t tick) {
+  uint32_t slot = SlotIndex(level, tick);
+  TimerList &list = slots_[level][slot];
+  occupied_[level] &= ~(UINT32_C(1) << slot);
+
+  // Timers are only re-placed on lower levels (or back on the last level if
+  // they are still out of range) so this slot cannot grow while draining it.
+  while (Timer *timer = list.PopFront()) Place(*timer);
+}
+
+void TimerWheel::RunSlot(uint32_t tick) {
+  // Empty the slot before running anything. A timer armed from here for a full
+  // lap of the lowest level from now, like one with a period of `kNumSlots`,
+  // lands back on this slot and should not fire until then.
+  assert(expiring_.empty());
+  uint32_t slot = SlotIndex(/*level=*/0, tick);
+  TimerList &list = slots_[0][slot];
+  occupied_[0] &= ~(UINT32_C(1) << slot);
+  while (Timer *timer = list.PopFront()) expiring_.PushBack(*timer);
+
+  while (Timer *timer = expiring_.PopFront()) {
+    --num_timers_;
+    assert(!TickBefore(tick, timer->deadline_) && "Timer fired too early.");
+
+    // Re-arm periodic timers before running the callback so the callback can
+    // cancel it.
+    if (uint32_t period = timer->period_)
+      Insert(*timer, timer->deadline_ + period, period);
+
+    timer->callback_(*timer, timer->arg_);
+  }
+}
+
+void TimerWheel::Advance(uint32_t now) {
+  while (TickBefore(now_, now)) {
+    uint32_t tick = now_ + 1;
+    uint32_t idx = SlotIndex(/*level=*/0, tick);
+
+    // Skip ahead to the next tick that either has timers to fire or needs to
+    // cascade timers from higher levels.
+    if (idx) {
+      uint32_t pending = occupied_[0] & (~UINT32_C(0) << idx);
+      uint32_t next_idx = pending ? LowestSetBit(pending) : kNumSlots;
+      if (next_idx != idx) {
+        uint32_t skip_to = tick + (next_idx - idx) - 1;
+        now_ = TickBefore(skip_to, now) ? skip_to : now;
+        continue;
+      }
+    }
+
+    // Cascade from the highest level whose slot boundary this tick is on.
+    // Timers from higher levels may land in a lower level slot that is also
+    // about to be cascaded on this tick.
+    uint32_t levels = 1;
+    while (levels < kNumLevels &&
+           (tick & ((UINT32_C(1) << SlotShift(levels)) - 1)) == 0)
+      ++levels;
+    for (uint32_t level = levels - 1; level > 0; --level)
+      Cascade(level, tick);
+
+    now_ = tick;
+    RunSlot(tick);
+  }
+}
+
+bool TimerWheel::NextEventTick(uint32_t &tick) const {
+  if (empty()) return false;
+
+  bool found = false;
+  for (uint32_t level = 0; level < kNumLevels; ++level) {
+    if (!occupied_[level]) continue;
+
+    // The first occupied slot after the current one on this level. On the
+    // lowest level, the current slot was already run. On the other levels,
+    // it was already cascaded.
+    uint32_t base = now_ >> SlotShift(level);
+    uint32_t offset =
+        LowestSetBit(RotateRight(occupied_[level], base + 1)) + 1;
+    uint32_t candidate =
+        level ? (base + offset) << SlotShift(level) : now_ + offset;
+    if (!found || TickBefore(candidate, tick)) {
+      tick = candidate;
+      found = true;
+    }
+  }
+  assert(found);
+  return true;
+}
+
+}  // namespace timer
@@ -0,0 +1,11 @@
+#include <kernel/scheduler.h>
+#include <kernel/waitqueue.h>
+
+namespace scheduler {
+
+void WaitQueue::WakeAll() {
+  while (WaitQueueEntry *entry = entries_.PopFront())
+    WakeTask(entry->getTask());
+}
+
+}  // namespace scheduler
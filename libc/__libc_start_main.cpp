@@ -15,6 +15,24 @@
 extern "C" int main(int argc, char **argv);
 extern "C" char **environ;
 
+namespace {
+
+// `malloc` starts out with this much, mapped with 4KB pages, and grows by a
+// 4MB reservation at a time from there. Those are only backed as they are
+// touched.
+constexpr size_t kInitialHeapSize = 0x10000;
+
+void AskForMoreHeap(uintptr_t &alloc, size_t &alloc_size) {
+  if (syscall::AllocPage(alloc, /*proc_handle=*/0,
+                         ALLOC_ANON | ALLOC_CURRENT | ALLOC_LAZY) != K_OK) {
+    printf("ERROR: UNABLE TO ALLOCATE MORE PAGES FOR MALLOC!!!\n");
+    abort();
+  }
+  alloc_size = syscall::PageSize();
+}
+
+}  // namespace
+
 #ifndef __USERBOOT_STAGE1__
 
 namespace {
@@ -70,10 +88,12 @@ void SetCurrentDir(Dir *wd) {
 // process which contains any information needed for a functional libc
 // environment (`main` arguments, file system, working dir, etc).
 extern "C" int __libc_start_main([[maybe_unused]] uint32_t arg) {
-  // Allocate one page for `malloc` to use.
+  // Allocate the first memory for `malloc` to use.
   uintptr_t malloc_page;
-  kstatus_t status = syscall::AllocPage(malloc_page, /*proc_handle=*/0,
-                                        ALLOC_ANON | ALLOC_CURRENT);
+  kstatus_t status =
+      syscall::AllocPage(malloc_page, /*proc_handle=*/0,
+                         ALLOC_ANON | ALLOC_CURRENT | ALLOC_SIZED,
+                         kInitialHeapSize);
   if (status != K_OK) {
     printf("ERROR: UNABLE TO ALLOCATE A PAGE FOR MALLOC!!!\n");
     abort();
@@ -98,8 +118,7 @@ extern "C" int __libc_start_main([[maybe_unused]] uint32_t arg) {
   // first possible pointer returned by `malloc` would actually return
   // whatever `sizeof(MallocHeader)` is).
   assert(malloc_page);
-  size_t pagesize = syscall::PageSize();
-  libc::malloc::Initialize(malloc_page, pagesize);
+  libc::malloc::Initialize(malloc_page, kInitialHeapSize, AskForMoreHeap);
 
 #ifdef __USERBOOT_STAGE1__
   // NOTE: argc and argv are meaningless here since we jumped directly from the
@@ -110,26 +129,37 @@ extern "C" int __libc_start_main([[maybe_unused]] uint32_t arg) {
 
   libc::startup::RootDir root;
 
-  // Each of these things we initialize follows a pattern of:
-  // - First thing off the stream is the expected size.
-  // - Second thing is some packed data of the size we just got that we can use
-  //   to construct an object.
-  size_t vfssize;
-  syscall::ChannelReadBlocking(startup_channel, &vfssize, sizeof(vfssize));
-  ResizableBuffer vfsbuffer(vfssize);
-  syscall::ChannelReadBlocking(startup_channel, vfsbuffer.getData(), vfssize);
-  libc::startup::InitVFS(root,
-                         reinterpret_cast<uintptr_t>(vfsbuffer.getData()));
-  gRawVfsData = vfsbuffer.getData();
+  // First off the stream are the sizes of everything else. Then comes the
+  // packed data for each thing we initialize, which is all read at once.
+  libc::startup::StartupSizes sizes;
+  syscall::ChannelReadBlocking(startup_channel, &sizes, sizeof(sizes));
+  ResizableBuffer vfsbuffer(sizes.isVfsLoaned() ? 0 : sizes.vfs);
+  ResizableBuffer envpbuffer(sizes.envp);
+  ResizableBuffer argvbuffer(sizes.argv);
+  syscall::IoVec iov[] = {
+      {vfsbuffer.getData(), vfsbuffer.getSize()},
+      {envpbuffer.getData(), sizes.envp},
+      {argvbuffer.getData(), sizes.argv},
+  };
+  syscall::ChannelReadVBlocking(startup_channel, iov,
+                                sizeof(iov) / sizeof(iov[0]));
+
+  void *vfsdata = vfsbuffer.getData();
+  if (sizes.isVfsLoaned()) {
+    // The image arrives on a page loaned to us. The parent loaned it before
+    // starting us, so it is already there.
+    uintptr_t vfs_page;
+    status = syscall::ChannelTakePage(startup_channel, vfs_page);
+    assert(status == K_OK);
+    vfsdata = reinterpret_cast<void *>(vfs_page);
+  }
+  libc::startup::InitVFS(root, reinterpret_cast<uintptr_t>(vfsdata));
+  gRawVfsData = vfsdata;
   gGlobalFs = &root;
   gCurrentDir = &root;
 
   libc::startup::Envp envp;
-  size_t envpsize;
-  syscall::ChannelReadBlocking(startup_channel, &envpsize, sizeof(envpsize));
-  ResizableBuffer buffer(envpsize);
-  syscall::ChannelReadBlocking(startup_channel, buffer.getData(), envpsize);
-  envp.Unpack(buffer);
+  envp.Unpack(envpbuffer);
   gEnvp = &envp;
   std::unique_ptr<char[]> plain_env = gEnvp->getPlainEnvp();
   gPlainEnv = &plain_env;
@@ -145,14 +175,9 @@ extern "C" int __libc_start_main([[maybe_unused]] uint32_t arg) {
 
   // From here, we need to extract params from our process argument to
   // create argc and argv.
-  size_t argvsize;
-  syscall::ChannelReadBlocking(startup_channel, &argvsize, sizeof(argvsize));
-  buffer.Clear();
-  buffer.Resize(argvsize);
-  syscall::ChannelReadBlocking(startup_channel, buffer.getData(), argvsize);
   int argc;
   char **argv;
-  libc::startup::UnpackParams(reinterpret_cast<uintptr_t>(buffer.getData()),
+  libc::startup::UnpackParams(reinterpret_cast<uintptr_t>(argvbuffer.getData()),
                               argc, argv);
 
   syscall::HandleClose(startup_channel);
@@ -6,6 +6,8 @@
 #include <libc/startup/startparams.h>
 #include <syscalls.h>
 
+#include <algorithm>
+
 using syscall::handle_t;
 
 namespace libc {
@@ -104,33 +106,25 @@ void HandleDynamicSection(const Elf32_Dyn *dynamic, Relocator &relocator) {
   (void)flags;
 }
 
-}  // namespace
-
-// NOTE: It's not guaranteed that `elf_data` will be aligned to some power of 2.
-// It's either immediately concatenated after the userboot stage 1, or it's
-// copied somewhere on a page.
-void LoadElfProgram(uintptr_t elf_data, const libc::startup::ArgvParam *params,
-                    size_t num_params, uintptr_t vfs_data, size_t vfs_data_size,
-                    const startup::Envp &envp) {
-  syscall::PageAlloc load_addr;
-
-  ElfModule elf_mod(elf_data);
-  DEBUG_PRINT("ELF module location: 0x%x\n", elf_data);
-
-  // NOTE: A binary can still be marked as a shared object file (ET_DYN) yet
-  // still be an executable. It depends on what the linker puts. See the
-  // answers in https://stackoverflow.com/q/34519521/2775471.
-  //
-  // We could also probably do some inference for this. For example, if the
-  // dynamic section is provided, there are some tags that are required on
-  // executables or ignored on executables.
-  auto *hdr = elf_mod.getElfHdr();
-  DEBUG_PRINT("program type: %d\n", hdr->e_type);
-
-  uint32_t program_entry_point = hdr->e_entry;
-  DEBUG_PRINT("program entry point (offset): 0x%x\n", program_entry_point);
+// Only allocate as much as the loadable segments reach, rather than a whole
+// page.
+size_t GetImageSize(const ElfModule &elf_mod) {
+  const auto *hdr = elf_mod.getElfHdr();
+  const auto *phdr = elf_mod.getProgHdr();
+  size_t image_size = 0;
+  for (int i = 0; i < hdr->e_phnum; ++i) {
+    if (phdr[i].p_type != PT_LOAD) continue;
+    size_t segment_end = phdr[i].p_vaddr + phdr[i].p_memsz;
+    image_size = std::max(image_size, segment_end);
+  }
+  DEBUG_ASSERT(image_size && image_size <= syscall::PageSize());
+  return image_size;
+}
 
-  // Map the loadable segments.
+// Copy the loadable segments into the image at `image_addr` in this process.
+void LoadSegments(uintptr_t elf_data, const ElfModule &elf_mod,
+                  uintptr_t image_addr) {
+  const auto *hdr = elf_mod.getElfHdr();
   const auto *phdr = elf_mod.getProgHdr();
   for (int i = 0; i < hdr->e_phnum; ++i) {
     const auto &segment = phdr[i];
@@ -145,8 +139,7 @@ void LoadElfProgram(uintptr_t elf_data, const libc::startup::ArgvParam *params,
     // If the segment’s memory size (p_memsz) is larger than the file size
     // (p_filesz), the extra bytes are defined to hold the value 0 and to
     // follow the segment’s initialized area.
-    uint8_t *dst =
-        reinterpret_cast<uint8_t *>(load_addr.getAddr()) + segment.p_vaddr;
+    uint8_t *dst = reinterpret_cast<uint8_t *>(image_addr) + segment.p_vaddr;
     uint8_t *src = reinterpret_cast<uint8_t *>(elf_data) + segment.p_offset;
     if (segment.p_memsz > segment.p_filesz) {
       size_t cpy_size = static_cast<size_t>(segment.p_filesz);
@@ -157,13 +150,17 @@ void LoadElfProgram(uintptr_t elf_data, const libc::startup::ArgvParam *params,
       memcpy(dst, src, static_cast<size_t>(segment.p_memsz));
     }
   }
+}
 
-  // Handle the DYNAMIC segment.
-  // See http://www.skyfree.org/linux/references/ELF_Format.pdf on how to handle
-  // each tag.
-  // https://docs.oracle.com/cd/E19957-01/806-0641/chapter6-42444/index.html
-  // contains others.
-  Relocator relocator;
+// Handle the DYNAMIC segment.
+// See http://www.skyfree.org/linux/references/ELF_Format.pdf on how to handle
+// each tag.
+// https://docs.oracle.com/cd/E19957-01/806-0641/chapter6-42444/index.html
+// contains others.
+void FindRelocs(uintptr_t elf_data, const ElfModule &elf_mod,
+                Relocator &relocator) {
+  const auto *hdr = elf_mod.getElfHdr();
+  const auto *phdr = elf_mod.getProgHdr();
   for (int i = 0; i < hdr->e_phnum; ++i) {
     if (phdr[i].p_type == PT_DYNAMIC) {
       // TODO: Could probably do some error checking here by finding the
@@ -175,55 +172,135 @@ void LoadElfProgram(uintptr_t elf_data, const libc::startup::ArgvParam *params,
       break;
     }
   }
+}
+
+// The last image loaded with `share_image`. It stays mapped in this process,
+// relocated to run at the same address it is mapped at here, and new processes
+// running the same program map it copy-on-write at that address. Pages they
+// never write to, like the program's text, are never copied.
+struct SharedImage {
+  uintptr_t elf_data;
+  uintptr_t addr;
+};
+SharedImage gSharedImage;
+
+uintptr_t GetSharedImage(uintptr_t elf_data, const ElfModule &elf_mod) {
+  if (gSharedImage.addr && gSharedImage.elf_data == elf_data)
+    return gSharedImage.addr;
+
+  if (gSharedImage.addr) syscall::UnmapPage(gSharedImage.addr);
+  syscall::PageAlloc image(GetImageSize(elf_mod));
+  LoadSegments(elf_data, elf_mod, image.getAddr());
+
+  Relocator relocator;
+  FindRelocs(elf_data, elf_mod, relocator);
+  if (relocator.FoundRelocs())
+    relocator.ApplyRelocs(elf_data, image.getAddr(), image.getAddr());
+
+  gSharedImage = {.elf_data = elf_data, .addr = image.Release()};
+  return gSharedImage.addr;
+}
+
+}  // namespace
+
+// NOTE: It's not guaranteed that `elf_data` will be aligned to some power of 2.
+// It's either immediately concatenated after the userboot stage 1, or it's
+// copied somewhere on a page.
+void LoadElfProgram(uintptr_t elf_data, const libc::startup::ArgvParam *params,
+                    size_t num_params, uintptr_t vfs_data, size_t vfs_data_size,
+                    const startup::Envp &envp, bool share_image) {
+  ElfModule elf_mod(elf_data);
+  DEBUG_PRINT("ELF module location: 0x%x\n", elf_data);
+
+  // NOTE: A binary can still be marked as a shared object file (ET_DYN) yet
+  // still be an executable. It depends on what the linker puts. See the
+  // answers in https://stackoverflow.com/q/34519521/2775471.
+  //
+  // We could also probably do some inference for this. For example, if the
+  // dynamic section is provided, there are some tags that are required on
+  // executables or ignored on executables.
+  auto *hdr = elf_mod.getElfHdr();
+  DEBUG_PRINT("program type: %d\n", hdr->e_type);
+
+  uint32_t program_entry_point = hdr->e_entry;
+  DEBUG_PRINT("program entry point (offset): 0x%x\n", program_entry_point);
 
   // Create a new process.
   handle_t proc_handle;
   DEBUG_OK(syscall::ProcessCreate(proc_handle));
   DEBUG_PRINT("New process handle: 0x%x\n", proc_handle);
 
-  // Map a the page we allocated into the new process's address space.
-  // Here it'll just be the same virtual address. The SWAP_OWNER flag means
-  // the new process will own the physical page backing this virtual page.
+  // A shared image goes at the same address in the new process as here. A 4MB
+  // image can't be shared copy-on-write, so that falls back to a private copy.
   uintptr_t new_load_addr;
-  DEBUG_OK(load_addr.MapAnonAndSwap(proc_handle, new_load_addr));
-  DEBUG_PRINT(
-      "New process load address = 0x%x, mapped from this process at 0x%x\n",
-      new_load_addr, load_addr.getAddr());
-
-  // Apply relocations using the new process' load address.
-  if (relocator.FoundRelocs()) {
-    relocator.ApplyRelocs(elf_data, load_addr.getAddr(), new_load_addr);
+  kstatus_t status = K_INVALID_ARG;
+  if (share_image) {
+    new_load_addr = GetSharedImage(elf_data, elf_mod);
+    status = syscall::MapPage(new_load_addr, proc_handle, new_load_addr,
+                              /*flags=*/MAP_COW);
+  }
+
+  if (status != K_OK) {
+    syscall::PageAlloc load_addr(GetImageSize(elf_mod));
+    LoadSegments(elf_data, elf_mod, load_addr.getAddr());
+    Relocator relocator;
+    FindRelocs(elf_data, elf_mod, relocator);
+
+    // Map a the page we allocated into the new process's address space. The
+    // SWAP_OWNER flag means the new process will own the physical page backing
+    // this virtual page.
+    DEBUG_OK(load_addr.MapAnonAndSwap(proc_handle, new_load_addr));
+    DEBUG_PRINT(
+        "New process load address = 0x%x, mapped from this process at 0x%x\n",
+        new_load_addr, load_addr.getAddr());
+
+    // Apply relocations using the new process' load address.
+    if (relocator.FoundRelocs()) {
+      relocator.ApplyRelocs(elf_data, load_addr.getAddr(), new_load_addr);
+    }
   }
 
-  handle_t end1, end2;
+  // The new process knows its end by a handle of its own.
+  handle_t end1, end2, startup_channel;
   syscall::ChannelCreate(end1, end2);
-  syscall::TransferHandle(proc_handle, end2);
-
-  syscall::ChannelWrite(end1, &vfs_data_size, sizeof(vfs_data_size));
-  syscall::ChannelWrite(end1, reinterpret_cast<void *>(vfs_data),
-                        vfs_data_size);
-
-  // First write the size of the buffer so the receiving end knows how much to
-  // expect.
-  ResizableBuffer buffer;
-  envp.Pack(buffer);
-  size_t envpsize = buffer.getSize();
-  syscall::ChannelWrite(end1, &envpsize, sizeof(envpsize));
-
-  // Then write the rest of the data.
-  syscall::ChannelWrite(end1, buffer.getData(), envpsize);
-
-  // Write the argv data.
-  buffer.Clear();
-  buffer.Resize(libc::startup::PackSize(params, num_params));
-  libc::startup::PackParams(reinterpret_cast<uintptr_t>(buffer.getData()),
+  DEBUG_OK(syscall::TransferHandle(proc_handle, end2, startup_channel));
+
+  ResizableBuffer envp_buffer;
+  envp.Pack(envp_buffer);
+
+  ResizableBuffer argv_buffer(libc::startup::PackSize(params, num_params));
+  libc::startup::PackParams(reinterpret_cast<uintptr_t>(argv_buffer.getData()),
                             params, num_params);
-  size_t argvsize = buffer.getSize();
-  syscall::ChannelWrite(end1, &argvsize, sizeof(argvsize));
-  syscall::ChannelWrite(end1, buffer.getData(), argvsize);
+
+  startup::StartupSizes sizes = {
+      .vfs = vfs_data_size,
+      .envp = envp_buffer.getSize(),
+      .argv = argv_buffer.getSize(),
+  };
+  if (sizes.isVfsLoaned()) {
+    // Copying once into a page the new process takes over is cheaper than
+    // copying the whole image into the channel and back out again.
+    DEBUG_ASSERT(vfs_data_size <= syscall::PageSize());
+    syscall::PageAlloc vfs_page;
+    memcpy(reinterpret_cast<void *>(vfs_page.getAddr()),
+           reinterpret_cast<const void *>(vfs_data), vfs_data_size);
+    DEBUG_OK(vfs_page.Loan(end1));
+  }
+
+  // The sizes go first so the receiving end knows how much to expect, then
+  // the data itself, all in one write.
+  syscall::IoVec iov[] = {
+      {&sizes, sizeof(sizes)},
+      {reinterpret_cast<void *>(vfs_data),
+       sizes.isVfsLoaned() ? 0 : vfs_data_size},
+      {envp_buffer.getData(), sizes.envp},
+      {argv_buffer.getData(), sizes.argv},
+  };
+  DEBUG_OK(syscall::ChannelWriteV(end1, iov, sizeof(iov) / sizeof(iov[0])));
 
   // Start the process.
-  syscall::ProcessStart(proc_handle, new_load_addr + program_entry_point, end2);
+  syscall::ProcessStart(proc_handle, new_load_addr + program_entry_point,
+                        startup_channel);
 
   syscall::HandleClose(end1);
 }
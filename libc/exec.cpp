@@ -39,7 +39,7 @@ int ExecImpl(const char *path, char *const argv[],
         params.size(), vfs_data, vfs_data_size, envp);
   } else {
     libc::elf::LoadElfProgram(elf_data, params.data(), params.size(), vfs_data,
-                              vfs_data_size, envp);
+                              vfs_data_size, envp, /*share_image=*/true);
   }
 
   return 0;
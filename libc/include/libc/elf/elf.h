@@ -394,9 +394,14 @@ class Relocator {
   bool found_relocs_ = false;
 };
 
+// Load the program in `elf_data` into a new process and start it. With
+// `share_image`, the loaded image is kept around in this process, and loading
+// the same `elf_data` again shares it copy-on-write with the new process rather
+// than copying it. `elf_data` must then stay put for as long as this process
+// runs, like a file in the VFS does.
 void LoadElfProgram(uintptr_t elf_data, const libc::startup::ArgvParam *params,
                     size_t num_params, uintptr_t vfs_data, size_t vfs_data_size,
-                    const startup::Envp &envp);
+                    const startup::Envp &envp, bool share_image = false);
 
 }  // namespace elf
 }  // namespace libc
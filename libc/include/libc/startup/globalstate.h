@@ -15,6 +15,21 @@ RootDir *GetGlobalFS();
 std::unique_ptr<char[]> *GetPlainEnv();
 const void *GetRawVfsData();
 
+// A file system image at least this large is handed to a new process on a
+// loaned page rather than copied through its startup channel.
+constexpr size_t kVfsLoanThreshold = 0x10000;
+
+// The first thing on a new process' startup channel. The file system image,
+// environment, and argv follow in that order, with these sizes. A loaned image
+// is not on the channel at all.
+struct StartupSizes {
+  size_t vfs;
+  size_t envp;
+  size_t argv;
+
+  bool isVfsLoaned() const { return vfs >= kVfsLoanThreshold; }
+};
+
 // This class makes it easier to edit the environment by separating the keys
 // and values into their own allocations in a dynamic container.
 class Envp {
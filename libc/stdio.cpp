@@ -3,9 +3,17 @@
 #include <stdio.h>
 #include <syscalls.h>
 
+namespace {
+
+// How long to wait between checks for input. Serial input does not wake
+// anyone up, so we still need to poll, but there's no need to hog the CPU.
+constexpr uint32_t kInputPollMs = 10;
+
+}  // namespace
+
 extern "C" int getchar() {
   char c;
-  while (syscall::DebugRead(c) != K_OK) {}
+  while (syscall::DebugRead(c) != K_OK) syscall::SleepFor(kInputPollMs);
   return c;
 }
 
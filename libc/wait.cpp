@@ -52,16 +52,34 @@ pid_t wait(int *res) {
                                 written_or_needed, written_or_needed);
   DEBUG_OK(status);
 
-  // Finally wait on the child. `wait` only needs to wait for one of the
-  // children, but it doesn't matter which one we wait on, so just pick the
-  // first one. NOTE: A return status of `K_INVALID_HANDLE` means the child is
-  // no longer running.
-  uint32_t received_signal, signal_val;
-  status = syscall::ProcessWait(children[0], TASK_TERMINATED, received_signal,
-                                signal_val);
-  DEBUG_ASSERT(status == K_OK || status == K_INVALID_HANDLE);
-  DEBUG_ASSERT(received_signal == TASK_TERMINATED);
-  if (res) *res = static_cast<int>(signal_val);
+  // Finally wait for any one of the children to finish. A handle that is no
+  // longer valid belongs to a child that finished before we started waiting.
+  // The kernel can only wait on so many handles at once, so any children past
+  // that are left out.
+  constexpr size_t kMaxWaitItems = 64;
+  size_t num_items = num_handles < kMaxWaitItems ? num_handles : kMaxWaitItems;
+  std::unique_ptr<syscall::WaitItem[]> items(
+      new syscall::WaitItem[num_items]);
+  for (size_t i = 0; i < num_items; ++i)
+    items[i] = {children[i], TASK_TERMINATED, /*pending=*/0, /*value=*/0};
+
+  size_t num_ready;
+  do {
+    status = syscall::ObjectWaitMany(items.get(), num_items, /*timeout=*/0,
+                                     num_ready);
+    DEBUG_ASSERT(status == K_OK || status == K_INVALID_HANDLE);
+  } while (status == K_OK && !num_ready);
+
+  // The exit value is unknown for a child that finished before we waited.
+  if (res) {
+    *res = 0;
+    for (size_t i = 0; status == K_OK && i < num_items; ++i) {
+      if (items[i].pending) {
+        *res = static_cast<int>(items[i].value);
+        break;
+      }
+    }
+  }
 
   return 0;
 }
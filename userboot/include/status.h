@@ -27,6 +27,15 @@
 // Some argument was invalid.
 #define K_INVALID_ARG 8
 
+// A blocking call gave up before what it was waiting for happened.
+#define K_TIMED_OUT 9
+
+// The other end of a channel was closed.
+#define K_PEER_CLOSED 10
+
+// The process has no room for another handle.
+#define K_OOM_HANDLES 11
+
 #ifndef ASM_FILE
 #include <stdint.h>
 typedef uint32_t kstatus_t;
@@ -17,20 +17,43 @@
 #define SYS_ChannelRead 13
 #define SYS_ChannelWrite 14
 #define SYS_TransferHandle 15
+#define SYS_Yield 16
+#define SYS_SleepUntil 17
+#define SYS_SchedStats 18
+#define SYS_SetWeight 19
+#define SYS_ThreadCreate 20
+#define SYS_ChannelSetOptions 21
+#define SYS_ObjectWaitMany 22
+#define SYS_ChannelLoanPage 23
+#define SYS_ChannelTakePage 24
+#define SYS_ChannelWriteV 25
+#define SYS_ChannelReadV 26
+#define SYS_GetTicks 27
 
 // AllocPage flags.
 #define ALLOC_ANON 0x1
 #define ALLOC_CURRENT 0x2
+#define ALLOC_SIZED 0x4
+#define ALLOC_LAZY 0x8
 
 // MapPage flags.
 #define SWAP_OWNER 0x1
 #define MAP_ANON 0x2
+#define MAP_COW 0x4
 
 // Task info kinds.
 #define PROC_CURRENT 0
 #define PROC_PARENT 1
 #define PROC_CHILDREN 2
 
+// ChannelSetOptions flags.
+#define CHANNEL_NONBLOCK 0x1
+
+// Channel endpoint signals for ObjectWaitMany.
+#define CHANNEL_READABLE 0x1
+#define CHANNEL_PEER_CLOSED 0x2
+#define CHANNEL_PAGE_LOANED 0x4
+
 // Task signals.
 #define TASK_READY 0x1
 #define TASK_RUNNING 0x2
@@ -45,11 +68,34 @@ namespace syscall {
 
 using handle_t = uint32_t;
 
+// How syscalls enter the kernel. SYSENTER is used by default whenever the CPU
+// supports it since it is much cheaper than a software interrupt. `int $0x80`
+// always works.
+enum class SyscallEntry {
+  kInt80,
+  kSysenter,
+};
+
+// Returns false and leaves the entry path alone if the CPU cannot use `entry`.
+// This is mostly useful for benchmarking.
+bool SetSyscallEntry(SyscallEntry entry);
+SyscallEntry GetSyscallEntry();
+
 void DebugWrite(const char *str, size_t size);
 void ProcessKill(uint32_t retval);
-kstatus_t AllocPage(uintptr_t &vaddr, handle_t proc_handle, uint32_t flags);
+
+// Without ALLOC_SIZED, this allocates one 4MB page. With it, `size` bytes are
+// rounded up to 4KB pages, so small allocations only take what they need.
+// With ALLOC_LAZY, the memory is only reserved, and each 4KB page is backed by
+// a zeroed frame when it is first touched. These are unmapped in one go with
+// `UnmapPage` on the address returned.
+kstatus_t AllocPage(uintptr_t &vaddr, handle_t proc_handle, uint32_t flags,
+                    size_t size = 0);
 size_t PageSize();
 kstatus_t ProcessCreate(handle_t &proc_handle);
+
+// With MAP_COW, both processes share the 4KB pages read-only, and whichever
+// writes to a page first gets its own copy of it.
 kstatus_t MapPage(uintptr_t vaddr, handle_t other_proc, uintptr_t &other_vaddr,
                   uint32_t flags);
 void ProcessStart(handle_t proc, uintptr_t entry, uint32_t arg = 0);
@@ -61,10 +107,111 @@ kstatus_t ProcessInfo(handle_t proc, uint32_t kind, void *dst,
                       size_t buffer_size, size_t &written_or_needed);
 void ChannelCreate(handle_t &end1, handle_t &end2);
 void HandleClose(handle_t handle);
+
+// Read `size` bytes off a channel. Unless the endpoint was made non-blocking
+// with `ChannelSetOptions`, this waits in the kernel until that many bytes are
+// on the channel, the other end closes, or the endpoint's read timeout passes.
 kstatus_t ChannelRead(handle_t endpoint, void *dst, size_t size,
                       size_t *bytes_available = nullptr);
-void ChannelWrite(handle_t endpoint, const void *src, size_t size);
-void TransferHandle(handle_t proc, handle_t handle);
+
+// `flags` is a combination of CHANNEL_* flags. A `read_timeout` of zero lets
+// blocking reads wait forever.
+kstatus_t ChannelSetOptions(handle_t endpoint, uint32_t flags,
+                            uint32_t read_timeout);
+
+// Write `size` bytes to a channel. Nothing is written if `src` cannot be read.
+kstatus_t ChannelWrite(handle_t endpoint, const void *src, size_t size);
+
+// Hand `handle` over to `proc`. It is closed in this process, and `new_handle`
+// is set to what `proc` knows it as.
+kstatus_t TransferHandle(handle_t proc, handle_t handle,
+                         handle_t &new_handle);
+void Yield();
+
+// Sleep until the kernel's tick count (in milliseconds) reaches `ticks` and
+// return the tick count at wakeup. A tick that has already passed returns
+// right away.
+uint32_t SleepUntil(uint32_t ticks);
+
+// Return the kernel's tick count (in milliseconds) without sleeping.
+uint32_t GetTicks();
+
+// Scheduler counters for one CPU. See `SYS_SchedStats` in the kernel for
+// what each one counts.
+struct SchedStats {
+  uint32_t steals;
+  uint32_t stolen;
+  uint32_t failed_steals;
+  uint32_t hot_skips;
+  uint32_t idle_ticks;
+};
+
+// Returns K_INVALID_ARG if `cpu` is not online.
+kstatus_t GetSchedStats(uint32_t cpu, SchedStats &stats);
+
+// Set how much CPU time a task gets relative to others. `proc` is 0 for the
+// current task. The default weight is 1024. Returns K_INVALID_ARG if `weight`
+// is outside [16, 65536].
+kstatus_t SetWeight(handle_t proc, uint32_t weight);
+
+// Start a thread in this process at `entry` running on the stack at
+// `stack_top`. The thread receives `arg` in EAX, and its GS segment starts at
+// `tls_base` if that is non-zero. The entry point must end with ProcessKill
+// rather than return. The handle can be waited on like any other task.
+kstatus_t ThreadCreate(handle_t &thread, uintptr_t entry, uintptr_t stack_top,
+                       uint32_t arg, uintptr_t tls_base = 0);
+
+// One handle for `ObjectWaitMany` to wait on. `signals` are TASK_* signals for
+// a task, or CHANNEL_* signals for a channel endpoint.
+struct WaitItem {
+  handle_t handle;
+  uint32_t signals;
+
+  // Set by the kernel to which of `signals` fired, and the value sent with a
+  // task signal (such as the exit value for TASK_TERMINATED).
+  uint32_t pending;
+  uint32_t value;
+};
+
+// Block until any of `items` has a signal pending, or `timeout` ticks pass (0
+// waits forever). Channel signals that already hold return right away, but
+// task signals are only seen if sent while waiting. `num_ready` is set to how
+// many items have `pending` set, which may be zero after a spurious wakeup. On
+// K_INVALID_HANDLE it is the index of the bad item instead.
+kstatus_t ObjectWaitMany(WaitItem *items, size_t count, uint32_t timeout,
+                         size_t &num_ready);
+
+// Give the page at `vaddr` to whoever reads the other end of `endpoint`
+// without copying it. It is unmapped here, and this process must own it.
+// Loaned pages are queued apart from the bytes on the channel.
+kstatus_t ChannelLoanPage(handle_t endpoint, uintptr_t vaddr);
+
+// Map the oldest page loaned to `endpoint` into this process and set `vaddr`
+// to where it went. This returns K_BUFFER_TOO_SMALL rather than waiting if no
+// page is there yet.
+kstatus_t ChannelTakePage(handle_t endpoint, uintptr_t &vaddr);
+
+// One buffer for a vectored channel read or write.
+struct IoVec {
+  void *base;
+  size_t size;
+};
+
+// The most segments one ChannelWriteV or ChannelReadV takes.
+constexpr size_t kMaxIoVecs = 16;
+
+// Write each of `iov` to the channel in order, in one system call. Nothing is
+// written if any segment can't be read.
+kstatus_t ChannelWriteV(handle_t endpoint, const IoVec *iov, size_t count);
+
+// Like ChannelRead for the total size of `iov`, but the bytes are spread
+// across the segments in order.
+kstatus_t ChannelReadV(handle_t endpoint, const IoVec *iov, size_t count,
+                       size_t *bytes_available = nullptr);
+
+inline uint32_t SleepFor(uint32_t ticks) {
+  return SleepUntil(GetTicks() + ticks);
+}
 
 // This is an RAII-style object for either allocating or mapping a page upon
 // creation (in the current process), then unmapping it on destruction.
@@ -77,14 +224,15 @@ class PageAlloc {
   //   AllocPage(addr_, /*proc_handle=*/0, ALLOC_ANON | ALLOC_CURRENT);
   //   ```
   //
-  PageAlloc() {
-    if (AllocPage(addr_, /*proc_handle=*/0, ALLOC_ANON | ALLOC_CURRENT) !=
-        K_OK) {
-      abort();
-    }
+  // If `size` is given, only that much is allocated, as with ALLOC_SIZED.
+  explicit PageAlloc(size_t size = 0) {
+    uint32_t flags = ALLOC_ANON | ALLOC_CURRENT | (size ? ALLOC_SIZED : 0);
+    if (AllocPage(addr_, /*proc_handle=*/0, flags, size) != K_OK) abort();
   }
 
-  ~PageAlloc() { UnmapPage(addr_); }
+  ~PageAlloc() {
+    if (addr_) UnmapPage(addr_);
+  }
 
   uintptr_t getAddr() const { return addr_; }
 
@@ -106,15 +254,47 @@ class PageAlloc {
                    /*flags=*/SWAP_OWNER | MAP_ANON);
   }
 
+  // Loan this page over a channel. Once that succeeds, this no longer refers
+  // to any page.
+  kstatus_t Loan(handle_t endpoint) {
+    kstatus_t status = ChannelLoanPage(endpoint, addr_);
+    if (status == K_OK) addr_ = 0;
+    return status;
+  }
+
+  // Stop managing this page without unmapping it, and return its address.
+  uintptr_t Release() {
+    uintptr_t addr = addr_;
+    addr_ = 0;
+    return addr;
+  }
+
  private:
   uintptr_t addr_;
 };
 
-// Perform a blocking read on a channel until we successfully read bytes
-// off it.
-inline void ChannelReadBlocking(handle_t channel, void *dst, size_t size) {
+// Read `size` bytes off a channel, waiting as long as it takes. This only
+// gives up if the other end closes first.
+inline kstatus_t ChannelReadBlocking(handle_t channel, void *dst,
+                                     size_t size) {
   kstatus_t status;
-  do { status = ChannelRead(channel, dst, size); } while (status != K_OK);
+  while ((status = ChannelRead(channel, dst, size)) == K_TIMED_OUT ||
+         status == K_BUFFER_TOO_SMALL) {
+    // Only non-blocking endpoints come back without waiting.
+    if (status == K_BUFFER_TOO_SMALL) Yield();
+  }
+  return status;
+}
+
+// The same as ChannelReadBlocking, but for ChannelReadV.
+inline kstatus_t ChannelReadVBlocking(handle_t channel, const IoVec *iov,
+                                      size_t count) {
+  kstatus_t status;
+  while ((status = ChannelReadV(channel, iov, count)) == K_TIMED_OUT ||
+         status == K_BUFFER_TOO_SMALL) {
+    if (status == K_BUFFER_TOO_SMALL) Yield();
+  }
+  return status;
 }
 
 }  // namespace syscall
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <syscalls.h>
+#include <unistd.h>
+
+// Measure how promptly a mostly sleeping task wakes up while CPU-bound tasks
+// compete with it. This is the kind of latency an interactive program like the
+// shell sees under load.
+//
+//   sched-bench
+
+namespace {
+
+// Enough CPU hogs to keep every CPU busy with a few tasks waiting behind them.
+constexpr uint32_t kNumHogs = 8;
+
+constexpr uint32_t kSleepTicks = 5;
+constexpr uint32_t kNumSamples = 100;
+
+// Hogs stop spinning after this long so the benchmark always finishes.
+constexpr uint32_t kHogTicks = kNumSamples * kSleepTicks * 4;
+
+// Run as one of the CPU hogs until `kHogTicks` pass.
+void Hog() {
+  uint32_t deadline = syscall::GetTicks() + kHogTicks;
+  while (static_cast<int32_t>(syscall::GetTicks() - deadline) < 0) {}
+}
+
+// Sleep repeatedly and report how late each wakeup was.
+void Measure(const char *name) {
+  uint32_t total = 0, max = 0;
+  for (uint32_t i = 0; i < kNumSamples; ++i) {
+    uint32_t deadline = syscall::GetTicks() + kSleepTicks;
+    uint32_t late = syscall::SleepUntil(deadline) - deadline;
+    total += late;
+    if (late > max) max = late;
+  }
+  printf("%s: avg=%u max=%u ticks late over %u wakeups\n", name,
+         total / kNumSamples, max, kNumSamples);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc == 2 && strcmp(argv[1], "hog") == 0) {
+    Hog();
+    return 0;
+  }
+
+  Measure("idle");
+
+  char hog_arg[] = "hog";
+  char *hog_argv[] = {argv[0], hog_arg, nullptr};
+  auto start_hogs = [&]() {
+    for (uint32_t i = 0; i < kNumHogs; ++i) {
+      if (execv(argv[0], hog_argv) < 0) {
+        printf("Unable to start %s\n", argv[0]);
+        return false;
+      }
+    }
+    return true;
+  };
+  auto reap_hogs = []() {
+    for (uint32_t i = 0; i < kNumHogs; ++i) wait(nullptr);
+  };
+
+  if (!start_hogs()) return 1;
+  Measure("loaded");
+  reap_hogs();
+
+  // Four times the default weight.
+  if (syscall::SetWeight(/*proc=*/0, 4096) != K_OK) {
+    printf("Unable to set the weight\n");
+    return 1;
+  }
+  if (!start_hogs()) return 1;
+  Measure("loaded, weight=4096");
+  reap_hogs();
+}
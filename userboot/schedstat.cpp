@@ -0,0 +1,15 @@
+#include <stdio.h>
+#include <syscalls.h>
+
+// Print the load balancer's work stealing counters and the idle time for every
+// CPU.
+int main() {
+  syscall::SchedStats stats;
+  for (uint32_t cpu = 0; syscall::GetSchedStats(cpu, stats) == K_OK; ++cpu) {
+    printf(
+        "cpu %u: steals=%u stolen=%u failed_steals=%u hot_skips=%u "
+        "idle_ms=%u\n",
+        cpu, stats.steals, stats.stolen, stats.failed_steals, stats.hot_skips,
+        stats.idle_ticks);
+  }
+}
@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <syscalls.h>
+
+// Measure the round trip cost of a syscall that does no work through each way
+// of entering the kernel.
+//
+//   syscall-bench
+
+namespace {
+
+constexpr uint32_t kNumIters = 10000;
+
+uint64_t ReadTimestampCounter() {
+  uint32_t lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+
+// PageSize does nothing but return a constant, so this is all entry and exit.
+void Measure(const char *name, syscall::SyscallEntry entry) {
+  if (!syscall::SetSyscallEntry(entry)) {
+    printf("%s: not supported\n", name);
+    return;
+  }
+
+  // Warm up the caches first.
+  for (uint32_t i = 0; i < 100; ++i) syscall::PageSize();
+
+  // Keep the lowest of a few runs so a preemption does not skew the result.
+  uint32_t best = UINT32_MAX;
+  for (uint32_t run = 0; run < 5; ++run) {
+    uint64_t start = ReadTimestampCounter();
+    for (uint32_t i = 0; i < kNumIters; ++i) syscall::PageSize();
+    auto cycles = static_cast<uint32_t>(ReadTimestampCounter() - start);
+    if (cycles / kNumIters < best) best = cycles / kNumIters;
+  }
+  printf("%s: ~%u cycles per syscall\n", name, best);
+}
+
+}  // namespace
+
+int main() {
+  syscall::SyscallEntry original = syscall::GetSyscallEntry();
+  Measure("int 0x80", syscall::SyscallEntry::kInt80);
+  Measure("sysenter", syscall::SyscallEntry::kSysenter);
+  syscall::SetSyscallEntry(original);
+}
@@ -2,110 +2,249 @@
 #include <stdint.h>
 #include <syscalls.h>
 
+extern "C" void __sysenter_syscall();
+
 namespace syscall {
 
+namespace {
+
+constexpr uint32_t kCpuidSepFlag = 1 << 11;  // CPUID.01h:EDX - bit 11
+
+enum : uint8_t {
+  kEntryUnknown,
+  kEntryInt80,
+  kEntrySysenter,
+} gEntry = kEntryUnknown;
+
+bool CpuHasSysenter() {
+  uint32_t eax = 1, ebx, ecx = 0, edx;
+  asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+  return edx & kCpuidSepFlag;
+}
+
+bool UseSysenter() {
+  if (gEntry == kEntryUnknown)
+    gEntry = CpuHasSysenter() ? kEntrySysenter : kEntryInt80;
+  return gEntry == kEntrySysenter;
+}
+
+}  // namespace
+
+// Enter the kernel with the given asm operands. `__sysenter_syscall` takes and
+// returns the same registers `int $0x80` does, so either can be used.
+#define SYSCALL(...)                                        \
+  do {                                                      \
+    if (UseSysenter())                                      \
+      asm volatile("call __sysenter_syscall" __VA_ARGS__); \
+    else                                                    \
+      asm volatile("int $0x80" __VA_ARGS__);                \
+  } while (0)
+
+bool SetSyscallEntry(SyscallEntry entry) {
+  if (entry == SyscallEntry::kSysenter && !CpuHasSysenter()) return false;
+  gEntry = entry == SyscallEntry::kSysenter ? kEntrySysenter : kEntryInt80;
+  return true;
+}
+
+SyscallEntry GetSyscallEntry() {
+  return UseSysenter() ? SyscallEntry::kSysenter : SyscallEntry::kInt80;
+}
+
 void DebugWrite(const char *str, size_t size) {
-  asm volatile("int $0x80" ::"a"(SYS_DebugWrite), "b"(str), "c"(size));
+  SYSCALL(::"a"(SYS_DebugWrite), "b"(str), "c"(size));
 }
 
 void ProcessKill(uint32_t retval) {
-  asm volatile("int $0x80" ::"a"(SYS_ProcessKill), "b"(retval));
+  SYSCALL(::"a"(SYS_ProcessKill), "b"(retval));
 }
 
 kstatus_t AllocPage(uintptr_t &page_addr, handle_t proc_handle,
-                    uint32_t flags) {
+                    uint32_t flags, size_t size) {
   kstatus_t status;
-  asm volatile("int $0x80"
-               : "=a"(status), "=b"(page_addr)
-               : "0"(SYS_AllocPage), "1"(page_addr), "c"(proc_handle),
-                 "d"(flags));
+  SYSCALL(: "=a"(status), "=b"(page_addr)
+          : "0"(SYS_AllocPage), "1"(page_addr), "c"(proc_handle),
+            "d"(flags), "S"(size));
   return status;
 }
 
 size_t PageSize() {
   uint32_t page_size;
-  asm volatile("int $0x80" : "=a"(page_size) : "0"(SYS_PageSize));
+  SYSCALL(: "=a"(page_size) : "0"(SYS_PageSize));
   return page_size;
 }
 
 kstatus_t ProcessCreate(handle_t &proc_handle) {
   kstatus_t status;
-  asm volatile("int $0x80"
-               : "=a"(status), "=b"(proc_handle)
-               : "0"(SYS_ProcessCreate));
+  SYSCALL(: "=a"(status), "=b"(proc_handle) : "0"(SYS_ProcessCreate));
   return status;
 }
 
 kstatus_t MapPage(uintptr_t vaddr, handle_t other_proc, uintptr_t &other_vaddr,
                   uint32_t flags) {
   kstatus_t status;
-  asm volatile("int $0x80"
-               : "=a"(status), "=b"(other_vaddr)
-               : "0"(SYS_MapPage), "1"(vaddr), "c"(other_proc),
-                 "d"(other_vaddr), "S"(flags));
+  SYSCALL(: "=a"(status), "=b"(other_vaddr)
+          : "0"(SYS_MapPage), "1"(vaddr), "c"(other_proc),
+            "d"(other_vaddr), "S"(flags));
   return status;
 }
 
 void ProcessStart(handle_t proc, uintptr_t entry, uint32_t arg) {
-  asm volatile("int $0x80" ::"a"(SYS_ProcessStart), "b"(proc), "c"(entry),
-               "d"(arg));
+  SYSCALL(::"a"(SYS_ProcessStart), "b"(proc), "c"(entry), "d"(arg));
 }
 
 void UnmapPage(uintptr_t page_addr) {
-  asm volatile("int $0x80" ::"a"(SYS_UnmapPage), "b"(page_addr));
+  SYSCALL(::"a"(SYS_UnmapPage), "b"(page_addr));
 }
 
 kstatus_t DebugRead(char &c) {
   kstatus_t status;
-  asm volatile("int $0x80" : "=a"(status) : "0"(SYS_DebugRead), "b"(&c));
+  SYSCALL(: "=a"(status) : "0"(SYS_DebugRead), "b"(&c));
   return status;
 }
 
 kstatus_t ProcessWait(handle_t proc, uint32_t signals,
                       uint32_t &received_signal, uint32_t &signal_val) {
   kstatus_t status;
-  asm volatile("int $0x80"
-               : "=a"(status), "=b"(received_signal), "=c"(signal_val)
-               : "0"(SYS_ProcessWait), "1"(proc), "2"(signals));
+  SYSCALL(: "=a"(status), "=b"(received_signal), "=c"(signal_val)
+          : "0"(SYS_ProcessWait), "1"(proc), "2"(signals));
   return status;
 }
 
 kstatus_t ProcessInfo(handle_t proc, uint32_t kind, void *dst,
                       size_t buffer_size, size_t &written_or_needed) {
   kstatus_t status;
-  asm volatile("int $0x80"
-               : "=a"(status), "=b"(written_or_needed)
-               : "0"(SYS_ProcessInfo), "1"(proc), "c"(kind), "d"(dst),
-                 "S"(buffer_size));
+  SYSCALL(: "=a"(status), "=b"(written_or_needed)
+          : "0"(SYS_ProcessInfo), "1"(proc), "c"(kind), "d"(dst),
+            "S"(buffer_size));
   return status;
 }
 
 void ChannelCreate(handle_t &end1, handle_t &end2) {
-  asm volatile("int $0x80" : "=a"(end1), "=b"(end2) : "0"(SYS_ChannelCreate));
+  SYSCALL(: "=a"(end1), "=b"(end2) : "0"(SYS_ChannelCreate));
 }
 
 void HandleClose(handle_t handle) {
-  asm volatile("int $0x80" ::"a"(SYS_HandleClose), "b"(handle));
+  SYSCALL(::"a"(SYS_HandleClose), "b"(handle));
 }
 
 kstatus_t ChannelRead(handle_t endpoint, void *dst, size_t size,
                       size_t *bytes_available) {
   size_t bytes_avail;
   kstatus_t status;
-  asm volatile("int $0x80"
-               : "=a"(status), "=b"(bytes_avail)
-               : "0"(SYS_ChannelRead), "1"(endpoint), "c"(dst), "d"(size));
+  SYSCALL(: "=a"(status), "=b"(bytes_avail)
+          : "0"(SYS_ChannelRead), "1"(endpoint), "c"(dst), "d"(size));
   if (bytes_available) *bytes_available = bytes_avail;
   return status;
 }
 
-void ChannelWrite(handle_t endpoint, const void *src, size_t size) {
-  asm volatile("int $0x80" ::"a"(SYS_ChannelWrite), "b"(endpoint), "c"(src),
-               "d"(size));
+kstatus_t ChannelSetOptions(handle_t endpoint, uint32_t flags,
+                            uint32_t read_timeout) {
+  kstatus_t status;
+  SYSCALL(: "=a"(status)
+          : "0"(SYS_ChannelSetOptions), "b"(endpoint), "c"(flags),
+            "d"(read_timeout));
+  return status;
+}
+
+kstatus_t ChannelWrite(handle_t endpoint, const void *src, size_t size) {
+  kstatus_t status;
+  SYSCALL(: "=a"(status)
+          : "0"(SYS_ChannelWrite), "b"(endpoint), "c"(src), "d"(size));
+  return status;
+}
+
+kstatus_t TransferHandle(handle_t proc, handle_t handle,
+                         handle_t &new_handle) {
+  kstatus_t status;
+  SYSCALL(: "=a"(status), "=b"(new_handle)
+          : "0"(SYS_TransferHandle), "1"(proc), "c"(handle));
+  return status;
+}
+
+void Yield() {
+  // EAX holds the returned status, which is always K_OK.
+  uint32_t eax = SYS_Yield;
+  SYSCALL(: "+a"(eax));
+}
+
+uint32_t SleepUntil(uint32_t ticks) {
+  kstatus_t status;
+  uint32_t now;
+  SYSCALL(: "=a"(status), "=b"(now) : "0"(SYS_SleepUntil), "1"(ticks));
+  return now;
+}
+
+uint32_t GetTicks() {
+  // EAX holds the returned status, which is always K_OK.
+  kstatus_t status;
+  uint32_t now;
+  SYSCALL(: "=a"(status), "=b"(now) : "0"(SYS_GetTicks));
+  return now;
+}
+
+kstatus_t GetSchedStats(uint32_t cpu, SchedStats &stats) {
+  kstatus_t status;
+  SYSCALL(: "=a"(status)
+          : "0"(SYS_SchedStats), "b"(cpu), "c"(&stats)
+          : "memory");
+  return status;
+}
+
+kstatus_t SetWeight(handle_t proc, uint32_t weight) {
+  kstatus_t status;
+  SYSCALL(: "=a"(status) : "0"(SYS_SetWeight), "b"(proc), "c"(weight));
+  return status;
+}
+
+kstatus_t ThreadCreate(handle_t &thread, uintptr_t entry, uintptr_t stack_top,
+                       uint32_t arg, uintptr_t tls_base) {
+  kstatus_t status;
+  SYSCALL(: "=a"(status), "=b"(thread)
+          : "0"(SYS_ThreadCreate), "1"(entry), "c"(stack_top), "d"(arg),
+            "S"(tls_base));
+  return status;
+}
+
+kstatus_t ObjectWaitMany(WaitItem *items, size_t count, uint32_t timeout,
+                         size_t &num_ready) {
+  kstatus_t status;
+  SYSCALL(: "=a"(status), "=b"(num_ready)
+          : "0"(SYS_ObjectWaitMany), "1"(items), "c"(count), "d"(timeout)
+          : "memory");
+  return status;
+}
+
+kstatus_t ChannelLoanPage(handle_t endpoint, uintptr_t vaddr) {
+  kstatus_t status;
+  SYSCALL(: "=a"(status)
+          : "0"(SYS_ChannelLoanPage), "b"(endpoint), "c"(vaddr));
+  return status;
+}
+
+kstatus_t ChannelTakePage(handle_t endpoint, uintptr_t &vaddr) {
+  kstatus_t status;
+  SYSCALL(: "=a"(status), "=b"(vaddr)
+          : "0"(SYS_ChannelTakePage), "1"(endpoint));
+  return status;
+}
+
+kstatus_t ChannelWriteV(handle_t endpoint, const IoVec *iov, size_t count) {
+  kstatus_t status;
+  SYSCALL(: "=a"(status)
+          : "0"(SYS_ChannelWriteV), "b"(endpoint), "c"(iov), "d"(count)
+          : "memory");
+  return status;
 }
 
-void TransferHandle(handle_t proc, handle_t handle) {
-  asm volatile("int $0x80" ::"a"(SYS_TransferHandle), "b"(proc), "c"(handle));
+kstatus_t ChannelReadV(handle_t endpoint, const IoVec *iov, size_t count,
+                       size_t *bytes_available) {
+  size_t bytes_avail;
+  kstatus_t status;
+  SYSCALL(: "=a"(status), "=b"(bytes_avail)
+          : "0"(SYS_ChannelReadV), "1"(endpoint), "c"(iov), "d"(count)
+          : "memory");
+  if (bytes_available) *bytes_available = bytes_avail;
+  return status;
 }
 
 }  // namespace syscall
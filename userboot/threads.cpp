@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <syscalls.h>
+
+// Split a sum across several threads in this process. Each thread writes its
+// partial sum straight into memory the main thread reads, and finds which
+// slot to write through its own TLS segment.
+//
+//   threads
+
+namespace {
+
+constexpr uint32_t kNumThreads = 4;
+constexpr uint32_t kNumTerms = 1 << 16;
+constexpr uint32_t kStackSize = 0x10000;
+
+// What each thread finds at %gs:0.
+struct ThreadLocal {
+  uint32_t index;
+};
+
+ThreadLocal gThreadLocals[kNumThreads];
+uint32_t gPartialSums[kNumThreads];
+
+uint32_t GetThreadIndex() {
+  uint32_t index;
+  asm volatile("movl %%gs:0, %0" : "=r"(index));
+  return index;
+}
+
+// The first argument arrives in EAX.
+[[noreturn]] __attribute__((regparm(1))) void ThreadMain(uint32_t first) {
+  uint32_t sum = 0;
+  for (uint32_t i = first; i < kNumTerms; i += kNumThreads) sum += i;
+  gPartialSums[GetThreadIndex()] = sum;
+  syscall::ProcessKill(0);
+  __builtin_unreachable();
+}
+
+}  // namespace
+
+int main() {
+  syscall::PageAlloc stacks(kNumThreads * kStackSize);
+
+  syscall::handle_t threads[kNumThreads];
+  for (uint32_t i = 0; i < kNumThreads; ++i) {
+    gThreadLocals[i].index = i;
+
+    // Leave room for the return address a call would have pushed.
+    uintptr_t stack_top = stacks.getAddr() + (i + 1) * kStackSize - 4;
+    kstatus_t status = syscall::ThreadCreate(
+        threads[i], reinterpret_cast<uintptr_t>(ThreadMain), stack_top,
+        /*arg=*/i, reinterpret_cast<uintptr_t>(&gThreadLocals[i]));
+    if (status != K_OK) {
+      printf("Unable to create thread %u\n", i);
+      return 1;
+    }
+  }
+
+  // A thread that already finished is no longer a valid handle.
+  for (syscall::handle_t thread : threads) {
+    uint32_t received_signal, signal_val;
+    kstatus_t status = syscall::ProcessWait(thread, TASK_TERMINATED,
+                                            received_signal, signal_val);
+    if (status != K_OK && status != K_INVALID_HANDLE) {
+      printf("Unable to wait on thread %u\n", thread);
+      return 1;
+    }
+  }
+
+  uint32_t sum = 0;
+  for (uint32_t partial : gPartialSums) sum += partial;
+  uint32_t expected = (kNumTerms / 2) * (kNumTerms - 1);
+  printf("sum=%u expected=%u\n", sum, expected);
+  return sum == expected ? 0 : 1;
+}